@@ -1 +1,53 @@
 #include "canvas_layer.h"
+#include <algorithm>
+#include <iterator>
+using namespace M2V;
+
+
+static bool BlockBefore(GObjectID objId, const GObjectBlock* block)
+{
+    return objId < block->GetFirstId();
+}
+
+void CanvasLayer::Add(GObjectPtr obj)
+{
+    m_objects.insert({obj->GetId(), obj});
+    m_dirty = true;
+}
+
+void CanvasLayer::Remove(GObjectID objId)
+{
+    if (m_objects.erase(objId) == 0) {
+        auto block = FindBlock(objId);
+        if (block == nullptr) {
+            MDEBUG_LOG("object " << objId << " isn't in layer '" << m_layerName << "'");
+            return;
+        }
+        block->Remove(objId);
+    }
+    m_dirty = true;
+}
+
+void CanvasLayer::AddBlock(GObjectBlock* block)
+{
+    auto pos = std::upper_bound(m_blocks.begin(), m_blocks.end(), block->GetFirstId(), BlockBefore);
+    m_blocks.insert(pos, block);
+    m_dirty = true;
+}
+
+void CanvasLayer::RemoveBlock(GObjectBlock* block)
+{
+    auto pos = std::find(m_blocks.begin(), m_blocks.end(), block);
+    MASSERT(pos != m_blocks.end());
+    m_blocks.erase(pos);
+    m_dirty = true;
+}
+
+GObjectBlock* CanvasLayer::FindBlock(GObjectID objId) const
+{
+    auto pos = std::upper_bound(m_blocks.begin(), m_blocks.end(), objId, BlockBefore);
+    if (pos == m_blocks.begin() || !(*std::prev(pos))->Contains(objId)) {
+        return nullptr;
+    }
+    return *std::prev(pos);
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "gobject.h"
 
@@ -16,15 +17,23 @@ public:
         m_zindex(zindex), m_dirty(false) {}
 
     void Add(GObjectPtr obj);
+    // an object that isn't in the layer is ignored
     void Remove(GObjectID objId);
     void Remove(GObjectPtr obj) { Remove(obj->GetId()); };
+    // add or remove all objects of a block, the layer is invalidated once
+    void AddBlock(GObjectBlock* block);
+    void RemoveBlock(GObjectBlock* block);
 
     auto& GetName() const { return m_layerName; }
 
     bool dirty() const { return m_dirty; }
 
 private:
+    GObjectBlock* FindBlock(GObjectID objId) const;
+
     std::unordered_map<GObjectID,GObjectPtr> m_objects;
+    // sorted by the first id
+    std::vector<GObjectBlock*> m_blocks;
     LayerID m_layerId;
     std::string m_layerName;
     size_t m_zindex;
@@ -13,6 +13,7 @@ public:
         m_viewportPtr(&viewport), m_submitted(false) { }
 
     bool done() const { return m_submitted; }
+    void Submit() { m_submitted = true; }
 
     void PushCommand(std::unique_ptr<ViewportCommand>&& cmd)
     {
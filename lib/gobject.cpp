@@ -0,0 +1,13 @@
+#include "gobject.h"
+using namespace M2V;
+
+
+std::vector<GObject> GObject::CreateObjects(GObjectID firstId, std::vector<CommonShape>& shapes)
+{
+    std::vector<GObject> ans;
+    ans.reserve(shapes.size());
+    for (size_t i=0;i<shapes.size();i++) {
+        ans.push_back(GObject(firstId + i, std::move(shapes[i])));
+    }
+    return ans;
+}
@@ -21,7 +21,13 @@ public:
     auto& shape() const { return m_shape; }
     auto& shape()       { return m_shape; }
 
-    static std::unique_ptr<GObject> CreateObject();
+    static std::unique_ptr<GObject> CreateObject(GObjectID id, CommonShape shape)
+    {
+        return std::unique_ptr<GObject>(new GObject(id, std::move(shape)));
+    }
+    // objects of shapes with the consecutive ids from firstId, in one array.
+    // the shapes are moved out
+    static std::vector<GObject> CreateObjects(GObjectID firstId, std::vector<CommonShape>& shapes);
 
 private:
     GObject(GObjectID id, CommonShape shape):
@@ -33,5 +39,46 @@ private:
 
 using GObjectPtr = QPtr<GObject>;
 
+// Objects with consecutive ids created together, e.g. the shapes a script
+// emitted to a layer in one frame. They are stored in one array and added
+// to the viewport and the layer as a unit, so a block costs one insertion
+// instead of one per object. A removed object stays in the array until
+// the block is deleted.
+class GObjectBlock {
+public:
+    GObjectBlock(GObjectID firstId, std::vector<GObject>&& objects):
+        m_firstId(firstId), m_objects(std::move(objects)),
+        m_removed(m_objects.size(), false), m_removedCount(0) {}
+
+    GObjectID GetFirstId() const { return m_firstId; }
+    GObjectID GetEndId() const { return m_firstId + m_objects.size(); }
+    bool Contains(GObjectID objId) const { return objId >= m_firstId && objId < GetEndId(); }
+    bool IsRemoved(GObjectID objId) const { return m_removed.at(objId - m_firstId); }
+
+    GObjectPtr Get(GObjectID objId)
+    {
+        MASSERT(Contains(objId));
+        return GObjectPtr(&m_objects[objId - m_firstId]);
+    }
+
+    void Remove(GObjectID objId)
+    {
+        MASSERT(Contains(objId));
+        if (!m_removed[objId - m_firstId]) {
+            m_removed[objId - m_firstId] = true;
+            m_removedCount++;
+        }
+    }
+
+    size_t size() const { return m_objects.size() - m_removedCount; }
+    bool empty() const { return size() == 0; }
+
+private:
+    GObjectID m_firstId;
+    std::vector<GObject> m_objects;
+    std::vector<bool> m_removed;
+    size_t m_removedCount;
+};
+
 }
 
@@ -0,0 +1,34 @@
+#include "scene_batch.h"
+#include <algorithm>
+using namespace M2V;
+
+
+void SceneBatch::Clear()
+{
+    for (auto& staged: m_layers) {
+        staged.m_shapes.clear();
+    }
+    m_size = 0;
+}
+
+bool SceneBatch::HasLayer(LayerID layer) const
+{
+    return std::find(m_validLayers.begin(), m_validLayers.end(), layer) != m_validLayers.end();
+}
+
+std::vector<CommonShape>& SceneBatch::Staging(LayerID layer)
+{
+    // shapes usually come in runs of the same layer
+    if (m_lastLayer < m_layers.size() && m_layers[m_lastLayer].m_layer == layer) {
+        return m_layers[m_lastLayer].m_shapes;
+    }
+    for (size_t i=0;i<m_layers.size();i++) {
+        if (m_layers[i].m_layer == layer) {
+            m_lastLayer = i;
+            return m_layers[i].m_shapes;
+        }
+    }
+    m_lastLayer = m_layers.size();
+    m_layers.push_back(LayerShapes{ layer, {} });
+    return m_layers.back().m_shapes;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "canvas_layer.h"
+#include <vector>
+
+
+namespace M2V {
+
+// Shapes staged per layer, e.g. by a script through the scene natives,
+// and added to a viewport as one commit by Viewport::Emit. Clear() keeps
+// the buffers, so a batch refilled every frame stops allocating once it
+// has seen the largest frame.
+class SceneBatch {
+public:
+    struct LayerShapes {
+        LayerID m_layer;
+        std::vector<CommonShape> m_shapes;
+    };
+
+    SceneBatch(): m_lastLayer(0), m_size(0) {}
+
+    void Append(LayerID layer, CommonShape shape)
+    {
+        Staging(layer).push_back(std::move(shape));
+        m_size++;
+    }
+    void Reserve(LayerID layer, size_t count) { Staging(layer).reserve(count); }
+    void Clear();
+
+    // the layers of the viewport the batch is emitted to, e.g.
+    // Viewport::GetLayers(). the scene natives reject any other layer
+    void SetLayers(std::vector<LayerID> layers) { m_validLayers = std::move(layers); }
+    bool HasLayer(LayerID layer) const;
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    std::vector<LayerShapes>& GetLayers() { return m_layers; }
+    const std::vector<LayerShapes>& GetLayers() const { return m_layers; }
+
+    // scratch space for the vertices of a shape being built, its capacity
+    // is reused by the next shape
+    std::vector<Point>& GetVertexBuffer() { return m_vertices; }
+
+private:
+    std::vector<CommonShape>& Staging(LayerID layer);
+
+    // in the order of the first shape of each layer, there are few layers
+    std::vector<LayerShapes> m_layers;
+    size_t m_lastLayer;
+    size_t m_size;
+    std::vector<LayerID> m_validLayers;
+    std::vector<Point> m_vertices;
+};
+
+}
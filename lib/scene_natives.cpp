@@ -0,0 +1,71 @@
+#include "scene_natives.h"
+#include "scene_batch.h"
+#include <cstdint>
+using namespace M2V;
+
+
+namespace {
+
+SceneBatch* Scene(VirtualMachine& vm, IntegerValueType layer)
+{
+    auto scene = static_cast<SceneBatch*>(vm.GetHost());
+    if (scene == nullptr) {
+        vm.Panic("no scene to emit into");
+        return nullptr;
+    }
+    if (layer <= 0 || !scene->HasLayer(static_cast<LayerID>(layer))) {
+        vm.Panic("invalid layer " + std::to_string(layer));
+        return nullptr;
+    }
+    return scene;
+}
+
+void EmitPolygon(VirtualMachine& vm, IntegerValueType layer, VMArrayObject* points)
+{
+    auto scene = Scene(vm, layer);
+    if (scene == nullptr) {
+        return;
+    }
+    auto& vertices = scene->GetVertexBuffer();
+    vertices.clear();
+    for (size_t i=0;i<points->size();i++) {
+        const auto vertex = points->get(i);
+        if (vertex.type() != VMObjectType::Point) {
+            vm.Panic("point expected");
+            return;
+        }
+        vertices.push_back(vertex.GetPoint());
+    }
+    scene->Append(layer, CommonShape::createPolygon(vertices.begin(), vertices.end()));
+}
+
+void EmitCircle(VirtualMachine& vm, IntegerValueType layer, PointValueType center, IntegerValueType radius)
+{
+    auto scene = Scene(vm, layer);
+    if (scene == nullptr) {
+        return;
+    }
+    if (radius < 0 || radius > INT32_MAX) {
+        vm.Panic("invalid radius " + std::to_string(radius));
+        return;
+    }
+    scene->Append(layer, CommonShape::createCircle(center, static_cast<int>(radius)));
+}
+
+void EmitSegment(VirtualMachine& vm, IntegerValueType layer, PointValueType p, PointValueType q)
+{
+    auto scene = Scene(vm, layer);
+    if (scene == nullptr) {
+        return;
+    }
+    scene->Append(layer, CommonShape::createLineSegment(p, q));
+}
+
+}
+
+void M2V::AddSceneNatives(NativeRegistry& natives)
+{
+    natives.Add<&EmitPolygon>("emit_polygon");
+    natives.Add<&EmitCircle>("emit_circle");
+    natives.Add<&EmitSegment>("emit_segment");
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "native.h"
+
+
+namespace M2V {
+
+// Natives through which a script draws into the SceneBatch set as the host
+// of its VM (VirtualMachine::SetHost), the host then hands the batch to
+// Viewport::Emit once per frame. A layer is a LayerID of the viewport, one
+// not set with SceneBatch::SetLayers() panics the VM:
+//   (emit_polygon layer points)     points is an array of points
+//   (emit_circle layer center radius)
+//   (emit_segment layer p q)
+void AddSceneNatives(NativeRegistry& natives);
+
+}
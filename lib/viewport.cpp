@@ -1,6 +1,44 @@
 #include "viewport.h"
+#include "scene_batch.h"
 using namespace M2V;
 
+
+// the blocks of one Emit, they are owned by the viewport while the command
+// is done and by the command while it is undone
+class Viewport::EmitCommand: public ViewportCommand {
+public:
+    EmitCommand(ViewportOperator viewport): m_viewport(viewport) {}
+
+    void Stage(LayerID layer, std::unique_ptr<GObjectBlock> block)
+    {
+        const auto firstId = block->GetFirstId();
+        m_blocks.push_back(Entry{ layer, firstId, std::move(block) });
+    }
+
+    void Execute() override
+    {
+        for (auto& entry: m_blocks) {
+            m_viewport.AddObjectBlock(entry.m_layer, std::move(entry.m_block));
+        }
+    }
+
+    void Undo() override
+    {
+        for (auto entry=m_blocks.rbegin();entry!=m_blocks.rend();entry++) {
+            entry->m_block = m_viewport.RemoveObjectBlock(entry->m_layer, entry->m_firstId);
+        }
+    }
+
+private:
+    struct Entry {
+        LayerID m_layer;
+        GObjectID m_firstId;
+        std::unique_ptr<GObjectBlock> m_block;
+    };
+    ViewportOperator m_viewport;
+    std::vector<Entry> m_blocks;
+};
+
 Commit& Viewport::BeginTransaction()
 {
     MDEBUG_LOG("begin transaction");
@@ -18,6 +56,42 @@ void Viewport::Abort(Commit& commit)
 void Viewport::Summit(Commit& commit)
 {
     MDEBUG_LOG("submit transaction");
+    MASSERT(!m_undoList.empty() && m_undoList.back().get() == &commit);
+    commit.Submit();
+}
+
+size_t Viewport::Emit(SceneBatch& batch)
+{
+    if (batch.empty()) {
+        return 0;
+    }
+    const auto size = batch.size();
+    size_t dropped = 0;
+    auto command = std::make_unique<EmitCommand>(ViewportOperator(this));
+    for (auto& staged: batch.GetLayers()) {
+        if (staged.m_shapes.empty()) {
+            continue;
+        }
+        if (!m_layers.count(staged.m_layer)) {
+            MDEBUG_LOG("emit to unknown layer " + std::to_string(staged.m_layer));
+            dropped += staged.m_shapes.size();
+            continue;
+        }
+        const auto firstId = m_freeObjectId;
+        m_freeObjectId += staged.m_shapes.size();
+        command->Stage(staged.m_layer, std::make_unique<GObjectBlock>(
+            firstId, GObject::CreateObjects(firstId, staged.m_shapes)));
+    }
+    batch.Clear();
+    if (dropped == size) {
+        return dropped;
+    }
+
+    auto& commit = BeginTransaction();
+    command->Execute();
+    commit.PushCommand(std::move(command));
+    Summit(commit);
+    return dropped;
 }
 
 void Viewport::OnScale(double scaleX, double scaleY)
@@ -61,6 +135,23 @@ LayerID Viewport::CreateLayer(const std::string& layerName)
     return layerId;
 }
 
+void Viewport::AddObjectBlock(LayerID layer, std::unique_ptr<GObjectBlock> block)
+{
+    MASSERT(m_layers.count(layer));
+    m_layers.at(layer).AddBlock(block.get());
+    const auto firstId = block->GetFirstId();
+    m_blocks.insert({firstId, std::move(block)});
+}
+
+std::unique_ptr<GObjectBlock> Viewport::RemoveObjectBlock(LayerID layer, GObjectID firstId)
+{
+    MASSERT(m_layers.count(layer) && m_blocks.count(firstId));
+    auto block = std::move(m_blocks.at(firstId));
+    m_blocks.erase(firstId);
+    m_layers.at(layer).RemoveBlock(block.get());
+    return block;
+}
+
 std::optional<LayerID> Viewport::FindLayer(const std::string& layerName) const
 {
     for (auto& [id, layer]: m_layers) {
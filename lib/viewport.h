@@ -2,16 +2,25 @@
 #include "commit.h"
 #include "canvas_layer.h"
 #include <map>
+#include <memory>
 #include <optional>
 #include <string>
+#include <vector>
 
 namespace M2V {
 
+class SceneBatch;
 class Viewport {
 public:
     Commit& BeginTransaction();
     void Abort(Commit& commit);
     void Summit(Commit& commit);
+    // add the shapes staged in batch as one commit, each layer gets one
+    // block of objects. shapes of a layer the viewport doesn't have are
+    // dropped, return their number. the batch is cleared for the next frame
+    size_t Emit(SceneBatch& batch);
+    // ids of the layers from bottom to top
+    const std::vector<LayerID>& GetLayers() const { return m_layerStack; }
 
     void OnScale(double scaleX, double scaleY);
     void OnTranslate(int deltaX, double deltaY);
@@ -61,6 +70,16 @@ protected:
         m_viewportPtr->CanvasRemoveObject(layer, object);
     }
 
+    void AddObjectBlock(LayerID layer, std::unique_ptr<GObjectBlock> block)
+    {
+        m_viewportPtr->AddObjectBlock(layer, std::move(block));
+    }
+
+    std::unique_ptr<GObjectBlock> RemoveObjectBlock(LayerID layer, GObjectID firstId)
+    {
+        return m_viewportPtr->RemoveObjectBlock(layer, firstId);
+    }
+
     protected:
         friend class Viewport;
         ViewportOperator(Viewport* viewportPtr):
@@ -95,8 +114,14 @@ protected:
 
     void DeleteObject(GObjectID objId)
     {
-        MASSERT(m_objects.count(objId));
-        m_objects.erase(objId);
+        if (m_objects.erase(objId) == 0) {
+            // an object of a block is freed with its block
+            auto block = m_blocks.upper_bound(objId);
+            MASSERT(block != m_blocks.begin());
+            --block;
+            MASSERT(block->second->Contains(objId));
+            block->second->Remove(objId);
+        }
     }
 
     void CanvasAddObject(LayerID layer, GObjectPtr object)
@@ -111,7 +136,12 @@ protected:
         m_layers.at(layer).Remove(object);
     }
 
+    void AddObjectBlock(LayerID layer, std::unique_ptr<GObjectBlock> block);
+    std::unique_ptr<GObjectBlock> RemoveObjectBlock(LayerID layer, GObjectID firstId);
+
 private:
+    class EmitCommand;
+
     std::vector<std::unique_ptr<Commit>> m_undoList;
     std::vector<std::unique_ptr<Commit>> m_redoList;
     LayerID m_freeLayerId;
@@ -119,6 +149,8 @@ private:
     std::map<LayerID, CanvasLayer> m_layers;
     std::vector<LayerID> m_layerStack;
     std::unordered_map<GObjectID, std::unique_ptr<GObject>> m_objects;
+    // by the first id
+    std::map<GObjectID, std::unique_ptr<GObjectBlock>> m_blocks;
 };
 
 }
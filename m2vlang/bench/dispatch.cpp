@@ -0,0 +1,129 @@
+#include "vm.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+using namespace M2V;
+
+using I = VMInstruction;
+using OP = VMOpcode;
+
+// instructions of the loop body, from MODULE_GETVAR to the backward jump
+static constexpr size_t LoopInstructions = 16;
+
+// a counting loop over a module variable with a mixed integer/float body
+static ExecutionModule LoopModule(IntegerValueType iterations)
+{
+    ExecutionModule module("bench");
+    const auto si = module.AddString("i");
+    const auto i0 = module.AddInteger(0);
+    const auto i1 = module.AddInteger(1);
+    const auto i3 = module.AddInteger(3);
+    const auto n = module.AddInteger(iterations);
+    const auto fhalf = module.AddFloat(0.5);
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, si, 0),
+        I(OP::PUSHINT, i0, 0),
+        I(OP::MODULE_SETVAR, 0, 1),
+        I(OP::PUSHINT, i1, 0),
+        I(OP::PUSHINT, n, 0),
+        I(OP::PUSHINT, i3, 0),
+        I(OP::PUSHFLT, fhalf, 0),
+        I(OP::MODULE_GETVAR, 0, 0),
+        I(OP::LESS, 6, 3),
+        I(OP::JMP_FLASE, 7, 14),
+        I(OP::ADD, 6, 4),
+        I(OP::MUL, 8, 4),
+        I(OP::SUB, 9, 6),
+        I(OP::MUL, 10, 5),
+        I(OP::ADD, 11, 5),
+        I(OP::LESS, 12, 9),
+        I(OP::LOGICAL_AND, 13, 7),
+        I(OP::EQUAL, 8, 9),
+        I(OP::DUP, 15, 0),
+        I(OP::GREATER, 10, 4),
+        I(OP::ADD, 6, 2),
+        I(OP::MODULE_SETVAR, 0, 18),
+        I(OP::POPN, 13, 0),
+        I(OP::JMP_TRUE, 2, -17),
+        I(OP::RET, 6, 0),
+    }, false);
+    return module;
+}
+
+// naive recursive fibonacci, the exit status is fib(n) modulo 2^32
+static ExecutionModule FibModule(IntegerValueType n)
+{
+    ExecutionModule module("bench");
+    const auto i1 = module.AddInteger(1);
+    const auto i2 = module.AddInteger(2);
+    const auto in = module.AddInteger(n);
+    const auto fib = module.AddFunction("fib", {
+        I(OP::PUSHINT, i2, 0),
+        I(OP::LESS, -1, 0),
+        I(OP::JMP_FLASE, 1, 1),
+        I(OP::RET, -1, 0),
+        I(OP::PUSHINT, i1, 0),
+        I(OP::SUB, -1, 2),
+        I(OP::CALL_MODULEFUNC, 0, 1),
+        I(OP::SUB, -1, 0),
+        I(OP::CALL_MODULEFUNC, 0, 1),
+        I(OP::ADD, 4, 6),
+        I(OP::RET, 7, 0),
+    }, false);
+    module.AddFunction("main", {
+        I(OP::PUSHINT, in, 0),
+        I(OP::CALL_MODULEFUNC, static_cast<int16_t>(fib), 1),
+        I(OP::RET, 1, 0),
+    }, false);
+    return module;
+}
+
+static bool Run(const char* name, const ExecutionModule& module, int expected, double instructions)
+{
+    VirtualMachine vm;
+    const auto begin = std::chrono::steady_clock::now();
+    vm.ExecuteModule(module, "main");
+    const auto end = std::chrono::steady_clock::now();
+    if (vm.IsPanicked() || vm.GetExitStatus().value_or(-1) != expected) {
+        std::cerr << name << " failed: " << vm.GetPanicMessage() << std::endl;
+        return false;
+    }
+
+    const double seconds = std::chrono::duration<double>(end - begin).count();
+    std::cout << name << ": " << seconds << " s, "
+              << instructions / seconds / 1e6 << " M instructions/s" << std::endl;
+#ifdef M2V_PROFILE
+    for (auto& spot: vm.GetProfiler().GetHotSpots(5)) {
+        std::cout << "  " << spot.m_function->m_name << "+" << spot.m_offset << ": "
+                  << spot.m_counter.m_count << " times, " << spot.m_counter.m_time.count() / 1e6 << " ms" << std::endl;
+    }
+#endif
+    return true;
+}
+
+static IntegerValueType Fibonacci(IntegerValueType n)
+{
+    IntegerValueType a = 0, b = 1;
+    for (IntegerValueType i=0;i<n;i++) {
+        const auto next = a + b;
+        a = b;
+        b = next;
+    }
+    return a;
+}
+
+int main(int argc, char** argv)
+{
+    const IntegerValueType iterations = argc > 1 ? std::atoll(argv[1]) : 10000000;
+    const IntegerValueType fibN = argc > 2 ? std::atoll(argv[2]) : 30;
+
+    // fib(n) has fib(n + 1) base cases of 4 instructions,
+    // every other call runs 11 instructions
+    const auto leaves = static_cast<double>(Fibonacci(fibN + 1));
+    const double fibInstructions = leaves * 4 + (leaves - 1) * 11;
+
+    bool ok = Run("loop", LoopModule(iterations), static_cast<int>(iterations),
+                  static_cast<double>(iterations) * LoopInstructions);
+    ok = Run("fib", FibModule(fibN), static_cast<int>(Fibonacci(fibN)), fibInstructions) && ok;
+    return ok ? 0 : 1;
+}
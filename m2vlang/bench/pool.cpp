@@ -0,0 +1,60 @@
+#include "compiler.h"
+#include "module_image.h"
+#include "parser.h"
+#include "vm_pool.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+using namespace M2V;
+
+
+// one job of the bench, a frame of a generator script
+static const char* FrameScript =
+    "(def fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+    "(def main () (- (fib (+ 20 (% frame 4))) (fib (+ 20 (% frame 4)))))";
+
+// seconds to run the jobs on a pool of the given size
+static double RunFrames(const std::shared_ptr<const ModuleImage>& image, size_t threads, size_t frames)
+{
+    std::vector<VMPool::Job> jobs;
+    for (size_t i=0;i<frames;i++) {
+        jobs.push_back(VMPool::Job{ image, "main", [i](VirtualMachine& vm) {
+            vm.SetGlobal("frame", VMValue::Integer(static_cast<IntegerValueType>(i)));
+        }});
+    }
+    VMPool pool(threads);
+    const auto begin = std::chrono::steady_clock::now();
+    const auto results = pool.RunAll(std::move(jobs));
+    const auto end = std::chrono::steady_clock::now();
+    for (auto& result: results) {
+        if (result.m_exitStatus != 0) {
+            std::cerr << "frame failed: " << result.m_panicMessage << std::endl;
+            std::exit(1);
+        }
+    }
+    return std::chrono::duration<double>(end - begin).count();
+}
+
+int main(int argc, char** argv)
+{
+    const size_t frames = argc > 1 ? std::atoll(argv[1]) : 256;
+    const size_t threads = argc > 2 ? std::atoll(argv[2]) : std::thread::hardware_concurrency();
+
+    GObjectParser parser;
+    auto ast = parser.parse(FrameScript);
+    Compiler compiler("frame");
+    compiler.AddGlobal("frame");
+    auto module = compiler.Compile(*ast);
+    if (!module.has_value()) {
+        std::cerr << compiler.GetErrorMessage() << std::endl;
+        return 1;
+    }
+    const std::shared_ptr<const ModuleImage> image = ModuleImage::Link(module.value());
+
+    const auto single = RunFrames(image, 1, frames);
+    std::cout << "1 thread: " << frames / single << " frames/s" << std::endl;
+    const auto parallel = RunFrames(image, threads, frames);
+    std::cout << threads << " threads: " << frames / parallel << " frames/s, speedup "
+              << single / parallel << std::endl;
+    return 0;
+}
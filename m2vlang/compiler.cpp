@@ -0,0 +1,1165 @@
+#include "compiler.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+using namespace M2V;
+
+using Constant = std::variant<IntegerValueType, FloatValueType, bool>;
+
+
+static std::optional<VMOpcode> BinaryOpcode(const std::string& op)
+{
+    static const std::unordered_map<std::string, VMOpcode> opcodes = {
+        { "+",  VMOpcode::ADD },
+        { "-",  VMOpcode::SUB },
+        { "*",  VMOpcode::MUL },
+        { "/",  VMOpcode::DIV },
+        { "%",  VMOpcode::MOD },
+        { "==", VMOpcode::EQUAL },
+        { "!=", VMOpcode::INEQUAL },
+        { ">",  VMOpcode::GREATER },
+        { "<",  VMOpcode::LESS },
+        { ">=", VMOpcode::GREATER_EQ },
+        { "<=", VMOpcode::LESS_EQ },
+        { "&&", VMOpcode::LOGICAL_AND },
+        { "||", VMOpcode::LOGICAL_OR },
+    };
+    auto it = opcodes.find(op);
+    if (it == opcodes.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+static void ForEachChild(const ASTExprNode& expr, const std::function<void(const ASTExprNode&)>& fn)
+{
+    if (auto def = dynamic_cast<const ASTFuncDefExprNode*>(&expr)) {
+        for (auto& e: def->GetExpressions()) fn(*e);
+    } else if (auto call = dynamic_cast<const ASTFuncExprNode*>(&expr)) {
+        for (auto& e: call->GetArgs()) fn(*e);
+    } else if (auto let = dynamic_cast<const ASTLetExprNode*>(&expr)) {
+        fn(*let->m_expr);
+    } else if (auto minus = dynamic_cast<const ASTMinusExprNode*>(&expr)) {
+        fn(*minus->m_expr);
+    } else if (auto binary = dynamic_cast<const ASTBinaryOpExprNode*>(&expr)) {
+        fn(*binary->m_left);
+        fn(*binary->m_right);
+    }
+}
+
+// the forms compiled inline by CompileCall(), the others are calls
+static bool IsBuiltinForm(const std::string& name)
+{
+    static const std::unordered_set<std::string> forms = {
+        "if", "while", "do", "return", "object", "get", "set", "concat", "array", "at", "put", "len",
+    };
+    return forms.count(name) > 0;
+}
+
+// whether expr calls a function, excluding nested definitions
+static bool HasCall(const ASTExprNode& expr)
+{
+    if (dynamic_cast<const ASTFuncDefExprNode*>(&expr)) {
+        return false;
+    }
+    if (auto call = dynamic_cast<const ASTFuncExprNode*>(&expr)) {
+        if (!IsBuiltinForm(call->GetFunc())) {
+            return true;
+        }
+    }
+    bool ans = false;
+    ForEachChild(expr, [&](const ASTExprNode& e) { ans = ans || HasCall(e); });
+    return ans;
+}
+
+// names assigned by let in a function body, excluding nested definitions
+static void CollectAssigned(const ASTExprNode& expr, std::vector<std::string>& names)
+{
+    if (dynamic_cast<const ASTFuncDefExprNode*>(&expr)) {
+        return;
+    }
+    if (auto let = dynamic_cast<const ASTLetExprNode*>(&expr)) {
+        names.push_back(let->m_id);
+    }
+    ForEachChild(expr, [&](const ASTExprNode& e) { CollectAssigned(e, names); });
+}
+
+static bool IsTrue(const Constant& val)
+{
+    if (auto i = std::get_if<IntegerValueType>(&val)) {
+        return *i != 0;
+    } else if (auto f = std::get_if<FloatValueType>(&val)) {
+        return *f != 0;
+    }
+    return std::get<bool>(val);
+}
+
+static FloatValueType ToFloat(const Constant& val)
+{
+    if (auto i = std::get_if<IntegerValueType>(&val)) {
+        return static_cast<FloatValueType>(*i);
+    }
+    return std::get<FloatValueType>(val);
+}
+
+template<typename T>
+static Constant FoldArithmetic(VMOpcode opcode, T v1, T v2)
+{
+    switch (opcode) {
+    case VMOpcode::ADD: return Constant(v1 + v2);
+    case VMOpcode::SUB: return Constant(v1 - v2);
+    case VMOpcode::MUL: return Constant(v1 * v2);
+    default:            return Constant(v1 / v2);
+    }
+}
+
+template<typename T>
+static bool FoldCompare(VMOpcode opcode, T v1, T v2)
+{
+    switch (opcode) {
+    case VMOpcode::GREATER:    return v1 > v2;
+    case VMOpcode::LESS:       return v1 < v2;
+    case VMOpcode::GREATER_EQ: return v1 >= v2;
+    default:                   return v1 <= v2;
+    }
+}
+
+// the result of VirtualMachine::ExecuteBinaryOperator, nothing if it would panic
+static std::optional<Constant> FoldBinary(VMOpcode opcode, const Constant& v1, const Constant& v2)
+{
+    switch (opcode) {
+    case VMOpcode::LOGICAL_AND:
+        return Constant(IsTrue(v1) && IsTrue(v2));
+    case VMOpcode::LOGICAL_OR:
+        return Constant(IsTrue(v1) || IsTrue(v2));
+    case VMOpcode::EQUAL:
+    case VMOpcode::INEQUAL:
+        return Constant((v1 == v2) == (opcode == VMOpcode::EQUAL));
+    default:
+        break;
+    }
+    if (std::holds_alternative<bool>(v1) || std::holds_alternative<bool>(v2)) {
+        return std::nullopt;
+    }
+    const bool integers = std::holds_alternative<IntegerValueType>(v1) && std::holds_alternative<IntegerValueType>(v2);
+    switch (opcode) {
+    case VMOpcode::ADD:
+    case VMOpcode::SUB:
+    case VMOpcode::MUL:
+    case VMOpcode::DIV:
+    case VMOpcode::MOD:
+        if (integers) {
+            const auto i1 = std::get<IntegerValueType>(v1);
+            const auto i2 = std::get<IntegerValueType>(v2);
+            if (opcode == VMOpcode::MOD) {
+                return i2 == 0 ? std::nullopt : std::optional<Constant>(i1 % i2);
+            }
+            if (opcode == VMOpcode::DIV && i2 == 0) {
+                return std::nullopt;
+            }
+            return FoldArithmetic(opcode, i1, i2);
+        }
+        if (opcode == VMOpcode::MOD) {
+            return std::nullopt;
+        }
+        return FoldArithmetic(opcode, ToFloat(v1), ToFloat(v2));
+    case VMOpcode::GREATER:
+    case VMOpcode::LESS:
+    case VMOpcode::GREATER_EQ:
+    case VMOpcode::LESS_EQ:
+        if (integers) {
+            return Constant(FoldCompare(opcode, std::get<IntegerValueType>(v1), std::get<IntegerValueType>(v2)));
+        }
+        return Constant(FoldCompare(opcode, ToFloat(v1), ToFloat(v2)));
+    default:
+        return std::nullopt;
+    }
+}
+
+std::optional<ExecutionModule> Compiler::Compile(const ASTModuleNode& module)
+{
+    m_errorMessage.clear();
+    m_module.emplace(m_moduleName);
+    m_functionIndex.clear();
+    m_functionDefs.clear();
+    m_captures.clear();
+    m_moduleVariables.clear();
+    m_strings.clear();
+    m_integers.clear();
+    m_floats.clear();
+
+    const auto& exprs = module.GetExpressions();
+    for (auto& expr: exprs) {
+        CollectFunctions(*expr);
+        CollectAssigned(*expr, m_moduleVariables);
+    }
+    AnalyzeClosures(exprs);
+    m_functionCode.assign(m_functionDefs.size(), {});
+    for (auto def: m_functionDefs) {
+        CompileFunction(*def);
+    }
+
+    FunctionState initializer;
+    initializer.m_name = "<init>";
+    initializer.m_moduleScope = true;
+    m_function = &initializer;
+    bool hasInitializer = false;
+    for (auto& expr: exprs) {
+        if (!initializer.m_reachable) {
+            break;
+        }
+        if (dynamic_cast<const ASTFuncDefExprNode*>(expr.get())) {
+            continue;
+        }
+        hasInitializer = true;
+        CompileExpr(*expr);
+    }
+    if (initializer.m_reachable) {
+        Emit(VMOpcode::RETNULL, 0, 0, 0);
+    }
+    m_function = nullptr;
+
+    if (!m_errorMessage.empty()) {
+        m_module.reset();
+        return std::nullopt;
+    }
+    for (size_t i=0;i<m_functionDefs.size();i++) {
+        m_module->AddFunction(m_functionDefs.at(i)->GetFuncName(), m_functionCode.at(i), false);
+    }
+    if (hasInitializer) {
+        m_module->SetInitializer(m_module->AddFunction(initializer.m_name, initializer.m_code, false));
+    }
+    auto ans = std::move(m_module);
+    m_module.reset();
+    return ans;
+}
+
+void Compiler::CollectFunctions(const ASTExprNode& expr)
+{
+    if (auto def = dynamic_cast<const ASTFuncDefExprNode*>(&expr)) {
+        if (m_functionIndex.count(def->GetFuncName())) {
+            Error("function '" + def->GetFuncName() + "' is defined twice");
+        } else {
+            m_functionIndex.insert({def->GetFuncName(), m_functionDefs.size()});
+            m_functionDefs.push_back(def);
+        }
+    }
+    ForEachChild(expr, [this](const ASTExprNode& e) { CollectFunctions(e); });
+}
+
+// Whether a nested function is a closure depends on the closures it refers
+// to, which are locals of the function around it, so the captures are
+// computed again until the set of closures doesn't change.
+void Compiler::AnalyzeClosures(const std::vector<std::shared_ptr<ASTExprNode>>& exprs)
+{
+    std::unordered_set<const ASTFuncDefExprNode*> closures;
+    for (;;) {
+        m_captures.clear();
+        // functions outside of any function
+        std::function<void(const ASTExprNode&)> analyze = [&](const ASTExprNode& expr) {
+            if (auto def = dynamic_cast<const ASTFuncDefExprNode*>(&expr)) {
+                AnalyzeFunction(*def, {}, closures);
+                return;
+            }
+            ForEachChild(expr, analyze);
+        };
+        for (auto& expr: exprs) {
+            analyze(*expr);
+        }
+        std::unordered_set<const ASTFuncDefExprNode*> found;
+        for (auto& [def, captures]: m_captures) {
+            if (!captures.m_upvalues.empty()) {
+                found.insert(def);
+            }
+        }
+        if (found == closures) {
+            break;
+        }
+        closures = std::move(found);
+    }
+}
+
+std::vector<std::string> Compiler::AnalyzeFunction(const ASTFuncDefExprNode& def, const std::unordered_set<std::string>& enclosing,
+                                                   const std::unordered_set<const ASTFuncDefExprNode*>& closures)
+{
+    // parameters, locals and nested closures. a let of a variable of the
+    // functions around it assigns to that variable
+    std::unordered_set<std::string> bound(def.GetParameters().begin(), def.GetParameters().end());
+    std::vector<std::string> assigned;
+    for (auto& expr: def.GetExpressions()) {
+        CollectAssigned(*expr, assigned);
+    }
+    const auto& modvars = m_moduleVariables;
+    for (auto& name: assigned) {
+        if (std::find(modvars.begin(), modvars.end(), name) == modvars.end() && !enclosing.count(name)) {
+            bound.insert(name);
+        }
+    }
+    std::vector<const ASTFuncDefExprNode*> nested;
+    std::function<void(const ASTExprNode&)> findNested = [&](const ASTExprNode& expr) {
+        if (auto inner = dynamic_cast<const ASTFuncDefExprNode*>(&expr)) {
+            nested.push_back(inner);
+            if (closures.count(inner)) {
+                bound.insert(inner->GetFuncName());
+            }
+            return;
+        }
+        ForEachChild(expr, findNested);
+    };
+    for (auto& expr: def.GetExpressions()) {
+        findNested(*expr);
+    }
+
+    std::vector<std::string> used;
+    auto use = [&used](const std::string& name) {
+        if (std::find(used.begin(), used.end(), name) == used.end()) {
+            used.push_back(name);
+        }
+    };
+    std::function<void(const ASTExprNode&)> collect = [&](const ASTExprNode& expr) {
+        if (dynamic_cast<const ASTFuncDefExprNode*>(&expr)) {
+            return;
+        } else if (auto id = dynamic_cast<const ASTIDExprNode*>(&expr)) {
+            use(id->GetID());
+        } else if (auto let = dynamic_cast<const ASTLetExprNode*>(&expr)) {
+            use(let->m_id);
+        } else if (auto call = dynamic_cast<const ASTFuncExprNode*>(&expr)) {
+            use(call->GetFunc());
+        }
+        ForEachChild(expr, collect);
+    };
+    for (auto& expr: def.GetExpressions()) {
+        collect(*expr);
+    }
+
+    Captures captures;
+    auto inner = enclosing;
+    inner.insert(bound.begin(), bound.end());
+    for (auto fn: nested) {
+        for (auto& name: AnalyzeFunction(*fn, inner, closures)) {
+            use(name);
+        }
+        for (auto& name: m_captures.at(fn).m_upvalues) {
+            if (bound.count(name)) {
+                captures.m_cells.insert(name);
+            }
+        }
+    }
+    std::vector<std::string> free;
+    for (auto& name: used) {
+        if (bound.count(name)) {
+            continue;
+        }
+        free.push_back(name);
+        if (enclosing.count(name)) {
+            captures.m_upvalues.push_back(name);
+        }
+    }
+    m_captures[&def] = std::move(captures);
+    return free;
+}
+
+bool Compiler::IsClosure(const ASTFuncDefExprNode& def) const
+{
+    auto it = m_captures.find(&def);
+    return it != m_captures.end() && !it->second.m_upvalues.empty();
+}
+
+void Compiler::CompileFunction(const ASTFuncDefExprNode& def)
+{
+    FunctionState state;
+    state.m_name = def.GetFuncName();
+    state.m_parameters = def.GetParameters();
+    state.m_upvalues = m_captures.at(&def).m_upvalues;
+    state.m_cells = m_captures.at(&def).m_cells;
+    state.m_pure = def.IsPure();
+    m_function = &state;
+    if (def.GetParameters().size() > INT16_MAX) {
+        Error("function '" + def.GetFuncName() + "' has too many parameters");
+    }
+    if (state.m_upvalues.size() > INT16_MAX) {
+        Error("function '" + def.GetFuncName() + "' captures too many variables");
+    }
+    if (def.IsPure()) {
+        // the cache is keyed by the arguments only
+        if (!state.m_upvalues.empty()) {
+            Error("pure function '" + def.GetFuncName() + "' captures variables");
+        }
+        Emit(VMOpcode::MEMO_GET, 0, 0, 0);
+    }
+
+    // arguments can't be stored to, assigned parameters are copied to locals
+    // and captured ones to cells
+    std::vector<std::string> assigned;
+    for (auto& expr: def.GetExpressions()) {
+        CollectAssigned(*expr, assigned);
+    }
+    for (size_t i=0;i<def.GetParameters().size();i++) {
+        const auto& name = def.GetParameters().at(i);
+        if (FindLocal(name)) {
+            continue;
+        }
+        if (IsCell(name)) {
+            state.m_locals.emplace_back(name, Push(VMOpcode::NEWCELL, -static_cast<int>(i) - 1));
+        } else if (std::find(assigned.begin(), assigned.end(), name) != assigned.end()) {
+            state.m_locals.emplace_back(name, Push(VMOpcode::DUP, -static_cast<int>(i) - 1));
+        }
+    }
+
+    if (def.GetExpressions().empty()) {
+        Emit(VMOpcode::RETNULL, 0, 0, 0);
+    } else {
+        const auto value = CompileBlock(def.GetExpressions(), !def.IsPure());
+        if (state.m_reachable) {
+            Emit(def.IsPure() ? VMOpcode::MEMO_RET : VMOpcode::RET, value, 0, 0);
+        }
+    }
+    m_functionCode.at(m_functionIndex.at(def.GetFuncName())) = std::move(state.m_code);
+    m_function = nullptr;
+}
+
+int Compiler::CompileExpr(const ASTExprNode& expr, bool tail)
+{
+    if (auto value = Fold(expr)) {
+        return PushConstant(value.value());
+    }
+    if (auto str = dynamic_cast<const ASTStringExprNode*>(&expr)) {
+        return Push(VMOpcode::PUSHSTR, StringIndex(str->GetValue()));
+    }
+    if (auto id = dynamic_cast<const ASTIDExprNode*>(&expr)) {
+        if (id->GetID() == "null") {
+            return Push(VMOpcode::PUSHNULL);
+        }
+        return CompileVariable(id->GetID());
+    }
+    if (auto minus = dynamic_cast<const ASTMinusExprNode*>(&expr)) {
+        const auto zero = PushConstant(IntegerValueType(0));
+        const auto value = CompileExpr(*minus->m_expr);
+        return Push(VMOpcode::SUB, zero, value);
+    }
+    if (auto binary = dynamic_cast<const ASTBinaryOpExprNode*>(&expr)) {
+        const auto opcode = BinaryOpcode(binary->m_op);
+        if (!opcode.has_value()) {
+            Error("unsupported operator '" + binary->m_op + "'");
+            return 0;
+        }
+        const auto left = CompileExpr(*binary->m_left);
+        const auto right = CompileExpr(*binary->m_right);
+        return Push(opcode.value(), left, right);
+    }
+    if (auto let = dynamic_cast<const ASTLetExprNode*>(&expr)) {
+        return CompileLet(*let);
+    }
+    if (auto call = dynamic_cast<const ASTFuncExprNode*>(&expr)) {
+        return CompileCall(*call, tail);
+    }
+    if (auto def = dynamic_cast<const ASTFuncDefExprNode*>(&expr)) {
+        return IsClosure(*def) ? CompileClosure(*def) : Push(VMOpcode::PUSHNULL);
+    }
+    Error("unexpected expression");
+    return 0;
+}
+
+int Compiler::CompileBlock(const std::vector<std::shared_ptr<ASTExprNode>>& exprs, bool tail)
+{
+    const auto scope = m_function->m_locals.size();
+    int value = 0;
+    for (size_t i=0;i<exprs.size();i++) {
+        // the rest of the block is unreachable after a return
+        if (!m_function->m_reachable) {
+            break;
+        }
+        const auto& expr = *exprs.at(i);
+        auto def = dynamic_cast<const ASTFuncDefExprNode*>(&expr);
+        if (i + 1 < exprs.size() && def && !IsClosure(*def)) {
+            continue;
+        }
+        const auto codeSize = m_function->m_code.size();
+        value = CompileExpr(expr, tail && i + 1 == exprs.size());
+        if (i + 1 < exprs.size()) {
+            DiscardValue(value, codeSize);
+        }
+    }
+    if (exprs.empty()) {
+        value = Push(VMOpcode::PUSHNULL);
+    }
+    m_function->m_locals.erase(m_function->m_locals.begin() + scope, m_function->m_locals.end());
+    return value;
+}
+
+void Compiler::DiscardValue(int value, size_t codeSize)
+{
+    auto& func = *m_function;
+    if (!func.m_reachable || func.m_code.size() != codeSize + 1 ||
+        value != func.m_depth - 1 || IsBound(value))
+    {
+        return;
+    }
+    switch (func.m_code.back().m_opcode) {
+    case VMOpcode::DUP:
+    case VMOpcode::PUSHSTR:
+    case VMOpcode::PUSHINT:
+    case VMOpcode::PUSHFLT:
+    case VMOpcode::PUSHNULL:
+    case VMOpcode::PUSHTRUE:
+    case VMOpcode::PUSHFALSE:
+        func.m_code.pop_back();
+        func.m_depth--;
+        break;
+    default:
+        break;
+    }
+}
+
+int Compiler::CompileVariable(const std::string& name)
+{
+    if (auto slot = FindLocal(name)) {
+        return IsCell(name) ? Push(VMOpcode::GETCELL, slot.value()) : slot.value();
+    }
+    const auto& parameters = m_function->m_parameters;
+    auto it = std::find(parameters.begin(), parameters.end(), name);
+    if (it != parameters.end()) {
+        return -static_cast<int>(it - parameters.begin()) - 1;
+    }
+    if (auto idx = FindUpvalue(name)) {
+        return Push(VMOpcode::GETUPVAL, idx.value());
+    }
+    auto func = m_functionIndex.find(name);
+    if (func != m_functionIndex.end()) {
+        if (IsClosure(*m_functionDefs.at(func->second))) {
+            Error("closure '" + name + "' is used before its definition");
+            return 0;
+        }
+        return Push(VMOpcode::CREATE_CLOSURE, static_cast<int>(func->second), 0);
+    }
+    const auto key = Push(VMOpcode::PUSHSTR, StringIndex(name));
+    const auto& modvars = m_moduleVariables;
+    if (m_globals.count(name) && std::find(modvars.begin(), modvars.end(), name) == modvars.end()) {
+        return Push(VMOpcode::GLOBAL_GETVAR, key);
+    }
+    return Push(VMOpcode::MODULE_GETVAR, key);
+}
+
+int Compiler::CompileLet(const ASTLetExprNode& let)
+{
+    const auto value = CompileExpr(*let.m_expr);
+    if (auto slot = FindLocal(let.m_id)) {
+        if (IsCell(let.m_id)) {
+            Emit(VMOpcode::SETCELL, slot.value(), value, 0);
+            return value;
+        }
+        if (slot.value() != value) {
+            Emit(VMOpcode::STORE, slot.value(), value, 0);
+        }
+        NoteInteger(slot.value(), *let.m_expr);
+        return slot.value();
+    }
+    if (auto idx = FindUpvalue(let.m_id)) {
+        Emit(VMOpcode::SETUPVAL, idx.value(), value, 0);
+        return value;
+    }
+    const auto& modvars = m_moduleVariables;
+    if (m_function->m_moduleScope || std::find(modvars.begin(), modvars.end(), let.m_id) != modvars.end()) {
+        const auto key = Push(VMOpcode::PUSHSTR, StringIndex(let.m_id));
+        Emit(VMOpcode::MODULE_SETVAR, key, value, 0);
+        return value;
+    }
+    if (IsCell(let.m_id)) {
+        m_function->m_locals.emplace_back(let.m_id, Push(VMOpcode::NEWCELL, value));
+        return value;
+    }
+    // a new local takes the slot of the value if nothing else refers to it
+    const bool fresh = value == m_function->m_depth - 1 && !IsBound(value);
+    const auto slot = fresh ? value : Push(VMOpcode::DUP, value);
+    m_function->m_locals.emplace_back(let.m_id, slot);
+    NoteInteger(slot, *let.m_expr);
+    return slot;
+}
+
+void Compiler::NoteInteger(int slot, const ASTExprNode& expr)
+{
+    auto& known = m_function->m_knownIntegers;
+    const auto value = Fold(expr);
+    if (value.has_value() && std::holds_alternative<IntegerValueType>(value.value())) {
+        known[slot] = std::get<IntegerValueType>(value.value());
+    } else {
+        known.erase(slot);
+    }
+}
+
+int Compiler::CompileCall(const ASTFuncExprNode& call, bool tail)
+{
+    const auto& name = call.GetFunc();
+    if (name == "if") {
+        return CompileIf(call, tail);
+    } else if (name == "while") {
+        return CompileWhile(call);
+    } else if (name == "do") {
+        return CompileBlock(call.GetArgs(), tail);
+    } else if (name == "return") {
+        return CompileReturn(call);
+    } else if (name == "object") {
+        if (!call.GetArgs().empty()) {
+            Error("object expects no arguments");
+            return 0;
+        }
+        return Push(VMOpcode::PUSHOBJECT);
+    } else if (name == "get" || name == "set") {
+        return CompileProperty(call);
+    } else if (name == "array") {
+        const auto array = Push(VMOpcode::PUSHARRAY);
+        for (size_t i=0;i<call.GetArgs().size();i++) {
+            const auto depth = m_function->m_depth;
+            const auto idx = PushConstant(static_cast<IntegerValueType>(i));
+            const auto value = CompileExpr(*call.GetArgs().at(i));
+            if (value != m_function->m_depth - 1) {
+                Push(VMOpcode::DUP, value);
+            }
+            Emit(VMOpcode::ARRAY_SET, array, idx, 0);
+            PopTo(depth);
+        }
+        return array;
+    } else if (name == "at" || name == "put" || name == "len") {
+        return CompileElement(call);
+    } else if (name == "concat") {
+        if (call.GetArgs().size() < 2) {
+            Error("concat expects at least two strings");
+            return 0;
+        }
+        auto value = CompileExpr(*call.GetArgs().at(0));
+        for (size_t i=1;i<call.GetArgs().size();i++) {
+            value = Push(VMOpcode::CONCAT, value, CompileExpr(*call.GetArgs().at(i)));
+        }
+        return value;
+    }
+
+    const auto& parameters = m_function->m_parameters;
+    const bool isVariable = FindLocal(name).has_value() || FindUpvalue(name).has_value() ||
+                            std::find(parameters.begin(), parameters.end(), name) != parameters.end();
+    auto it = m_functionIndex.find(name);
+    if (!isVariable && it != m_functionIndex.end() && IsClosure(*m_functionDefs.at(it->second))) {
+        Error("closure '" + name + "' is called before its definition");
+        return 0;
+    }
+    std::optional<int> callee;
+    if (isVariable || it == m_functionIndex.end()) {
+        callee = CompileVariable(name);
+    }
+
+    std::vector<int> args;
+    for (auto& arg: call.GetArgs()) {
+        args.push_back(CompileExpr(*arg));
+    }
+    // the arguments are the top values of the stack
+    const int nargs = static_cast<int>(args.size());
+    bool inPlace = true;
+    for (int i=0;i<nargs;i++) {
+        inPlace = inPlace && args.at(i) == m_function->m_depth - nargs + i;
+    }
+    if (!inPlace) {
+        for (auto arg: args) {
+            Push(VMOpcode::DUP, arg);
+        }
+    }
+    if (nargs > INT16_MAX) {
+        Error("too many arguments for '" + name + "'");
+    }
+    if (tail) {
+        // the callee returns to our caller, nothing after it is reachable
+        if (callee.has_value()) {
+            Emit(VMOpcode::TAILCALL, callee.value(), nargs, 0);
+        } else {
+            Emit(VMOpcode::TAILCALL_MODULEFUNC, static_cast<int>(it->second), nargs, 0);
+        }
+        m_function->m_reachable = false;
+        return Push(VMOpcode::PUSHNULL);
+    }
+    if (callee.has_value()) {
+        return Push(VMOpcode::CALL, callee.value(), nargs);
+    }
+    return Push(VMOpcode::CALL_MODULEFUNC, static_cast<int>(it->second), nargs);
+}
+
+// the cells of the captured variables, then CREATE_CLOSURE. a closure
+// that refers to itself captures the cell it's stored to
+int Compiler::CompileClosure(const ASTFuncDefExprNode& def)
+{
+    std::optional<int> self;
+    if (IsCell(def.GetFuncName())) {
+        self = Push(VMOpcode::NEWCELL, Push(VMOpcode::PUSHNULL));
+        m_function->m_locals.emplace_back(def.GetFuncName(), self.value());
+    }
+    const auto& upvalues = m_captures.at(&def).m_upvalues;
+    for (auto& name: upvalues) {
+        if (auto slot = FindLocal(name)) {
+            Push(VMOpcode::DUP, slot.value());
+        } else if (auto idx = FindUpvalue(name)) {
+            Push(VMOpcode::PUSHUPVAL, idx.value());
+        } else {
+            Error("variable '" + name + "' is captured by '" + def.GetFuncName() + "' before its declaration");
+            return 0;
+        }
+    }
+    const auto closure = Push(VMOpcode::CREATE_CLOSURE, static_cast<int>(m_functionIndex.at(def.GetFuncName())),
+                              static_cast<int>(upvalues.size()));
+    if (self.has_value()) {
+        Emit(VMOpcode::SETCELL, self.value(), closure, 0);
+    } else {
+        m_function->m_locals.emplace_back(def.GetFuncName(), closure);
+    }
+    return closure;
+}
+
+// GETPROP pushes the value, SETPROP stores the top value and leaves it
+// there as the value of the set
+int Compiler::CompileProperty(const ASTFuncExprNode& call)
+{
+    const auto& args = call.GetArgs();
+    const bool isSet = call.GetFunc() == "set";
+    if (args.size() != (isSet ? 3 : 2)) {
+        Error(isSet ? "set expects an object, a property name and a value" : "get expects an object and a property name");
+        return 0;
+    }
+    const auto obj = CompileExpr(*args.at(0));
+    // a literal key has an inline cache
+    const auto literal = dynamic_cast<const ASTStringExprNode*>(args.at(1).get());
+    const auto key = literal ? StringIndex(literal->GetValue()) : CompileExpr(*args.at(1));
+    if (!isSet) {
+        return Push(literal ? VMOpcode::GETPROP : VMOpcode::MAP_GET, obj, key);
+    }
+    auto value = CompileExpr(*args.at(2));
+    if (value != m_function->m_depth - 1) {
+        value = Push(VMOpcode::DUP, value);
+    }
+    Emit(literal ? VMOpcode::SETPROP : VMOpcode::MAP_SET, obj, key, 0);
+    return value;
+}
+
+// ARRAY_GET/ARRAY_SET of an index of a counted loop around skip the
+// bounds check, ARRAY_SET stores the top value like SETPROP
+int Compiler::CompileElement(const ASTFuncExprNode& call)
+{
+    const auto& args = call.GetArgs();
+    const auto& name = call.GetFunc();
+    if (name == "len") {
+        if (args.size() != 1) {
+            Error("len expects an array");
+            return 0;
+        }
+        return Push(VMOpcode::ARRAY_LEN, CompileExpr(*args.at(0)));
+    }
+    const bool isPut = name == "put";
+    if (args.size() != (isPut ? 3 : 2)) {
+        Error(isPut ? "put expects an array, an index and a value" : "at expects an array and an index");
+        return 0;
+    }
+    const auto array = CompileExpr(*args.at(0));
+    const auto idx = CompileExpr(*args.at(1));
+    const auto& inBounds = m_function->m_inBounds;
+    const int proven = std::find(inBounds.begin(), inBounds.end(), std::make_pair(array, idx)) != inBounds.end();
+    if (!isPut) {
+        return Push(VMOpcode::ARRAY_GET, array, idx, proven);
+    }
+    auto value = CompileExpr(*args.at(2));
+    if (value != m_function->m_depth - 1) {
+        value = Push(VMOpcode::DUP, value);
+    }
+    Emit(VMOpcode::ARRAY_SET, array, idx, 0, proven);
+    return value;
+}
+
+// the value of an if is kept in a slot reserved before the condition:
+//     PUSHNULL; <cond>; JMP_FALSE else; <then>; STORE; POPN; JMP end
+//     else: <else>; STORE; POPN
+//     end:
+int Compiler::CompileIf(const ASTFuncExprNode& call, bool tail)
+{
+    const auto& args = call.GetArgs();
+    if (args.size() != 2 && args.size() != 3) {
+        Error("if expects a condition and one or two branches");
+        return 0;
+    }
+    if (auto cond = Fold(*args.at(0))) {
+        if (IsTrue(cond.value())) {
+            return CompileBlock({ args.at(1) }, tail);
+        }
+        return args.size() == 3 ? CompileBlock({ args.at(2) }, tail) : Push(VMOpcode::PUSHNULL);
+    }
+
+    const auto result = Push(VMOpcode::PUSHNULL);
+    const auto cond = CompileExpr(*args.at(0));
+    const auto condDepth = m_function->m_depth;
+    const auto elseLabel = NewLabel();
+    EmitJump(VMOpcode::JMP_FLASE, cond, elseLabel);
+    Emit(VMOpcode::STORE, result, CompileBlock({ args.at(1) }, tail), 0);
+    if (args.size() == 2) {
+        // the else path only drops the condition
+        PopTo(condDepth);
+        BindLabel(elseLabel);
+        PopTo(result + 1);
+        return result;
+    }
+    const auto endLabel = NewLabel();
+    PopTo(result + 1);
+    EmitJump(VMOpcode::JMP, 0, endLabel);
+    BindLabel(elseLabel);
+    Emit(VMOpcode::STORE, result, CompileBlock({ args.at(2) }, tail), 0);
+    PopTo(result + 1);
+    BindLabel(endLabel);
+    return result;
+}
+
+//     head: <cond>; JMP_FALSE exit; <body>; POPN; JMP head
+//     exit: POPN
+int Compiler::CompileWhile(const ASTFuncExprNode& call)
+{
+    const auto& args = call.GetArgs();
+    if (args.empty()) {
+        Error("while expects a condition");
+        return 0;
+    }
+    const auto cond = Fold(*args.at(0));
+    if (cond.has_value() && !IsTrue(cond.value())) {
+        return Push(VMOpcode::PUSHNULL);
+    }
+
+    const auto depth = m_function->m_depth;
+    const auto counted = CountedLoop(call);
+    const auto head = NewLabel();
+    BindLabel(head);
+    std::optional<size_t> exit;
+    if (!cond.has_value()) {
+        const auto value = CompileExpr(*args.at(0));
+        exit = NewLabel();
+        EmitJump(VMOpcode::JMP_FLASE, value, exit.value());
+    }
+    if (counted.has_value()) {
+        m_function->m_inBounds.push_back(counted.value());
+    }
+    if (args.size() > 1) {
+        CompileBlock(std::vector<std::shared_ptr<ASTExprNode>>(args.begin() + 1, args.end()));
+    }
+    if (counted.has_value()) {
+        m_function->m_inBounds.pop_back();
+    }
+    PopTo(depth);
+    EmitJump(VMOpcode::JMP, 0, head);
+    if (exit.has_value()) {
+        BindLabel(exit.value());
+        PopTo(depth);
+    }
+    return Push(VMOpcode::PUSHNULL);
+}
+
+// (while (< i (len a)) ... (let i (+ i c))) where i is a local holding a
+// non-negative integer before the loop and c is a positive integer of at
+// most 32 bits, so i + c can't wrap: if the rest of the body doesn't assign
+// i or a, and calls nothing that could shrink a, i is an index of a until
+// the increment
+std::optional<std::pair<int,int>> Compiler::CountedLoop(const ASTFuncExprNode& call) const
+{
+    const auto& args = call.GetArgs();
+    if (args.size() < 2) {
+        return std::nullopt;
+    }
+    const auto cond = dynamic_cast<const ASTBinaryOpExprNode*>(args.front().get());
+    if (cond == nullptr || cond->m_op != "<") {
+        return std::nullopt;
+    }
+    const auto index = dynamic_cast<const ASTIDExprNode*>(cond->m_left.get());
+    const auto len = dynamic_cast<const ASTFuncExprNode*>(cond->m_right.get());
+    if (index == nullptr || len == nullptr || len->GetFunc() != "len" || len->GetArgs().size() != 1) {
+        return std::nullopt;
+    }
+    const auto array = dynamic_cast<const ASTIDExprNode*>(len->GetArgs().front().get());
+    if (array == nullptr) {
+        return std::nullopt;
+    }
+    const auto indexSlot = FindSlot(index->GetID());
+    const auto arraySlot = FindSlot(array->GetID());
+    if (!indexSlot.has_value() || !arraySlot.has_value() || indexSlot.value() < 0) {
+        return std::nullopt;
+    }
+    const auto& known = m_function->m_knownIntegers;
+    const auto start = known.find(indexSlot.value());
+    if (start == known.end() || start->second < 0) {
+        return std::nullopt;
+    }
+
+    const auto increment = dynamic_cast<const ASTLetExprNode*>(args.back().get());
+    if (increment == nullptr || increment->m_id != index->GetID()) {
+        return std::nullopt;
+    }
+    const auto add = dynamic_cast<const ASTBinaryOpExprNode*>(increment->m_expr.get());
+    if (add == nullptr || add->m_op != "+") {
+        return std::nullopt;
+    }
+    auto isIndex = [&](const ASTExprNode& expr) {
+        const auto id = dynamic_cast<const ASTIDExprNode*>(&expr);
+        return id != nullptr && id->GetID() == index->GetID();
+    };
+    const ASTExprNode* step = isIndex(*add->m_left) ? add->m_right.get() : isIndex(*add->m_right) ? add->m_left.get() : nullptr;
+    const auto c = step ? Fold(*step) : std::nullopt;
+    if (!c.has_value() || !std::holds_alternative<IntegerValueType>(c.value()) || std::get<IntegerValueType>(c.value()) <= 0
+            || std::get<IntegerValueType>(c.value()) > INT32_MAX) {
+        return std::nullopt;
+    }
+
+    for (size_t i=1;i+1<args.size();i++) {
+        std::vector<std::string> assigned;
+        CollectAssigned(*args.at(i), assigned);
+        for (auto& name: assigned) {
+            if (name == index->GetID() || name == array->GetID()) {
+                return std::nullopt;
+            }
+        }
+        if (HasCall(*args.at(i))) {
+            return std::nullopt;
+        }
+    }
+    return std::make_pair(arraySlot.value(), indexSlot.value());
+}
+
+int Compiler::CompileReturn(const ASTFuncExprNode& call)
+{
+    const auto& args = call.GetArgs();
+    if (args.size() > 1) {
+        Error("return expects at most one value");
+        return 0;
+    }
+    if (args.empty()) {
+        Emit(VMOpcode::RETNULL, 0, 0, 0);
+    } else {
+        const bool pure = m_function->m_pure;
+        Emit(pure ? VMOpcode::MEMO_RET : VMOpcode::RET, CompileExpr(*args.at(0), !pure), 0, 0);
+    }
+    m_function->m_reachable = false;
+    return Push(VMOpcode::PUSHNULL);
+}
+
+int Compiler::PushConstant(const Constant& value)
+{
+    if (auto i = std::get_if<IntegerValueType>(&value)) {
+        return Push(VMOpcode::PUSHINT, IntegerIndex(*i));
+    } else if (auto f = std::get_if<FloatValueType>(&value)) {
+        return Push(VMOpcode::PUSHFLT, FloatIndex(*f));
+    }
+    return Push(std::get<bool>(value) ? VMOpcode::PUSHTRUE : VMOpcode::PUSHFALSE);
+}
+
+std::optional<Compiler::Constant> Compiler::Fold(const ASTExprNode& expr) const
+{
+    if (auto i = dynamic_cast<const ASTIntExprNode*>(&expr)) {
+        return Constant(static_cast<IntegerValueType>(i->GetValue()));
+    }
+    if (auto f = dynamic_cast<const ASTFloatExprNode*>(&expr)) {
+        return Constant(static_cast<FloatValueType>(f->GetValue()));
+    }
+    if (auto id = dynamic_cast<const ASTIDExprNode*>(&expr)) {
+        if (id->GetID() == "true" || id->GetID() == "false") {
+            return Constant(id->GetID() == "true");
+        }
+        return std::nullopt;
+    }
+    if (auto minus = dynamic_cast<const ASTMinusExprNode*>(&expr)) {
+        const auto value = Fold(*minus->m_expr);
+        if (!value.has_value()) {
+            return std::nullopt;
+        }
+        return FoldBinary(VMOpcode::SUB, Constant(IntegerValueType(0)), value.value());
+    }
+    if (auto binary = dynamic_cast<const ASTBinaryOpExprNode*>(&expr)) {
+        const auto opcode = BinaryOpcode(binary->m_op);
+        if (!opcode.has_value()) {
+            return std::nullopt;
+        }
+        const auto left = Fold(*binary->m_left);
+        const auto right = left.has_value() ? Fold(*binary->m_right) : std::nullopt;
+        if (!right.has_value()) {
+            return std::nullopt;
+        }
+        return FoldBinary(opcode.value(), left.value(), right.value());
+    }
+    return std::nullopt;
+}
+
+void Compiler::Emit(VMOpcode opcode, int op1, int op2, int stackEffect, int op3)
+{
+    auto& func = *m_function;
+    func.m_depth += stackEffect;
+    MASSERT(func.m_depth >= 0);
+    if (func.m_depth > INT16_MAX) {
+        Error("function '" + func.m_name + "' uses too many slots");
+    }
+    if (func.m_reachable) {
+        func.m_code.emplace_back(opcode, static_cast<int16_t>(op1), static_cast<int16_t>(op2), static_cast<int16_t>(op3));
+    }
+}
+
+int Compiler::Push(VMOpcode opcode, int op1, int op2, int op3)
+{
+    Emit(opcode, op1, op2, 1, op3);
+    return m_function->m_depth - 1;
+}
+
+void Compiler::PopTo(int depth)
+{
+    const auto n = m_function->m_depth - depth;
+    MASSERT(n >= 0);
+    auto& known = m_function->m_knownIntegers;
+    for (auto it = known.begin(); it != known.end();) {
+        it = it->first >= depth ? known.erase(it) : std::next(it);
+    }
+    if (n > 0) {
+        Emit(VMOpcode::POPN, n, 0, -n);
+    }
+}
+
+size_t Compiler::NewLabel()
+{
+    m_function->m_labels.emplace_back();
+    return m_function->m_labels.size() - 1;
+}
+
+void Compiler::EmitJump(VMOpcode opcode, int op1, size_t label)
+{
+    auto& func = *m_function;
+    auto& target = func.m_labels.at(label);
+    if (func.m_reachable) {
+        int offset = 0;
+        if (target.m_pc.has_value()) {
+            offset = static_cast<int>(target.m_pc.value()) - static_cast<int>(func.m_code.size()) - 1;
+        } else {
+            target.m_jumps.push_back(func.m_code.size());
+            target.m_depth = func.m_depth;
+        }
+        if (offset < INT16_MIN) {
+            Error("function '" + func.m_name + "' is too large");
+        }
+        func.m_code.emplace_back(opcode, static_cast<int16_t>(op1), static_cast<int16_t>(offset));
+    }
+    if (opcode == VMOpcode::JMP) {
+        func.m_reachable = false;
+    }
+}
+
+void Compiler::BindLabel(size_t label)
+{
+    auto& func = *m_function;
+    auto& target = func.m_labels.at(label);
+    target.m_pc = func.m_code.size();
+    // other paths join here
+    func.m_knownIntegers.clear();
+    if (!target.m_jumps.empty()) {
+        MASSERT(!func.m_reachable || func.m_depth == target.m_depth);
+        func.m_reachable = true;
+        func.m_depth = target.m_depth;
+    }
+    for (auto jump: target.m_jumps) {
+        const auto offset = target.m_pc.value() - jump - 1;
+        if (offset > INT16_MAX) {
+            Error("function '" + func.m_name + "' is too large");
+        }
+        func.m_code.at(jump).m_operand2 = static_cast<int16_t>(offset);
+    }
+}
+
+std::optional<int> Compiler::FindLocal(const std::string& name) const
+{
+    const auto& locals = m_function->m_locals;
+    for (auto it = locals.rbegin(); it != locals.rend(); it++) {
+        if (it->first == name) {
+            return it->second;
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<int> Compiler::FindUpvalue(const std::string& name) const
+{
+    const auto& upvalues = m_function->m_upvalues;
+    auto it = std::find(upvalues.begin(), upvalues.end(), name);
+    if (it == upvalues.end()) {
+        return std::nullopt;
+    }
+    return static_cast<int>(it - upvalues.begin());
+}
+
+std::optional<int> Compiler::FindSlot(const std::string& name) const
+{
+    if (auto slot = FindLocal(name)) {
+        if (IsCell(name)) {
+            return std::nullopt;
+        }
+        return slot;
+    }
+    const auto& parameters = m_function->m_parameters;
+    auto it = std::find(parameters.begin(), parameters.end(), name);
+    if (it != parameters.end()) {
+        return -static_cast<int>(it - parameters.begin()) - 1;
+    }
+    return std::nullopt;
+}
+
+bool Compiler::IsBound(int slot) const
+{
+    for (auto& [_, s]: m_function->m_locals) {
+        if (s == slot) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int Compiler::StringIndex(const std::string& val)
+{
+    auto it = m_strings.find(val);
+    if (it != m_strings.end()) {
+        return it->second;
+    }
+    const auto idx = m_module->AddString(val);
+    if (idx > INT16_MAX) {
+        Error("too many string literals");
+    }
+    m_strings.insert({val, static_cast<int>(idx)});
+    return static_cast<int>(idx);
+}
+
+int Compiler::IntegerIndex(IntegerValueType val)
+{
+    auto it = m_integers.find(val);
+    if (it != m_integers.end()) {
+        return it->second;
+    }
+    const auto idx = m_module->AddInteger(val);
+    if (idx > INT16_MAX) {
+        Error("too many integer literals");
+    }
+    m_integers.insert({val, static_cast<int>(idx)});
+    return static_cast<int>(idx);
+}
+
+int Compiler::FloatIndex(FloatValueType val)
+{
+    uint64_t bits;
+    static_assert(sizeof(bits) == sizeof(val), "FloatValueType should be 64 bits");
+    std::memcpy(&bits, &val, sizeof(bits));
+    auto it = m_floats.find(bits);
+    if (it != m_floats.end()) {
+        return it->second;
+    }
+    const auto idx = m_module->AddFloat(val);
+    if (idx > INT16_MAX) {
+        Error("too many float literals");
+    }
+    m_floats.insert({bits, static_cast<int>(idx)});
+    return static_cast<int>(idx);
+}
+
+void Compiler::Error(const std::string& message)
+{
+    if (m_errorMessage.empty()) {
+        m_errorMessage = message;
+    }
+}
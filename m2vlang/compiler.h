@@ -0,0 +1,159 @@
+#pragma once
+#include "parser.h"
+#include "vm.h"
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+
+namespace M2V {
+
+// Compiles a parsed module into an ExecutionModule.
+//   (def f (a b) ...)     a function of the module, called by name. nested
+//                         definitions are module functions too
+//   (let x e)             assigns x. x is a module variable if it's assigned at
+//                         the top level, otherwise a local of the innermost
+//                         block, declared when it isn't visible
+//   (if c a b) (while c ...) (do ...) (return e)
+//   (object)              a new object
+//   (get o "k") (set o "k" v)  a property of an object, the name is a literal
+//   (get o k) (set o k v) the key may be computed, then it isn't cached
+//   (concat s1 s2 ...)    a string, long results are ropes
+//   (array e1 e2 ...)     a new array
+//   (at a i) (put a i v) (len a)  elements of arrays and typed arrays, a put
+//                         one past the end appends to an array
+// A function name is a value too. A nested definition that refers to
+// variables of the functions around it is a closure, created where it's
+// defined and bound to a local of that name: the variables it captures
+// live in cells shared by every function that uses them.
+//   true false null
+// The other top level expressions form the initializer of the module.
+// Constant subexpressions are folded, a branch on a constant condition and
+// the code after a return aren't emitted, locals are slots of the stack.
+// Calls in tail position reuse the frame of the caller. The elements a[i]
+// of a counted loop (while (< i (len a)) ... (let i (+ i 1))) aren't
+// checked against the length of a, see CountedLoop().
+class Compiler {
+public:
+    explicit Compiler(const std::string& moduleName): m_moduleName(moduleName) {}
+
+    // a free name that isn't a variable of the module refers to the global
+    // variable name of the VM, e.g. a native function
+    void AddGlobal(const std::string& name) { m_globals.insert(name); }
+
+    // return nothing if the module can't be compiled, see GetErrorMessage()
+    std::optional<ExecutionModule> Compile(const ASTModuleNode& module);
+    const std::string& GetErrorMessage() const { return m_errorMessage; }
+
+private:
+    using Constant = std::variant<IntegerValueType, FloatValueType, bool>;
+
+    struct Label {
+        std::optional<size_t> m_pc;
+        // jumps waiting for m_pc, and the stack size they jump with
+        std::vector<size_t> m_jumps;
+        int m_depth = 0;
+    };
+
+    // the captured variables of a function, see AnalyzeClosures()
+    struct Captures {
+        // variables of the functions around it, in the order of its upvalues
+        std::vector<std::string> m_upvalues;
+        // its variables captured by nested functions, they're kept in cells
+        std::unordered_set<std::string> m_cells;
+    };
+
+    struct FunctionState {
+        std::string m_name;
+        std::vector<std::string> m_parameters;
+        std::vector<std::string> m_upvalues;
+        std::unordered_set<std::string> m_cells;
+        std::vector<VMInstruction> m_code;
+        // visible locals and their slots, the innermost last
+        std::vector<std::pair<std::string,int>> m_locals;
+        std::vector<Label> m_labels;
+        // slots of locals known to hold an integer, forgotten at labels
+        std::unordered_map<int, IntegerValueType> m_knownIntegers;
+        // array and index operands of the counted loops around
+        std::vector<std::pair<int,int>> m_inBounds;
+        int m_depth = 0;
+        bool m_reachable = true;
+        // let declares module variables
+        bool m_moduleScope = false;
+        // returns go through the memo cache, they are never tail calls
+        bool m_pure = false;
+    };
+
+    void CollectFunctions(const ASTExprNode& expr);
+    void AnalyzeClosures(const std::vector<std::shared_ptr<ASTExprNode>>& exprs);
+    // the free names of def. enclosing are the names bound by the functions around it
+    std::vector<std::string> AnalyzeFunction(const ASTFuncDefExprNode& def, const std::unordered_set<std::string>& enclosing,
+                                             const std::unordered_set<const ASTFuncDefExprNode*>& closures);
+    bool IsClosure(const ASTFuncDefExprNode& def) const;
+    void CompileFunction(const ASTFuncDefExprNode& def);
+
+    // the operand of the value. the value of an expression in tail position
+    // is returned by the function, a call there becomes a tail call
+    int CompileExpr(const ASTExprNode& expr, bool tail = false);
+    int CompileBlock(const std::vector<std::shared_ptr<ASTExprNode>>& exprs, bool tail = false);
+    // drop the value of a statement if it was pushed by its only instruction
+    void DiscardValue(int value, size_t codeSize);
+    int CompileVariable(const std::string& name);
+    int CompileLet(const ASTLetExprNode& let);
+    // remember whether the local at slot holds the integer constant expr
+    void NoteInteger(int slot, const ASTExprNode& expr);
+    int CompileCall(const ASTFuncExprNode& call, bool tail);
+    int CompileIf(const ASTFuncExprNode& call, bool tail);
+    int CompileWhile(const ASTFuncExprNode& call);
+    int CompileReturn(const ASTFuncExprNode& call);
+    int CompileProperty(const ASTFuncExprNode& call);
+    int CompileElement(const ASTFuncExprNode& call);
+    // the array and the index of a loop whose index is always in range
+    std::optional<std::pair<int,int>> CountedLoop(const ASTFuncExprNode& call) const;
+    int CompileClosure(const ASTFuncDefExprNode& def);
+    int PushConstant(const Constant& value);
+
+    std::optional<Constant> Fold(const ASTExprNode& expr) const;
+
+    void Emit(VMOpcode opcode, int op1, int op2, int stackEffect, int op3 = 0);
+    // emit an instruction pushing one value, return its slot
+    int Push(VMOpcode opcode, int op1 = 0, int op2 = 0, int op3 = 0);
+    void PopTo(int depth);
+    size_t NewLabel();
+    void EmitJump(VMOpcode opcode, int op1, size_t label);
+    void BindLabel(size_t label);
+
+    std::optional<int> FindLocal(const std::string& name) const;
+    std::optional<int> FindUpvalue(const std::string& name) const;
+    // the operand of a local or a parameter read without an instruction
+    std::optional<int> FindSlot(const std::string& name) const;
+    bool IsCell(const std::string& name) const { return m_function->m_cells.count(name) > 0; }
+    bool IsBound(int slot) const;
+    int StringIndex(const std::string& val);
+    int IntegerIndex(IntegerValueType val);
+    int FloatIndex(FloatValueType val);
+
+    void Error(const std::string& message);
+
+    std::string m_moduleName;
+    std::string m_errorMessage;
+    std::optional<ExecutionModule> m_module;
+    std::unordered_map<std::string, size_t> m_functionIndex;
+    std::vector<const ASTFuncDefExprNode*> m_functionDefs;
+    std::unordered_map<const ASTFuncDefExprNode*, Captures> m_captures;
+    std::vector<std::vector<VMInstruction>> m_functionCode;
+    std::vector<std::string> m_moduleVariables;
+    std::unordered_set<std::string> m_globals;
+    FunctionState* m_function = nullptr;
+
+    std::unordered_map<std::string, int> m_strings;
+    std::unordered_map<IntegerValueType, int> m_integers;
+    // keyed by the bits of the value, so that NaN and -0.0 have their own entry
+    std::unordered_map<uint64_t, int> m_floats;
+};
+
+}
@@ -0,0 +1,66 @@
+#include "geometry.h"
+#include <cstdint>
+using namespace M2V;
+
+
+namespace {
+
+VMValue Point(VirtualMachine& vm, IntegerValueType x, IntegerValueType y)
+{
+    if (x < INT32_MIN || x > INT32_MAX || y < INT32_MIN || y > INT32_MAX) {
+        vm.Panic("point coordinate out of range");
+        return VMValue();
+    }
+    return VMValue::Point(PointValueType(static_cast<int>(x), static_cast<int>(y)));
+}
+
+IntegerValueType X(PointValueType p) { return p.m_x; }
+IntegerValueType Y(PointValueType p) { return p.m_y; }
+IntegerValueType Dot(PointValueType p, PointValueType q) { return p.Dot(q); }
+IntegerValueType Cross(PointValueType p, PointValueType q) { return p.Cross(q); }
+
+BoxValueType Box(PointValueType p, PointValueType q)
+{
+    return BoxValueType(p).merge(q);
+}
+
+VMValue Merge(VirtualMachine& vm, const BoxValueType& box, VMValue val)
+{
+    if (val.type() == VMObjectType::Point) {
+        return vm.CreateBox(box.merge(val.GetPoint()));
+    } else if (VMBoxObject::ClassOf(val)) {
+        return vm.CreateBox(box.merge(val.As<VMBoxObject>()->GetBox()));
+    }
+    vm.Panic("point or box expected");
+    return VMValue();
+}
+
+bool Contains(VirtualMachine& vm, const BoxValueType& box, VMValue val)
+{
+    if (val.type() == VMObjectType::Point) {
+        return box.contains(val.GetPoint());
+    } else if (VMBoxObject::ClassOf(val)) {
+        return box.contains(val.As<VMBoxObject>()->GetBox());
+    }
+    vm.Panic("point or box expected");
+    return false;
+}
+
+IntegerValueType Width(const BoxValueType& box) { return box.width(); }
+IntegerValueType Height(const BoxValueType& box) { return box.height(); }
+
+}
+
+void M2V::AddGeometryNatives(NativeRegistry& natives)
+{
+    natives.Add<&Point>("point");
+    natives.Add<&X>("px");
+    natives.Add<&Y>("py");
+    natives.Add<&Dot>("dot");
+    natives.Add<&Cross>("cross");
+    natives.Add<&Box>("box");
+    natives.Add<&Merge>("box_merge");
+    natives.Add<&Contains>("box_contains");
+    natives.Add<&Width>("box_width");
+    natives.Add<&Height>("box_height");
+}
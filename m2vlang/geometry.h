@@ -0,0 +1,19 @@
+#pragma once
+#include "native.h"
+
+
+namespace M2V {
+
+// Natives over the points and boxes of scripts, which are the H2G values
+// PointValueType and BoxValueType. A point is stored in the VMValue, so
+// vertex arithmetic allocates nothing; natives taking H2G types get them
+// without a conversion. Coordinates are ints:
+//   (point x y) (px p) (py p)
+//   (+ p q) (- p q) (== p q)      instructions, not natives
+//   (dot p q) (cross p q)         64 bit integers
+//   (box p q)                     the smallest box containing p and q
+//   (box_merge b x) (box_contains b x)  x is a point or a box
+//   (box_width b) (box_height b)
+void AddGeometryNatives(NativeRegistry& natives);
+
+}
@@ -0,0 +1,246 @@
+#include "memo.h"
+using namespace M2V;
+
+
+namespace {
+
+// nesting of arguments and results walked at most, deeper values are
+// taken as cycles
+constexpr size_t MaxDepth = 16;
+
+template<typename T>
+void Append(std::string& key, const T& val)
+{
+    key.append(reinterpret_cast<const char*>(&val), sizeof(T));
+}
+
+// estimated bytes of the objects val keeps alive, inline values are
+// counted with the entry
+size_t ApproximateSize(VMValue val, size_t depth)
+{
+    if (!val.IsObject() || depth == MaxDepth) {
+        return 0;
+    }
+    switch (val.type()) {
+    case VMObjectType::String:
+        return sizeof(VMStringObject) + val.As<VMStringObject>()->size();
+    case VMObjectType::Array:
+    {
+        auto array = val.As<VMArrayObject>();
+        size_t ans = sizeof(VMArrayObject) + array->size() * sizeof(VMValue);
+        for (size_t i=0;i<array->size();i++) {
+            ans += ApproximateSize(array->get(i), depth + 1);
+        }
+        return ans;
+    }
+    case VMObjectType::TypedArray:
+    {
+        auto array = val.As<VMTypedArrayObject>();
+        if (array->kind() == VMTypedArrayKind::Int32) {
+            return sizeof(VMTypedArrayObject) + array->size() * sizeof(int32_t);
+        }
+        const size_t floats = array->kind() == VMTypedArrayKind::Point2 ? array->size() * 2 : array->size();
+        return sizeof(VMTypedArrayObject) + floats * sizeof(FloatValueType);
+    }
+    case VMObjectType::Object:
+    {
+        auto object = val.As<VMMapObject>();
+        size_t ans = sizeof(VMMapObject) + object->size() * sizeof(VMValue);
+        for (size_t i=0;i<object->size();i++) {
+            ans += ApproximateSize(object->GetSlot(i), depth + 1);
+        }
+        return ans;
+    }
+    case VMObjectType::Box:
+        return sizeof(VMBoxObject);
+    default:
+        return sizeof(VMObject);
+    }
+}
+
+}
+
+std::optional<VMValue> VMMemoCache::Find(VMFunctionObject* func, const VMValue* args, size_t nargs, size_t depth)
+{
+    DropPending(depth - 1);
+    if (m_budget == 0 || !EncodeArguments(args, nargs)) {
+        m_misses++;
+        return std::nullopt;
+    }
+    auto table = m_tables.find(func);
+    if (table != m_tables.end()) {
+        auto it = table->second.find(m_key);
+        if (it != table->second.end()) {
+            m_hits++;
+            m_entries.splice(m_entries.begin(), m_entries, it->second);
+            return it->second->m_result;
+        }
+    }
+    m_misses++;
+    m_pending.push_back(Pending{ depth, m_key });
+    return std::nullopt;
+}
+
+void VMMemoCache::Insert(VMFunctionObject* func, size_t depth, VMValue result)
+{
+    DropPending(depth);
+    if (m_pending.empty() || m_pending.back().m_depth != depth) {
+        // the arguments couldn't be a key
+        return;
+    }
+    std::string key = std::move(m_pending.back().m_key);
+    m_pending.pop_back();
+    if (m_budget == 0) {
+        return;
+    }
+    const size_t size = sizeof(Entry) + 4 * sizeof(void*) + key.size() + ApproximateSize(result, 0);
+    if (size > m_budget) {
+        return;
+    }
+    auto table = m_tables.find(func);
+    if (table != m_tables.end() && table->second.count(key)) {
+        // a recursive call with the same arguments got there first
+        return;
+    }
+    Evict(m_budget - size);
+    m_entries.push_front(Entry{ func, std::move(key), result, size });
+    m_tables[func].emplace(m_entries.front().m_key, m_entries.begin());
+    m_size += size;
+}
+
+void VMMemoCache::Clear()
+{
+    m_entries.clear();
+    m_tables.clear();
+    m_pending.clear();
+    m_size = 0;
+}
+
+void VMMemoCache::SetBudget(size_t bytes)
+{
+    m_budget = bytes;
+    Evict(bytes);
+}
+
+void VMMemoCache::MarkValues(VMHeap& heap)
+{
+    // the functions too, so the address of a collected one is never reused
+    // while it is still a key
+    for (auto& entry: m_entries) {
+        heap.MarkObject(entry.m_function);
+        heap.MarkValue(entry.m_result);
+    }
+}
+
+void VMMemoCache::Evict(size_t budget)
+{
+    while (m_size > budget) {
+        auto& entry = m_entries.back();
+        auto table = m_tables.find(entry.m_function);
+        table->second.erase(entry.m_key);
+        if (table->second.empty()) {
+            m_tables.erase(table);
+        }
+        m_size -= entry.m_size;
+        m_entries.pop_back();
+    }
+}
+
+void VMMemoCache::DropPending(size_t depth)
+{
+    while (!m_pending.empty() && m_pending.back().m_depth > depth) {
+        m_pending.pop_back();
+    }
+}
+
+bool VMMemoCache::EncodeArguments(const VMValue* args, size_t nargs)
+{
+    m_key.clear();
+    Append(m_key, nargs);
+    for (size_t i=0;i<nargs;i++) {
+        if (!Encode(args[i], 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VMMemoCache::Encode(VMValue val, size_t depth)
+{
+    if (depth == MaxDepth || m_key.size() > MaxKeySize) {
+        return false;
+    }
+    Append(m_key, val.type());
+    switch (val.type()) {
+    case VMObjectType::Null:
+        return true;
+    case VMObjectType::Integer:
+        Append(m_key, val.GetInteger());
+        return true;
+    case VMObjectType::Boolean:
+        Append(m_key, val.GetBoolean());
+        return true;
+    case VMObjectType::Float:
+        // by the bits, 0.0 and -0.0 are different arguments
+        Append(m_key, val.GetFloat());
+        return true;
+    case VMObjectType::Point:
+        Append(m_key, val.GetPoint().m_x);
+        Append(m_key, val.GetPoint().m_y);
+        return true;
+    case VMObjectType::String:
+    {
+        const auto& str = val.As<VMStringObject>()->GetValue();
+        Append(m_key, str.size());
+        m_key += str;
+        return true;
+    }
+    case VMObjectType::Array:
+    {
+        auto array = val.As<VMArrayObject>();
+        Append(m_key, array->size());
+        for (size_t i=0;i<array->size();i++) {
+            if (!Encode(array->get(i), depth + 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case VMObjectType::TypedArray:
+    {
+        auto array = val.As<VMTypedArrayObject>();
+        Append(m_key, array->kind());
+        Append(m_key, array->size());
+        if (array->kind() == VMTypedArrayKind::Int32) {
+            m_key.append(reinterpret_cast<const char*>(array->Int32Data()), array->size() * sizeof(int32_t));
+        } else {
+            const size_t floats = array->kind() == VMTypedArrayKind::Point2 ? array->size() * 2 : array->size();
+            m_key.append(reinterpret_cast<const char*>(array->FloatData()), floats * sizeof(FloatValueType));
+        }
+        return m_key.size() <= MaxKeySize;
+    }
+    case VMObjectType::Object:
+    {
+        auto object = val.As<VMMapObject>();
+        Append(m_key, object->size());
+        for (size_t i=0;i<object->size();i++) {
+            const auto& name = object->GetShape()->KeyAt(i);
+            Append(m_key, name.size());
+            m_key += name;
+            if (!Encode(object->GetSlot(i), depth + 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case VMObjectType::Box:
+    {
+        // the corners of Box2D are private, a box is encoded by its bytes
+        const auto& box = val.As<VMBoxObject>()->GetBox();
+        m_key.append(reinterpret_cast<const char*>(&box), sizeof(box));
+        return true;
+    }
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include "vm_object.h"
+#include "vm_heap.h"
+#include <cstddef>
+#include <list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+namespace M2V {
+
+// Results of calls of functions marked pure, cached per function and keyed
+// by the arguments. The key is a structural encoding of the arguments:
+// numbers, booleans, points and boxes by value, strings by their characters,
+// arrays, typed arrays and objects by their elements, so a key never refers
+// to the heap and an array changed after the call doesn't hit. A call with
+// a function, a cycle or very large arguments isn't cached.
+// A cached result is shared by every call that hits it, the result and its
+// function are roots of the GC until the entry is evicted. Entries are
+// evicted least recently used first when the estimated size of the cache
+// exceeds its budget.
+class VMMemoCache {
+public:
+    static constexpr size_t DefaultBudget = 4 * 1024 * 1024;
+    static constexpr size_t MaxKeySize = 4 * 1024;
+
+    explicit VMMemoCache(size_t budget = DefaultBudget): m_budget(budget), m_size(0), m_hits(0), m_misses(0) {}
+    VMMemoCache(const VMMemoCache&) = delete;
+    VMMemoCache& operator=(const VMMemoCache&) = delete;
+
+    // the cached result of a call of func at call depth depth, nothing on a
+    // miss. the key of a miss is kept for Insert() of the same call, the
+    // body may change the arguments before it returns
+    std::optional<VMValue> Find(VMFunctionObject* func, const VMValue* args, size_t nargs, size_t depth);
+    // cache the result of the call at depth under the key of its miss,
+    // evicting entries to stay in the budget
+    void Insert(VMFunctionObject* func, size_t depth, VMValue result);
+    void Clear();
+
+    // a budget of 0 disables the cache
+    void SetBudget(size_t bytes);
+    size_t GetBudget() const { return m_budget; }
+    // estimated bytes of the keys and the results
+    size_t GetSize() const { return m_size; }
+    size_t GetEntryCount() const { return m_entries.size(); }
+    size_t GetHits() const { return m_hits; }
+    size_t GetMisses() const { return m_misses; }
+
+    void MarkValues(VMHeap& heap);
+
+private:
+    struct Entry {
+        VMFunctionObject* m_function;
+        std::string m_key;
+        VMValue m_result;
+        size_t m_size;
+    };
+    using EntryList = std::list<Entry>;
+    // the entries of one function by key
+    using Table = std::unordered_map<std::string_view, EntryList::iterator>;
+    // the key of a call that missed and hasn't returned yet
+    struct Pending {
+        size_t m_depth;
+        std::string m_key;
+    };
+
+    // encode the arguments into m_key, false if they can't be a key
+    bool EncodeArguments(const VMValue* args, size_t nargs);
+    bool Encode(VMValue val, size_t depth);
+    void Evict(size_t budget);
+    // forget the keys of calls deeper than depth, they were unwound by a panic
+    void DropPending(size_t depth);
+
+    size_t m_budget;
+    size_t m_size;
+    // most recently used first
+    EntryList m_entries;
+    std::unordered_map<VMFunctionObject*, Table> m_tables;
+    // scratch buffer of the key of the current call
+    std::string m_key;
+    // innermost call last
+    std::vector<Pending> m_pending;
+    size_t m_hits;
+    size_t m_misses;
+};
+
+}
@@ -0,0 +1,349 @@
+#include "module_image.h"
+#include "optimizer.h"
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define M2V_HAS_MMAP
+#endif
+
+using namespace M2V;
+
+
+namespace {
+
+uint64_t AlignSection(uint64_t offset)
+{
+    return (offset + 7) & ~static_cast<uint64_t>(7);
+}
+
+// rewrite accesses of variables with a literal name, give the others an inline cache
+void ResolveVariables(ExecutionModule& module, std::vector<std::string>& variables, uint32_t& cacheCount)
+{
+    std::unordered_map<std::string, size_t> variableIndex;
+    for (auto& func: module.GetFunctionTable()) {
+        if (func.m_size == 0) {
+            continue;
+        }
+        auto code = &module.GetInstruction(func.m_begin);
+        const auto literals = PeepholeOptimizer::StringLiterals(code, func.m_size);
+        for (size_t pc=0;pc<func.m_size;pc++) {
+            auto& ins = code[pc];
+            const bool isModule = ins.m_opcode == VMOpcode::MODULE_GETVAR || ins.m_opcode == VMOpcode::MODULE_SETVAR;
+            const bool isGlobal = ins.m_opcode == VMOpcode::GLOBAL_GETVAR || ins.m_opcode == VMOpcode::GLOBAL_SETVAR;
+            if (!isModule && !isGlobal) {
+                continue;
+            }
+            const auto& slots = literals.at(pc);
+            const auto nameSlot = ins.m_operand1;
+            if (nameSlot >= 0 && nameSlot < static_cast<int>(slots.size()) && slots[nameSlot] >= 0) {
+                const auto nameIdx = slots[nameSlot];
+                if (isGlobal) {
+                    // global slots belong to the VM, they're bound when the instruction first runs
+                    ins.m_opcode = ins.m_opcode == VMOpcode::GLOBAL_GETVAR ? VMOpcode::GLOBAL_GETNAME : VMOpcode::GLOBAL_SETNAME;
+                    ins.m_operand1 = static_cast<int16_t>(nameIdx);
+                    continue;
+                }
+                const auto& name = module.GetNthString(nameIdx);
+                auto it = variableIndex.insert({name, variables.size()}).first;
+                if (it->second == variables.size()) {
+                    variables.push_back(name);
+                }
+                if (it->second <= INT16_MAX) {
+                    ins.m_opcode = ins.m_opcode == VMOpcode::MODULE_GETVAR ? VMOpcode::MODULE_GETSLOT : VMOpcode::MODULE_SETSLOT;
+                    ins.m_operand1 = static_cast<int16_t>(it->second);
+                    continue;
+                }
+            }
+            ins.m_operand3 = cacheCount <= INT16_MAX ? static_cast<int16_t>(cacheCount) : -1;
+            if (ins.m_operand3 >= 0) {
+                cacheCount++;
+            }
+        }
+    }
+}
+
+// give every property access an inline cache
+void NumberPropertyCaches(ExecutionModule& module, uint32_t& cacheCount)
+{
+    for (size_t i=0;i<module.GetInstructionCount();i++) {
+        auto& ins = module.GetInstruction(i);
+        if (ins.m_opcode == VMOpcode::GETPROP || ins.m_opcode == VMOpcode::SETPROP) {
+            ins.m_operand3 = cacheCount <= INT16_MAX ? static_cast<int16_t>(cacheCount++) : -1;
+        }
+    }
+}
+
+// operands that index a section of the module or a cache are in range and
+// control stays in the function. the interpreter writes the quickened and
+// slot forms, and the bounds proofs of the compiler aren't kept in files
+bool IsValidCode(const ModuleFileHeader& header, const VMInstruction* code, size_t size)
+{
+    const auto below = [](int idx, uint32_t count) {
+        return idx >= 0 && static_cast<uint32_t>(idx) < count;
+    };
+    const auto cache = [&below](int idx, uint32_t count) {
+        return idx == -1 || below(idx, count);
+    };
+    for (size_t pc=0;pc<size;pc++) {
+        const auto& ins = code[pc];
+        bool valid = true;
+        switch (ins.m_opcode) {
+        case VMOpcode::POPN:
+            valid = ins.m_operand1 >= 0;
+            break;
+        case VMOpcode::CALL:
+        case VMOpcode::TAILCALL:
+            valid = ins.m_operand2 >= 0;
+            break;
+        case VMOpcode::CALL_MODULEFUNC:
+        case VMOpcode::TAILCALL_MODULEFUNC:
+        case VMOpcode::CREATE_CLOSURE:
+            valid = below(ins.m_operand1, header.m_functionCount) && ins.m_operand2 >= 0;
+            break;
+        case VMOpcode::PUSHSTR:
+        case VMOpcode::GLOBAL_GETNAME:
+        case VMOpcode::GLOBAL_SETNAME:
+            valid = below(ins.m_operand1, header.m_stringCount);
+            break;
+        case VMOpcode::PUSHINT:
+            valid = below(ins.m_operand1, header.m_integerCount);
+            break;
+        case VMOpcode::PUSHFLT:
+            valid = below(ins.m_operand1, header.m_floatCount);
+            break;
+        case VMOpcode::ADD_CONST:
+        case VMOpcode::SUB_CONST:
+            valid = below(ins.m_operand2, header.m_integerCount);
+            break;
+        case VMOpcode::MODULE_GETSLOT:
+        case VMOpcode::MODULE_SETSLOT:
+            valid = below(ins.m_operand1, header.m_variableCount);
+            break;
+        case VMOpcode::GLOBAL_GETVAR:
+        case VMOpcode::GLOBAL_SETVAR:
+        case VMOpcode::MODULE_GETVAR:
+        case VMOpcode::MODULE_SETVAR:
+            valid = cache(ins.m_operand3, header.m_cacheCount);
+            break;
+        case VMOpcode::GETPROP:
+        case VMOpcode::SETPROP:
+            valid = below(ins.m_operand2, header.m_stringCount) && cache(ins.m_operand3, header.m_propertyCacheCount);
+            break;
+        case VMOpcode::ARRAY_GET:
+        case VMOpcode::ARRAY_SET:
+            valid = ins.m_operand3 == 0;
+            break;
+        case VMOpcode::GLOBAL_GETSLOT:
+        case VMOpcode::GLOBAL_SETSLOT:
+            valid = false;
+            break;
+        default:
+            valid = static_cast<size_t>(ins.m_opcode) < VMOpcodeCount &&
+                    (ins.m_opcode < VMOpcode::ADD_II || ins.m_opcode > VMOpcode::LESS_EQ_JMP_FALSE_II);
+            break;
+        }
+        if (!valid) {
+            return false;
+        }
+    }
+    return size == 0 || !PeepholeOptimizer::StackDepths(code, size).empty();
+}
+
+}
+
+std::unique_ptr<ModuleImage> ModuleImage::Link(const ExecutionModule& source)
+{
+    ExecutionModule module(source);
+    [[maybe_unused]] const auto eliminated = PeepholeOptimizer::Optimize(module);
+    MDEBUG_LOG("module '" << module.GetModuleName() << "': " << eliminated << " instructions eliminated");
+
+    ModuleFileHeader header{};
+    header.m_magic = ModuleFileHeader::Magic;
+    header.m_version = ModuleFileHeader::Version;
+    std::vector<std::string> variables;
+    ResolveVariables(module, variables, header.m_cacheCount);
+    NumberPropertyCaches(module, header.m_propertyCacheCount);
+
+    std::string bytes;
+    const auto addBytes = [&bytes](const std::string& val) {
+        const ModuleFileString ans{ static_cast<uint32_t>(bytes.size()), static_cast<uint32_t>(val.size()) };
+        bytes.append(val);
+        return ans;
+    };
+    header.m_name = addBytes(module.GetModuleName());
+    std::vector<ModuleFileString> strings;
+    for (size_t i=0;i<module.GetStringCount();i++) {
+        strings.push_back(addBytes(module.GetNthString(i)));
+    }
+    std::vector<ModuleFileFunction> functions;
+    for (auto& func: module.GetFunctionTable()) {
+        functions.push_back(ModuleFileFunction{ addBytes(func.m_name), static_cast<uint32_t>(func.m_begin),
+                                                static_cast<uint32_t>(func.m_size), func.m_varadic, 0 });
+    }
+    std::vector<ModuleFileString> variableNames;
+    for (auto& name: variables) {
+        variableNames.push_back(addBytes(name));
+    }
+
+    header.m_instructionCount = static_cast<uint32_t>(module.GetInstructionCount());
+    header.m_integerCount = static_cast<uint32_t>(module.GetIntegerCount());
+    header.m_floatCount = static_cast<uint32_t>(module.GetFloatCount());
+    header.m_stringCount = static_cast<uint32_t>(strings.size());
+    header.m_functionCount = static_cast<uint32_t>(functions.size());
+    header.m_variableCount = static_cast<uint32_t>(variableNames.size());
+    header.m_initializer = module.ModuleIntializer().has_value() ? static_cast<int32_t>(module.ModuleIntializer().value()) : -1;
+
+    uint64_t size = AlignSection(sizeof(ModuleFileHeader));
+    const auto place = [&size](uint64_t sectionSize) {
+        const auto ans = size;
+        size = AlignSection(size + sectionSize);
+        return ans;
+    };
+    header.m_instructionOffset = place(header.m_instructionCount * sizeof(VMInstruction));
+    header.m_integerOffset = place(header.m_integerCount * sizeof(IntegerValueType));
+    header.m_floatOffset = place(header.m_floatCount * sizeof(FloatValueType));
+    header.m_stringOffset = place(strings.size() * sizeof(ModuleFileString));
+    header.m_functionOffset = place(functions.size() * sizeof(ModuleFileFunction));
+    header.m_variableOffset = place(variableNames.size() * sizeof(ModuleFileString));
+    header.m_bytesOffset = place(bytes.size());
+    header.m_bytesSize = bytes.size();
+
+    auto data = new char[size]();
+    const auto copy = [data](uint64_t offset, const void* src, size_t len) {
+        if (len > 0) {
+            std::memcpy(data + offset, src, len);
+        }
+    };
+    copy(0, &header, sizeof(header));
+    copy(header.m_instructionOffset, module.GetInstructionData(), header.m_instructionCount * sizeof(VMInstruction));
+    copy(header.m_integerOffset, module.GetIntegerData(), header.m_integerCount * sizeof(IntegerValueType));
+    copy(header.m_floatOffset, module.GetFloatData(), header.m_floatCount * sizeof(FloatValueType));
+    copy(header.m_stringOffset, strings.data(), strings.size() * sizeof(ModuleFileString));
+    copy(header.m_functionOffset, functions.data(), functions.size() * sizeof(ModuleFileFunction));
+    copy(header.m_variableOffset, variableNames.data(), variableNames.size() * sizeof(ModuleFileString));
+    copy(header.m_bytesOffset, bytes.data(), bytes.size());
+    return std::unique_ptr<ModuleImage>(new ModuleImage(data, size, false));
+}
+
+std::unique_ptr<ModuleImage> ModuleImage::Map(const std::string& path)
+{
+#ifdef M2V_HAS_MMAP
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(ModuleFileHeader)) {
+        close(fd);
+        return nullptr;
+    }
+    const auto size = static_cast<size_t>(st.st_size);
+    auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    if (!IsValid(static_cast<const char*>(data), size)) {
+        munmap(data, size);
+        return nullptr;
+    }
+    return std::unique_ptr<ModuleImage>(new ModuleImage(static_cast<char*>(data), size, true));
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return nullptr;
+    }
+    const auto size = static_cast<size_t>(file.tellg());
+    std::unique_ptr<char[]> data(new char[size]);
+    file.seekg(0);
+    if (!file.read(data.get(), size) || !IsValid(data.get(), size)) {
+        return nullptr;
+    }
+    return std::unique_ptr<ModuleImage>(new ModuleImage(data.release(), size, false));
+#endif
+}
+
+bool ModuleImage::Save(const std::string& path) const
+{
+    // a file doesn't keep the bounds proofs, IsValid() rejects them
+    std::vector<char> data(m_data, m_data + m_size);
+    const auto code = reinterpret_cast<VMInstruction*>(data.data() + Header().m_instructionOffset);
+    for (size_t i=0;i<InstructionCount();i++) {
+        if (code[i].m_opcode == VMOpcode::ARRAY_GET || code[i].m_opcode == VMOpcode::ARRAY_SET) {
+            code[i].m_operand3 = 0;
+        }
+    }
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+    return static_cast<bool>(file);
+}
+
+ModuleImage::~ModuleImage()
+{
+#ifdef M2V_HAS_MMAP
+    if (m_mapped) {
+        munmap(m_data, m_size);
+        return;
+    }
+#endif
+    delete[] m_data;
+}
+
+bool ModuleImage::IsValid(const char* data, size_t size)
+{
+    if (size < sizeof(ModuleFileHeader)) {
+        return false;
+    }
+    ModuleFileHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (header.m_magic != ModuleFileHeader::Magic || header.m_version != ModuleFileHeader::Version) {
+        return false;
+    }
+    const auto fits = [size](uint64_t offset, uint64_t count, uint64_t elementSize) {
+        return offset % 8 == 0 && offset <= size && count <= (size - offset) / elementSize;
+    };
+    if (!fits(header.m_instructionOffset, header.m_instructionCount, sizeof(VMInstruction)) ||
+        !fits(header.m_integerOffset, header.m_integerCount, sizeof(IntegerValueType)) ||
+        !fits(header.m_floatOffset, header.m_floatCount, sizeof(FloatValueType)) ||
+        !fits(header.m_stringOffset, header.m_stringCount, sizeof(ModuleFileString)) ||
+        !fits(header.m_functionOffset, header.m_functionCount, sizeof(ModuleFileFunction)) ||
+        !fits(header.m_variableOffset, header.m_variableCount, sizeof(ModuleFileString)) ||
+        !fits(header.m_bytesOffset, header.m_bytesSize, 1)) {
+        return false;
+    }
+    const auto inBytes = [&header](const ModuleFileString& str) {
+        return str.m_offset <= header.m_bytesSize && str.m_size <= header.m_bytesSize - str.m_offset;
+    };
+    const auto strings = reinterpret_cast<const ModuleFileString*>(data + header.m_stringOffset);
+    const auto variables = reinterpret_cast<const ModuleFileString*>(data + header.m_variableOffset);
+    const auto functions = reinterpret_cast<const ModuleFileFunction*>(data + header.m_functionOffset);
+    if (!inBytes(header.m_name)) {
+        return false;
+    }
+    for (uint32_t i=0;i<header.m_stringCount;i++) {
+        if (!inBytes(strings[i])) {
+            return false;
+        }
+    }
+    for (uint32_t i=0;i<header.m_variableCount;i++) {
+        if (!inBytes(variables[i])) {
+            return false;
+        }
+    }
+    const auto code = reinterpret_cast<const VMInstruction*>(data + header.m_instructionOffset);
+    for (uint32_t i=0;i<header.m_functionCount;i++) {
+        const auto& func = functions[i];
+        if (!inBytes(func.m_name) || func.m_begin > header.m_instructionCount ||
+            func.m_size > header.m_instructionCount - func.m_begin ||
+            !IsValidCode(header, code + func.m_begin, func.m_size)) {
+            return false;
+        }
+    }
+    return header.m_initializer >= -1 && header.m_initializer < static_cast<int64_t>(header.m_functionCount);
+}
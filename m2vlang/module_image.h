@@ -0,0 +1,146 @@
+#pragma once
+#include "vm.h"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+
+namespace M2V {
+
+// On-disk format of a linked module. Sections are 8-byte aligned and stored
+// in the byte order of the host, so the file is executed in place:
+//   ModuleFileHeader
+//   instructions      VMInstruction[instructionCount]
+//   integers          IntegerValueType[integerCount]
+//   floats            FloatValueType[floatCount]
+//   strings           ModuleFileString[stringCount], the string literals
+//   functions         ModuleFileFunction[functionCount]
+//   variables         ModuleFileString[variableCount], names of the module variables
+//   bytes             characters of every string
+struct ModuleFileString {
+    uint32_t m_offset;
+    uint32_t m_size;
+};
+
+struct ModuleFileFunction {
+    ModuleFileString m_name;
+    uint32_t m_begin;
+    uint32_t m_size;
+    uint32_t m_varargs;
+    uint32_t m_reserved;
+};
+
+struct ModuleFileHeader {
+    static constexpr uint32_t Magic = 0x4256324d; // "M2VB"
+    static constexpr uint32_t Version = 2;
+
+    uint32_t m_magic;
+    uint32_t m_version;
+    ModuleFileString m_name;
+    uint32_t m_instructionCount;
+    uint32_t m_integerCount;
+    uint32_t m_floatCount;
+    uint32_t m_stringCount;
+    uint32_t m_functionCount;
+    uint32_t m_variableCount;
+    // inline caches of variable accesses by a dynamic name
+    uint32_t m_cacheCount;
+    // inline caches of GETPROP/SETPROP
+    uint32_t m_propertyCacheCount;
+    uint32_t m_reserved;
+    // index of the initializer in the function table, -1 if there is none
+    int32_t  m_initializer;
+    uint64_t m_instructionOffset;
+    uint64_t m_integerOffset;
+    uint64_t m_floatOffset;
+    uint64_t m_stringOffset;
+    uint64_t m_functionOffset;
+    uint64_t m_variableOffset;
+    uint64_t m_bytesOffset;
+    uint64_t m_bytesSize;
+};
+
+// A module ready to run: the code is optimized, accesses of module variables
+// with a literal name are resolved to slots, and those of global variables to
+// GLOBAL_GETNAME/GLOBAL_SETNAME. Property accesses get an inline cache. An
+// image is either linked in memory from an ExecutionModule or mapped from a
+// module file. It never changes once built: a VM copies the instructions of
+// a function when it first uses it, its interpreter rewrites the copy, and
+// reads everything else in place, so one image may be shared by any number
+// of VMs on any threads and the code of functions never run is never copied.
+// Mapping a module file checks its layout and the instructions of every
+// function: literal, function, variable and cache indices are in range and
+// jumps stay in the function. Stack slots are still trusted like code. Files
+// don't keep the indices proven in bounds by the compiler, so the element
+// accesses of a mapped module are always checked.
+class ModuleImage {
+public:
+    static constexpr const char* FileExtension = ".m2vb";
+
+    static std::unique_ptr<ModuleImage> Link(const ExecutionModule& module);
+    // null if the file can't be read or isn't a module file
+    static std::unique_ptr<ModuleImage> Map(const std::string& path);
+    bool Save(const std::string& path) const;
+
+    ModuleImage(const ModuleImage&) = delete;
+    ModuleImage& operator=(const ModuleImage&) = delete;
+    ~ModuleImage();
+
+    std::string_view GetModuleName() const { return View(Header().m_name); }
+
+    const VMInstruction* GetInstructions() const { return Section<const VMInstruction>(Header().m_instructionOffset); }
+    size_t InstructionCount() const { return Header().m_instructionCount; }
+    const IntegerValueType* GetIntegerData() const { return Section<const IntegerValueType>(Header().m_integerOffset); }
+    const FloatValueType* GetFloatData() const { return Section<const FloatValueType>(Header().m_floatOffset); }
+
+    size_t StringCount() const { return Header().m_stringCount; }
+    std::string_view GetString(size_t idx) const
+    {
+        MASSERT(idx < StringCount());
+        return View(Section<const ModuleFileString>(Header().m_stringOffset)[idx]);
+    }
+
+    size_t FunctionCount() const { return Header().m_functionCount; }
+    const ModuleFileFunction& GetFunction(size_t idx) const
+    {
+        MASSERT(idx < FunctionCount());
+        return Section<const ModuleFileFunction>(Header().m_functionOffset)[idx];
+    }
+    std::string_view GetFunctionName(size_t idx) const { return View(GetFunction(idx).m_name); }
+    std::optional<size_t> Initializer() const
+    {
+        const auto idx = Header().m_initializer;
+        return idx >= 0 ? std::optional<size_t>(idx) : std::nullopt;
+    }
+
+    size_t VariableCount() const { return Header().m_variableCount; }
+    std::string_view GetVariableName(size_t idx) const
+    {
+        MASSERT(idx < VariableCount());
+        return View(Section<const ModuleFileString>(Header().m_variableOffset)[idx]);
+    }
+    size_t CacheCount() const { return Header().m_cacheCount; }
+    size_t PropertyCacheCount() const { return Header().m_propertyCacheCount; }
+
+private:
+    ModuleImage(char* data, size_t size, bool mapped): m_data(data), m_size(size), m_mapped(mapped) {}
+
+    // check that every section lies in the image and the code of every function
+    static bool IsValid(const char* data, size_t size);
+
+    const ModuleFileHeader& Header() const { return *reinterpret_cast<const ModuleFileHeader*>(m_data); }
+    template<typename T>
+    T* Section(uint64_t offset) const { return reinterpret_cast<T*>(m_data + offset); }
+    std::string_view View(ModuleFileString str) const
+    {
+        return std::string_view(m_data + Header().m_bytesOffset + str.m_offset, str.m_size);
+    }
+
+    char* m_data;
+    size_t m_size;
+    bool m_mapped;
+};
+
+}
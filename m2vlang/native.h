@@ -0,0 +1,206 @@
+#pragma once
+#include "vm.h"
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace M2V {
+
+// Conversion of a VM value to an argument of a typed native function.
+// Integers are accepted where a float is expected.
+template<typename T, typename = void>
+struct NativeArg;
+
+template<>
+struct NativeArg<VMValue> {
+    static bool Is(VMValue) { return true; }
+    static VMValue Get(VMValue val) { return val; }
+};
+
+template<>
+struct NativeArg<bool> {
+    static bool Is(VMValue val) { return val.type() == VMObjectType::Boolean; }
+    static bool Get(VMValue val) { return val.GetBoolean(); }
+};
+
+template<typename T>
+struct NativeArg<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>> {
+    static bool Is(VMValue val) { return val.type() == VMObjectType::Integer; }
+    static T Get(VMValue val) { return static_cast<T>(val.GetInteger()); }
+};
+
+template<typename T>
+struct NativeArg<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+    static bool Is(VMValue val) { return val.type() == VMObjectType::Float || val.type() == VMObjectType::Integer; }
+    static T Get(VMValue val)
+    {
+        return static_cast<T>(val.type() == VMObjectType::Float ? val.GetFloat() : val.GetInteger());
+    }
+};
+
+template<>
+struct NativeArg<std::string_view> {
+    static bool Is(VMValue val) { return val.type() == VMObjectType::String; }
+    static std::string_view Get(VMValue val) { return val.As<VMStringObject>()->GetValue(); }
+};
+
+template<>
+struct NativeArg<std::string>: NativeArg<std::string_view> {
+    static const std::string& Get(VMValue val) { return val.As<VMStringObject>()->GetValue(); }
+};
+
+// VMArrayObject*, VMMapObject*, ...
+template<typename T>
+struct NativeArg<T*, std::enable_if_t<std::is_base_of_v<VMObject, T>>> {
+    static bool Is(VMValue val) { return T::ClassOf(val); }
+    static T* Get(VMValue val) { return val.As<T>(); }
+};
+
+// H2G::Point<int> and H2G::Box2D<int> are passed without a conversion
+template<>
+struct NativeArg<PointValueType> {
+    static bool Is(VMValue val) { return val.type() == VMObjectType::Point; }
+    static PointValueType Get(VMValue val) { return val.GetPoint(); }
+};
+
+template<>
+struct NativeArg<BoxValueType> {
+    static bool Is(VMValue val) { return VMBoxObject::ClassOf(val); }
+    static const BoxValueType& Get(VMValue val) { return val.As<VMBoxObject>()->GetBox(); }
+};
+
+// Conversion of the result of a typed native function to a VM value
+template<typename T, typename = void>
+struct NativeResult;
+
+template<>
+struct NativeResult<VMValue> {
+    static VMValue Box(VirtualMachine&, VMValue val) { return val; }
+};
+
+template<>
+struct NativeResult<bool> {
+    static VMValue Box(VirtualMachine&, bool val) { return VMValue::Boolean(val); }
+};
+
+template<typename T>
+struct NativeResult<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>> {
+    static VMValue Box(VirtualMachine&, T val) { return VMValue::Integer(static_cast<IntegerValueType>(val)); }
+};
+
+template<typename T>
+struct NativeResult<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+    static VMValue Box(VirtualMachine&, T val) { return VMValue::Float(static_cast<FloatValueType>(val)); }
+};
+
+template<>
+struct NativeResult<std::string> {
+    static VMValue Box(VirtualMachine& vm, const std::string& val) { return vm.CreateString(val); }
+};
+
+template<>
+struct NativeResult<PointValueType> {
+    static VMValue Box(VirtualMachine&, const PointValueType& val) { return VMValue::Point(val); }
+};
+
+template<>
+struct NativeResult<BoxValueType> {
+    static VMValue Box(VirtualMachine& vm, const BoxValueType& val) { return vm.CreateBox(val); }
+};
+
+// Adapter from a typed C++ function to NativeFunction. The arity and the
+// argument types are checked, then the unboxed arguments are passed
+// straight to the function, everything else is resolved at compile time.
+// A function that allocates its result takes the VM as first parameter.
+template<typename R, typename ... Args>
+struct NativeCall {
+    template<typename Fn>
+    static VMValue Invoke(VirtualMachine& vm, const VMValue* args, size_t nargs, Fn&& fn)
+    {
+        if (nargs != sizeof...(Args)) {
+            vm.Panic("native function expects " + std::to_string(sizeof...(Args)) +
+                     " arguments, got " + std::to_string(nargs));
+            return VMValue();
+        }
+        return Call(vm, args, fn, std::index_sequence_for<Args...>());
+    }
+
+private:
+    template<typename T>
+    using Arg = NativeArg<std::remove_cv_t<std::remove_reference_t<T>>>;
+
+    template<typename Fn, size_t ... I>
+    static VMValue Call(VirtualMachine& vm, const VMValue* args, Fn& fn, std::index_sequence<I...>)
+    {
+        if (!(Arg<Args>::Is(args[I]) && ...)) {
+            vm.Panic("invalid argument of native function");
+            return VMValue();
+        }
+        if constexpr (std::is_void_v<R>) {
+            fn(Arg<Args>::Get(args[I])...);
+            return VMValue();
+        } else {
+            return NativeResult<std::remove_cv_t<std::remove_reference_t<R>>>::Box(vm, fn(Arg<Args>::Get(args[I])...));
+        }
+    }
+};
+
+template<typename F>
+struct NativeBinding;
+
+template<typename R, typename ... Args>
+struct NativeBinding<R(*)(Args...)> {
+    template<R(*F)(Args...)>
+    static VMValue Invoke(VirtualMachine& vm, const VMValue* args, size_t nargs)
+    {
+        return NativeCall<R, Args...>::Invoke(vm, args, nargs, [](Args ... a) -> R { return F(a...); });
+    }
+};
+
+template<typename R, typename ... Args>
+struct NativeBinding<R(*)(VirtualMachine&, Args...)> {
+    template<R(*F)(VirtualMachine&, Args...)>
+    static VMValue Invoke(VirtualMachine& vm, const VMValue* args, size_t nargs)
+    {
+        return NativeCall<R, Args...>::Invoke(vm, args, nargs, [&vm](Args ... a) -> R { return F(vm, a...); });
+    }
+};
+
+// NativeFunction of a typed function, e.g. BindNative<&Distance>()
+template<auto F>
+constexpr NativeFunction BindNative()
+{
+    return &NativeBinding<decltype(F)>::template Invoke<F>;
+}
+
+// Native functions to define as globals of a VM, one registry can be
+// installed into any number of VMs
+class NativeRegistry {
+public:
+    struct Entry {
+        std::string m_name;
+        NativeFunction m_function;
+    };
+
+    void Add(const std::string& name, NativeFunction func) { m_entries.push_back(Entry{ name, func }); }
+    template<auto F>
+    void Add(const std::string& name) { Add(name, BindNative<F>()); }
+
+    void Install(VirtualMachine& vm) const
+    {
+        for (auto& entry: m_entries) {
+            vm.RegisterNative(entry.m_name, entry.m_function);
+        }
+    }
+
+    const std::vector<Entry>& GetEntries() const { return m_entries; }
+
+private:
+    std::vector<Entry> m_entries;
+};
+
+}
@@ -0,0 +1,357 @@
+#include "optimizer.h"
+using namespace M2V;
+
+
+static bool IsJump(VMOpcode opcode)
+{
+    return opcode == VMOpcode::JMP_TRUE || opcode == VMOpcode::JMP_FLASE || opcode == VMOpcode::JMP;
+}
+
+static bool FallsThrough(VMOpcode opcode)
+{
+    return opcode != VMOpcode::RET && opcode != VMOpcode::RETNULL && opcode != VMOpcode::MEMO_RET &&
+           opcode != VMOpcode::JMP && opcode != VMOpcode::TAILCALL && opcode != VMOpcode::TAILCALL_MODULEFUNC;
+}
+
+static bool IsCompareJump(VMOpcode opcode)
+{
+    return opcode >= VMOpcode::EQUAL_JMP_TRUE && opcode <= VMOpcode::LESS_EQ_JMP_FALSE;
+}
+
+static std::optional<size_t> JumpTarget(const VMInstruction& ins, size_t pc)
+{
+    if (IsJump(ins.m_opcode)) {
+        return pc + ins.m_operand2 + 1;
+    } else if (IsCompareJump(ins.m_opcode)) {
+        return pc + ins.m_operand3 + 1;
+    }
+    return std::nullopt;
+}
+
+static std::optional<VMOpcode> FusedCompareJump(VMOpcode compare, VMOpcode jump)
+{
+    if (jump != VMOpcode::JMP_TRUE && jump != VMOpcode::JMP_FLASE) {
+        return std::nullopt;
+    }
+    const bool onTrue = jump == VMOpcode::JMP_TRUE;
+    switch (compare) {
+    case VMOpcode::EQUAL:
+        return onTrue ? VMOpcode::EQUAL_JMP_TRUE : VMOpcode::EQUAL_JMP_FALSE;
+    case VMOpcode::INEQUAL:
+        return onTrue ? VMOpcode::INEQUAL_JMP_TRUE : VMOpcode::INEQUAL_JMP_FALSE;
+    case VMOpcode::GREATER:
+        return onTrue ? VMOpcode::GREATER_JMP_TRUE : VMOpcode::GREATER_JMP_FALSE;
+    case VMOpcode::LESS:
+        return onTrue ? VMOpcode::LESS_JMP_TRUE : VMOpcode::LESS_JMP_FALSE;
+    case VMOpcode::GREATER_EQ:
+        return onTrue ? VMOpcode::GREATER_EQ_JMP_TRUE : VMOpcode::GREATER_EQ_JMP_FALSE;
+    case VMOpcode::LESS_EQ:
+        return onTrue ? VMOpcode::LESS_EQ_JMP_TRUE : VMOpcode::LESS_EQ_JMP_FALSE;
+    default:
+        return std::nullopt;
+    }
+}
+
+std::optional<int> PeepholeOptimizer::StackEffect(const VMInstruction& instruction)
+{
+    switch (instruction.m_opcode) {
+    case VMOpcode::NOP:
+    case VMOpcode::BEGIN_FUNCTION:
+    case VMOpcode::END_FUNCTION:
+    case VMOpcode::SETCELL:
+    case VMOpcode::SETUPVAL:
+    case VMOpcode::GLOBAL_SETVAR:
+    case VMOpcode::MODULE_SETVAR:
+    case VMOpcode::GLOBAL_SETSLOT:
+    case VMOpcode::MODULE_SETSLOT:
+    case VMOpcode::GLOBAL_SETNAME:
+    case VMOpcode::SETPROP:
+    case VMOpcode::ARRAY_SET:
+    case VMOpcode::MAP_SET:
+    case VMOpcode::JMP_TRUE:
+    case VMOpcode::JMP_FLASE:
+    case VMOpcode::JMP:
+    case VMOpcode::STORE:
+    case VMOpcode::RET:
+    case VMOpcode::RETNULL:
+    case VMOpcode::MEMO_GET:
+    case VMOpcode::MEMO_RET:
+    case VMOpcode::TAILCALL:
+    case VMOpcode::TAILCALL_MODULEFUNC:
+        return 0;
+    case VMOpcode::POPN:
+        return -instruction.m_operand1;
+    case VMOpcode::ADD:
+    case VMOpcode::SUB:
+    case VMOpcode::MUL:
+    case VMOpcode::DIV:
+    case VMOpcode::MOD:
+    case VMOpcode::EQUAL:
+    case VMOpcode::INEQUAL:
+    case VMOpcode::GREATER:
+    case VMOpcode::LESS:
+    case VMOpcode::GREATER_EQ:
+    case VMOpcode::LESS_EQ:
+    case VMOpcode::LOGICAL_AND:
+    case VMOpcode::LOGICAL_OR:
+    case VMOpcode::CALL:
+    case VMOpcode::CALL_MODULEFUNC:
+    case VMOpcode::DUP:
+    case VMOpcode::PUSHSTR:
+    case VMOpcode::PUSHINT:
+    case VMOpcode::PUSHFLT:
+    case VMOpcode::PUSHNULL:
+    case VMOpcode::PUSHTRUE:
+    case VMOpcode::PUSHFALSE:
+    case VMOpcode::PUSHARRAY:
+    case VMOpcode::PUSHOBJECT:
+    case VMOpcode::GLOBAL_GETVAR:
+    case VMOpcode::MODULE_GETVAR:
+    case VMOpcode::GLOBAL_GETSLOT:
+    case VMOpcode::MODULE_GETSLOT:
+    case VMOpcode::GLOBAL_GETNAME:
+    case VMOpcode::GETPROP:
+    case VMOpcode::CONCAT:
+    case VMOpcode::CREATE_CLOSURE:
+    case VMOpcode::NEWCELL:
+    case VMOpcode::GETCELL:
+    case VMOpcode::GETUPVAL:
+    case VMOpcode::PUSHUPVAL:
+    case VMOpcode::ARRAY_GET:
+    case VMOpcode::ARRAY_LEN:
+    case VMOpcode::MAP_GET:
+        return 1;
+    case VMOpcode::ADD_CONST:
+    case VMOpcode::SUB_CONST:
+        return 2;
+    default:
+        if (IsCompareJump(instruction.m_opcode)) {
+            return 1;
+        }
+        // LOAD_MODULE pushes a different number of values depending on
+        // whether the module is loaded, superinstructions aren't expected
+        return std::nullopt;
+    }
+}
+
+std::vector<int> PeepholeOptimizer::StackDepths(const VMInstruction* code, size_t size)
+{
+    std::vector<int> depths(size, Unreachable);
+    std::vector<size_t> worklist;
+    if (size > 0) {
+        depths[0] = 0;
+        worklist.push_back(0);
+    }
+    while (!worklist.empty()) {
+        const auto pc = worklist.back();
+        worklist.pop_back();
+        const auto& ins = code[pc];
+        const auto effect = StackEffect(ins);
+        int depth = UnknownDepth;
+        if (depths[pc] >= 0 && effect.has_value() && depths[pc] + effect.value() >= 0) {
+            depth = depths[pc] + effect.value();
+        }
+
+        size_t successors[2];
+        size_t nsucc = 0;
+        if (FallsThrough(ins.m_opcode)) {
+            successors[nsucc++] = pc + 1;
+        }
+        if (const auto target = JumpTarget(ins, pc)) {
+            successors[nsucc++] = target.value();
+        }
+        for (size_t i=0;i<nsucc;i++) {
+            const auto succ = successors[i];
+            if (succ >= size) {
+                return {};
+            }
+            if (depths[succ] == Unreachable) {
+                depths[succ] = depth;
+                worklist.push_back(succ);
+            } else if (depths[succ] != depth && depths[succ] != UnknownDepth) {
+                depths[succ] = UnknownDepth;
+                worklist.push_back(succ);
+            }
+        }
+    }
+    return depths;
+}
+
+std::vector<std::vector<int>> PeepholeOptimizer::StringLiterals(const VMInstruction* code, size_t size)
+{
+    enum class State { Unreachable, Known, Unknown };
+    std::vector<State> states(size, State::Unreachable);
+    std::vector<std::vector<int>> slots(size);
+    std::vector<size_t> worklist;
+    if (size > 0) {
+        states[0] = State::Known;
+        worklist.push_back(0);
+    }
+    while (!worklist.empty()) {
+        const auto pc = worklist.back();
+        worklist.pop_back();
+        const auto& ins = code[pc];
+        const auto effect = StackEffect(ins);
+
+        auto after = slots[pc];
+        bool known = states[pc] == State::Known && effect.has_value() &&
+                     static_cast<int>(after.size()) + effect.value() >= 0;
+        if (known) {
+            if (ins.m_opcode == VMOpcode::PUSHSTR) {
+                after.push_back(ins.m_operand1);
+            } else if (ins.m_opcode == VMOpcode::DUP) {
+                const auto idx = ins.m_operand1;
+                after.push_back(idx >= 0 && idx < static_cast<int>(after.size()) ? after[idx] : -1);
+            } else if (ins.m_opcode == VMOpcode::STORE) {
+                const auto slot = ins.m_operand1;
+                const auto idx = ins.m_operand2;
+                if (slot >= 0 && slot < static_cast<int>(after.size())) {
+                    after[slot] = idx >= 0 && idx < static_cast<int>(after.size()) ? after[idx] : -1;
+                }
+            } else if (effect.value() < 0) {
+                after.resize(after.size() + effect.value());
+            } else {
+                after.resize(after.size() + effect.value(), -1);
+            }
+        }
+
+        size_t successors[2];
+        size_t nsucc = 0;
+        if (FallsThrough(ins.m_opcode)) {
+            successors[nsucc++] = pc + 1;
+        }
+        if (const auto target = JumpTarget(ins, pc)) {
+            successors[nsucc++] = target.value();
+        }
+        for (size_t i=0;i<nsucc;i++) {
+            const auto succ = successors[i];
+            if (succ >= size) {
+                return std::vector<std::vector<int>>(size);
+            }
+            if (states[succ] == State::Unknown) {
+                continue;
+            }
+            if (!known || (states[succ] == State::Known && slots[succ].size() != after.size())) {
+                states[succ] = State::Unknown;
+                slots[succ].clear();
+                worklist.push_back(succ);
+            } else if (states[succ] == State::Unreachable) {
+                states[succ] = State::Known;
+                slots[succ] = after;
+                worklist.push_back(succ);
+            } else {
+                bool changed = false;
+                for (size_t j=0;j<after.size();j++) {
+                    if (slots[succ][j] != after[j] && slots[succ][j] != -1) {
+                        slots[succ][j] = -1;
+                        changed = true;
+                    }
+                }
+                if (changed) {
+                    worklist.push_back(succ);
+                }
+            }
+        }
+    }
+    return slots;
+}
+
+size_t PeepholeOptimizer::OptimizeFunction(const VMInstruction* code, size_t size, std::vector<VMInstruction>& out)
+{
+    const auto depths = StackDepths(code, size);
+    if (depths.empty()) {
+        out.insert(out.end(), code, code + size);
+        return 0;
+    }
+
+    // jumps of reachable instructions are checked by StackDepths(),
+    // unreachable ones are copied as they are
+    std::vector<bool> isTarget(size, false);
+    for (size_t i=0;i<size;i++) {
+        if (depths[i] != Unreachable && IsJump(code[i].m_opcode)) {
+            isTarget[i + code[i].m_operand2 + 1] = true;
+        }
+    }
+
+    const size_t begin = out.size();
+    std::vector<size_t> newIndex(size);
+    // instructions of out with a jump offset, and their old target
+    std::vector<std::pair<size_t,size_t>> jumps;
+    for (size_t i=0;i<size;i++) {
+        const auto& ins = code[i];
+        newIndex[i] = out.size() - begin;
+        if (i + 1 < size && depths[i] >= 0 && !isTarget[i + 1]) {
+            const auto& next = code[i + 1];
+            const int top = depths[i];
+
+            if (ins.m_opcode == VMOpcode::PUSHINT &&
+                (next.m_opcode == VMOpcode::ADD || next.m_opcode == VMOpcode::SUB))
+            {
+                const bool constFirst = next.m_operand1 == top && next.m_operand2 != top;
+                const bool constSecond = next.m_operand2 == top && next.m_operand1 != top;
+                if (constSecond || (constFirst && next.m_opcode == VMOpcode::ADD)) {
+                    const auto opcode = next.m_opcode == VMOpcode::ADD ? VMOpcode::ADD_CONST : VMOpcode::SUB_CONST;
+                    const auto other = constSecond ? next.m_operand1 : next.m_operand2;
+                    out.emplace_back(opcode, other, ins.m_operand1);
+                    newIndex[++i] = out.size() - 1 - begin;
+                    continue;
+                }
+            }
+
+            const auto fused = FusedCompareJump(ins.m_opcode, next.m_opcode);
+            if (fused.has_value() && next.m_operand1 == top) {
+                jumps.emplace_back(out.size(), i + 1 + next.m_operand2 + 1);
+                out.emplace_back(fused.value(), ins.m_operand1, ins.m_operand2);
+                newIndex[++i] = out.size() - 1 - begin;
+                continue;
+            }
+
+            if (ins.m_opcode == VMOpcode::DUP && (next.m_opcode == VMOpcode::RET || next.m_opcode == VMOpcode::MEMO_RET) &&
+                next.m_operand1 == top)
+            {
+                out.emplace_back(next.m_opcode, ins.m_operand1, 0);
+                newIndex[++i] = out.size() - 1 - begin;
+                continue;
+            }
+
+            if ((ins.m_opcode == VMOpcode::CALL || ins.m_opcode == VMOpcode::CALL_MODULEFUNC) &&
+                next.m_opcode == VMOpcode::RET && next.m_operand1 == top)
+            {
+                const auto opcode = ins.m_opcode == VMOpcode::CALL ? VMOpcode::TAILCALL : VMOpcode::TAILCALL_MODULEFUNC;
+                out.emplace_back(opcode, ins.m_operand1, ins.m_operand2);
+                newIndex[++i] = out.size() - 1 - begin;
+                continue;
+            }
+        }
+        if (depths[i] != Unreachable && IsJump(ins.m_opcode)) {
+            jumps.emplace_back(out.size(), i + ins.m_operand2 + 1);
+        }
+        out.push_back(ins);
+    }
+
+    for (auto& [idx, oldTarget]: jumps) {
+        auto& ins = out.at(idx);
+        const auto offset = static_cast<int16_t>(newIndex.at(oldTarget) - (idx - begin) - 1);
+        if (IsJump(ins.m_opcode)) {
+            ins.m_operand2 = offset;
+        } else {
+            ins.m_operand3 = offset;
+        }
+    }
+    return size - (out.size() - begin);
+}
+
+size_t PeepholeOptimizer::Optimize(ExecutionModule& module)
+{
+    std::vector<VMInstruction> out;
+    out.reserve(module.m_instructions.size());
+    size_t eliminated = 0;
+    for (auto& func: module.m_functionTable) {
+        const auto begin = out.size();
+        eliminated += OptimizeFunction(module.m_instructions.data() + func.m_begin, func.m_size, out);
+        func.m_begin = begin;
+        func.m_size = out.size() - begin;
+    }
+    module.m_instructions = std::move(out);
+    return eliminated;
+}
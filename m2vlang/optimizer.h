@@ -0,0 +1,40 @@
+#pragma once
+#include "vm.h"
+#include <optional>
+#include <vector>
+
+
+namespace M2V {
+
+// Rewrites common instruction sequences of a module into superinstructions:
+//   PUSHINT k; ADD/SUB idx, top     => ADD_CONST/SUB_CONST idx, k
+//   <compare> idx1, idx2; JMP_* top => <compare>_JMP_* idx1, idx2, offset
+//   DUP idx; RET top                => RET idx
+//   CALL/CALL_MODULEFUNC f, n; RET top => TAILCALL/TAILCALL_MODULEFUNC f, n
+// Slot numbering of the following instructions is unchanged. Sequences are
+// not fused across a jump target, jump offsets and function ranges of the
+// module are updated.
+class PeepholeOptimizer {
+public:
+    // return the number of eliminated instructions
+    static size_t Optimize(ExecutionModule& module);
+
+    // for every instruction of a function, the index of the string literal
+    // held by each stack slot before the instruction runs, -1 if the slot
+    // may hold anything else. the entry is empty if the stack isn't known
+    static std::vector<std::vector<int>> StringLiterals(const VMInstruction* code, size_t size);
+
+    // stack size before every instruction of the function,
+    // empty if a jump or the last instruction leaves the function
+    static std::vector<int> StackDepths(const VMInstruction* code, size_t size);
+
+private:
+    static constexpr int Unreachable = -1;
+    // paths with different stack sizes meet, or follow a LOAD_MODULE
+    static constexpr int UnknownDepth = -2;
+
+    static std::optional<int> StackEffect(const VMInstruction& instruction);
+    static size_t OptimizeFunction(const VMInstruction* code, size_t size, std::vector<VMInstruction>& out);
+};
+
+}
@@ -40,7 +40,8 @@ struct TokenStringLiteral: public LexerToken {
 
 #define GOBJ_KEYWORD_LIST \
     K_ENTRY(let) \
-    K_ENTRY(def)
+    K_ENTRY(def) \
+    K_ENTRY(pure)
 
 #define K_ENTRY(n) \
     struct TokenKeyword_##n: public LexerToken { \
@@ -174,6 +175,27 @@ static TokenConstantInteger handle_integer_str(std::string str)
      return ret;
 }
 
+// the value of a quoted literal, \n \t \r \0 are control characters and
+// any other escaped character stands for itself
+static std::string UnquoteString(const std::string& literal)
+{
+    std::string ans;
+    for (size_t i=1;i+1<literal.size();i++) {
+        char c = literal[i];
+        if (c == '\\') {
+            switch (literal[++i]) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case '0': c = '\0'; break;
+            default: c = literal[i]; break;
+            }
+        }
+        ans.push_back(c);
+    }
+    return ans;
+}
+
 static std::unique_ptr<Lexer<int>> createTokenizer()
 {
     auto lexer = std::make_unique<Lexer<int>>();
@@ -182,7 +204,7 @@ static std::unique_ptr<Lexer<int>> createTokenizer()
             s2u("\"([^\\\\\"\n]|(\\\\[^\n]))*\""),
             [](auto str, auto info) {
             return std::make_shared<TokenStringLiteral>(
-                    std::string(u2s(str)));
+                    UnquoteString(u2s(str)));
         }));
 
 // keywords
@@ -423,6 +445,19 @@ static std::unique_ptr<DCParser> createParser()
         return std::make_shared<NonTermEXPRESSION>(std::make_shared<ASTFuncDefExprNode>(id->m_id, ids, exprs));
     });
 
+    // a function whose result depends only on its arguments, see VMMemoCache
+    parser(NI(EXPRESSION), {PT(LPAREN), KW(pure), TI(ID), PT(LPAREN), ParserChar::beOptional(NI(ID_LIST)), PT(RPAREN), ParserChar::beOptional(NI(EXPRESSION_LIST)), PT(RPAREN)}, [](auto c, auto ts) {
+        assert(ts.size() == 8);
+        const std::shared_ptr<TokenID> id = std::dynamic_pointer_cast<TokenID>(ts.at(2));
+        const auto parameters = std::dynamic_pointer_cast<NonTermID_LIST>(ts.at(4));
+        const auto parametersNode = parameters ? std::dynamic_pointer_cast<ASTIDListNode>(parameters->m_astnode) : nullptr;
+        const auto exprList = std::dynamic_pointer_cast<NonTermEXPRESSION_LIST>(ts.at(6));
+        const auto exprListNode = exprList ? std::dynamic_pointer_cast<ASTExprListNode>(exprList->m_astnode) : nullptr;
+        const auto ids = parametersNode ? parametersNode->m_ids : std::vector<std::string>();
+        const auto exprs = exprListNode ? exprListNode->m_exprs : std::vector<std::shared_ptr<ASTExprNode>>();
+        return std::make_shared<NonTermEXPRESSION>(std::make_shared<ASTFuncDefExprNode>(id->m_id, ids, exprs, true));
+    });
+
     parser( NI(MODULE),
         { ParserChar::beOptional(NI(MODULE)), NI(EXPRESSION) },
         [](auto c, auto ts) {
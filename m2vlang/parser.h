@@ -64,6 +64,9 @@ public:
         return ans;
     }
 
+    const std::string& GetFunc() const { return m_func; }
+    const auto& GetArgs() const { return m_args; }
+
 private:
     std::string m_func;
     std::vector<std::shared_ptr<ASTExprNode>> m_args;
@@ -71,11 +74,12 @@ private:
 
 class ASTFuncDefExprNode: public ASTExprNode {
 public:
-    ASTFuncDefExprNode(const std::string& funcname, std::vector<std::string> parameters, std::vector<std::shared_ptr<ASTExprNode>> exprs):
-        m_funcname(funcname), m_parameters(parameters), m_exprs(exprs) {}
+    ASTFuncDefExprNode(const std::string& funcname, std::vector<std::string> parameters,
+                       std::vector<std::shared_ptr<ASTExprNode>> exprs, bool pure = false):
+        m_funcname(funcname), m_parameters(parameters), m_exprs(exprs), m_pure(pure) {}
 
     std::string format() override {
-        std::string ans = "(def " + m_funcname + " (";
+        std::string ans = (m_pure ? "(pure " : "(def ") + m_funcname + " (";
         for (auto& p: m_parameters) {
             ans += p + " ";
         }
@@ -89,10 +93,17 @@ public:
         return ans;
     }
 
+    const std::string& GetFuncName() const { return m_funcname; }
+    const std::vector<std::string>& GetParameters() const { return m_parameters; }
+    const auto& GetExpressions() const { return m_exprs; }
+    // the results are cached by the VM
+    bool IsPure() const { return m_pure; }
+
 private:
     std::string m_funcname;
     std::vector<std::string> m_parameters;
     std::vector<std::shared_ptr<ASTExprNode>> m_exprs;
+    bool m_pure;
 };
 
 class ASTMinusExprNode: public ASTExprNode {
@@ -149,6 +160,8 @@ public:
 
     std::string format() override { return std::to_string(m_value); }
 
+    int64_t GetValue() const { return m_value; }
+
 private:
     int64_t m_value;
 };
@@ -159,6 +172,8 @@ public:
 
     std::string format() override { return std::to_string(m_value); }
 
+    double GetValue() const { return m_value; }
+
 private:
     double m_value;
 };
@@ -167,7 +182,25 @@ class ASTStringExprNode: public ASTExprNode {
 public:
     ASTStringExprNode(const std::string& val): m_value(val) {}
 
-    std::string format() override { return "\"" + m_value + "\""; }
+    // a literal that parses back to the value
+    std::string format() override
+    {
+        std::string ans = "\"";
+        for (char c: m_value) {
+            switch (c) {
+            case '"':  ans += "\\\""; break;
+            case '\\': ans += "\\\\"; break;
+            case '\n': ans += "\\n"; break;
+            case '\t': ans += "\\t"; break;
+            case '\r': ans += "\\r"; break;
+            case '\0': ans += "\\0"; break;
+            default:   ans.push_back(c); break;
+            }
+        }
+        return ans + "\"";
+    }
+
+    const std::string& GetValue() const { return m_value; }
 
 private:
     std::string m_value;
@@ -179,6 +212,8 @@ public:
 
     std::string format() override { return m_id; }
 
+    const std::string& GetID() const { return m_id; }
+
 private:
     std::string m_id;
 };
@@ -191,6 +226,7 @@ public:
     {
         m_exprs.push_back(expr);
     }
+    const auto& GetExpressions() const { return m_exprs; }
 
     std::string format() override {
         std::string ans;
@@ -0,0 +1,109 @@
+#include "profiler.h"
+#include "vm.h"
+#include <algorithm>
+
+using namespace M2V;
+
+
+VMProfiler::VMProfiler()
+{
+    Reset();
+}
+
+VMProfiler::~VMProfiler() = default;
+
+void VMProfiler::Reset()
+{
+    m_opcodes.assign(VMOpcodeCount, Counter());
+    m_allocations.assign(VMObjectTypeCount, 0);
+    m_allocatedBytes.assign(VMObjectTypeCount, 0);
+    m_functions.clear();
+    m_nodes.clear();
+    m_nodes.push_back(std::make_unique<Node>(nullptr, nullptr, 0));
+    m_running = false;
+    m_opcode = 0;
+    m_offset = 0;
+    m_code = nullptr;
+    m_depth = 0;
+    m_function = nullptr;
+    m_node = m_nodes.front().get();
+}
+
+void VMProfiler::Enter(VMFunctionObject* function, const VMInstruction* code, size_t depth)
+{
+    auto& profile = m_functions[code];
+    if (!profile) {
+        profile = std::make_unique<FunctionProfile>();
+        const auto module = function->GetModule();
+        const auto name = module->GetFunctionNameAt(function->GetBaseOffset());
+        profile->m_name = module->GetModuleName() + ":" + std::string(name);
+        profile->m_instructions.resize(function->InstructionSize());
+    }
+    // a deeper frame or another function in the same frame is a call,
+    // a shallower one is a return
+    if (depth > m_depth || (depth == m_depth && code != m_code)) {
+        profile->m_calls++;
+    }
+
+    auto parent = m_node;
+    while (parent->m_parent && parent->m_depth >= depth) {
+        parent = parent->m_parent;
+    }
+    auto& node = parent->m_children[profile.get()];
+    if (!node) {
+        m_nodes.push_back(std::make_unique<Node>(profile.get(), parent, parent->m_depth + 1));
+        node = m_nodes.back().get();
+    }
+    m_code = code;
+    m_depth = depth;
+    m_function = profile.get();
+    m_node = node;
+}
+
+std::vector<const VMProfiler::FunctionProfile*> VMProfiler::GetFunctions() const
+{
+    std::vector<const FunctionProfile*> ans;
+    for (auto& [_, profile]: m_functions) {
+        ans.push_back(profile.get());
+    }
+    std::sort(ans.begin(), ans.end(), [](auto a, auto b) { return a->m_total.m_time > b->m_total.m_time; });
+    return ans;
+}
+
+std::vector<VMProfiler::HotSpot> VMProfiler::GetHotSpots(size_t n) const
+{
+    std::vector<HotSpot> ans;
+    for (auto& [_, profile]: m_functions) {
+        for (size_t i=0;i<profile->m_instructions.size();i++) {
+            if (profile->m_instructions[i].m_count > 0) {
+                ans.push_back(HotSpot{ profile.get(), i, profile->m_instructions[i] });
+            }
+        }
+    }
+    const auto byTime = [](const HotSpot& a, const HotSpot& b) { return a.m_counter.m_time > b.m_counter.m_time; };
+    if (ans.size() > n) {
+        std::partial_sort(ans.begin(), ans.begin() + n, ans.end(), byTime);
+        ans.resize(n);
+    } else {
+        std::sort(ans.begin(), ans.end(), byTime);
+    }
+    return ans;
+}
+
+void VMProfiler::WriteFoldedStacks(std::ostream& out) const
+{
+    std::vector<const Node*> path;
+    for (auto& node: m_nodes) {
+        if (!node->m_function || node->m_self.count() == 0) {
+            continue;
+        }
+        path.clear();
+        for (auto n = node.get(); n->m_function; n = n->m_parent) {
+            path.push_back(n);
+        }
+        for (auto it = path.rbegin(); it != path.rend(); it++) {
+            out << (it == path.rbegin() ? "" : ";") << (*it)->m_function->m_name;
+        }
+        out << " " << node->m_self.count() << "\n";
+    }
+}
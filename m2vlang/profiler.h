@@ -0,0 +1,150 @@
+#pragma once
+#include "vm_object.h"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace M2V {
+
+enum class VMOpcode: uint16_t;
+struct VMInstruction;
+
+// Profile of a VM built with M2V_PROFILE. The interpreter reports every
+// instruction it dispatches, the time until the next dispatch is charged to
+// the opcode, the function and the instruction offset, and to the call path
+// of the function. The heap reports every allocation. Without M2V_PROFILE
+// the VM has no profiler and no hooks.
+class VMProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Counter {
+        uint64_t m_count = 0;
+        std::chrono::nanoseconds m_time{0};
+
+        void Add(std::chrono::nanoseconds time)
+        {
+            m_count++;
+            m_time += time;
+        }
+    };
+
+    struct FunctionProfile {
+        // <module>:<function>
+        std::string m_name;
+        // calls and tail calls of the function
+        uint64_t m_calls = 0;
+        // instructions executed in the function and their time
+        Counter m_total;
+        // indexed by the offset of the instruction in the function
+        std::vector<Counter> m_instructions;
+    };
+
+    struct HotSpot {
+        const FunctionProfile* m_function;
+        size_t m_offset;
+        Counter m_counter;
+    };
+
+    VMProfiler();
+    VMProfiler(const VMProfiler&) = delete;
+    VMProfiler& operator=(const VMProfiler&) = delete;
+    ~VMProfiler();
+
+    const Counter& GetOpcode(VMOpcode opcode) const { return m_opcodes.at(static_cast<size_t>(opcode)); }
+    std::vector<const FunctionProfile*> GetFunctions() const;
+    // the n instructions with the most time
+    std::vector<HotSpot> GetHotSpots(size_t n) const;
+    uint64_t GetAllocationCount(VMObjectType type) const { return m_allocations.at(static_cast<size_t>(type)); }
+    uint64_t GetAllocatedBytes(VMObjectType type) const { return m_allocatedBytes.at(static_cast<size_t>(type)); }
+
+    // one line per call path, "f;g;h <nanoseconds>", the input of flamegraph.pl
+    void WriteFoldedStacks(std::ostream& out) const;
+    void Reset();
+
+    // an instruction of function is about to run, depth is the number of frames
+    void Step(VMFunctionObject* function, const VMInstruction* code, size_t offset, VMOpcode opcode, size_t depth)
+    {
+        const auto now = Clock::now();
+        Charge(now);
+        if (code != m_code || depth != m_depth) {
+            Enter(function, code, depth);
+        }
+        m_opcode = static_cast<size_t>(opcode);
+        m_offset = offset;
+        m_start = now;
+        m_running = true;
+    }
+    // the interpreter stopped, charge the running instruction
+    void Stop()
+    {
+        Charge(Clock::now());
+        m_running = false;
+    }
+    void CountAllocation(VMObjectType type, size_t bytes)
+    {
+        m_allocations.at(static_cast<size_t>(type))++;
+        m_allocatedBytes.at(static_cast<size_t>(type)) += bytes;
+    }
+
+    // stops the profiler when the interpreter returns
+    class Session {
+    public:
+        explicit Session(VMProfiler& profiler): m_profiler(profiler) {}
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+        ~Session() { m_profiler.Stop(); }
+
+    private:
+        VMProfiler& m_profiler;
+    };
+
+private:
+    // a call path, children are keyed by their function
+    struct Node {
+        Node(FunctionProfile* function, Node* parent, size_t depth):
+            m_function(function), m_parent(parent), m_depth(depth) {}
+
+        FunctionProfile* m_function;
+        Node* m_parent;
+        size_t m_depth;
+        std::chrono::nanoseconds m_self{0};
+        std::unordered_map<FunctionProfile*, Node*> m_children;
+    };
+
+    void Charge(Clock::time_point now)
+    {
+        if (!m_running) {
+            return;
+        }
+        const auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_start);
+        m_opcodes[m_opcode].Add(time);
+        m_function->m_total.Add(time);
+        m_function->m_instructions[m_offset].Add(time);
+        m_node->m_self += time;
+    }
+    void Enter(VMFunctionObject* function, const VMInstruction* code, size_t depth);
+
+    std::vector<Counter> m_opcodes;
+    std::vector<uint64_t> m_allocations;
+    std::vector<uint64_t> m_allocatedBytes;
+    std::unordered_map<const VMInstruction*, std::unique_ptr<FunctionProfile>> m_functions;
+    std::vector<std::unique_ptr<Node>> m_nodes;
+
+    // the running instruction
+    bool m_running;
+    Clock::time_point m_start;
+    size_t m_opcode;
+    size_t m_offset;
+    const VMInstruction* m_code;
+    size_t m_depth;
+    FunctionProfile* m_function;
+    Node* m_node;
+};
+
+}
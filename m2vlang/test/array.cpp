@@ -0,0 +1,108 @@
+#include "run_script.h"
+#include "typed_array.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <utility>
+using namespace M2V;
+
+
+static NativeRegistry TypedArrayNatives()
+{
+    NativeRegistry natives;
+    AddTypedArrayNatives(natives);
+    return natives;
+}
+
+// the element accesses of the module, and how many of them are unchecked
+using Accesses = std::pair<size_t, size_t>;
+static Accesses CountAccesses(const std::string& source)
+{
+    std::string error;
+    auto module = CompileScript(source, TypedArrayNatives(), error);
+    EXPECT_TRUE(module.has_value()) << error;
+    Accesses ans;
+    if (!module.has_value()) {
+        return ans;
+    }
+    for (size_t i=0;i<module->GetInstructionCount();i++) {
+        const auto& ins = module->GetInstruction(i);
+        if (ins.m_opcode == VMOpcode::ARRAY_GET || ins.m_opcode == VMOpcode::ARRAY_SET) {
+            ans.first++;
+            ans.second += ins.m_operand3 != 0;
+        }
+    }
+    return ans;
+}
+
+TEST(array, elements_in_a_script) {
+    EXPECT_EQ(RunScript("(def main () (let a (array 1 2 3)) (+ (at a 0) (* 10 (len a))))", TypedArrayNatives()), "31");
+    // a put one past the end appends
+    EXPECT_EQ(RunScript(
+        "(def main () (let a (array)) (let i 0)"
+        "  (while (< i 10) (put a i (* i i)) (let i (+ i 1)))"
+        "  (put a 3 100) (+ (len a) (at a 3)))", TypedArrayNatives()), "110");
+    EXPECT_EQ(RunScript(
+        "(def main () (let a (float64_array 4)) (put a 1 2.5) (put a 2 3)"
+        "  (let s (+ (at a 1) (at a 2))) (if (== s 5.5) (len a) 0))", TypedArrayNatives()), "4");
+    // computed property names
+    EXPECT_EQ(RunScript(
+        "(def main () (let o (object)) (let keys (array \"a\" \"b\")) (let i 0)"
+        "  (while (< i (len keys)) (set o (at keys i) (+ i 1)) (let i (+ i 1)))"
+        "  (+ (get o \"a\") (* 10 (get o (at keys 1)))))", TypedArrayNatives()), "21");
+}
+
+TEST(array, counted_loops_skip_bounds_checks) {
+    const std::string sum =
+        "(def sum (a) (let s 0) (let i 0)"
+        "  (while (< i (len a)) (let s (+ s (at a i))) (let i (+ i 1))) s)"
+        "(def main () (let a (int32_array 100)) (let i 0)"
+        "  (while (< i (len a)) (put a i i) (let i (+ i 1))) (- (sum a) 4900))";
+    EXPECT_EQ(CountAccesses(sum), Accesses(2, 2));
+    EXPECT_EQ(RunScript(sum, TypedArrayNatives()), "50");
+    // a nested loop over the same array
+    EXPECT_EQ(RunScript(
+        "(def main () (let a (array 1 2 3 4)) (let n 0) (let i 0)"
+        "  (while (< i (len a)) (let j 0)"
+        "    (while (< j (len a)) (let n (+ n (* (at a i) (at a j)))) (let j (+ j 1)))"
+        "    (let i (+ i 1)))"
+        "  n)", TypedArrayNatives()), "100");
+
+    // the index isn't known to be non-negative
+    EXPECT_EQ(CountAccesses(
+        "(def f (a i) (let i i) (while (< i (len a)) (at a i) (let i (+ i 1))))"), Accesses(1, 0));
+    // the index is assigned in the body
+    EXPECT_EQ(CountAccesses(
+        "(def f (a) (let i 0) (while (< i (len a)) (let i (+ i 0)) (at a i) (let i (+ i 1))))"),
+        Accesses(1, 0));
+    // a call could shrink the array
+    EXPECT_EQ(CountAccesses(
+        "(def g () 0) (def f (a) (let i 0) (while (< i (len a)) (g) (at a i) (let i (+ i 1))))"),
+        Accesses(1, 0));
+    // the start is only known on one path
+    EXPECT_EQ(CountAccesses(
+        "(def f (a c) (let i 0) (if c (let i (- 0 1))) (while (< i (len a)) (at a i) (let i (+ i 1))))"),
+        Accesses(1, 0));
+    // the step could wrap the index
+    const std::string wrap =
+        "(def main () (let a (array 1 2 3)) (let i 1)"
+        "  (while (< i (len a)) (put a i 7) (let i (+ i 9223372036854775807))) 5)";
+    EXPECT_EQ(CountAccesses(wrap), Accesses(4, 0));
+    EXPECT_EQ(RunScript(wrap, TypedArrayNatives()), "index -9223372036854775808 out of range");
+    // an access after the increment
+    EXPECT_EQ(CountAccesses(
+        "(def f (a) (let i 0) (while (< i (len a)) (let i (+ i 1)) (at a i)))"), Accesses(1, 0));
+    EXPECT_EQ(RunScript("(def main () (let a (array 1)) (let i 0) (while (< i (len a)) (let i (+ i 1)) (at a i)))", TypedArrayNatives()),
+              "index 1 out of range");
+}
+
+TEST(array, errors) {
+    EXPECT_EQ(RunScript("(def main () (at (array 1 2) 2))", TypedArrayNatives()), "index 2 out of range");
+    EXPECT_EQ(RunScript("(def main () (at (array 1 2) -1))", TypedArrayNatives()), "index -1 out of range");
+    EXPECT_EQ(RunScript("(def main () (put (array) 1 0))", TypedArrayNatives()), "index 1 out of range");
+    EXPECT_EQ(RunScript("(def main () (at (array 1) 0.0))", TypedArrayNatives()), "index of an array must be an integer");
+    EXPECT_EQ(RunScript("(def main () (at (object) 0))", TypedArrayNatives()), "element of a non-array");
+    EXPECT_EQ(RunScript("(def main () (len 1))", TypedArrayNatives()), "length of a non-array");
+    EXPECT_EQ(RunScript("(def main () (put (int32_array 1) 0 1.5))", TypedArrayNatives()), "int32 expected");
+    EXPECT_EQ(RunScript("(def main () (get (object) 1))", TypedArrayNatives()), "property name must be a string");
+    EXPECT_EQ(RunScript("(def main () (at (array) 0 1))", TypedArrayNatives()), "at expects an array and an index");
+}
@@ -0,0 +1,124 @@
+#include "run_script.h"
+#include <gtest/gtest.h>
+#include <string>
+using namespace M2V;
+
+
+static VMValue Range(VirtualMachine& vm, IntegerValueType n)
+{
+    auto array = vm.CreateArray();
+    for (IntegerValueType i=0;i<n;i++) {
+        array.As<VMArrayObject>()->push(VMValue::Integer(i));
+    }
+    return array;
+}
+
+// (map array f), the results of f on the elements
+static VMValue Map(VirtualMachine& vm, const VMValue* args, size_t nargs)
+{
+    if (nargs != 2 || args[0].type() != VMObjectType::Array) {
+        vm.Panic("map expects an array and a function");
+        return VMValue();
+    }
+    // args point into the stack of the VM, which the calls may move
+    const auto array = args[0];
+    const auto func = args[1];
+    auto ans = vm.CreateArray();
+    vm.PushRoot(array);
+    vm.PushRoot(func);
+    vm.PushRoot(ans);
+    for (size_t i=0;i<array.As<VMArrayObject>()->size();i++) {
+        auto elem = array.As<VMArrayObject>()->get(i);
+        auto val = vm.Call(func, &elem, 1);
+        if (vm.IsPanicked()) {
+            break;
+        }
+        ans.As<VMArrayObject>()->push(val);
+    }
+    vm.PopRoot();
+    vm.PopRoot();
+    vm.PopRoot();
+    return ans;
+}
+
+static IntegerValueType Total(VMArrayObject* array)
+{
+    IntegerValueType ans = 0;
+    for (size_t i=0;i<array->size();i++) {
+        ans += array->get(i).GetInteger();
+    }
+    return ans;
+}
+
+static NativeRegistry Natives()
+{
+    NativeRegistry natives;
+    natives.Add<&Range>("range");
+    natives.Add<&Total>("total");
+    natives.Add("map", &Map);
+    return natives;
+}
+
+TEST(closure, shared_cells) {
+    // both closures see one counter
+    EXPECT_EQ(RunScript(
+        "(def main () (let n 0)"
+        "  (def inc () (let n (+ n 1)))"
+        "  (def read () n)"
+        "  (inc) (inc) (inc) (read))", Natives()), "3");
+    // an assignment in the function is seen by the closure
+    EXPECT_EQ(RunScript(
+        "(def main () (let n 1) (def read () n) (let n 41) (+ (read) 1))", Natives()), "42");
+    // captured parameter
+    EXPECT_EQ(RunScript(
+        "(def adder (k) (def add (x) (+ x k)) add)"
+        "(def main () (let a (adder 10)) (let b (adder 20)) (+ (a 1) (b 2)))", Natives()), "33");
+}
+
+TEST(closure, nested) {
+    // g captures x through f, which doesn't use it itself
+    EXPECT_EQ(RunScript(
+        "(def main () (let x 5)"
+        "  (def f () (def g () (let x (* x 2))) g)"
+        "  (let h (f)) (h) (h) x)", Natives()), "20");
+    // a closure calling itself
+    EXPECT_EQ(RunScript(
+        "(def main () (let base 1)"
+        "  (def fact (n) (if (< n 2) base (* n (fact (- n 1)))))"
+        "  (fact 10))", Natives()), "3628800");
+    // a closure calling a closure defined before it
+    EXPECT_EQ(RunScript(
+        "(def main () (let k 3)"
+        "  (def triple (x) (* x k))"
+        "  (def twice (x) (triple (triple x)))"
+        "  (twice 2))", Natives()), "18");
+}
+
+TEST(closure, callbacks_from_natives) {
+    EXPECT_EQ(RunScript(
+        "(def main () (let k 3)"
+        "  (def scale (x) (* x k))"
+        "  (total (map (range 10) scale)))", Natives()), "135");
+    // a module function is a value too
+    EXPECT_EQ(RunScript(
+        "(def square (x) (* x x))"
+        "(def main () (total (map (range 4) square)))", Natives()), "14");
+    // the cells outlive the collections in the callbacks
+    VirtualMachine vm;
+    vm.SetNurserySize(1024);
+    EXPECT_EQ(RunScript(
+        "(def main () (let calls 0)"
+        "  (def f (x) (let calls (+ calls 1)) (let s \"\") (let i 0)"
+        "    (while (< i 20) (let s (concat s \"garbage\")) (let i (+ i 1))) x)"
+        "  (let t (total (map (range 200) f)))"
+        "  (- t calls))", Natives(), vm), "19700");
+    EXPECT_EQ(RunScript(
+        "(def main () (def f (x) (if (< x 5) x (get x \"y\"))) (total (map (range 10) f)))", Natives()),
+        "property of a non-object");
+}
+
+TEST(closure, errors) {
+    EXPECT_EQ(RunScript("(def main () (let n 1) (f) (def f () n))", Natives()), "closure 'f' is called before its definition");
+    EXPECT_EQ(RunScript("(def main () (def f () n) (let n 1) (f))", Natives()),
+              "variable 'n' is captured by 'f' before its declaration");
+}
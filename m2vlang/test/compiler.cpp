@@ -0,0 +1,126 @@
+#include "run_script.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+using namespace M2V;
+
+
+static std::optional<ExecutionModule> CompileSource(const std::string& source)
+{
+    std::string error;
+    return CompileScript(source, {}, error);
+}
+
+static std::optional<int> RunMain(const ExecutionModule& module)
+{
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    if (vm.IsPanicked()) {
+        return std::nullopt;
+    }
+    return vm.GetExitStatus();
+}
+
+static size_t FunctionSize(const ExecutionModule& module, const std::string& name)
+{
+    for (auto& func: module.GetFunctionTable()) {
+        if (func.m_name == name) {
+            return func.m_size;
+        }
+    }
+    return 0;
+}
+
+TEST(compiler, fold_constants) {
+    auto module = CompileSource("(def main () (+ (* 2 3) (- 10 (/ 8 2))))");
+    ASSERT_TRUE(module.has_value());
+    EXPECT_EQ(RunMain(module.value()), 12);
+    // PUSHINT 12; RET
+    EXPECT_EQ(FunctionSize(module.value(), "main"), 2);
+}
+
+TEST(compiler, recursion) {
+    auto module = CompileSource(
+        "(def main () (fib 20))"
+        "(def fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+    ASSERT_TRUE(module.has_value());
+    EXPECT_EQ(RunMain(module.value()), 6765);
+}
+
+TEST(compiler, loop_with_locals) {
+    auto module = CompileSource(
+        "(def sum (n)"
+        "  (let s 0)"
+        "  (while (> n 0)"
+        "    (let s (+ s n))"
+        "    (let n (- n 1)))"
+        "  s)"
+        "(def main () (sum 100))");
+    ASSERT_TRUE(module.has_value());
+    EXPECT_EQ(RunMain(module.value()), 5050);
+}
+
+TEST(compiler, module_variables) {
+    auto module = CompileSource(
+        "(let base 40)"
+        "(let step 1)"
+        "(def bump () (let step (+ step 1)))"
+        "(def main () (bump) (+ base step))");
+    ASSERT_TRUE(module.has_value());
+    EXPECT_EQ(RunMain(module.value()), 42);
+}
+
+TEST(compiler, dead_code) {
+    auto module = CompileSource(
+        "(def main ()"
+        "  (if false (return 1))"
+        "  (return 7)"
+        "  (+ 1 2))");
+    ASSERT_TRUE(module.has_value());
+    EXPECT_EQ(RunMain(module.value()), 7);
+    // PUSHINT 7; RET
+    EXPECT_EQ(FunctionSize(module.value(), "main"), 2);
+}
+
+TEST(compiler, if_without_else) {
+    auto module = CompileSource(
+        "(def pick (a) (if (> a 1) 5))"
+        "(def main () (let v (pick 0)) (if (== v null) (pick 3) 0))");
+    ASSERT_TRUE(module.has_value());
+    EXPECT_EQ(RunMain(module.value()), 5);
+}
+
+TEST(compiler, tail_calls) {
+    // far deeper than the frame limit
+    auto module = CompileSource(
+        "(def main () (count 1000000 0))"
+        "(def count (n acc) (if (== n 0) acc (count (- n 1) (+ acc 1))))");
+    ASSERT_TRUE(module.has_value());
+    EXPECT_EQ(RunMain(module.value()), 1000000);
+
+    module = CompileSource(
+        "(def main () (if (even 100001) 1 2))"
+        "(def even (n) (if (== n 0) true (return (odd (- n 1)))))"
+        "(def odd (n) (if (== n 0) false (even (- n 1))))");
+    ASSERT_TRUE(module.has_value());
+    EXPECT_EQ(RunMain(module.value()), 2);
+}
+
+TEST(compiler, errors) {
+    std::string error;
+    EXPECT_FALSE(CompileScript("(def main () (<< 1 2))", {}, error).has_value());
+    EXPECT_EQ(error, "unsupported operator '<<'");
+    EXPECT_FALSE(CompileScript("(def f () 1) (def f () 2)", {}, error).has_value());
+    EXPECT_EQ(error, "function 'f' is defined twice");
+}
+
+TEST(compiler, string_literals) {
+    // the value of a literal is between the quotes, with the escapes resolved
+    auto module = CompileSource("(def main () (let s \"a\\tb\") 0)");
+    ASSERT_TRUE(module.has_value());
+    const auto strings = module->GetStringData();
+    const std::vector<std::string> pool(strings, strings + module->GetStringCount());
+    EXPECT_NE(std::find(pool.begin(), pool.end(), "a\tb"), pool.end());
+    EXPECT_EQ(std::find(pool.begin(), pool.end(), "\"a\\tb\""), pool.end());
+}
@@ -0,0 +1,81 @@
+#include "geometry.h"
+#include "run_script.h"
+#include <gtest/gtest.h>
+#include <string>
+using namespace M2V;
+
+
+// a native written against H2G, the box of a polygon given as an array of points
+static BoxValueType Bounds(VirtualMachine& vm, VMArrayObject* points)
+{
+    BoxValueType ans;
+    for (size_t i=0;i<points->size();i++) {
+        if (points->get(i).type() != VMObjectType::Point) {
+            vm.Panic("point expected");
+            return ans;
+        }
+        ans = ans.merge(points->get(i).GetPoint());
+    }
+    return ans;
+}
+
+static NativeRegistry GeometryNatives()
+{
+    NativeRegistry natives;
+    AddGeometryNatives(natives);
+    natives.Add<&Bounds>("bounds");
+    return natives;
+}
+
+TEST(geometry, points_are_inline) {
+    const auto p = VMValue::Point(PointValueType(3, -4));
+    EXPECT_FALSE(p.IsObject());
+    EXPECT_EQ(p.GetPoint(), PointValueType(3, -4));
+    EXPECT_TRUE(p.IsSame(VMValue::Point(PointValueType(3, -4))));
+    EXPECT_FALSE(p.IsSame(VMValue::Point(PointValueType(3, 4))));
+
+    // a loop over many vertices allocates no more than a loop over a few
+    auto allocated = [](int n) {
+        VirtualMachine vm;
+        const auto count = std::to_string(n);
+        EXPECT_EQ(RunScript(
+            "(def main () (let p (point 0 0)) (let d (point 1 2)) (let i 0)"
+            "  (while (< i " + count + ") (let p (+ p d)) (let i (+ i 1)))"
+            "  (if (== p (point " + count + " (* 2 " + count + "))) 1 0))", GeometryNatives(), vm), "1");
+        return vm.GetHeap().GetAllocatedBytes();
+    };
+    EXPECT_EQ(allocated(100000), allocated(10));
+}
+
+TEST(geometry, points_in_a_script) {
+    EXPECT_EQ(RunScript("(def main () (let p (- (point 5 7) (point 2 3))) (+ (* 10 (px p)) (py p)))", GeometryNatives()), "34");
+    EXPECT_EQ(RunScript("(def main () (+ (dot (point 1 2) (point 3 4)) (* 100 (cross (point 1 0) (point 0 1)))))", GeometryNatives()), "111");
+    // twice the signed area of a polygon
+    EXPECT_EQ(RunScript(
+        "(def main () (let poly (array (point 0 0) (point 4 0) (point 4 3) (point 0 3)))"
+        "  (let a 0) (let i 0) (let n (len poly))"
+        "  (while (< i (len poly))"
+        "    (let a (+ a (cross (at poly i) (at poly (% (+ i 1) n))))) (let i (+ i 1)))"
+        "  a)", GeometryNatives()), "24");
+}
+
+TEST(geometry, boxes) {
+    EXPECT_EQ(RunScript(
+        "(def main () (let b (box (point 4 1) (point 0 3)))"
+        "  (let c (box_merge b (point -2 0)))"
+        "  (if (box_contains c b)"
+        "    (if (box_contains b (point -2 0)) 0 (+ (* 10 (box_width c)) (box_height c))) 0))", GeometryNatives()), "63");
+    EXPECT_EQ(RunScript(
+        "(def main () (if (== (box (point 0 0) (point 1 1)) (box (point 1 1) (point 0 0))) 1 0))", GeometryNatives()), "1");
+    EXPECT_EQ(RunScript(
+        "(def main () (let b (bounds (array (point 1 5) (point -3 2) (point 4 0))))"
+        "  (if (== b (box (point -3 0) (point 4 5))) 1 0))", GeometryNatives()), "1");
+}
+
+TEST(geometry, errors) {
+    EXPECT_EQ(RunScript("(def main () (point 4294967296 0))", GeometryNatives()), "point coordinate out of range");
+    EXPECT_EQ(RunScript("(def main () (+ (point 2147483647 0) (point 1 0)))", GeometryNatives()), "point coordinate out of range");
+    EXPECT_EQ(RunScript("(def main () (+ (point 1 0) 1))", GeometryNatives()), "inproper type");
+    EXPECT_EQ(RunScript("(def main () (px 1))", GeometryNatives()), "invalid argument of native function");
+    EXPECT_EQ(RunScript("(def main () (box_merge (box (point 0 0) (point 1 1)) 1))", GeometryNatives()), "point or box expected");
+}
@@ -0,0 +1,131 @@
+#include "run_script.h"
+#include <gtest/gtest.h>
+#include <string>
+using namespace M2V;
+
+
+// a color ramp of n steps, called for every one of 100 frames
+static const std::string ramp =
+    "(pure ramp (n) (let a (array)) (let i 0)"
+    "  (while (< i n) (put a i (/ (* i 255) (- n 1))) (let i (+ i 1))) a)"
+    "(def frame (n) (let s 0) (let i 2)"
+    "  (while (< i n) (let s (+ s (at (ramp i) (- i 1)))) (let i (+ i 1))) s)"
+    "(def main () (let ok 1) (let f 0)"
+    "  (while (< f 100) (if (== (frame 18) (* 16 255)) 0 (let ok 0)) (let f (+ f 1))) ok)";
+
+TEST(memo, replayed_frames_hit) {
+    VirtualMachine vm;
+    EXPECT_EQ(RunScript(ramp, {}, vm), "1");
+    const auto& memo = vm.GetMemoCache();
+    EXPECT_EQ(memo.GetEntryCount(), 16u);
+    EXPECT_EQ(memo.GetMisses(), 16u);
+    EXPECT_EQ(memo.GetHits(), 99u * 16);
+
+    // a call that would take forever without the cache
+    EXPECT_EQ(RunScript(
+        "(pure fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+        "(def main () (% (fib 80) 1000))"), "685");
+    // an explicit return is cached too
+    EXPECT_EQ(RunScript(
+        "(pure f (n) (if (< n 2) (return 1)) (return (+ (f (- n 1)) (f (- n 2)))))"
+        "(def main () (% (f 70) 1000))"), "129");
+}
+
+TEST(memo, hits_share_the_result) {
+    EXPECT_EQ(RunScript(
+        "(pure make (n) (array n))"
+        "(def main () (if (== (make 1) (make 1)) (if (== (make 1) (make 2)) 0 1) 0))"), "1");
+}
+
+TEST(memo, keys_are_structural) {
+    // equal arrays and strings hit, an array changed after the call doesn't
+    VirtualMachine vm;
+    EXPECT_EQ(RunScript(
+        "(pure total (a) (let s 0) (let i 0) (while (< i (len a)) (let s (+ s (at a i))) (let i (+ i 1))) s)"
+        "(pure size (s) (len (array s s)))"
+        "(def main () (let a (array 1 2 3)) (let x (total a)) (let y (total (array 1 2 3)))"
+        "  (put a 0 100) (let z (total a))"
+        "  (let w (size (concat \"ab\" \"c\"))) (let w (+ w (size \"abc\")))"
+        "  (+ (* 1000 z) (+ (* 100 x) (+ (* 10 y) w))))", {}, vm), "105664");
+    EXPECT_EQ(vm.GetMemoCache().GetHits(), 2u);
+    EXPECT_EQ(vm.GetMemoCache().GetEntryCount(), 3u);
+
+    // 1 and 1.0 are different arguments, a function isn't a key
+    VirtualMachine other;
+    EXPECT_EQ(RunScript(
+        "(pure f (x) x) (def g () 0)"
+        "(def main () (f 1) (f 1.0) (f g) (f g) 0)", {}, other), "0");
+    EXPECT_EQ(other.GetMemoCache().GetHits(), 0u);
+    EXPECT_EQ(other.GetMemoCache().GetEntryCount(), 2u);
+}
+
+TEST(memo, keys_are_taken_at_the_call) {
+    // the body changes its argument, the result is cached under the
+    // argument it was called with
+    VirtualMachine vm;
+    EXPECT_EQ(RunScript(
+        "(pure g (a) (let r (at a 0)) (put a 0 100) r)"
+        "(def main () (let x (g (array 1))) (let y (g (array 100))) (let z (g (array 1)))"
+        "  (+ (* 10000 x) (+ (* 10 y) z)))", {}, vm), "11001");
+    EXPECT_EQ(vm.GetMemoCache().GetHits(), 1u);
+    EXPECT_EQ(vm.GetMemoCache().GetEntryCount(), 2u);
+
+    VirtualMachine other;
+    EXPECT_EQ(RunScript(
+        "(pure h (o) (let r (get o \"k\")) (set o \"k\" 100) r)"
+        "(def main () (let a (object)) (set a \"k\" 1) (let b (object)) (set b \"k\" 100)"
+        "  (let x (h a)) (+ (* 1000 x) (h b)))", {}, other), "1100");
+    EXPECT_EQ(other.GetMemoCache().GetHits(), 0u);
+}
+
+TEST(memo, budget_evicts_least_recently_used) {
+    const std::string source =
+        "(pure f (x) (array x x x x))"
+        "(def main () (let i 0) (while (< i 1000) (f i) (f 0) (let i (+ i 1))) 0)";
+    VirtualMachine vm;
+    vm.GetMemoCache().SetBudget(4096);
+    EXPECT_EQ(RunScript(source, {}, vm), "0");
+    const auto& memo = vm.GetMemoCache();
+    EXPECT_LE(memo.GetSize(), 4096u);
+    EXPECT_GT(memo.GetEntryCount(), 1u);
+    EXPECT_LT(memo.GetEntryCount(), 100u);
+    // (f 0) is used in every iteration, it is never evicted
+    EXPECT_EQ(memo.GetHits(), 1000u);
+
+    VirtualMachine off;
+    off.GetMemoCache().SetBudget(0);
+    EXPECT_EQ(RunScript(source, {}, off), "0");
+    EXPECT_EQ(off.GetMemoCache().GetEntryCount(), 0u);
+    EXPECT_EQ(off.GetMemoCache().GetHits(), 0u);
+}
+
+TEST(memo, results_are_roots) {
+    // the result is only referenced by the cache while the loop makes garbage
+    VirtualMachine vm;
+    vm.SetNurserySize(16 * 1024);
+    EXPECT_EQ(RunScript(
+        "(pure grid (n) (let a (array)) (let i 0)"
+        "  (while (< i n) (put a i (array i (* i i))) (let i (+ i 1))) a)"
+        "(def sum (g) (let s 0) (let i 0)"
+        "  (while (< i (len g)) (let s (+ s (at (at g i) 1))) (let i (+ i 1))) s)"
+        "(def main () (let ok 1) (let f 0)"
+        "  (while (< f 200) (let j 0) (while (< j 200) (array j j j) (let j (+ j 1)))"
+        "    (if (== (sum (grid 10)) 285) 0 (let ok 0)) (let f (+ f 1)))"
+        "  ok)", {}, vm), "1");
+    EXPECT_EQ(vm.GetMemoCache().GetHits(), 199u);
+}
+
+TEST(memo, pure_functions_are_compiled) {
+    std::string error;
+    auto module = CompileScript("(pure f (n) (g n)) (def g (n) n)", {}, error);
+    ASSERT_TRUE(module.has_value()) << error;
+    const auto& f = module->GetFunctionTable().at(0);
+    EXPECT_EQ(module->GetInstruction(f.m_begin).m_opcode, VMOpcode::MEMO_GET);
+    for (size_t i=f.m_begin;i<f.m_begin+f.m_size;i++) {
+        EXPECT_NE(module->GetInstruction(i).m_opcode, VMOpcode::TAILCALL_MODULEFUNC);
+        EXPECT_NE(module->GetInstruction(i).m_opcode, VMOpcode::RET);
+    }
+
+    EXPECT_EQ(RunScript("(def main () (let k 1) (pure f (n) (+ n k)) (f 1))"),
+              "pure function 'f' captures variables");
+}
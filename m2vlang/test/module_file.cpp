@@ -0,0 +1,181 @@
+#include "compiler.h"
+#include "module_image.h"
+#include "parser.h"
+#include <gtest/gtest.h>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+using namespace M2V;
+
+using I = VMInstruction;
+using OP = VMOpcode;
+
+
+static std::string TempDirectory()
+{
+    const auto dir = std::filesystem::temp_directory_path() / "m2vlang_module_file_test";
+    std::filesystem::create_directories(dir);
+    return dir.string();
+}
+
+static std::string ReadFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+TEST(module_file, save_and_map) {
+    GObjectParser parser;
+    auto ast = parser.parse(
+        "(let greeting \"hello\")"
+        "(def fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+    Compiler compiler("fib");
+    auto module = compiler.Compile(*ast);
+    ASSERT_TRUE(module.has_value());
+
+    auto image = ModuleImage::Link(module.value());
+    const auto path = TempDirectory() + "/fib.m2vb";
+    ASSERT_TRUE(image->Save(path));
+    auto mapped = ModuleImage::Map(path);
+    ASSERT_TRUE(mapped);
+
+    EXPECT_EQ(mapped->GetModuleName(), "fib");
+    ASSERT_EQ(mapped->FunctionCount(), image->FunctionCount());
+    for (size_t i=0;i<image->FunctionCount();i++) {
+        EXPECT_EQ(mapped->GetFunctionName(i), image->GetFunctionName(i));
+    }
+    EXPECT_EQ(mapped->Initializer(), image->Initializer());
+    ASSERT_EQ(mapped->InstructionCount(), image->InstructionCount());
+    EXPECT_EQ(std::memcmp(mapped->GetInstructions(), image->GetInstructions(),
+                          image->InstructionCount() * sizeof(VMInstruction)), 0);
+    ASSERT_EQ(mapped->StringCount(), image->StringCount());
+    for (size_t i=0;i<image->StringCount();i++) {
+        EXPECT_EQ(mapped->GetString(i), image->GetString(i));
+    }
+    // the top level let is resolved to a slot
+    ASSERT_EQ(mapped->VariableCount(), 1);
+    EXPECT_EQ(mapped->GetVariableName(0), "greeting");
+}
+
+TEST(module_file, load_module_from_path) {
+    ExecutionModule lib("lib");
+    const auto sanswer = lib.AddString("answer");
+    const auto i42 = lib.AddInteger(42);
+    lib.SetInitializer(lib.AddFunction("<init>", {
+        I(OP::PUSHSTR, sanswer, 0),
+        I(OP::PUSHINT, i42, 0),
+        I(OP::GLOBAL_SETVAR, 0, 1),
+        I(OP::RETNULL, 0, 0),
+    }, false));
+    const auto dir = TempDirectory();
+    const auto path = dir + "/lib.m2vb";
+    ASSERT_TRUE(ModuleImage::Link(lib)->Save(path));
+    const auto saved = ReadFile(path);
+
+    ExecutionModule module("test");
+    const auto slib = module.AddString("lib");
+    const auto sanswer2 = module.AddString("answer");
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, slib, 0),
+        I(OP::LOAD_MODULE, 0, 0),
+        I(OP::PUSHSTR, sanswer2, 0),
+        I(OP::GLOBAL_GETVAR, 3, 0),
+        I(OP::RET, 4, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.AddModulePath(dir);
+    vm.ExecuteModule(module, "main");
+    ASSERT_FALSE(vm.IsPanicked()) << vm.GetPanicMessage();
+    EXPECT_EQ(vm.GetExitStatus().value(), 42);
+    // instructions quickened by the VM are private to the mapping
+    EXPECT_EQ(ReadFile(path), saved);
+}
+
+TEST(module_file, reject_invalid_files) {
+    const auto dir = TempDirectory();
+    EXPECT_FALSE(ModuleImage::Map(dir + "/missing.m2vb"));
+
+    ExecutionModule lib("broken");
+    lib.AddFunction("f", { I(OP::RETNULL, 0, 0) }, false);
+    const auto path = dir + "/broken.m2vb";
+    ASSERT_TRUE(ModuleImage::Link(lib)->Save(path));
+    auto data = ReadFile(path);
+    // a function that ends past the code
+    ModuleFileHeader header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    ModuleFileFunction func;
+    std::memcpy(&func, data.data() + header.m_functionOffset, sizeof(func));
+    func.m_size = 100;
+    std::memcpy(data.data() + header.m_functionOffset, &func, sizeof(func));
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << data;
+    EXPECT_FALSE(ModuleImage::Map(path));
+
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << data.substr(0, sizeof(ModuleFileHeader) / 2);
+    EXPECT_FALSE(ModuleImage::Map(path));
+
+    ExecutionModule module("test");
+    const auto sbroken = module.AddString("broken");
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, sbroken, 0),
+        I(OP::LOAD_MODULE, 0, 0),
+        I(OP::RETNULL, 0, 0),
+    }, false);
+    VirtualMachine vm;
+    vm.AddModulePath(dir);
+    vm.ExecuteModule(module, "main");
+    EXPECT_TRUE(vm.IsPanicked());
+    EXPECT_EQ(vm.GetPanicMessage(), "fail to load module 'broken'");
+}
+
+TEST(module_file, reject_invalid_code) {
+    const auto dir = TempDirectory();
+    ExecutionModule lib("broken");
+    lib.AddFunction("f", { I(OP::NOP, 0, 0), I(OP::RETNULL, 0, 0) }, false);
+    const auto path = dir + "/broken.m2vb";
+    ASSERT_TRUE(ModuleImage::Link(lib)->Save(path));
+    const auto data = ReadFile(path);
+    ModuleFileHeader header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    const auto mapWith = [&](VMInstruction ins) {
+        auto corrupted = data;
+        std::memcpy(corrupted.data() + header.m_instructionOffset, &ins, sizeof(ins));
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << corrupted;
+        return ModuleImage::Map(path) != nullptr;
+    };
+    EXPECT_TRUE(mapWith(I(OP::NOP, 0, 0)));
+    // a literal, a function and a cache that don't exist
+    EXPECT_FALSE(mapWith(I(OP::PUSHSTR, 0, 0)));
+    EXPECT_FALSE(mapWith(I(OP::PUSHINT, -1, 0)));
+    EXPECT_FALSE(mapWith(I(OP::CALL_MODULEFUNC, 1, 0)));
+    EXPECT_FALSE(mapWith(I(OP::GLOBAL_GETVAR, 0, 0, 0)));
+    // jumps out of the function
+    EXPECT_FALSE(mapWith(I(OP::JMP, 0, 5)));
+    EXPECT_FALSE(mapWith(I(OP::JMP, 0, -2)));
+    // an index claimed to be in bounds, an opcode written by the interpreter
+    EXPECT_FALSE(mapWith(I(OP::ARRAY_GET, 0, 0, 1)));
+    EXPECT_FALSE(mapWith(I(OP::ADD_II, 0, 0)));
+    EXPECT_FALSE(mapWith(I(static_cast<OP>(VMOpcodeCount), 0, 0)));
+
+    // a linked module loses its bounds proofs when it's saved
+    ExecutionModule proven("proven");
+    proven.AddFunction("f", {
+        I(OP::PUSHARRAY, 0, 0),
+        I(OP::PUSHNULL, 0, 0),
+        I(OP::ARRAY_GET, 0, 1, 1),
+        I(OP::RETNULL, 0, 0),
+    }, false);
+    ASSERT_TRUE(ModuleImage::Link(proven)->Save(path));
+    auto mapped = ModuleImage::Map(path);
+    ASSERT_TRUE(mapped);
+    size_t accesses = 0;
+    for (size_t i=0;i<mapped->InstructionCount();i++) {
+        if (mapped->GetInstructions()[i].m_opcode == OP::ARRAY_GET) {
+            EXPECT_EQ(mapped->GetInstructions()[i].m_operand3, 0);
+            accesses++;
+        }
+    }
+    EXPECT_EQ(accesses, 1);
+}
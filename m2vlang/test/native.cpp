@@ -0,0 +1,101 @@
+#include "native.h"
+#include "run_script.h"
+#include <gtest/gtest.h>
+#include <cmath>
+#include <string>
+#include <string_view>
+using namespace M2V;
+
+
+static double Distance(double x, double y)
+{
+    return std::sqrt(x * x + y * y);
+}
+
+static IntegerValueType Round(double val)
+{
+    return static_cast<IntegerValueType>(std::lround(val));
+}
+
+static std::string Greet(std::string_view name)
+{
+    return "hello " + std::string(name);
+}
+
+static size_t Length(const std::string& val)
+{
+    return val.size();
+}
+
+static VMValue MakeArray(VirtualMachine& vm, IntegerValueType size)
+{
+    auto array = vm.CreateArray();
+    for (IntegerValueType i=0;i<size;i++) {
+        array.As<VMArrayObject>()->push(VMValue::Integer(i));
+    }
+    return array;
+}
+
+static size_t ArraySize(VMArrayObject* array)
+{
+    return array->size();
+}
+
+// a native function without a binding, sums its integer arguments
+static VMValue Sum(VirtualMachine& vm, const VMValue* args, size_t nargs)
+{
+    IntegerValueType ans = 0;
+    for (size_t i=0;i<nargs;i++) {
+        if (args[i].type() != VMObjectType::Integer) {
+            vm.Panic("sum of a non-integer");
+            return VMValue();
+        }
+        ans += args[i].GetInteger();
+    }
+    return VMValue::Integer(ans);
+}
+
+static NativeRegistry Natives()
+{
+    NativeRegistry natives;
+    natives.Add<&Distance>("distance");
+    natives.Add<&Round>("round");
+    natives.Add<&Greet>("greet");
+    natives.Add<&Length>("length");
+    natives.Add<&MakeArray>("make_array");
+    natives.Add<&ArraySize>("array_size");
+    natives.Add("sum", &Sum);
+    return natives;
+}
+
+TEST(native, typed_bindings) {
+    EXPECT_EQ(RunScript("(def main () (round (* 10 (distance 3 4))))", Natives()), "50");
+    EXPECT_EQ(RunScript("(def main () (round (distance 1.5 2)))", Natives()), "3");
+    EXPECT_EQ(RunScript("(def main () (- (length (greet \"world\")) (length \"world\")))", Natives()), "6");
+    EXPECT_EQ(RunScript("(def main () (sum 1 2 3 4))", Natives()), "10");
+}
+
+TEST(native, tail_call) {
+    // the call in tail position is a TAILCALL of the native
+    EXPECT_EQ(RunScript("(def f (x) (sum x x)) (def main () (f 21))", Natives()), "42");
+}
+
+TEST(native, in_a_loop) {
+    EXPECT_EQ(RunScript(
+        "(def main () (let i 0) (let n 0)"
+        "  (while (< i 100000) (let n (+ n (sum i 1))) (let i (+ i 1)))"
+        "  (- n 5000050000))", Natives()), "0");
+}
+
+TEST(native, errors) {
+    EXPECT_EQ(RunScript("(def main () (distance 1))", Natives()), "native function expects 2 arguments, got 1");
+    EXPECT_EQ(RunScript("(def main () (length 1))", Natives()), "invalid argument of native function");
+    EXPECT_EQ(RunScript("(def main () (sum 1 true))", Natives()), "sum of a non-integer");
+}
+
+TEST(native, object_arguments) {
+    EXPECT_EQ(RunScript("(def main () (array_size (make_array 7)))", Natives()), "7");
+    EXPECT_EQ(RunScript("(def main () (array_size 7))", Natives()), "invalid argument of native function");
+    // natives are globals, a module variable of the same name hides them
+    EXPECT_EQ(RunScript("(let sum 3) (def main () sum)", Natives()), "3");
+}
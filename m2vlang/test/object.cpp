@@ -0,0 +1,100 @@
+#include "run_script.h"
+#include <gtest/gtest.h>
+#include <string>
+using namespace M2V;
+
+
+TEST(object, shared_shapes) {
+    VirtualMachine vm;
+    auto p = vm.CreateObject().As<VMMapObject>();
+    auto q = vm.CreateObject().As<VMMapObject>();
+    EXPECT_EQ(p->GetShape(), q->GetShape());
+    p->insert("x", VMValue::Integer(1));
+    p->insert("y", VMValue::Integer(2));
+    q->insert("x", VMValue::Integer(3));
+    EXPECT_NE(p->GetShape(), q->GetShape());
+    q->insert("y", VMValue::Integer(4));
+    // same keys in the same order
+    EXPECT_EQ(p->GetShape(), q->GetShape());
+    EXPECT_TRUE(p->GetShape()->IsShared());
+    EXPECT_EQ(p->GetShape()->Find("y"), 1);
+    EXPECT_EQ(q->get("y").GetInteger(), 4);
+
+    // another order is another shape
+    auto r = vm.CreateObject().As<VMMapObject>();
+    r->insert("y", VMValue::Integer(5));
+    r->insert("x", VMValue::Integer(6));
+    EXPECT_NE(r->GetShape(), p->GetShape());
+    EXPECT_EQ(r->get("x").GetInteger(), 6);
+}
+
+TEST(object, dictionary_fallback) {
+    VirtualMachine vm;
+    auto p = vm.CreateObject().As<VMMapObject>();
+    auto q = vm.CreateObject().As<VMMapObject>();
+    for (auto key: { "a", "b", "c" }) {
+        p->insert(key, VMValue::Integer(key[0]));
+        q->insert(key, VMValue::Integer(key[0]));
+    }
+    // an erase gives the object a shape of its own
+    p->erase("b");
+    EXPECT_FALSE(p->GetShape()->IsShared());
+    EXPECT_TRUE(q->GetShape()->IsShared());
+    EXPECT_FALSE(p->has("b"));
+    EXPECT_EQ(p->get("c").GetInteger(), 'c');
+    EXPECT_EQ(q->get("b").GetInteger(), 'b');
+    p->clear();
+    EXPECT_TRUE(p->GetShape()->IsShared());
+    EXPECT_EQ(p->size(), 0);
+
+    auto big = vm.CreateObject().As<VMMapObject>();
+    for (size_t i=0;i<=VMShape::MaxSharedKeys;i++) {
+        big->insert("k" + std::to_string(i), VMValue::Integer(i));
+    }
+    EXPECT_FALSE(big->GetShape()->IsShared());
+    EXPECT_EQ(big->size(), VMShape::MaxSharedKeys + 1);
+    EXPECT_EQ(big->get("k0").GetInteger(), 0);
+    EXPECT_EQ(big->get("k64").GetInteger(), 64);
+
+    // a computed key never adds a shared shape, an existing key stays in place
+    auto computed = vm.CreateObject().As<VMMapObject>();
+    computed->insert("a", VMValue::Integer(1));
+    const auto shape = computed->GetShape();
+    computed->insertComputed("a", VMValue::Integer(2));
+    EXPECT_EQ(computed->GetShape(), shape);
+    computed->insertComputed("z", VMValue::Integer(3));
+    EXPECT_FALSE(computed->GetShape()->IsShared());
+    EXPECT_EQ(computed->get("a").GetInteger(), 2);
+    EXPECT_EQ(computed->get("z").GetInteger(), 3);
+    EXPECT_TRUE(shape->IsShared());
+    EXPECT_EQ(shape->size(), 1u);
+}
+
+TEST(object, properties_in_a_script) {
+    EXPECT_EQ(RunScript(
+        "(def point (x y) (let p (object)) (set p \"x\" x) (set p \"y\" y) p)"
+        "(def main () (let i 0) (let s 0)"
+        // the caches of point and of the gets see one shape
+        "  (while (< i 1000) (let p (point i 1)) (let s (+ s (+ (get p \"x\") (get p \"y\")))) (let i (+ i 1)))"
+        "  (- s 499000))"), "1500");
+    EXPECT_EQ(RunScript(
+        "(def main () (let o (object)) (set o \"n\" 1) (set o \"n\" (+ (get o \"n\") 41)) (get o \"n\"))"), "42");
+    // objects of other shapes at the same access miss the cache
+    EXPECT_EQ(RunScript(
+        "(def f (o) (get o \"b\"))"
+        "(def main () (let o1 (object)) (set o1 \"b\" 1)"
+        "  (let o2 (object)) (set o2 \"a\" 10) (set o2 \"b\" 20)"
+        "  (+ (f o1) (+ (f o2) (f o1))))"), "22");
+    // distinct computed keys, one object each
+    EXPECT_EQ(RunScript(
+        "(def main () (let i 0) (let s 0) (let k \"\")"
+        "  (while (< i 1000) (let k (concat k \"k\")) (let o (object)) (set o k i) (set o \"v\" 1)"
+        "    (let s (+ s (get o \"v\"))) (let i (+ i 1)))"
+        "  s)"), "1000");
+}
+
+TEST(object, errors) {
+    EXPECT_EQ(RunScript("(def main () (get (object) \"x\"))"), "undefined property 'x'");
+    EXPECT_EQ(RunScript("(def main () (get 1 \"x\"))"), "property of a non-object");
+    EXPECT_EQ(RunScript("(def main () (let k \"x\") (get (object) k))"), "undefined property 'x'");
+}
@@ -0,0 +1,143 @@
+#include "optimizer.h"
+#include <gtest/gtest.h>
+using namespace M2V;
+
+using I = VMInstruction;
+using OP = VMOpcode;
+
+
+TEST(optimizer, fuse_and_fix_jumps) {
+    ExecutionModule module("test");
+    const auto i1 = module.AddInteger(1);
+    const auto i10 = module.AddInteger(10);
+    module.AddFunction("first", {
+        I(OP::DUP, -1, 0),
+        I(OP::RET, 0, 0),
+    }, false);
+    module.AddFunction("count", {
+        I(OP::PUSHINT, i10, 0),
+        I(OP::PUSHINT, i1, 0),
+        I(OP::ADD, -1, 1),
+        I(OP::LESS, 2, 0),
+        I(OP::JMP_FLASE, 3, 2),
+        I(OP::POPN, 1, 0),
+        I(OP::JMP_TRUE, 1, -4),
+        I(OP::RET, 2, 0),
+    }, false);
+
+    EXPECT_EQ(PeepholeOptimizer::Optimize(module), 3);
+
+    auto& first = module.GetFunctionTable().at(0);
+    EXPECT_EQ(first.m_begin, 0);
+    ASSERT_EQ(first.m_size, 1);
+    EXPECT_EQ(module.GetInstruction(0).m_opcode, OP::RET);
+    EXPECT_EQ(module.GetInstruction(0).m_operand1, -1);
+
+    auto& count = module.GetFunctionTable().at(1);
+    EXPECT_EQ(count.m_begin, 1);
+    ASSERT_EQ(count.m_size, 6);
+    auto& add = module.GetInstruction(count.m_begin + 1);
+    EXPECT_EQ(add.m_opcode, OP::ADD_CONST);
+    EXPECT_EQ(add.m_operand1, -1);
+    EXPECT_EQ(add.m_operand2, i1);
+    auto& less = module.GetInstruction(count.m_begin + 2);
+    EXPECT_EQ(less.m_opcode, OP::LESS_JMP_FALSE);
+    EXPECT_EQ(less.m_operand3, 2);
+    auto& back = module.GetInstruction(count.m_begin + 4);
+    EXPECT_EQ(back.m_opcode, OP::JMP_TRUE);
+    EXPECT_EQ(back.m_operand2, -3);
+}
+
+TEST(optimizer, compare_without_jump) {
+    ExecutionModule module("test");
+    module.AddFunction("main", {
+        I(OP::PUSHTRUE, 0, 0),
+        I(OP::LESS, 0, 0),
+        I(OP::LOGICAL_AND, 1, 0),
+        I(OP::RET, 2, 0),
+    }, false);
+    EXPECT_EQ(PeepholeOptimizer::Optimize(module), 0);
+    EXPECT_EQ(module.GetInstruction(1).m_opcode, OP::LESS);
+}
+
+TEST(optimizer, keep_jump_targets) {
+    ExecutionModule module("test");
+    const auto i1 = module.AddInteger(1);
+    module.AddFunction("main", {
+        I(OP::PUSHTRUE, 0, 0),
+        I(OP::PUSHINT, i1, 0),
+        I(OP::JMP_TRUE, 0, 0),
+        I(OP::ADD, 1, 1),
+        I(OP::RET, 2, 0),
+    }, false);
+    EXPECT_EQ(PeepholeOptimizer::Optimize(module), 0);
+}
+
+TEST(optimizer, unknown_stack_depth) {
+    ExecutionModule module("test");
+    const auto s = module.AddString("mod");
+    const auto i1 = module.AddInteger(1);
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, s, 0),
+        I(OP::LOAD_MODULE, 0, 0),
+        I(OP::PUSHINT, i1, 0),
+        I(OP::ADD, 3, 3),
+        I(OP::RET, 4, 0),
+    }, false);
+    EXPECT_EQ(PeepholeOptimizer::Optimize(module), 0);
+}
+
+TEST(optimizer, unconditional_jump_and_store) {
+    ExecutionModule module("test");
+    const auto sx = module.AddString("x");
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, sx, 0),
+        I(OP::PUSHNULL, 0, 0),
+        I(OP::LESS, 1, 1),
+        I(OP::JMP, 0, 1),
+        I(OP::STORE, 0, 1),
+        I(OP::STORE, 1, 0),
+        I(OP::RET, 2, 0),
+    }, false);
+    EXPECT_EQ(PeepholeOptimizer::Optimize(module), 0);
+    EXPECT_EQ(module.GetInstruction(2).m_opcode, OP::LESS);
+
+    // the first STORE is skipped by JMP, the second copies the literal
+    const auto literals = PeepholeOptimizer::StringLiterals(&module.GetInstruction(0), 7);
+    EXPECT_EQ(literals.at(4).size(), 0);
+    ASSERT_EQ(literals.at(6).size(), 3);
+    EXPECT_EQ(literals.at(6).at(0), sx);
+    EXPECT_EQ(literals.at(6).at(1), sx);
+}
+
+TEST(optimizer, tail_calls) {
+    ExecutionModule module("test");
+    module.AddFunction("f", {
+        I(OP::DUP, -1, 0),
+        I(OP::CALL_MODULEFUNC, 0, 1),
+        I(OP::RET, 1, 0),
+    }, false);
+    module.AddFunction("g", {
+        I(OP::DUP, -2, 0),
+        I(OP::CALL, -1, 1),
+        I(OP::RET, 1, 0),
+    }, false);
+    module.AddFunction("h", {
+        I(OP::DUP, -1, 0),
+        I(OP::CALL_MODULEFUNC, 0, 1),
+        I(OP::RET, 0, 0),
+    }, false);
+
+    EXPECT_EQ(PeepholeOptimizer::Optimize(module), 2);
+    auto& f = module.GetFunctionTable().at(0);
+    ASSERT_EQ(f.m_size, 2);
+    EXPECT_EQ(module.GetInstruction(f.m_begin + 1).m_opcode, OP::TAILCALL_MODULEFUNC);
+    EXPECT_EQ(module.GetInstruction(f.m_begin + 1).m_operand2, 1);
+    auto& g = module.GetFunctionTable().at(1);
+    ASSERT_EQ(g.m_size, 2);
+    EXPECT_EQ(module.GetInstruction(g.m_begin + 1).m_opcode, OP::TAILCALL);
+    EXPECT_EQ(module.GetInstruction(g.m_begin + 1).m_operand1, -1);
+    // returns the argument, not the result of the call
+    auto& h = module.GetFunctionTable().at(2);
+    EXPECT_EQ(h.m_size, 3);
+}
@@ -48,6 +48,7 @@ TEST(parser, basic) {
         "(|| (!= 1 2) (== 1 2))",
         "(def a (a b c) (f 1 2 3 -5))",
         "(def a (a b c) (f 1 2 3)) -(a 100)",
+        "(f \"a b\" \"\")",
     };
     for (auto& e: expressions) {
         auto obj = parser.parse(e);
@@ -57,3 +58,20 @@ TEST(parser, basic) {
         parser.reset();
     }
 }
+
+TEST(parser, string_escapes) {
+    M2V::GObjectParser parser;
+    auto obj = parser.parse("(f \"a\\\"b\\n\\\\\")");
+    ASSERT_TRUE(bool(obj));
+    // format() escapes the value again, so it parses back
+    EXPECT_EQ(obj->format(), "(f \"a\\\"b\\n\\\\\")");
+    parser.reset();
+    auto again = parser.parse(obj->format());
+    ASSERT_TRUE(bool(again));
+    EXPECT_EQ(again->format(), obj->format());
+
+    parser.reset();
+    auto controls = parser.parse("(f \"\\t\\r\\0x\")");
+    ASSERT_TRUE(bool(controls));
+    EXPECT_EQ(controls->format(), "(f \"\\t\\r\\0x\")");
+}
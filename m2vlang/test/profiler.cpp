@@ -0,0 +1,66 @@
+#include "run_script.h"
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+using namespace M2V;
+
+
+#ifdef M2V_PROFILE
+static ExecutionModule CompileSource(const std::string& source)
+{
+    std::string error;
+    return CompileScript(source, {}, error).value();
+}
+
+TEST(profiler, functions_and_opcodes) {
+    const auto module = CompileSource(
+        "(def main () (fib 10))"
+        "(def fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    ASSERT_EQ(vm.GetExitStatus(), 55);
+
+    const auto& profiler = vm.GetProfiler();
+    const VMProfiler::FunctionProfile* fib = nullptr;
+    uint64_t instructions = 0;
+    for (auto func: profiler.GetFunctions()) {
+        if (func->m_name == "test:fib") {
+            fib = func;
+        }
+        instructions += func->m_total.m_count;
+    }
+    ASSERT_NE(fib, nullptr);
+    // the tail call of main and 176 recursive calls
+    EXPECT_EQ(fib->m_calls, 177);
+    EXPECT_EQ(profiler.GetOpcode(VMOpcode::TAILCALL_MODULEFUNC).m_count, 1);
+
+    uint64_t opcodes = 0;
+    for (size_t i=0;i<VMOpcodeCount;i++) {
+        opcodes += profiler.GetOpcode(static_cast<VMOpcode>(i)).m_count;
+    }
+    EXPECT_EQ(opcodes, instructions);
+    auto hotSpots = profiler.GetHotSpots(3);
+    ASSERT_EQ(hotSpots.size(), 3);
+    EXPECT_EQ(hotSpots.front().m_function, fib);
+    EXPECT_GE(hotSpots.front().m_counter.m_time, hotSpots.back().m_counter.m_time);
+
+    std::ostringstream folded;
+    profiler.WriteFoldedStacks(folded);
+    EXPECT_NE(folded.str().find("\ntest:fib;test:fib "), std::string::npos);
+}
+
+TEST(profiler, allocations) {
+    const auto module = CompileSource("(def main () 0)");
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    const auto& profiler = vm.GetProfiler();
+    EXPECT_EQ(profiler.GetAllocationCount(VMObjectType::Module), 1);
+    EXPECT_EQ(profiler.GetAllocationCount(VMObjectType::Function), 1);
+    EXPECT_GT(profiler.GetAllocatedBytes(VMObjectType::Module), 0);
+    EXPECT_EQ(profiler.GetAllocationCount(VMObjectType::String), 0);
+}
+#else
+TEST(profiler, disabled) {
+    GTEST_SKIP() << "the VM is built without M2V_PROFILE";
+}
+#endif
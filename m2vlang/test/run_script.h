@@ -0,0 +1,48 @@
+#pragma once
+#include "compiler.h"
+#include "native.h"
+#include "parser.h"
+#include <optional>
+#include <string>
+
+
+namespace M2V {
+
+// compile source as the module "test", the natives are its globals
+inline std::optional<ExecutionModule> CompileScript(const std::string& source, const NativeRegistry& natives, std::string& error)
+{
+    GObjectParser parser;
+    auto ast = parser.parse(source);
+    Compiler compiler("test");
+    for (auto& entry: natives.GetEntries()) {
+        compiler.AddGlobal(entry.m_name);
+    }
+    auto module = compiler.Compile(*ast);
+    error = compiler.GetErrorMessage();
+    return module;
+}
+
+// run main of source in vm with the natives, the exit status, the error
+// of the compiler or the panic message
+inline std::string RunScript(const std::string& source, const NativeRegistry& natives, VirtualMachine& vm)
+{
+    std::string error;
+    auto module = CompileScript(source, natives, error);
+    if (!module.has_value()) {
+        return error;
+    }
+    natives.Install(vm);
+    vm.ExecuteModule(module.value(), "main");
+    if (vm.IsPanicked()) {
+        return vm.GetPanicMessage();
+    }
+    return std::to_string(vm.GetExitStatus().value());
+}
+
+inline std::string RunScript(const std::string& source, const NativeRegistry& natives = NativeRegistry())
+{
+    VirtualMachine vm;
+    return RunScript(source, natives, vm);
+}
+
+}
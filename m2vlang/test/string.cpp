@@ -0,0 +1,40 @@
+#include "run_script.h"
+#include <gtest/gtest.h>
+#include <string>
+using namespace M2V;
+
+
+TEST(string, ropes) {
+    VirtualMachine vm;
+    auto small = vm.ConcatStrings(vm.CreateString("ab").As<VMStringObject>(),
+                                  vm.CreateString("cd").As<VMStringObject>());
+    EXPECT_FALSE(small.As<VMStringObject>()->IsRope());
+    EXPECT_EQ(small.As<VMStringObject>()->GetValue(), "abcd");
+
+    const std::string piece = "0123456789";
+    auto str = vm.CreateString("");
+    std::string expected;
+    // deep enough to overflow the stack of a recursive flattening
+    for (int i=0;i<100000;i++) {
+        str = vm.ConcatStrings(str.As<VMStringObject>(), vm.CreateString(piece).As<VMStringObject>());
+        expected += piece;
+    }
+    auto rope = str.As<VMStringObject>();
+    EXPECT_TRUE(rope->IsRope());
+    EXPECT_EQ(rope->size(), expected.size());
+    EXPECT_EQ(rope->GetValue(), expected);
+    EXPECT_FALSE(rope->IsRope());
+}
+
+TEST(string, concat_in_a_script) {
+    EXPECT_EQ(RunScript(
+        "(def main () (if (== (concat \"layer \" \"1\" \"/\" \"top\") \"layer 1/top\") 1 0))"), "1");
+    EXPECT_EQ(RunScript(
+        "(def label (n) (let s \"\") (let i 0)"
+        "  (while (< i n) (let s (concat s \"segment of a long label;\")) (let i (+ i 1))) s)"
+        "(def main ()"
+        "  (if (== (label 1000) (label 1000))"
+        "    (if (!= (label 1000) (label 999)) 1 2) 3))"), "1");
+    EXPECT_EQ(RunScript("(def main () (concat \"a\" 1))"), "concatenation of a non-string");
+    EXPECT_EQ(RunScript("(def main () (concat \"a\"))"), "concat expects at least two strings");
+}
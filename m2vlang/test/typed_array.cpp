@@ -0,0 +1,116 @@
+#include "run_script.h"
+#include "typed_array.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+using namespace M2V;
+using namespace M2V::TypedArrayKernels;
+
+
+static NativeRegistry TypedArrayNatives()
+{
+    NativeRegistry natives;
+    AddTypedArrayNatives(natives);
+    return natives;
+}
+
+TEST(typed_array, kernels) {
+    // odd sizes cover the scalar tails of the SIMD loops
+    for (size_t n: { 1, 2, 3, 7, 64, 1001 }) {
+        std::vector<double> a(n), b(n), out(n);
+        std::vector<int32_t> ia(n), ib(n), iout(n);
+        for (size_t i=0;i<n;i++) {
+            a[i] = std::sin(static_cast<double>(i)) * 100;
+            b[i] = static_cast<double>(i % 13) - 6.5;
+            ia[i] = static_cast<int32_t>(i * 7919 % 1000) - 500;
+            ib[i] = static_cast<int32_t>(i % 17);
+        }
+        Elementwise(Operation::Sub, a.data(), b.data(), out.data(), n);
+        Elementwise(Operation::Mul, ia.data(), ib.data(), iout.data(), n);
+        double min, max;
+        MinMax(a.data(), n, min, max);
+        int32_t imin, imax;
+        MinMax(ia.data(), n, imin, imax);
+
+        double emin = a[0], emax = a[0];
+        int32_t eimin = ia[0], eimax = ia[0];
+        for (size_t i=0;i<n;i++) {
+            EXPECT_EQ(out[i], a[i] - b[i]);
+            EXPECT_EQ(iout[i], ia[i] * ib[i]);
+            emin = std::min(emin, a[i]);
+            emax = std::max(emax, a[i]);
+            eimin = std::min(eimin, ia[i]);
+            eimax = std::max(eimax, ia[i]);
+        }
+        EXPECT_EQ(min, emin);
+        EXPECT_EQ(max, emax);
+        EXPECT_EQ(imin, eimin);
+        EXPECT_EQ(imax, eimax);
+    }
+
+    const std::vector<double> points = { 1, 2, -3, 4, 5, -6 };
+    double bounds[4];
+    PointBounds(points.data(), 3, bounds);
+    EXPECT_EQ(std::vector<double>(bounds, bounds + 4), std::vector<double>({ -3, -6, 5, 4 }));
+
+    // a leading NaN isn't the seed
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    for (size_t n: { 2, 3, 4, 9 }) {
+        std::vector<double> a(n, 1.0);
+        a[0] = nan;
+        a[n - 1] = -2.0;
+        a[n / 2] = n == 2 ? -2.0 : 7.0;
+        double min, max;
+        MinMax(a.data(), n, min, max);
+        EXPECT_EQ(min, -2.0);
+        EXPECT_EQ(max, n == 2 ? -2.0 : 7.0);
+    }
+    const std::vector<double> nanPoints = { nan, 2, nan, nan, 5, -6, -1, 8 };
+    PointBounds(nanPoints.data(), 4, bounds);
+    EXPECT_EQ(std::vector<double>(bounds, bounds + 4), std::vector<double>({ -1, -6, 5, 8 }));
+    // rotation by 90 degrees, then a translation
+    const double m[4] = { 0, -1, 1, 0 };
+    const double t[2] = { 10, 20 };
+    std::vector<double> rotated(points.size());
+    Affine(points.data(), rotated.data(), 3, m, t);
+    EXPECT_EQ(rotated, std::vector<double>({ 8, 21, 6, 17, 16, 25 }));
+}
+
+TEST(typed_array, polygon_in_a_script) {
+    // a square of 4 vertices, moved by (10, 20) and scaled by 2
+    EXPECT_EQ(RunScript(
+        "(def main ()"
+        "  (let p (point2_array 4))"
+        "  (point_set p 0 0 0) (point_set p 1 1 0) (point_set p 2 1 1) (point_set p 3 0 1)"
+        "  (let q (point_transform p 2 0 0 2 10 20))"
+        "  (let b (point_bounds q))"
+        "  (if (== (typed_get b 0) 10.0)"
+        "    (if (== (typed_get b 3) 22.0)"
+        "      (if (== (+ (point_x q 2) (point_y q 2)) 34.0) 1 2) 3) 4))", TypedArrayNatives()), "1");
+    EXPECT_EQ(RunScript(
+        "(def main ()"
+        "  (let a (int32_array 5)) (let b (int32_array 5)) (let i 0)"
+        "  (while (< i 5) (typed_set a i (* i i)) (typed_set b i (- 0 i)) (let i (+ i 1)))"
+        "  (let c (typed_add a b))"
+        "  (+ (* 100 (typed_max c)) (typed_min c)))", TypedArrayNatives()), "1200");
+}
+
+TEST(typed_array, errors) {
+    EXPECT_EQ(RunScript("(def main () (typed_get (int32_array 3) 3))", TypedArrayNatives()), "index 3 out of range");
+    EXPECT_EQ(RunScript("(def main () (typed_set (int32_array 3) 0 1.5))", TypedArrayNatives()), "int32 expected");
+    EXPECT_EQ(RunScript("(def main () (typed_add (int32_array 3) (float64_array 3)))", TypedArrayNatives()),
+              "typed arrays of different kinds or sizes");
+    EXPECT_EQ(RunScript("(def main () (typed_min (float64_array 0)))", TypedArrayNatives()), "reduction of an empty array");
+    EXPECT_EQ(RunScript("(def main () (point_x (float64_array 2) 0))", TypedArrayNatives()), "point array expected");
+}
+
+TEST(typed_array, not_scanned_by_gc) {
+    VirtualMachine vm;
+    auto array = vm.CreateTypedArray(VMTypedArrayKind::Point2, 100000);
+    EXPECT_EQ(array.As<VMTypedArrayObject>()->size(), 100000);
+    // the coordinates are in one allocation outside of the heap cells
+    EXPECT_LT(vm.GetHeap().GetAllocatedBytes(), 1024);
+}
@@ -0,0 +1,502 @@
+#include "vm.h"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <string>
+#include <vector>
+using namespace M2V;
+
+using I = VMInstruction;
+using OP = VMOpcode;
+
+
+TEST(vm, arithmetic) {
+    ExecutionModule module("test");
+    const auto i2 = module.AddInteger(2);
+    const auto i3 = module.AddInteger(3);
+    module.AddFunction("main", {
+        I(OP::PUSHINT, i2, 0),
+        I(OP::PUSHINT, i3, 0),
+        I(OP::ADD, 0, 1),
+        I(OP::MUL, 2, 0),
+        I(OP::RET, 3, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    ASSERT_FALSE(vm.IsPanicked());
+    ASSERT_TRUE(vm.GetExitStatus().has_value());
+    EXPECT_EQ(vm.GetExitStatus().value(), 10);
+}
+
+TEST(vm, float_compare) {
+    ExecutionModule module("test");
+    const auto f15 = module.AddFloat(1.5);
+    const auto f30 = module.AddFloat(3.0);
+    const auto i2 = module.AddInteger(2);
+    const auto i7 = module.AddInteger(7);
+    module.AddFunction("main", {
+        I(OP::PUSHFLT, f15, 0),
+        I(OP::PUSHINT, i2, 0),
+        I(OP::MUL, 0, 1),
+        I(OP::PUSHFLT, f30, 0),
+        I(OP::EQUAL, 2, 3),
+        I(OP::JMP_TRUE, 4, 1),
+        I(OP::RET, 1, 0),
+        I(OP::PUSHINT, i7, 0),
+        I(OP::RET, 5, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    ASSERT_FALSE(vm.IsPanicked());
+    EXPECT_EQ(vm.GetExitStatus().value(), 7);
+}
+
+TEST(vm, loop_with_module_variables) {
+    ExecutionModule module("test");
+    const auto si = module.AddString("i");
+    const auto ssum = module.AddString("sum");
+    const auto i0 = module.AddInteger(0);
+    const auto i1 = module.AddInteger(1);
+    const auto i100 = module.AddInteger(100);
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, si, 0),
+        I(OP::PUSHSTR, ssum, 0),
+        I(OP::PUSHINT, i0, 0),
+        I(OP::MODULE_SETVAR, 0, 2),
+        I(OP::MODULE_SETVAR, 1, 2),
+        I(OP::PUSHINT, i1, 0),
+        I(OP::PUSHINT, i100, 0),
+        I(OP::MODULE_GETVAR, 0, 0),
+        I(OP::LESS, 5, 4),
+        I(OP::JMP_FLASE, 6, 7),
+        I(OP::ADD, 5, 3),
+        I(OP::MODULE_SETVAR, 0, 7),
+        I(OP::MODULE_GETVAR, 1, 0),
+        I(OP::ADD, 8, 7),
+        I(OP::MODULE_SETVAR, 1, 9),
+        I(OP::POPN, 5, 0),
+        I(OP::JMP_TRUE, 3, -10),
+        I(OP::MODULE_GETVAR, 1, 0),
+        I(OP::RET, 7, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    ASSERT_FALSE(vm.IsPanicked());
+    EXPECT_EQ(vm.GetExitStatus().value(), 5050);
+}
+
+// counts to the module variable n, which is set by the initializer
+static ExecutionModule CountingModule(IntegerValueType n)
+{
+    ExecutionModule module("test");
+    const auto sn = module.AddString("n");
+    const auto i0 = module.AddInteger(0);
+    const auto i1 = module.AddInteger(1);
+    const auto in = module.AddInteger(n);
+    module.SetInitializer(module.AddFunction("<init>", {
+        I(OP::PUSHSTR, sn, 0),
+        I(OP::PUSHINT, in, 0),
+        I(OP::MODULE_SETVAR, 0, 1),
+        I(OP::RETNULL, 0, 0),
+    }, false));
+    module.AddFunction("main", {
+        I(OP::PUSHINT, i0, 0),
+        I(OP::PUSHSTR, sn, 0),
+        I(OP::MODULE_GETVAR, 1, 0),
+        I(OP::PUSHINT, i1, 0),
+        I(OP::LESS, 0, 2),
+        I(OP::JMP_FLASE, 4, 4),
+        I(OP::ADD, 0, 3),
+        I(OP::STORE, 0, 5),
+        I(OP::POPN, 2, 0),
+        I(OP::JMP, 0, -6),
+        I(OP::RET, 0, 0),
+    }, false);
+    return module;
+}
+
+TEST(vm, run_in_slices) {
+    VirtualMachine vm;
+    vm.StartModule(CountingModule(100000), "main");
+    size_t slices = 0;
+    auto status = VMRunStatus::Yielded;
+    while (status == VMRunStatus::Yielded) {
+        status = vm.Run(1000);
+        slices++;
+    }
+    ASSERT_EQ(status, VMRunStatus::Exited);
+    EXPECT_EQ(vm.GetExitStatus().value(), 100000);
+    // 6 instructions per iteration
+    EXPECT_GE(slices, 500);
+    EXPECT_EQ(vm.Run(1000), VMRunStatus::Exited);
+
+    VirtualMachine timed;
+    timed.StartModule(CountingModule(100000), "main");
+    while ((status = timed.Run(std::chrono::microseconds(100))) == VMRunStatus::Yielded) {}
+    ASSERT_EQ(status, VMRunStatus::Exited);
+    EXPECT_EQ(timed.GetExitStatus().value(), 100000);
+}
+
+TEST(vm, division_by_zero) {
+    ExecutionModule module("test");
+    const auto i0 = module.AddInteger(0);
+    const auto i1 = module.AddInteger(1);
+    module.AddFunction("main", {
+        I(OP::PUSHINT, i1, 0),
+        I(OP::PUSHINT, i0, 0),
+        I(OP::DIV, 0, 1),
+        I(OP::RET, 2, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    EXPECT_TRUE(vm.IsPanicked());
+
+    VirtualMachine sliced;
+    sliced.StartModule(module, "main");
+    EXPECT_EQ(sliced.Run(100), VMRunStatus::Panicked);
+}
+
+TEST(vm, recursive_module_call) {
+    ExecutionModule module("test");
+    const auto i1 = module.AddInteger(1);
+    const auto i2 = module.AddInteger(2);
+    const auto i20 = module.AddInteger(20);
+    const auto fib = module.AddFunction("fib", {
+        I(OP::PUSHINT, i2, 0),
+        I(OP::LESS, -1, 0),
+        I(OP::JMP_FLASE, 1, 1),
+        I(OP::RET, -1, 0),
+        I(OP::PUSHINT, i1, 0),
+        I(OP::SUB, -1, 2),
+        I(OP::CALL_MODULEFUNC, 0, 1),
+        I(OP::SUB, -1, 0),
+        I(OP::CALL_MODULEFUNC, 0, 1),
+        I(OP::ADD, 4, 6),
+        I(OP::RET, 7, 0),
+    }, false);
+    ASSERT_EQ(fib, 0);
+    module.AddFunction("main", {
+        I(OP::PUSHINT, i20, 0),
+        I(OP::CALL_MODULEFUNC, fib, 1),
+        I(OP::RET, 1, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    ASSERT_FALSE(vm.IsPanicked());
+    EXPECT_EQ(vm.GetExitStatus().value(), 6765);
+}
+
+TEST(vm, quickened_types_change) {
+    ExecutionModule module("test");
+    const auto i1 = module.AddInteger(1);
+    const auto i2 = module.AddInteger(2);
+    const auto i4 = module.AddInteger(4);
+    const auto f15 = module.AddFloat(1.5);
+    const auto f25 = module.AddFloat(2.5);
+    const auto f40 = module.AddFloat(4.0);
+    module.AddFunction("add", {
+        I(OP::ADD, -1, -2),
+        I(OP::RET, 0, 0),
+    }, false);
+    module.AddFunction("main", {
+        I(OP::PUSHINT, i1, 0),
+        I(OP::PUSHINT, i2, 0),
+        I(OP::CALL_MODULEFUNC, 0, 2),
+        I(OP::PUSHFLT, f15, 0),
+        I(OP::PUSHFLT, f25, 0),
+        I(OP::CALL_MODULEFUNC, 0, 2),
+        I(OP::DUP, 2, 0),
+        I(OP::PUSHINT, i4, 0),
+        I(OP::CALL_MODULEFUNC, 0, 2),
+        I(OP::PUSHFLT, f40, 0),
+        I(OP::EQUAL, 5, 9),
+        I(OP::JMP_FLASE, 10, 1),
+        I(OP::RET, 8, 0),
+        I(OP::RET, 0, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    ASSERT_FALSE(vm.IsPanicked());
+    EXPECT_EQ(vm.GetExitStatus().value(), 7);
+}
+
+TEST(vm, stack_overflow) {
+    ExecutionModule module("test");
+    const auto i1 = module.AddInteger(1);
+    // not a tail call, every call needs a frame
+    module.AddFunction("forever", {
+        I(OP::PUSHINT, i1, 0),
+        I(OP::CALL_MODULEFUNC, 0, 1),
+        I(OP::RET, 0, 0),
+    }, false);
+    module.AddFunction("main", {
+        I(OP::CALL_MODULEFUNC, 0, 0),
+        I(OP::RET, 0, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    EXPECT_TRUE(vm.IsPanicked());
+    EXPECT_EQ(vm.GetPanicMessage(), "stack overflow");
+}
+
+TEST(vm, global_variables_by_name) {
+    ExecutionModule module("test");
+    const auto sx = module.AddString("x");
+    const auto i5 = module.AddInteger(5);
+    // the name is an argument, so it can't be resolved when the module is loaded
+    module.AddFunction("set", {
+        I(OP::GLOBAL_SETVAR, -1, -2),
+        I(OP::RET, -2, 0),
+    }, false);
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, sx, 0),
+        I(OP::PUSHINT, i5, 0),
+        I(OP::CALL_MODULEFUNC, 0, 2),
+        I(OP::PUSHSTR, sx, 0),
+        I(OP::GLOBAL_GETVAR, 3, 0),
+        I(OP::ADD, 2, 4),
+        I(OP::RET, 5, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    ASSERT_FALSE(vm.IsPanicked());
+    EXPECT_EQ(vm.GetExitStatus().value(), 10);
+}
+
+TEST(vm, undefined_variable) {
+    ExecutionModule module("test");
+    const auto sy = module.AddString("y");
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, sy, 0),
+        I(OP::MODULE_GETVAR, 0, 0),
+        I(OP::RET, 1, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    EXPECT_TRUE(vm.IsPanicked());
+    EXPECT_EQ(vm.GetPanicMessage(), "undefine variable 'y'");
+}
+
+TEST(vm, string_literals_are_shared) {
+    ExecutionModule module("test");
+    const auto si = module.AddString("i");
+    const auto sred = module.AddString("red");
+    const auto i0 = module.AddInteger(0);
+    const auto i1 = module.AddInteger(1);
+    const auto n = module.AddInteger(100000);
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, si, 0),
+        I(OP::PUSHINT, i0, 0),
+        I(OP::MODULE_SETVAR, 0, 1),
+        I(OP::PUSHINT, i1, 0),
+        I(OP::PUSHINT, n, 0),
+        I(OP::MODULE_GETVAR, 0, 0),
+        I(OP::LESS, 4, 3),
+        I(OP::JMP_FLASE, 5, 5),
+        I(OP::PUSHSTR, sred, 0),
+        I(OP::ADD, 4, 2),
+        I(OP::MODULE_SETVAR, 0, 7),
+        I(OP::POPN, 4, 0),
+        I(OP::JMP_TRUE, 2, -8),
+        I(OP::RET, 4, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.ExecuteModule(module, "main");
+    ASSERT_FALSE(vm.IsPanicked());
+    EXPECT_EQ(vm.GetExitStatus().value(), 100000);
+    EXPECT_EQ(vm.GetHeap().GetMinorCollectionCount(), 0);
+    EXPECT_LT(vm.GetHeap().GetAllocatedBytes(), 16 * 1024);
+}
+
+namespace {
+struct CountedObject: public VMObject {
+    explicit CountedObject(int& counter): VMObject(VMObjectType::Object), m_counter(counter) { m_counter++; }
+    ~CountedObject() override { m_counter--; }
+    int& m_counter;
+};
+}
+
+TEST(vm_heap, sweep_unmarked) {
+    int live = 0;
+    {
+        VMHeap heap;
+        std::vector<CountedObject*> objects;
+        for (int i=0;i<10000;i++) {
+            objects.push_back(heap.Allocate<CountedObject>(live));
+        }
+        EXPECT_EQ(live, 10000);
+        const auto pages = heap.GetPageCount();
+        const auto bytes = heap.GetAllocatedBytes();
+
+        for (size_t i=0;i<objects.size();i+=2) {
+            heap.MarkObject(objects.at(i));
+        }
+        heap.StartSweep();
+        EXPECT_TRUE(heap.IsSweeping());
+        heap.FinishSweep();
+        EXPECT_FALSE(heap.IsSweeping());
+        EXPECT_EQ(live, 5000);
+        EXPECT_EQ(heap.GetAllocatedBytes(), bytes / 2);
+        for (size_t i=0;i<objects.size();i+=2) {
+            EXPECT_FALSE(heap.IsMarked(objects.at(i)));
+        }
+
+        for (int i=0;i<5000;i++) {
+            heap.Allocate<CountedObject>(live);
+        }
+        EXPECT_EQ(heap.GetPageCount(), pages);
+        EXPECT_EQ(heap.GetAllocatedBytes(), bytes);
+    }
+    EXPECT_EQ(live, 0);
+}
+
+TEST(vm_heap, release_empty_pages) {
+    int live = 0;
+    VMHeap heap;
+    for (int i=0;i<100000;i++) {
+        heap.Allocate<CountedObject>(live);
+    }
+    const auto pages = heap.GetPageCount();
+    heap.StartSweep();
+    heap.FinishSweep();
+    EXPECT_EQ(live, 0);
+    EXPECT_EQ(heap.GetAllocatedBytes(), 0);
+    EXPECT_LT(heap.GetPageCount(), pages);
+}
+
+TEST(vm_heap, remembered_set) {
+    int live = 0;
+    VMHeap heap;
+    auto array = heap.Allocate<VMArrayObject>();
+    heap.BeginMinorCollection();
+    heap.MarkObject(array);
+    heap.FinishMinorCollection();
+    ASSERT_TRUE(heap.IsOld(array));
+
+    auto str = heap.Allocate<VMStringObject>("young");
+    heap.Allocate<CountedObject>(live);
+    array->push(VMValue(str));
+    EXPECT_EQ(live, 1);
+
+    heap.BeginMinorCollection();
+    heap.MarkObject(array);
+    heap.FinishMinorCollection();
+    EXPECT_EQ(live, 0);
+    EXPECT_TRUE(heap.IsOld(str));
+    EXPECT_EQ(array->get(0).As<VMStringObject>()->GetValue(), "young");
+    EXPECT_EQ(heap.GetYoungBytes(), 0);
+}
+
+TEST(vm_heap, deep_nesting) {
+    VMHeap heap;
+    auto root = heap.Allocate<VMArrayObject>();
+    auto tail = root;
+    for (int i=0;i<1000000;i++) {
+        auto next = heap.Allocate<VMArrayObject>();
+        tail->push(VMValue(next));
+        tail = next;
+    }
+    heap.BeginMajorCollection();
+    heap.MarkObject(root);
+    heap.FinishMajorCollection();
+    EXPECT_TRUE(heap.IsMarked(tail));
+    heap.FinishSweep();
+    EXPECT_TRUE(heap.IsOld(tail));
+}
+
+TEST(vm_heap, incremental_marking) {
+    int live = 0;
+    VMHeap heap;
+    auto root = heap.Allocate<VMArrayObject>();
+    auto holder = heap.Allocate<VMArrayObject>();
+    root->push(VMValue(holder));
+    holder->push(VMValue(heap.Allocate<CountedObject>(live)));
+    auto detached = heap.Allocate<VMArrayObject>();
+    detached->push(VMValue(heap.Allocate<CountedObject>(live)));
+    heap.Allocate<CountedObject>(live);
+
+    heap.BeginMajorCollection();
+    heap.MarkObject(root);
+    EXPECT_FALSE(heap.MarkStep(2));
+    EXPECT_TRUE(heap.MarkStep(1));
+    EXPECT_TRUE(heap.IsMarking());
+
+    // root is black, storing a white object into it has to shade the object
+    EXPECT_FALSE(heap.IsMarked(detached));
+    root->push(VMValue(detached));
+    EXPECT_TRUE(heap.IsMarked(detached));
+    // objects allocated while marking are gray
+    auto fresh = heap.Allocate<CountedObject>(live);
+    EXPECT_TRUE(heap.IsMarked(fresh));
+    EXPECT_FALSE(heap.MarkStep(1));
+    EXPECT_TRUE(heap.MarkStep(16));
+
+    heap.FinishMajorCollection();
+    EXPECT_FALSE(heap.IsMarking());
+    heap.FinishSweep();
+    EXPECT_EQ(live, 3);
+}
+
+TEST(vm, nursery_collection) {
+    ExecutionModule module("test");
+    const auto si = module.AddString("i");
+    const auto i0 = module.AddInteger(0);
+    const auto i1 = module.AddInteger(1);
+    const auto n = module.AddInteger(200000);
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, si, 0),
+        I(OP::PUSHINT, i0, 0),
+        I(OP::MODULE_SETVAR, 0, 1),
+        I(OP::PUSHINT, i1, 0),
+        I(OP::PUSHINT, n, 0),
+        I(OP::MODULE_GETVAR, 0, 0),
+        I(OP::LESS, 4, 3),
+        I(OP::JMP_FLASE, 5, 5),
+        I(OP::PUSHARRAY, 0, 0),
+        I(OP::ADD, 4, 2),
+        I(OP::MODULE_SETVAR, 0, 7),
+        I(OP::POPN, 4, 0),
+        I(OP::JMP_TRUE, 2, -8),
+        I(OP::MODULE_GETVAR, 0, 0),
+        I(OP::RET, 6, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.SetNurserySize(64 * 1024);
+    vm.ExecuteModule(module, "main");
+    ASSERT_FALSE(vm.IsPanicked());
+    EXPECT_EQ(vm.GetExitStatus().value(), 200000);
+    EXPECT_GT(vm.GetHeap().GetMinorCollectionCount(), 0);
+    EXPECT_LT(vm.GetHeap().GetAllocatedBytes(), 1024 * 1024);
+}
+
+TEST(vm, collect_garbage_in_idle_time) {
+    ExecutionModule module("test");
+    const auto s = module.AddString("garbage");
+    module.AddFunction("main", {
+        I(OP::PUSHSTR, s, 0),
+        I(OP::PUSHSTR, s, 0),
+        I(OP::PUSHARRAY, 0, 2),
+        I(OP::RETNULL, 0, 0),
+    }, false);
+
+    VirtualMachine vm;
+    vm.SetNurserySize(16);
+    vm.ExecuteModule(module, "main");
+    ASSERT_FALSE(vm.IsPanicked());
+    const auto bytes = vm.GetHeap().GetAllocatedBytes();
+    vm.CollectGarbage(std::chrono::seconds(1));
+    EXPECT_EQ(vm.GetHeap().GetMajorCollectionCount(), 1);
+    EXPECT_FALSE(vm.GetHeap().IsMarking());
+    EXPECT_FALSE(vm.GetHeap().IsSweeping());
+    EXPECT_LT(vm.GetHeap().GetAllocatedBytes(), bytes);
+}
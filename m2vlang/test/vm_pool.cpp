@@ -0,0 +1,94 @@
+#include "compiler.h"
+#include "module_image.h"
+#include "native.h"
+#include "parser.h"
+#include "vm_pool.h"
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace M2V;
+
+
+static std::shared_ptr<const ModuleImage> LinkSource(const std::string& source)
+{
+    GObjectParser parser;
+    auto ast = parser.parse(source);
+    Compiler compiler("frame");
+    compiler.AddGlobal("frame");
+    compiler.AddGlobal("twice");
+    auto module = compiler.Compile(*ast);
+    EXPECT_TRUE(module.has_value()) << compiler.GetErrorMessage();
+    return ModuleImage::Link(module.value());
+}
+
+static IntegerValueType Twice(IntegerValueType val)
+{
+    return val * 2;
+}
+
+TEST(vm_pool, scripts_share_an_image) {
+    // the loop quickens the code, every VM rewrites a copy of its own
+    const auto image = LinkSource(
+        "(let scale 3)"
+        "(def main () (let i 0) (let s 0)"
+        "  (while (< i frame) (let s (+ s scale)) (let i (+ i 1)))"
+        "  (twice s))");
+    const std::vector<VMInstruction> code(image->GetInstructions(), image->GetInstructions() + image->InstructionCount());
+    NativeRegistry natives;
+    natives.Add<&Twice>("twice");
+
+    std::vector<VMPool::Job> jobs;
+    for (int i=0;i<200;i++) {
+        jobs.push_back(VMPool::Job{ image, "main", [i, &natives](VirtualMachine& vm) {
+            natives.Install(vm);
+            vm.SetGlobal("frame", VMValue::Integer(i));
+        }});
+    }
+    VMPool pool(4);
+    EXPECT_EQ(pool.GetThreadCount(), 4);
+    const auto results = pool.RunAll(std::move(jobs));
+    ASSERT_EQ(results.size(), 200);
+    for (int i=0;i<200;i++) {
+        EXPECT_EQ(results[i].m_exitStatus, i * 6);
+    }
+    // the image itself is never rewritten
+    for (size_t i=0;i<code.size();i++) {
+        EXPECT_EQ(image->GetInstructions()[i].m_opcode, code[i].m_opcode);
+        EXPECT_EQ(image->GetInstructions()[i].m_operand1, code[i].m_operand1);
+    }
+}
+
+TEST(vm_pool, panics_stay_in_their_vm) {
+    const auto image = LinkSource("(def main () (/ 100 (- frame 3)))");
+    VMPool pool(2);
+    std::vector<std::future<VMResult>> results;
+    for (int i=0;i<6;i++) {
+        results.push_back(pool.Submit(VMPool::Job{ image, "main", [i](VirtualMachine& vm) {
+            vm.SetGlobal("frame", VMValue::Integer(i));
+        }}));
+    }
+    for (int i=0;i<6;i++) {
+        const auto result = results[i].get();
+        if (i == 3) {
+            EXPECT_EQ(result.m_panicMessage, "integer division by zero");
+            EXPECT_FALSE(result.m_exitStatus.has_value());
+        } else {
+            EXPECT_EQ(result.m_exitStatus, 100 / (i - 3));
+        }
+    }
+}
+
+TEST(vm_pool, exceptions_fail_their_job) {
+    const auto image = LinkSource("(def main () frame)");
+    VMPool pool(1);
+    auto failed = pool.Submit(VMPool::Job{ image, "main", [](VirtualMachine&) {
+        throw std::runtime_error("setup failed");
+    }});
+    auto next = pool.Submit(VMPool::Job{ image, "main", [](VirtualMachine& vm) {
+        vm.SetGlobal("frame", VMValue::Integer(7));
+    }});
+    EXPECT_THROW(failed.get(), std::runtime_error);
+    // the worker goes on with the queue
+    EXPECT_EQ(next.get().m_exitStatus, 7);
+}
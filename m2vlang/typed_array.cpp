@@ -0,0 +1,336 @@
+#include "typed_array.h"
+#include <cstdint>
+#include <string>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define M2V_HAS_SSE2
+#endif
+
+using namespace M2V;
+
+
+namespace M2V::TypedArrayKernels {
+
+void Elementwise(Operation op, const int32_t* a, const int32_t* b, int32_t* out, size_t n)
+{
+    // unsigned, so that overflow wraps instead of being undefined
+    const auto ua = reinterpret_cast<const uint32_t*>(a);
+    const auto ub = reinterpret_cast<const uint32_t*>(b);
+    const auto uout = reinterpret_cast<uint32_t*>(out);
+    switch (op) {
+    case Operation::Add:
+        for (size_t i=0;i<n;i++) uout[i] = ua[i] + ub[i];
+        break;
+    case Operation::Sub:
+        for (size_t i=0;i<n;i++) uout[i] = ua[i] - ub[i];
+        break;
+    case Operation::Mul:
+        for (size_t i=0;i<n;i++) uout[i] = ua[i] * ub[i];
+        break;
+    }
+}
+
+void Elementwise(Operation op, const double* a, const double* b, double* out, size_t n)
+{
+    size_t i = 0;
+#ifdef M2V_HAS_SSE2
+    for (;i+2<=n;i+=2) {
+        const auto va = _mm_loadu_pd(a + i);
+        const auto vb = _mm_loadu_pd(b + i);
+        const auto ans = op == Operation::Add ? _mm_add_pd(va, vb) :
+                         op == Operation::Sub ? _mm_sub_pd(va, vb) : _mm_mul_pd(va, vb);
+        _mm_storeu_pd(out + i, ans);
+    }
+#endif
+    for (;i<n;i++) {
+        out[i] = op == Operation::Add ? a[i] + b[i] :
+                 op == Operation::Sub ? a[i] - b[i] : a[i] * b[i];
+    }
+}
+
+void MinMax(const int32_t* data, size_t n, int32_t& min, int32_t& max)
+{
+    MASSERT(n > 0);
+    int32_t lo = data[0], hi = data[0];
+    for (size_t i=1;i<n;i++) {
+        lo = data[i] < lo ? data[i] : lo;
+        hi = data[i] > hi ? data[i] : hi;
+    }
+    min = lo;
+    max = hi;
+}
+
+// NaN are skipped by every min/max below: they are never the seed, and a
+// comparison with a NaN keeps the current value. min and max are NaN only
+// if every element is
+void MinMax(const double* data, size_t n, double& min, double& max)
+{
+    MASSERT(n > 0);
+    size_t i = 0;
+    while (i + 1 < n && data[i] != data[i]) {
+        i++;
+    }
+    double lo = data[i], hi = data[i];
+    i++;
+#ifdef M2V_HAS_SSE2
+    if (i + 2 <= n) {
+        auto vlo = _mm_set1_pd(lo);
+        auto vhi = vlo;
+        for (;i+2<=n;i+=2) {
+            const auto v = _mm_loadu_pd(data + i);
+            vlo = _mm_min_pd(v, vlo);
+            vhi = _mm_max_pd(v, vhi);
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, vlo);
+        lo = lanes[1] < lanes[0] ? lanes[1] : lanes[0];
+        _mm_storeu_pd(lanes, vhi);
+        hi = lanes[1] > lanes[0] ? lanes[1] : lanes[0];
+    }
+#endif
+    for (;i<n;i++) {
+        lo = data[i] < lo ? data[i] : lo;
+        hi = data[i] > hi ? data[i] : hi;
+    }
+    min = lo;
+    max = hi;
+}
+
+void PointBounds(const double* points, size_t n, double bounds[4])
+{
+    MASSERT(n > 0);
+    // each coordinate is seeded with its first number, see MinMax
+    double seed[2] = { points[0], points[1] };
+    for (size_t j=1;j<n && (seed[0] != seed[0] || seed[1] != seed[1]);j++) {
+        seed[0] = seed[0] != seed[0] ? points[2 * j] : seed[0];
+        seed[1] = seed[1] != seed[1] ? points[2 * j + 1] : seed[1];
+    }
+    size_t i = 1;
+#ifdef M2V_HAS_SSE2
+    // one point per register, both coordinates at once
+    auto vlo = _mm_loadu_pd(seed);
+    auto vhi = vlo;
+    for (;i<n;i++) {
+        const auto p = _mm_loadu_pd(points + 2 * i);
+        vlo = _mm_min_pd(p, vlo);
+        vhi = _mm_max_pd(p, vhi);
+    }
+    _mm_storeu_pd(bounds, vlo);
+    _mm_storeu_pd(bounds + 2, vhi);
+#else
+    bounds[0] = bounds[2] = seed[0];
+    bounds[1] = bounds[3] = seed[1];
+    for (;i<n;i++) {
+        const auto x = points[2 * i], y = points[2 * i + 1];
+        bounds[0] = x < bounds[0] ? x : bounds[0];
+        bounds[1] = y < bounds[1] ? y : bounds[1];
+        bounds[2] = x > bounds[2] ? x : bounds[2];
+        bounds[3] = y > bounds[3] ? y : bounds[3];
+    }
+#endif
+}
+
+void Affine(const double* points, double* out, size_t n, const double m[4], const double t[2])
+{
+#ifdef M2V_HAS_SSE2
+    // m * p = x * column0 + y * column1
+    const auto c0 = _mm_setr_pd(m[0], m[2]);
+    const auto c1 = _mm_setr_pd(m[1], m[3]);
+    const auto vt = _mm_loadu_pd(t);
+    for (size_t i=0;i<n;i++) {
+        const auto p = _mm_loadu_pd(points + 2 * i);
+        const auto x = _mm_unpacklo_pd(p, p);
+        const auto y = _mm_unpackhi_pd(p, p);
+        _mm_storeu_pd(out + 2 * i, _mm_add_pd(_mm_add_pd(_mm_mul_pd(x, c0), _mm_mul_pd(y, c1)), vt));
+    }
+#else
+    for (size_t i=0;i<n;i++) {
+        const auto x = points[2 * i], y = points[2 * i + 1];
+        out[2 * i] = m[0] * x + m[1] * y + t[0];
+        out[2 * i + 1] = m[2] * x + m[3] * y + t[1];
+    }
+#endif
+}
+
+}
+
+namespace {
+
+using namespace TypedArrayKernels;
+
+VMValue CreateTypedArray(VirtualMachine& vm, VMTypedArrayKind kind, IntegerValueType size)
+{
+    if (size < 0) {
+        vm.Panic("negative size of typed array");
+        return VMValue();
+    }
+    return vm.CreateTypedArray(kind, static_cast<size_t>(size));
+}
+
+VMValue Int32Array(VirtualMachine& vm, IntegerValueType size) { return CreateTypedArray(vm, VMTypedArrayKind::Int32, size); }
+VMValue Float64Array(VirtualMachine& vm, IntegerValueType size) { return CreateTypedArray(vm, VMTypedArrayKind::Float64, size); }
+VMValue Point2Array(VirtualMachine& vm, IntegerValueType size) { return CreateTypedArray(vm, VMTypedArrayKind::Point2, size); }
+
+IntegerValueType Length(VMTypedArrayObject* array)
+{
+    return static_cast<IntegerValueType>(array->size());
+}
+
+bool CheckIndex(VirtualMachine& vm, VMTypedArrayObject* array, IntegerValueType idx)
+{
+    if (idx < 0 || static_cast<size_t>(idx) >= array->size()) {
+        vm.Panic("index " + std::to_string(idx) + " out of range");
+        return false;
+    }
+    return true;
+}
+
+bool CheckPoints(VirtualMachine& vm, VMTypedArrayObject* array)
+{
+    if (array->kind() != VMTypedArrayKind::Point2) {
+        vm.Panic("point array expected");
+        return false;
+    }
+    return true;
+}
+
+VMValue Get(VirtualMachine& vm, VMTypedArrayObject* array, IntegerValueType idx)
+{
+    if (!CheckIndex(vm, array, idx)) {
+        return VMValue();
+    }
+    switch (array->kind()) {
+    case VMTypedArrayKind::Int32:
+        return VMValue::Integer(array->Int32Data()[idx]);
+    case VMTypedArrayKind::Float64:
+        return VMValue::Float(array->FloatData()[idx]);
+    case VMTypedArrayKind::Point2:
+        break;
+    }
+    vm.Panic("typed_get of a point array, use point_x and point_y");
+    return VMValue();
+}
+
+void Set(VirtualMachine& vm, VMTypedArrayObject* array, IntegerValueType idx, VMValue val)
+{
+    if (!CheckIndex(vm, array, idx)) {
+        return;
+    }
+    if (array->kind() == VMTypedArrayKind::Int32) {
+        if (val.type() != VMObjectType::Integer || val.GetInteger() < INT32_MIN || val.GetInteger() > INT32_MAX) {
+            vm.Panic("int32 expected");
+            return;
+        }
+        array->Int32Data()[idx] = static_cast<int32_t>(val.GetInteger());
+    } else if (array->kind() == VMTypedArrayKind::Point2) {
+        vm.Panic("typed_set of a point array, use point_set");
+    } else if (!NativeArg<double>::Is(val)) {
+        vm.Panic("number expected");
+    } else {
+        array->FloatData()[idx] = NativeArg<double>::Get(val);
+    }
+}
+
+double PointCoordinate(VirtualMachine& vm, VMTypedArrayObject* array, IntegerValueType idx, size_t coordinate)
+{
+    if (!CheckPoints(vm, array) || !CheckIndex(vm, array, idx)) {
+        return 0;
+    }
+    return array->FloatData()[2 * idx + coordinate];
+}
+
+double PointX(VirtualMachine& vm, VMTypedArrayObject* array, IntegerValueType idx) { return PointCoordinate(vm, array, idx, 0); }
+double PointY(VirtualMachine& vm, VMTypedArrayObject* array, IntegerValueType idx) { return PointCoordinate(vm, array, idx, 1); }
+
+void PointSet(VirtualMachine& vm, VMTypedArrayObject* array, IntegerValueType idx, double x, double y)
+{
+    if (!CheckPoints(vm, array) || !CheckIndex(vm, array, idx)) {
+        return;
+    }
+    array->FloatData()[2 * idx] = x;
+    array->FloatData()[2 * idx + 1] = y;
+}
+
+template<Operation op>
+VMValue ElementwiseNative(VirtualMachine& vm, VMTypedArrayObject* a, VMTypedArrayObject* b)
+{
+    if (a->kind() != b->kind() || a->size() != b->size()) {
+        vm.Panic("typed arrays of different kinds or sizes");
+        return VMValue();
+    }
+    auto ans = vm.CreateTypedArray(a->kind(), a->size());
+    auto out = ans.As<VMTypedArrayObject>();
+    if (a->kind() == VMTypedArrayKind::Int32) {
+        Elementwise(op, a->Int32Data(), b->Int32Data(), out->Int32Data(), a->size());
+    } else {
+        const auto n = a->kind() == VMTypedArrayKind::Point2 ? a->size() * 2 : a->size();
+        Elementwise(op, a->FloatData(), b->FloatData(), out->FloatData(), n);
+    }
+    return ans;
+}
+
+template<bool isMin>
+VMValue Reduce(VirtualMachine& vm, VMTypedArrayObject* array)
+{
+    if (array->size() == 0 || array->kind() == VMTypedArrayKind::Point2) {
+        vm.Panic(array->size() == 0 ? "reduction of an empty array" : "reduction of a point array, use point_bounds");
+        return VMValue();
+    }
+    if (array->kind() == VMTypedArrayKind::Int32) {
+        int32_t min, max;
+        MinMax(array->Int32Data(), array->size(), min, max);
+        return VMValue::Integer(isMin ? min : max);
+    }
+    double min, max;
+    MinMax(array->FloatData(), array->size(), min, max);
+    return VMValue::Float(isMin ? min : max);
+}
+
+VMValue Bounds(VirtualMachine& vm, VMTypedArrayObject* array)
+{
+    if (!CheckPoints(vm, array)) {
+        return VMValue();
+    }
+    if (array->size() == 0) {
+        vm.Panic("bounds of an empty array");
+        return VMValue();
+    }
+    auto ans = vm.CreateTypedArray(VMTypedArrayKind::Float64, 4);
+    PointBounds(array->FloatData(), array->size(), ans.As<VMTypedArrayObject>()->FloatData());
+    return ans;
+}
+
+VMValue Transform(VirtualMachine& vm, VMTypedArrayObject* array,
+                  double m00, double m01, double m10, double m11, double tx, double ty)
+{
+    if (!CheckPoints(vm, array)) {
+        return VMValue();
+    }
+    const double m[4] = { m00, m01, m10, m11 };
+    const double t[2] = { tx, ty };
+    auto ans = vm.CreateTypedArray(VMTypedArrayKind::Point2, array->size());
+    Affine(array->FloatData(), ans.As<VMTypedArrayObject>()->FloatData(), array->size(), m, t);
+    return ans;
+}
+
+}
+
+void M2V::AddTypedArrayNatives(NativeRegistry& natives)
+{
+    natives.Add<&Int32Array>("int32_array");
+    natives.Add<&Float64Array>("float64_array");
+    natives.Add<&Point2Array>("point2_array");
+    natives.Add<&Length>("typed_length");
+    natives.Add<&Get>("typed_get");
+    natives.Add<&Set>("typed_set");
+    natives.Add<&PointX>("point_x");
+    natives.Add<&PointY>("point_y");
+    natives.Add<&PointSet>("point_set");
+    natives.Add<&ElementwiseNative<Operation::Add>>("typed_add");
+    natives.Add<&ElementwiseNative<Operation::Sub>>("typed_sub");
+    natives.Add<&ElementwiseNative<Operation::Mul>>("typed_mul");
+    natives.Add<&Reduce<true>>("typed_min");
+    natives.Add<&Reduce<false>>("typed_max");
+    natives.Add<&Bounds>("point_bounds");
+    natives.Add<&Transform>("point_transform");
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "native.h"
+#include <cstddef>
+#include <cstdint>
+
+
+namespace M2V {
+
+// Kernels of the bulk operations over the storage of VMTypedArrayObject.
+// The float kernels use SSE2 where it's available, the integer loops are
+// left to the vectorizer of the compiler. Integer arithmetic wraps.
+namespace TypedArrayKernels {
+
+enum class Operation { Add, Sub, Mul };
+
+void Elementwise(Operation op, const int32_t* a, const int32_t* b, int32_t* out, size_t n);
+void Elementwise(Operation op, const double* a, const double* b, double* out, size_t n);
+// n > 0
+void MinMax(const int32_t* data, size_t n, int32_t& min, int32_t& max);
+void MinMax(const double* data, size_t n, double& min, double& max);
+// bounds of n > 0 points stored as x0 y0 x1 y1 ...: minx miny maxx maxy
+void PointBounds(const double* points, size_t n, double bounds[4]);
+// out = m * p + t for n points, m is row major { m00, m01, m10, m11 }
+void Affine(const double* points, double* out, size_t n, const double m[4], const double t[2]);
+
+}
+
+// Natives over typed arrays, arrays are created zero filled:
+//   (int32_array n) (float64_array n) (point2_array n)
+//   (typed_length a) (typed_get a i) (typed_set a i v)
+//   (point_x a i) (point_y a i) (point_set a i x y)
+//   (typed_add a b) (typed_sub a b) (typed_mul a b)   elementwise, a new array
+//   (typed_min a) (typed_max a)
+//   (point_bounds a)                                  float64 minx miny maxx maxy
+//   (point_transform a m00 m01 m10 m11 tx ty)         a new point array
+void AddTypedArrayNatives(NativeRegistry& natives);
+
+}
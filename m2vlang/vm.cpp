@@ -1,56 +1,132 @@
 #include "vm.h"
 #include "vm_object.h"
+#include "module_image.h"
 using namespace M2V;
 
 
 VirtualMachine::VirtualMachine():
-    m_nextFreeId(1),
-    m_status(VMStatus::Uninit),
-    m_gcGeneration(0),
-    m_nullVal(std::make_unique<VMNullObject>(m_nextFreeId++)),
-    m_trueVal(std::make_unique<VMBooleanObject>(m_nextFreeId++, true)),
-    m_falseVal(std::make_unique<VMBooleanObject>(m_nextFreeId++, false))
+    m_status(VMStatus::Uninit), m_host(nullptr), m_safePointsSinceMarkStep(0),
+    m_entryModule(nullptr), m_initializing(false), m_sliceInstructions(PTRDIFF_MAX), m_returnDepth(0)
 {
+#ifdef M2V_PROFILE
+    m_heap.SetProfiler(&m_profiler);
+#endif
     m_status = VMStatus::Initialized;
 }
 
 void VirtualMachine::ExecuteModule(const ExecutionModule& module, const std::string& funcname)
+{
+    StartModule(module, funcname);
+    RunSlice(PTRDIFF_MAX, std::nullopt);
+}
+
+void VirtualMachine::ExecuteModule(std::shared_ptr<const ModuleImage> image, const std::string& funcname)
+{
+    StartModule(std::move(image), funcname);
+    RunSlice(PTRDIFF_MAX, std::nullopt);
+}
+
+void VirtualMachine::StartModule(const ExecutionModule& module, const std::string& funcname)
+{
+    StartModule(ModuleImage::Link(module), funcname);
+}
+
+void VirtualMachine::StartModule(std::shared_ptr<const ModuleImage> image, const std::string& funcname)
 {
     MASSERT(m_status == VMStatus::Initialized);
-    const auto initializer = LoadModule(module);
-    m_status = VMStatus::Running;
-    if (initializer) {
-        m_callstacks.emplace_back(std::make_unique<CallStack>(initializer, std::vector<VMObjectPtr>()));
+    const std::string name(image->GetModuleName());
+    m_entryModule = CreateModule(name, std::move(image));
+    m_entryFunction = funcname;
+    m_status = VMStatus::Suspended;
+    const auto initializer = m_entryModule->GetInitializer();
+    m_initializing = initializer != nullptr;
+    if (m_initializing) {
+        m_callstack.PushFrame(initializer, 0);
+    } else {
+        CallEntryFunction();
+    }
+}
+
+VMRunStatus VirtualMachine::Run(size_t maxInstructions)
+{
+    return RunSlice(static_cast<ptrdiff_t>(std::min<size_t>(maxInstructions, PTRDIFF_MAX)), std::nullopt);
+}
+
+VMRunStatus VirtualMachine::Run(std::chrono::microseconds budget)
+{
+    return RunSlice(SliceCheckInterval, std::chrono::steady_clock::now() + budget);
+}
+
+VMRunStatus VirtualMachine::RunSlice(ptrdiff_t instructions, std::optional<std::chrono::steady_clock::time_point> deadline)
+{
+    m_sliceInstructions = instructions;
+    m_sliceDeadline = deadline;
+    bool resume = m_status == VMStatus::Suspended;
+    while (resume) {
+        m_status = VMStatus::Running;
         this->MainLoop();
-        if (m_status != VMStatus::Exited || (m_exitStatus.has_value() && m_exitStatus.value() != 0)) {
-            VMPanic("fail to load executable module");
+        resume = false;
+        // the initializer returned, the slice goes on with the entry function
+        if (m_initializing && m_status != VMStatus::Suspended) {
+            m_initializing = false;
+            if (m_status != VMStatus::Exited || (m_exitStatus.has_value() && m_exitStatus.value() != 0)) {
+                VMPanic("fail to load executable module");
+                break;
+            }
+            m_exitStatus.reset();
+            CallEntryFunction();
+            resume = m_status == VMStatus::Suspended;
         }
     }
+    if (m_status == VMStatus::Panic) {
+        return VMRunStatus::Panicked;
+    }
+    return m_status == VMStatus::Suspended ? VMRunStatus::Yielded : VMRunStatus::Exited;
 }
 
-static auto VMGetInt(VMObjectPtr obj)
+void VirtualMachine::CallEntryFunction()
 {
-    MASSERT(obj->type() == VMObjectType::Integer);
-    return static_cast<VMIntegerObject*>(&*obj)->GetValue();
+    if (m_entryFunction.empty()) {
+        m_status = VMStatus::Exited;
+        return;
+    }
+    auto func = m_entryModule->GetFunction(m_entryFunction);
+    if (!func) {
+        VMPanic("undefined function '" + m_entryFunction + "'");
+        return;
+    }
+    m_callstack.PushFrame(func, 0);
+    m_status = VMStatus::Suspended;
 }
-static auto VMGetFloat(VMObjectPtr obj)
+
+bool VirtualMachine::SliceEnds(ptrdiff_t& fuel)
 {
-    MASSERT(obj->type() == VMObjectType::Float);
-    return static_cast<VMFloatObject*>(&*obj)->GetValue();
+    if (m_sliceDeadline.has_value() && std::chrono::steady_clock::now() < m_sliceDeadline.value()) {
+        fuel = SliceCheckInterval;
+        return false;
+    }
+    return true;
 }
-static auto VMGetBool(VMObjectPtr obj)
+
+static auto VMGetInt(VMValue obj)
+{
+    return obj.GetInteger();
+}
+static auto VMGetFloat(VMValue obj)
 {
-    MASSERT(obj->type() == VMObjectType::Boolean);
-    return static_cast<VMBooleanObject*>(&*obj)->GetValue();
+    return obj.GetFloat();
 }
-static auto& VMGetString(VMObjectPtr obj)
+static auto VMGetBool(VMValue obj)
 {
-    MASSERT(obj->type() == VMObjectType::String);
-    return static_cast<VMStringObject*>(&*obj)->GetValue();
+    return obj.GetBoolean();
 }
-static bool VMConvertToBool(VMObjectPtr obj)
+static auto& VMGetString(VMValue obj)
 {
-    switch (obj->type()) {
+    return obj.As<VMStringObject>()->GetValue();
+}
+static bool VMConvertToBool(VMValue obj)
+{
+    switch (obj.type()) {
     case VMObjectType::Null:
         return false;
     case VMObjectType::Integer:
@@ -59,229 +135,20 @@ static bool VMConvertToBool(VMObjectPtr obj)
         return VMGetBool(obj);
     case VMObjectType::Float:
         return VMGetFloat(obj) != 0;
+    case VMObjectType::Point:
     case VMObjectType::String:
     case VMObjectType::Array:
+    case VMObjectType::TypedArray:
     case VMObjectType::Object:
     case VMObjectType::Function:
     case VMObjectType::Module:
+    case VMObjectType::Cell:
+    case VMObjectType::Box:
         break;
     }
     return true;
 }
 
-void VirtualMachine::ExecuteInstruction(const VMInstruction& instruction)
-{
-    auto callstack = GetActiveCallstack();
-    switch (instruction.m_opcode) {
-    case VMOpcode::NOP:
-        break;
-    case VMOpcode::POPN:
-        callstack->Pop(instruction.m_operand1);
-        break;
-    case VMOpcode::ADD:
-    case VMOpcode::SUB:
-    case VMOpcode::MUL:
-    case VMOpcode::DIV:
-    case VMOpcode::MOD:
-    case VMOpcode::LOGICAL_AND:
-    case VMOpcode::LOGICAL_OR:
-    case VMOpcode::EQUAL:
-    case VMOpcode::INEQUAL:
-    case VMOpcode::GREATER:
-    case VMOpcode::GREATER_EQ:
-    case VMOpcode::LESS:
-    case VMOpcode::LESS_EQ:
-    {
-        const auto op1 = callstack->Get(instruction.m_operand1);
-        const auto op2 = callstack->Get(instruction.m_operand2);
-        const auto result = this->ExecuteBinaryOperator(instruction.m_opcode, op1, op2);
-        callstack->Push(result);
-        break;
-    }
-    case VMOpcode::CALL:
-    {
-        auto op1 = callstack->Get(instruction.m_operand1);
-        if (op1->type() != VMObjectType::Function) {
-            VMPanic("call to non-funciton object");
-            break;
-        }
-        auto func = static_cast<VMFunctionObject*>(&*op1);
-        if (func->isInternal()) {
-            func->invokeInternal(*this, *this->GetActiveCallstack());
-        } else {
-            MASSERT(instruction.m_operand2 >= 0);
-            const auto args = callstack->GetTopN(instruction.m_operand2);
-            if (func->isVarArgs()) {
-                auto array = CreateArray();
-                for (auto& a: args) {
-                    static_cast<VMArrayObject*>(&*array)->push(a);
-                }
-                m_callstacks.emplace_back(std::make_unique<CallStack>(func, std::vector<VMObjectPtr>{array}));
-            } else {
-                m_callstacks.emplace_back(std::make_unique<CallStack>(func, args));
-            }
-            return;
-        }
-        break;
-    }
-    case VMOpcode::CALL_MODULEFUNC:
-    {
-        auto func = callstack->GetModule()->GetNthFunction(instruction.m_operand1);;
-        auto idx = callstack->StackSize();
-        callstack->Push(VMObjectPtr(func));
-        return ExecuteInstruction(VMInstruction(VMOpcode::CALL, idx, instruction.m_operand2));
-    }
-    case VMOpcode::DUP:
-        callstack->Dup(instruction.m_operand1);;
-        break;
-    case VMOpcode::RET:
-    {
-        auto val = callstack->Get(instruction.m_operand1);
-        m_callstacks.pop_back();
-        if (m_callstacks.empty()) {
-            m_status = VMStatus::Exited;
-            if (val->type() == VMObjectType::Integer) {
-                m_exitStatus = VMGetInt(val);
-            }
-        } else {
-            GetActiveCallstack()->Push(val);
-        }
-        break;
-    }
-    case VMOpcode::RETNULL:
-        m_callstacks.pop_back();
-        if (m_callstacks.empty()) {
-            m_status = VMStatus::Exited;
-        } else {
-            GetActiveCallstack()->Push(GetNull());
-        }
-        break;
-    case VMOpcode::PUSHSTR:
-        callstack->Push(CreateString(GetActiveModule().GetNthString(instruction.m_operand1)));
-        break;
-    case VMOpcode::PUSHINT:
-        callstack->Push(CreateInteger(GetActiveModule().GetNthInteger(instruction.m_operand1)));
-        break;
-    case VMOpcode::PUSHFLT:
-        callstack->Push(CreateFloat(GetActiveModule().GetNthFloat(instruction.m_operand1)));
-        break;
-    case M2V::VMOpcode::PUSHNULL:
-        callstack->Push(GetNull());
-        break;
-    case M2V::VMOpcode::PUSHTRUE:
-        callstack->Push(GetTrue());
-        break;
-    case M2V::VMOpcode::PUSHFALSE:
-        callstack->Push(GetFalse());
-        break;
-    case M2V::VMOpcode::PUSHARRAY:
-        callstack->Push(CreateArray());
-        break;
-    case M2V::VMOpcode::PUSHOBJECT:
-        callstack->Push(CreateObject());
-        break;
-    case M2V::VMOpcode::CREATE_CLOSURE:
-        break;
-    case VMOpcode::GLOBAL_GETVAR:
-    {
-        auto s = callstack->Get(instruction.m_operand1);
-        if (s->type() != VMObjectType::String) {
-            VMPanic("invalid key");
-            break;
-        }
-        const auto key = VMGetString(s);
-        if (m_globalObjects.count(key)) {
-            callstack->Push(m_globalObjects.at(key));
-        } else {
-            VMPanic("undefine variable '" + key + "'");
-        }
-        break;
-    }
-    case VMOpcode::GLOBAL_SETVAR:
-    {
-        auto s = callstack->Get(instruction.m_operand1);
-        if (s->type() != VMObjectType::String) {
-            VMPanic("invalid key");
-            break;
-        }
-        const auto key = VMGetString(s);
-        if (m_globalObjects.count(key)) {
-            m_globalObjects.at(key) = callstack->Get(instruction.m_operand2);
-        } else {
-            m_globalObjects.insert({key, callstack->Get(instruction.m_operand2)});
-        }
-        break;
-    }
-    case VMOpcode::MODULE_GETVAR:
-    {
-        auto s = callstack->Get(instruction.m_operand1);
-        if (s->type() != VMObjectType::String) {
-            VMPanic("invalid key");
-            break;
-        }
-        const auto key = VMGetString(s);
-        auto varOpt = callstack->GetModule()->GetModuleVariable(key);
-        if (varOpt.has_value()) {
-            callstack->Push(varOpt.value());
-        } else {
-            VMPanic("undefine variable '" + key + "'");
-        }
-        break;
-    }
-    case VMOpcode::MODULE_SETVAR:
-    {
-        auto s = callstack->Get(instruction.m_operand1);
-        if (s->type() != VMObjectType::String) {
-            VMPanic("invalid key");
-            break;
-        }
-        const auto key = VMGetString(s);
-        callstack->GetModule()->SetModuleVariable(key, callstack->Get(instruction.m_operand2));
-        break;
-    }
-    case VMOpcode::LOAD_MODULE:
-    {
-        auto v1 = callstack->Get(instruction.m_operand1);
-        if (v1->type() != VMObjectType::String) {
-            VMPanic("fail to load module");
-        }
-        const auto s = VMGetString(v1);
-        if (m_modules.count(s)) {
-            callstack->Push(VMObjectPtr(m_modules.at(s)));
-            callstack->Push(GetNull());
-            callstack->Push(GetNull());
-        } else {
-            auto func = this->LoadModuleFromFile(s);
-            MASSERT(m_modules.count(s));
-            callstack->Push(VMObjectPtr(m_modules.at(s)));
-            if (m_status == VMStatus::Running && func) {
-                const uint16_t idx = callstack->StackSize();
-                callstack->Push(VMObjectPtr(func));
-                this->ExecuteInstruction(VMInstruction(VMOpcode::CALL, idx, 0));
-            }
-        }
-        break;
-    }
-
-    case VMOpcode::BEGIN_FUNCTION:
-    case VMOpcode::END_FUNCTION:
-        break;
-
-    case VMOpcode::JMP_TRUE:
-    case VMOpcode::JMP_FLASE:
-    {
-        const bool isTrue = VMConvertToBool(callstack->Get(instruction.m_operand1));
-        if (isTrue == (VMOpcode::JMP_TRUE == instruction.m_opcode)) {
-            GetActiveCallstack()->Jmp(instruction.m_operand2);
-        }
-        break;
-    }
-    default:
-        MUnreachable();
-    }
-    GetActiveCallstack()->MoveNext();
-}
-
 template<typename T>
 static T number_operation(VMOpcode opcode, T v1, T v2)
 {
@@ -316,8 +183,8 @@ static bool val_compare(VMOpcode opcode, T1 v1, T2 v2)
     return false;
 }
 
-VMObjectPtr
-VirtualMachine::ExecuteBinaryOperator(VMOpcode opcode, VMObjectPtr op1, VMObjectPtr op2)
+VMValue
+VirtualMachine::ExecuteBinaryOperator(VMOpcode opcode, VMValue op1, VMValue op2)
 {
     switch (opcode) {
     case VMOpcode::ADD:
@@ -326,21 +193,30 @@ VirtualMachine::ExecuteBinaryOperator(VMOpcode opcode, VMObjectPtr op1, VMObject
     case VMOpcode::DIV:
     case VMOpcode::MOD:
     {
-        if (op1->type() != VMObjectType::Integer && op1->type() != VMObjectType::Float) {
+        if (op1.type() == VMObjectType::Point && op2.type() == VMObjectType::Point &&
+            (opcode == VMOpcode::ADD || opcode == VMOpcode::SUB))
+        {
+            return PointOperation(opcode, op1.GetPoint(), op2.GetPoint());
+        }
+        if (op1.type() != VMObjectType::Integer && op1.type() != VMObjectType::Float) {
             VMPanic("inproper type");
             return GetNull();
         }
-        if (op2->type() != VMObjectType::Integer && op2->type() != VMObjectType::Float) {
+        if (op2.type() != VMObjectType::Integer && op2.type() != VMObjectType::Float) {
             VMPanic("inproper type");
             return GetNull();
         }
-        if ((op1->type() == VMObjectType::Float || op2->type() == VMObjectType::Float) && opcode == VMOpcode::MOD) {
+        if ((op1.type() == VMObjectType::Float || op2.type() == VMObjectType::Float) && opcode == VMOpcode::MOD) {
             VMPanic("inproper type");
             return GetNull();
         }
 
-        if (op1->type() == VMObjectType::Integer) {
-            if (op2->type() == VMObjectType::Integer) {
+        if (op1.type() == VMObjectType::Integer) {
+            if (op2.type() == VMObjectType::Integer) {
+                if ((opcode == VMOpcode::DIV || opcode == VMOpcode::MOD) && VMGetInt(op2) == 0) {
+                    VMPanic("integer division by zero");
+                    return GetNull();
+                }
                 const auto val = number_operation(opcode, VMGetInt(op1), VMGetInt(op2)); 
                 return CreateInteger(val);
             } else {
@@ -348,7 +224,7 @@ VirtualMachine::ExecuteBinaryOperator(VMOpcode opcode, VMObjectPtr op1, VMObject
                 return CreateFloat(val);
             }
         } else {
-            if (op2->type() == VMObjectType::Integer) {
+            if (op2.type() == VMObjectType::Integer) {
                 const auto val = number_operation(opcode, VMGetFloat(op1), static_cast<FloatValueType>(VMGetInt(op2))); 
                 return CreateFloat(val);
             } else {
@@ -371,54 +247,48 @@ VirtualMachine::ExecuteBinaryOperator(VMOpcode opcode, VMObjectPtr op1, VMObject
         return b1 || b2 ? GetTrue() : GetFalse();
     }
     case VMOpcode::EQUAL:
-        if (op1->type() != op2->type()) {
+        if (op1.type() != op2.type()) {
             return GetFalse();
         } else {
-            if (op1->type() == VMObjectType::String) {
-                auto s1 = static_cast<VMStringObject*>(&*op1);
-                auto s2 = static_cast<VMStringObject*>(&*op2);
-                if (s1->GetId() == s2->GetId() || s1->GetValue() == s2->GetValue()) {
+            if (op1.type() == VMObjectType::String) {
+                // the sizes of ropes are known without flattening them
+                if (op1.IsSame(op2) || (op1.As<VMStringObject>()->size() == op2.As<VMStringObject>()->size() &&
+                                        VMGetString(op1) == VMGetString(op2)))
+                {
                     return GetTrue();
                 } else {
                     return GetFalse();
                 }
-            } else if (op1->type() == VMObjectType::Boolean) {
-                return op1->GetId() == op1->GetId() ? GetTrue() : GetFalse();
-            } else if (op1->type() == VMObjectType::Integer) {
-                const auto s1 = static_cast<VMIntegerObject*>(&*op1);
-                const auto s2 = static_cast<VMIntegerObject*>(&*op2);
-                return s1->GetValue() == s2->GetValue() ? GetTrue() : GetFalse();
-            } else if (op1->type() == VMObjectType::Float) {
-                const auto s1 = static_cast<VMFloatObject*>(&*op1);
-                const auto s2 = static_cast<VMFloatObject*>(&*op2);
-                return s1->GetValue() == s2->GetValue() ? GetTrue() : GetFalse();
+            } else if (op1.type() == VMObjectType::Float) {
+                return VMGetFloat(op1) == VMGetFloat(op2) ? GetTrue() : GetFalse();
+            } else if (op1.type() == VMObjectType::Box) {
+                return op1.As<VMBoxObject>()->GetBox() == op2.As<VMBoxObject>()->GetBox() ? GetTrue() : GetFalse();
             } else {
-                return op1->GetId() == op1->GetId() ? GetTrue() : GetFalse();
+                return op1.IsSame(op2) ? GetTrue() : GetFalse();
             }
         }
     case VMOpcode::INEQUAL:
-        return ExecuteBinaryOperator(VMOpcode::EQUAL, op1, op2)->GetId() == GetTrue()->GetId() 
-            ? GetFalse() : GetTrue();
+        return VMGetBool(ExecuteBinaryOperator(VMOpcode::EQUAL, op1, op2)) ? GetFalse() : GetTrue();
     case VMOpcode::GREATER:
     case VMOpcode::GREATER_EQ:
     case VMOpcode::LESS:
     case VMOpcode::LESS_EQ:
-        if (op1->type() != VMObjectType::Integer && op1->type() != VMObjectType::Float) {
+        if (op1.type() != VMObjectType::Integer && op1.type() != VMObjectType::Float) {
             VMPanic("inproper comparison type");
             return GetNull();
         }
-        if (op2->type() != VMObjectType::Integer && op2->type() != VMObjectType::Float) {
+        if (op2.type() != VMObjectType::Integer && op2.type() != VMObjectType::Float) {
             VMPanic("inproper comparison type");
             return GetNull();
         }
-        if (op1->type() == VMObjectType::Integer) {
-            if (op2->type() == VMObjectType::Integer) {
+        if (op1.type() == VMObjectType::Integer) {
+            if (op2.type() == VMObjectType::Integer) {
                 return val_compare(opcode, VMGetInt(op1), VMGetInt(op2)) ? GetTrue() : GetFalse(); 
             } else {
                 return val_compare(opcode, VMGetInt(op1), VMGetFloat(op2)) ? GetTrue() : GetFalse(); 
             }
         } else {
-            if (op2->type() == VMObjectType::Integer) {
+            if (op2.type() == VMObjectType::Integer) {
                 return val_compare(opcode, VMGetFloat(op1), VMGetInt(op2)) ? GetTrue() : GetFalse(); 
             } else {
                 return val_compare(opcode, VMGetFloat(op1), VMGetFloat(op2)) ? GetTrue() : GetFalse(); 
@@ -427,62 +297,1194 @@ VirtualMachine::ExecuteBinaryOperator(VMOpcode opcode, VMObjectPtr op1, VMObject
     default:
         MUnreachable();
     }
-    return VMObjectPtr(nullptr);
+    return GetNull();
+}
+
+// the coordinates are computed in 64 bits, a result outside of int is an error
+VMValue VirtualMachine::PointOperation(VMOpcode opcode, const PointValueType& p1, const PointValueType& p2)
+{
+    using Ext = PointValueType::ExtNum;
+    const bool isAdd = opcode == VMOpcode::ADD;
+    const Ext x = isAdd ? Ext(p1.m_x) + p2.m_x : Ext(p1.m_x) - p2.m_x;
+    const Ext y = isAdd ? Ext(p1.m_y) + p2.m_y : Ext(p1.m_y) - p2.m_y;
+    if (x < INT32_MIN || x > INT32_MAX || y < INT32_MIN || y > INT32_MAX) {
+        VMPanic("point coordinate out of range");
+        return GetNull();
+    }
+    return VMValue::Point(PointValueType(static_cast<int>(x), static_cast<int>(y)));
+}
+
+// the quickened form of a generic binary operator for the given operand types
+static VMOpcode QuickenBinary(VMOpcode opcode, VMObjectType t1, VMObjectType t2)
+{
+    if (t1 == VMObjectType::Integer && t2 == VMObjectType::Integer) {
+        switch (opcode) {
+        case VMOpcode::ADD:        return VMOpcode::ADD_II;
+        case VMOpcode::SUB:        return VMOpcode::SUB_II;
+        case VMOpcode::MUL:        return VMOpcode::MUL_II;
+        case VMOpcode::EQUAL:      return VMOpcode::EQUAL_II;
+        case VMOpcode::INEQUAL:    return VMOpcode::INEQUAL_II;
+        case VMOpcode::GREATER:    return VMOpcode::GREATER_II;
+        case VMOpcode::LESS:       return VMOpcode::LESS_II;
+        case VMOpcode::GREATER_EQ: return VMOpcode::GREATER_EQ_II;
+        case VMOpcode::LESS_EQ:    return VMOpcode::LESS_EQ_II;
+        default:                   break;
+        }
+    } else if (t1 == VMObjectType::Float && t2 == VMObjectType::Float) {
+        switch (opcode) {
+        case VMOpcode::ADD:        return VMOpcode::ADD_FF;
+        case VMOpcode::SUB:        return VMOpcode::SUB_FF;
+        case VMOpcode::MUL:        return VMOpcode::MUL_FF;
+        case VMOpcode::DIV:        return VMOpcode::DIV_FF;
+        case VMOpcode::GREATER:    return VMOpcode::GREATER_FF;
+        case VMOpcode::LESS:       return VMOpcode::LESS_FF;
+        case VMOpcode::GREATER_EQ: return VMOpcode::GREATER_EQ_FF;
+        case VMOpcode::LESS_EQ:    return VMOpcode::LESS_EQ_FF;
+        default:                   break;
+        }
+    }
+    return opcode;
+}
+
+bool VirtualMachine::CallFunction(VMFunctionObject* func, size_t nargs)
+{
+    auto callstack = GetActiveCallstack();
+    MASSERT(!func->isNative());
+    bool pushed;
+    if (func->isVarArgs()) {
+        auto array = CreateArray();
+        const auto args = callstack->GetTopN(nargs);
+        for (size_t i=0;i<nargs;i++) {
+            array.As<VMArrayObject>()->push(args[i]);
+        }
+        pushed = callstack->Push(array) && callstack->PushFrame(func, 1, 1);
+    } else {
+        pushed = callstack->PushFrame(func, nargs);
+    }
+    if (!pushed) {
+        VMPanic("stack overflow");
+    }
+    return pushed;
+}
+
+bool VirtualMachine::TailCallFunction(VMFunctionObject* func, size_t nargs)
+{
+    auto callstack = GetActiveCallstack();
+    MASSERT(!func->isNative());
+    if (func->isVarArgs()) {
+        auto array = CreateArray();
+        const auto args = callstack->GetTopN(nargs);
+        for (size_t i=0;i<nargs;i++) {
+            array.As<VMArrayObject>()->push(args[i]);
+        }
+        if (!callstack->Push(array)) {
+            VMPanic("stack overflow");
+            return false;
+        }
+        nargs = 1;
+    }
+    callstack->ReplaceFrame(func, nargs);
+    return true;
+}
+
+void VirtualMachine::CollectAtSafePoint()
+{
+    m_status = VMStatus::GC;
+    if (m_heap.IsMarking()) {
+        if (m_heap.NeedsMarkStep() || ++m_safePointsSinceMarkStep >= IncrementalMarkInterval) {
+            IncrementalMarkStep(IncrementalMarkWork);
+            m_safePointsSinceMarkStep = 0;
+        }
+    } else if (m_heap.NeedsMinorCollection()) {
+        RunMinorCollection();
+        if (m_heap.NeedsMajorCollection()) {
+            StartIncrementalCollection();
+        }
+    }
+    m_status = VMStatus::Running;
 }
 
+// The interpreter keeps the instruction pointer, the active frame and the
+// literal pools of its module in locals, they are reloaded only when the
+// active frame changes. With GCC and Clang every handler jumps to the next
+// one through a table of label addresses, otherwise a switch is used.
+#if defined(__GNUC__) && !defined(M2V_NO_THREADED_DISPATCH)
+#define M2V_THREADED_DISPATCH 1
+#endif
+
+#ifdef M2V_THREADED_DISPATCH
+#define VM_CASE(op) L_##op
+#define VM_DISPATCH() do { MASSERT(pc < codeEnd); fuel--; VM_PROFILE(); goto *dispatchTable[static_cast<size_t>(pc->m_opcode)]; } while(false)
+#else
+#define VM_CASE(op) case VMOpcode::op
+#define VM_DISPATCH() goto dispatch
+#endif
+#ifdef M2V_PROFILE
+#define VM_PROFILE() m_profiler.Step(callstack->GetFunction(), code, pc - code, pc->m_opcode, callstack->Depth())
+#else
+#define VM_PROFILE() do {} while(false)
+#endif
+#define VM_NEXT() do { pc++; VM_DISPATCH(); } while(false)
+#define VM_LOAD_FRAME() do {                                         \
+        callstack = GetActiveCallstack();                            \
+        const auto func = callstack->GetFunction();                  \
+        module = func->GetModule();                                  \
+        code = func->GetInstruction(0);                              \
+        codeEnd = code + func->InstructionSize();                    \
+        pc = code + callstack->GetInstructionPointer();              \
+        strings = module->GetStringLiterals();                       \
+        integers = module->GetIntegerData();                         \
+        floats = module->GetFloatData();                             \
+        upvalues = func->GetUpvalues();                              \
+    } while(false)
+#define VM_PUSH(val) do {                                            \
+        if (!callstack->Push(val)) {                                 \
+            VMPanic("stack overflow");                               \
+            return;                                                  \
+        }                                                            \
+    } while(false)
+// a quickened handler whose operand types don't match turns the instruction
+// back into its generic form and executes that
+#define VM_QUICK_BINARY(op, generic, tag, getter, make, oper)                            \
+    VM_CASE(op): {                                                                       \
+        const auto op1 = callstack->Get(pc->m_operand1);                                 \
+        const auto op2 = callstack->Get(pc->m_operand2);                                 \
+        if (op1.type() != VMObjectType::tag || op2.type() != VMObjectType::tag) {        \
+            pc->m_opcode = VMOpcode::generic;                                            \
+            VM_DISPATCH();                                                               \
+        }                                                                                \
+        VM_PUSH(VMValue::make(op1.getter() oper op2.getter()));                          \
+        VM_NEXT();                                                                       \
+    }
+#define VM_QUICK_CONST(op, generic, oper)                                                \
+    VM_CASE(op): {                                                                       \
+        const auto op1 = callstack->Get(pc->m_operand1);                                 \
+        if (op1.type() != VMObjectType::Integer) {                                       \
+            pc->m_opcode = VMOpcode::generic;                                            \
+            VM_DISPATCH();                                                               \
+        }                                                                                \
+        const auto val = integers[pc->m_operand2];                                       \
+        VM_PUSH(VMValue::Integer(val));                                                  \
+        VM_PUSH(VMValue::Integer(op1.GetInteger() oper val));                            \
+        VM_NEXT();                                                                       \
+    }
+#define VM_QUICK_COMPARE_JMP(op, generic, oper, onTrue)                                  \
+    VM_CASE(op): {                                                                       \
+        const auto op1 = callstack->Get(pc->m_operand1);                                 \
+        const auto op2 = callstack->Get(pc->m_operand2);                                 \
+        if (op1.type() != VMObjectType::Integer || op2.type() != VMObjectType::Integer) { \
+            pc->m_opcode = VMOpcode::generic;                                            \
+            VM_DISPATCH();                                                               \
+        }                                                                                \
+        const bool result = op1.GetInteger() oper op2.GetInteger();                      \
+        VM_PUSH(VMValue::Boolean(result));                                               \
+        if (result == onTrue) {                                                          \
+            const auto offset = pc->m_operand3;                                          \
+            pc += offset;                                                                \
+            if (offset < 0) {                                                            \
+                VM_SAFEPOINT(pc + 1);                                                    \
+            }                                                                            \
+        }                                                                                \
+        VM_NEXT();                                                                       \
+    }
+#define VM_SAVE_IP(ip) callstack->SetInstructionPointer((ip) - code)
+#define VM_RETURN(value) do {                                        \
+        const auto val = (value);                                    \
+        callstack->PopFrame();                                       \
+        if (callstack->Depth() <= m_returnDepth) {                   \
+            if (callstack->Empty()) {                                \
+                VMExit(val.type() == VMObjectType::Integer ? VMGetInt(val) : 0); \
+            } else {                                                 \
+                m_callResult = val;                                  \
+            }                                                        \
+            return;                                                  \
+        }                                                            \
+        VM_LOAD_FRAME();                                             \
+        VM_PUSH(val);                                                \
+        VM_SAFEPOINT(pc);                                            \
+        VM_DISPATCH();                                               \
+    } while(false)
+// calls, returns, backward jumps and allocations. next is the instruction
+// that runs after it, the VM resumes there if the slice ends
+#define VM_SAFEPOINT(next) do {                                      \
+        if (m_heap.IsMarking() || m_heap.NeedsMinorCollection()) {   \
+            CollectAtSafePoint();                                    \
+        }                                                            \
+        if (fuel <= 0 && SliceEnds(fuel)) {                          \
+            VM_SAVE_IP(next);                                        \
+            m_status = VMStatus::Suspended;                          \
+            return;                                                  \
+        }                                                            \
+    } while(false)
+
 void VirtualMachine::MainLoop()
 {
-    size_t instructionCount = 0;
-    while (m_status == VMStatus::Running) {
-        const auto instruction = GetActiveCallstack()->FetchInstruction();
-        ExecuteInstruction(instruction);
-        instructionCount++;
+#ifdef M2V_THREADED_DISPATCH
+    static const void* const dispatchTable[] = {
+        &&L_NOP, &&L_POPN,
+        &&L_ADD, &&L_SUB, &&L_MUL, &&L_DIV, &&L_MOD,
+        &&L_EQUAL, &&L_INEQUAL, &&L_GREATER, &&L_LESS, &&L_GREATER_EQ, &&L_LESS_EQ,
+        &&L_LOGICAL_AND, &&L_LOGICAL_OR,
+        &&L_CALL, &&L_CALL_MODULEFUNC, &&L_DUP, &&L_STORE, &&L_RET, &&L_RETNULL,
+        &&L_PUSHSTR, &&L_PUSHINT, &&L_PUSHFLT, &&L_PUSHNULL, &&L_PUSHTRUE, &&L_PUSHFALSE,
+        &&L_PUSHARRAY, &&L_PUSHOBJECT, &&L_CREATE_CLOSURE,
+        &&L_GLOBAL_GETVAR, &&L_GLOBAL_SETVAR, &&L_MODULE_GETVAR, &&L_MODULE_SETVAR,
+        &&L_LOAD_MODULE, &&L_BEGIN_FUNCTION, &&L_END_FUNCTION,
+        &&L_JMP_TRUE, &&L_JMP_FLASE, &&L_JMP,
+        &&L_ADD_CONST, &&L_SUB_CONST,
+        &&L_EQUAL_JMP_TRUE, &&L_EQUAL_JMP_FALSE, &&L_INEQUAL_JMP_TRUE, &&L_INEQUAL_JMP_FALSE,
+        &&L_GREATER_JMP_TRUE, &&L_GREATER_JMP_FALSE, &&L_LESS_JMP_TRUE, &&L_LESS_JMP_FALSE,
+        &&L_GREATER_EQ_JMP_TRUE, &&L_GREATER_EQ_JMP_FALSE, &&L_LESS_EQ_JMP_TRUE, &&L_LESS_EQ_JMP_FALSE,
+        &&L_ADD_II, &&L_ADD_FF, &&L_SUB_II, &&L_SUB_FF, &&L_MUL_II, &&L_MUL_FF, &&L_DIV_FF,
+        &&L_EQUAL_II, &&L_INEQUAL_II,
+        &&L_GREATER_II, &&L_GREATER_FF, &&L_LESS_II, &&L_LESS_FF,
+        &&L_GREATER_EQ_II, &&L_GREATER_EQ_FF, &&L_LESS_EQ_II, &&L_LESS_EQ_FF,
+        &&L_ADD_CONST_I, &&L_SUB_CONST_I,
+        &&L_EQUAL_JMP_TRUE_II, &&L_EQUAL_JMP_FALSE_II, &&L_INEQUAL_JMP_TRUE_II, &&L_INEQUAL_JMP_FALSE_II,
+        &&L_GREATER_JMP_TRUE_II, &&L_GREATER_JMP_FALSE_II, &&L_LESS_JMP_TRUE_II, &&L_LESS_JMP_FALSE_II,
+        &&L_GREATER_EQ_JMP_TRUE_II, &&L_GREATER_EQ_JMP_FALSE_II, &&L_LESS_EQ_JMP_TRUE_II, &&L_LESS_EQ_JMP_FALSE_II,
+        &&L_MODULE_GETSLOT, &&L_MODULE_SETSLOT, &&L_GLOBAL_GETSLOT, &&L_GLOBAL_SETSLOT,
+        &&L_GLOBAL_GETNAME, &&L_GLOBAL_SETNAME,
+        &&L_TAILCALL, &&L_TAILCALL_MODULEFUNC,
+        &&L_GETPROP, &&L_SETPROP,
+        &&L_CONCAT,
+        &&L_NEWCELL, &&L_GETCELL, &&L_SETCELL, &&L_GETUPVAL, &&L_SETUPVAL, &&L_PUSHUPVAL,
+        &&L_ARRAY_GET, &&L_ARRAY_SET, &&L_ARRAY_LEN, &&L_MAP_GET, &&L_MAP_SET,
+        &&L_MEMO_GET, &&L_MEMO_RET,
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == VMOpcodeCount,
+                  "every opcode needs a handler");
+#endif
+
+    if (m_status != VMStatus::Running) {
+        return;
+    }
+#ifdef M2V_PROFILE
+    VMProfiler::Session profile(m_profiler);
+#endif
+    CallStack* callstack;
+    VMModuleObject* module;
+    VMInstruction* code;
+    // end of the code of the active function, only checked with DEBUG
+    [[maybe_unused]] VMInstruction* codeEnd;
+    VMInstruction* pc;
+    const VMValue* strings;
+    const IntegerValueType* integers;
+    const FloatValueType* floats;
+    VMCellObject* const* upvalues;
+    // instructions until the slice is checked
+    ptrdiff_t fuel = m_sliceInstructions;
+    VM_LOAD_FRAME();
+
+#ifdef M2V_THREADED_DISPATCH
+    VM_DISPATCH();
+#else
+dispatch:
+    MASSERT(pc < codeEnd);
+    fuel--;
+    VM_PROFILE();
+    switch (pc->m_opcode) {
+#endif
+
+    VM_CASE(NOP):
+    VM_CASE(BEGIN_FUNCTION):
+    VM_CASE(END_FUNCTION):
+        VM_NEXT();
+    VM_CASE(POPN):
+        callstack->Pop(pc->m_operand1);
+        VM_NEXT();
+    VM_CASE(ADD):
+    VM_CASE(SUB):
+    VM_CASE(MUL):
+    VM_CASE(DIV):
+    VM_CASE(MOD):
+    VM_CASE(LOGICAL_AND):
+    VM_CASE(LOGICAL_OR):
+    VM_CASE(EQUAL):
+    VM_CASE(INEQUAL):
+    VM_CASE(GREATER):
+    VM_CASE(GREATER_EQ):
+    VM_CASE(LESS):
+    VM_CASE(LESS_EQ):
+    {
+        const auto op1 = callstack->Get(pc->m_operand1);
+        const auto op2 = callstack->Get(pc->m_operand2);
+        const auto result = ExecuteBinaryOperator(pc->m_opcode, op1, op2);
+        if (m_status != VMStatus::Running) {
+            return;
+        }
+        pc->m_opcode = QuickenBinary(pc->m_opcode, op1.type(), op2.type());
+        VM_PUSH(result);
+        VM_NEXT();
+    }
+    VM_CASE(CALL):
+    {
+        auto op1 = callstack->Get(pc->m_operand1);
+        if (op1.type() != VMObjectType::Function) {
+            VMPanic("call to non-funciton object");
+            return;
+        }
+        MASSERT(pc->m_operand2 >= 0);
+        const auto func = op1.As<VMFunctionObject>();
+        if (func->isNative()) {
+            // no frame, the native reads the arguments where they are
+            const auto ans = func->GetNative()(*this, callstack->GetTopN(pc->m_operand2), pc->m_operand2);
+            if (m_status != VMStatus::Running) {
+                return;
+            }
+            VM_PUSH(ans);
+            VM_NEXT();
+        }
+        VM_SAVE_IP(pc + 1);
+        if (!CallFunction(func, pc->m_operand2)) {
+            return;
+        }
+        VM_LOAD_FRAME();
+        VM_SAFEPOINT(pc);
+        VM_DISPATCH();
+    }
+    VM_CASE(CALL_MODULEFUNC):
+    {
+        MASSERT(pc->m_operand2 >= 0);
+        auto func = callstack->GetFunction()->GetModule()->GetNthFunction(pc->m_operand1);
+        VM_SAVE_IP(pc + 1);
+        if (!CallFunction(func, pc->m_operand2)) {
+            return;
+        }
+        VM_LOAD_FRAME();
+        VM_SAFEPOINT(pc);
+        VM_DISPATCH();
+    }
+    VM_CASE(TAILCALL):
+    VM_CASE(TAILCALL_MODULEFUNC):
+    {
+        MASSERT(pc->m_operand2 >= 0);
+        VMFunctionObject* func;
+        if (pc->m_opcode == VMOpcode::TAILCALL) {
+            auto op1 = callstack->Get(pc->m_operand1);
+            if (op1.type() != VMObjectType::Function) {
+                VMPanic("call to non-funciton object");
+                return;
+            }
+            func = op1.As<VMFunctionObject>();
+        } else {
+            func = module->GetNthFunction(pc->m_operand1);
+        }
+        if (func->isNative()) {
+            const auto ans = func->GetNative()(*this, callstack->GetTopN(pc->m_operand2), pc->m_operand2);
+            if (m_status != VMStatus::Running) {
+                return;
+            }
+            VM_RETURN(ans);
+        }
+        const bool self = func == callstack->GetFunction();
+        if (!TailCallFunction(func, pc->m_operand2)) {
+            return;
+        }
+        // a self-recursive call only jumps back to the beginning of the function
+        if (self) {
+            pc = code;
+        } else {
+            VM_LOAD_FRAME();
+        }
+        VM_SAFEPOINT(pc);
+        VM_DISPATCH();
+    }
+    VM_CASE(DUP):
+        VM_PUSH(callstack->Get(pc->m_operand1));
+        VM_NEXT();
+    VM_CASE(STORE):
+        callstack->Set(pc->m_operand1, callstack->Get(pc->m_operand2));
+        VM_NEXT();
+    VM_CASE(RET):
+    VM_CASE(RETNULL):
+        VM_RETURN(pc->m_opcode == VMOpcode::RET ? callstack->Get(pc->m_operand1) : GetNull());
+    VM_CASE(PUSHSTR):
+    {
+        auto val = strings[pc->m_operand1];
+        if (val.type() == VMObjectType::Null) {
+            val = module->InternStringLiteral(pc->m_operand1);
+        }
+        VM_PUSH(val);
+        VM_NEXT();
+    }
+    VM_CASE(PUSHINT):
+        VM_PUSH(CreateInteger(integers[pc->m_operand1]));
+        VM_NEXT();
+    VM_CASE(PUSHFLT):
+        VM_PUSH(CreateFloat(floats[pc->m_operand1]));
+        VM_NEXT();
+    VM_CASE(PUSHNULL):
+        VM_PUSH(GetNull());
+        VM_NEXT();
+    VM_CASE(PUSHTRUE):
+        VM_PUSH(GetTrue());
+        VM_NEXT();
+    VM_CASE(PUSHFALSE):
+        VM_PUSH(GetFalse());
+        VM_NEXT();
+    VM_CASE(PUSHARRAY):
+        VM_PUSH(CreateArray());
+        VM_SAFEPOINT(pc + 1);
+        VM_NEXT();
+    VM_CASE(PUSHOBJECT):
+        VM_PUSH(CreateObject());
+        VM_SAFEPOINT(pc + 1);
+        VM_NEXT();
+    VM_CASE(CREATE_CLOSURE):
+    {
+        const auto n = pc->m_operand2;
+        MASSERT(n >= 0);
+        // a function without upvalues is the function of the module
+        if (n == 0) {
+            VM_PUSH(VMValue(module->GetNthFunction(pc->m_operand1)));
+            VM_NEXT();
+        }
+        const auto cells = callstack->GetTopN(n);
+        std::vector<VMCellObject*> captured(n);
+        for (int i=0;i<n;i++) {
+            captured[i] = cells[i].As<VMCellObject>();
+        }
+        VM_PUSH(VMValue(module->CreateClosure(pc->m_operand1, std::move(captured))));
+        VM_SAFEPOINT(pc + 1);
+        VM_NEXT();
+    }
+    VM_CASE(NEWCELL):
+        VM_PUSH(VMValue(m_heap.Allocate<VMCellObject>(callstack->Get(pc->m_operand1))));
+        VM_SAFEPOINT(pc + 1);
+        VM_NEXT();
+    VM_CASE(GETCELL):
+        VM_PUSH(callstack->Get(pc->m_operand1).As<VMCellObject>()->Get());
+        VM_NEXT();
+    VM_CASE(SETCELL):
+        callstack->Get(pc->m_operand1).As<VMCellObject>()->Set(callstack->Get(pc->m_operand2));
+        VM_NEXT();
+    VM_CASE(GETUPVAL):
+        MASSERT(static_cast<size_t>(pc->m_operand1) < callstack->GetFunction()->UpvalueCount());
+        VM_PUSH(upvalues[pc->m_operand1]->Get());
+        VM_NEXT();
+    VM_CASE(SETUPVAL):
+        MASSERT(static_cast<size_t>(pc->m_operand1) < callstack->GetFunction()->UpvalueCount());
+        upvalues[pc->m_operand1]->Set(callstack->Get(pc->m_operand2));
+        VM_NEXT();
+    VM_CASE(PUSHUPVAL):
+        MASSERT(static_cast<size_t>(pc->m_operand1) < callstack->GetFunction()->UpvalueCount());
+        VM_PUSH(VMValue(upvalues[pc->m_operand1]));
+        VM_NEXT();
+    VM_CASE(ARRAY_GET):
+    {
+        const auto array = callstack->Get(pc->m_operand1);
+        const auto idx = callstack->Get(pc->m_operand2);
+        if (array.type() == VMObjectType::Array && idx.type() == VMObjectType::Integer) {
+            const auto elements = array.As<VMArrayObject>();
+            // a negative index wraps around and fails the check
+            const auto i = static_cast<size_t>(idx.GetInteger());
+            if (pc->m_operand3 != 0 || i < elements->size()) {
+                MASSERT(i < elements->size());
+                VM_PUSH(elements->data()[i]);
+                VM_NEXT();
+            }
+        }
+        const auto val = GetElement(array, idx);
+        if (!val.has_value()) {
+            return;
+        }
+        VM_PUSH(val.value());
+        VM_NEXT();
+    }
+    VM_CASE(ARRAY_SET):
+    {
+        const auto array = callstack->Get(pc->m_operand1);
+        const auto idx = callstack->Get(pc->m_operand2);
+        const auto val = *callstack->GetTopN(1);
+        if (array.type() == VMObjectType::Array && idx.type() == VMObjectType::Integer) {
+            const auto elements = array.As<VMArrayObject>();
+            const auto i = static_cast<size_t>(idx.GetInteger());
+            if (pc->m_operand3 != 0 || i < elements->size()) {
+                elements->set(i, val);
+                VM_NEXT();
+            }
+        }
+        if (!SetElement(array, idx, val)) {
+            return;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(ARRAY_LEN):
+    {
+        const auto array = callstack->Get(pc->m_operand1);
+        if (array.type() == VMObjectType::Array) {
+            VM_PUSH(CreateInteger(static_cast<IntegerValueType>(array.As<VMArrayObject>()->size())));
+        } else if (array.type() == VMObjectType::TypedArray) {
+            VM_PUSH(CreateInteger(static_cast<IntegerValueType>(array.As<VMTypedArrayObject>()->size())));
+        } else {
+            VMPanic("length of a non-array");
+            return;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(MAP_GET):
+    {
+        const auto obj = callstack->Get(pc->m_operand1);
+        const auto key = callstack->Get(pc->m_operand2);
+        if (obj.type() != VMObjectType::Object) {
+            VMPanic("property of a non-object");
+            return;
+        }
+        if (key.type() != VMObjectType::String) {
+            VMPanic("property name must be a string");
+            return;
+        }
+        const auto map = obj.As<VMMapObject>();
+        const auto slot = map->GetShape()->Find(VMGetString(key));
+        if (!slot.has_value()) {
+            VMPanic("undefined property '" + VMGetString(key) + "'");
+            return;
+        }
+        VM_PUSH(map->GetSlot(slot.value()));
+        VM_NEXT();
+    }
+    VM_CASE(MAP_SET):
+    {
+        const auto obj = callstack->Get(pc->m_operand1);
+        const auto key = callstack->Get(pc->m_operand2);
+        if (obj.type() != VMObjectType::Object) {
+            VMPanic("property of a non-object");
+            return;
+        }
+        if (key.type() != VMObjectType::String) {
+            VMPanic("property name must be a string");
+            return;
+        }
+        obj.As<VMMapObject>()->insertComputed(VMGetString(key), *callstack->GetTopN(1));
+        VM_NEXT();
+    }
+    VM_CASE(MEMO_GET):
+    {
+        const auto cached = m_memo.Find(callstack->GetFunction(), callstack->GetArgs(), callstack->ArgCount(), callstack->Depth());
+        if (cached.has_value()) {
+            VM_RETURN(cached.value());
+        }
+        VM_NEXT();
+    }
+    VM_CASE(MEMO_RET):
+    {
+        const auto result = callstack->Get(pc->m_operand1);
+        m_memo.Insert(callstack->GetFunction(), callstack->Depth(), result);
+        VM_RETURN(result);
+    }
+    VM_CASE(CONCAT):
+    {
+        const auto op1 = callstack->Get(pc->m_operand1);
+        const auto op2 = callstack->Get(pc->m_operand2);
+        if (op1.type() != VMObjectType::String || op2.type() != VMObjectType::String) {
+            VMPanic("concatenation of a non-string");
+            return;
+        }
+        VM_PUSH(ConcatStrings(op1.As<VMStringObject>(), op2.As<VMStringObject>()));
+        VM_SAFEPOINT(pc + 1);
+        VM_NEXT();
+    }
+    VM_CASE(GETPROP):
+    {
+        const auto obj = callstack->Get(pc->m_operand1);
+        if (obj.type() != VMObjectType::Object) {
+            VMPanic("property of a non-object");
+            return;
+        }
+        const auto map = obj.As<VMMapObject>();
+        const auto cache = module->GetPropertyCache(pc->m_operand3);
+        if (cache != nullptr && cache->m_shape == map->GetShape()) {
+            VM_PUSH(map->GetSlot(cache->m_slot));
+            VM_NEXT();
+        }
+        auto key = strings[pc->m_operand2];
+        if (key.type() == VMObjectType::Null) {
+            key = module->InternStringLiteral(pc->m_operand2);
+        }
+        const auto shape = map->GetShape();
+        const auto slot = shape->Find(VMGetString(key));
+        if (!slot.has_value()) {
+            VMPanic("undefined property '" + VMGetString(key) + "'");
+            return;
+        }
+        if (cache != nullptr && shape->IsShared()) {
+            *cache = VMShape::Cache{ shape, nullptr, slot.value() };
+        }
+        VM_PUSH(map->GetSlot(slot.value()));
+        VM_NEXT();
+    }
+    VM_CASE(SETPROP):
+    {
+        const auto obj = callstack->Get(pc->m_operand1);
+        if (obj.type() != VMObjectType::Object) {
+            VMPanic("property of a non-object");
+            return;
+        }
+        const auto map = obj.As<VMMapObject>();
+        const auto val = *callstack->GetTopN(1);
+        const auto cache = module->GetPropertyCache(pc->m_operand3);
+        if (cache != nullptr && cache->m_shape == map->GetShape()) {
+            if (cache->m_transition != nullptr) {
+                map->AddSlot(cache->m_transition, val);
+            } else {
+                map->SetSlot(cache->m_slot, val);
+            }
+            VM_NEXT();
+        }
+        auto key = strings[pc->m_operand2];
+        if (key.type() == VMObjectType::Null) {
+            key = module->InternStringLiteral(pc->m_operand2);
+        }
+        const auto shape = map->GetShape();
+        const auto slot = shape->Find(VMGetString(key));
+        map->insert(VMGetString(key), val);
+        // a dictionary shape is never cached, an insert may have made one
+        if (cache != nullptr && shape->IsShared() && map->GetShape()->IsShared()) {
+            if (slot.has_value()) {
+                *cache = VMShape::Cache{ shape, nullptr, slot.value() };
+            } else {
+                *cache = VMShape::Cache{ shape, map->GetShape(), shape->size() };
+            }
+        }
+        VM_NEXT();
+    }
+    VM_CASE(GLOBAL_GETVAR):
+    {
+        auto s = callstack->Get(pc->m_operand1);
+        if (s.type() != VMObjectType::String) {
+            VMPanic("invalid key");
+            return;
+        }
+        const auto& key = VMGetString(s);
+        const auto slot = m_globals.Find(key, module->GetVariableCache(pc->m_operand3));
+        if (!slot.has_value() || !m_globals.at(slot.value()).m_defined) {
+            VMPanic("undefine variable '" + key + "'");
+            return;
+        }
+        VM_PUSH(m_globals.at(slot.value()).m_value);
+        VM_NEXT();
+    }
+    VM_CASE(GLOBAL_SETVAR):
+    {
+        auto s = callstack->Get(pc->m_operand1);
+        if (s.type() != VMObjectType::String) {
+            VMPanic("invalid key");
+            return;
+        }
+        auto& var = m_globals.at(m_globals.Declare(VMGetString(s), module->GetVariableCache(pc->m_operand3)));
+        var.m_value = callstack->Get(pc->m_operand2);
+        var.m_defined = true;
+        VM_NEXT();
+    }
+    VM_CASE(MODULE_GETVAR):
+    {
+        auto s = callstack->Get(pc->m_operand1);
+        if (s.type() != VMObjectType::String) {
+            VMPanic("invalid key");
+            return;
+        }
+        const auto& key = VMGetString(s);
+        const auto slot = module->GetVariables().Find(key, module->GetVariableCache(pc->m_operand3));
+        if (!slot.has_value() || !module->GetVariables().at(slot.value()).m_defined) {
+            VMPanic("undefine variable '" + key + "'");
+            return;
+        }
+        VM_PUSH(module->GetVariables().at(slot.value()).m_value);
+        VM_NEXT();
+    }
+    VM_CASE(MODULE_SETVAR):
+    {
+        auto s = callstack->Get(pc->m_operand1);
+        if (s.type() != VMObjectType::String) {
+            VMPanic("invalid key");
+            return;
+        }
+        auto& variables = module->GetVariables();
+        const auto slot = variables.Declare(VMGetString(s), module->GetVariableCache(pc->m_operand3));
+        module->SetVariable(slot, callstack->Get(pc->m_operand2));
+        VM_NEXT();
+    }
+    VM_CASE(MODULE_GETSLOT):
+    {
+        const auto& var = module->GetVariables().data()[pc->m_operand1];
+        if (!var.m_defined) {
+            VMPanic("undefine variable '" + module->GetVariables().NameOf(pc->m_operand1) + "'");
+            return;
+        }
+        VM_PUSH(var.m_value);
+        VM_NEXT();
+    }
+    VM_CASE(MODULE_SETSLOT):
+        module->SetVariable(pc->m_operand1, callstack->Get(pc->m_operand2));
+        VM_NEXT();
+    VM_CASE(GLOBAL_GETSLOT):
+    {
+        const auto& var = m_globals.at(pc->m_operand1);
+        if (!var.m_defined) {
+            VMPanic("undefine variable '" + m_globals.NameOf(pc->m_operand1) + "'");
+            return;
+        }
+        VM_PUSH(var.m_value);
+        VM_NEXT();
+    }
+    VM_CASE(GLOBAL_SETSLOT):
+    {
+        auto& var = m_globals.at(pc->m_operand1);
+        var.m_value = callstack->Get(pc->m_operand2);
+        var.m_defined = true;
+        VM_NEXT();
+    }
+    VM_CASE(GLOBAL_GETNAME):
+    {
+        const auto slot = m_globals.Declare(std::string(module->GetNthString(pc->m_operand1)), nullptr);
+        if (slot <= INT16_MAX) {
+            pc->m_opcode = VMOpcode::GLOBAL_GETSLOT;
+            pc->m_operand1 = static_cast<int16_t>(slot);
+            VM_DISPATCH();
+        }
+        const auto& var = m_globals.at(slot);
+        if (!var.m_defined) {
+            VMPanic("undefine variable '" + m_globals.NameOf(slot) + "'");
+            return;
+        }
+        VM_PUSH(var.m_value);
+        VM_NEXT();
+    }
+    VM_CASE(GLOBAL_SETNAME):
+    {
+        const auto slot = m_globals.Declare(std::string(module->GetNthString(pc->m_operand1)), nullptr);
+        if (slot <= INT16_MAX) {
+            pc->m_opcode = VMOpcode::GLOBAL_SETSLOT;
+            pc->m_operand1 = static_cast<int16_t>(slot);
+            VM_DISPATCH();
+        }
+        auto& var = m_globals.at(slot);
+        var.m_value = callstack->Get(pc->m_operand2);
+        var.m_defined = true;
+        VM_NEXT();
+    }
+    VM_CASE(LOAD_MODULE):
+    {
+        auto v1 = callstack->Get(pc->m_operand1);
+        if (v1.type() != VMObjectType::String) {
+            VMPanic("fail to load module");
+            return;
+        }
+        const auto s = VMGetString(v1);
+        if (m_modules.count(s)) {
+            VM_PUSH(VMValue(m_modules.at(s)));
+            VM_PUSH(GetNull());
+            VM_PUSH(GetNull());
+            VM_NEXT();
+        }
+        auto func = this->LoadModuleFromFile(s);
+        if (!m_modules.count(s)) {
+            VMPanic("fail to load module '" + s + "'");
+            return;
+        }
+        VM_PUSH(VMValue(m_modules.at(s)));
+        VM_SAVE_IP(pc + 1);
+        if (func && CallFunction(func, 0)) {
+            VM_LOAD_FRAME();
+            VM_DISPATCH();
+        }
+        if (m_status != VMStatus::Running) {
+            return;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(JMP_TRUE):
+        if (VMConvertToBool(callstack->Get(pc->m_operand1))) {
+            const auto offset = pc->m_operand2;
+            pc += offset;
+            if (offset < 0) {
+                VM_SAFEPOINT(pc + 1);
+            }
+        }
+        VM_NEXT();
+    VM_CASE(JMP_FLASE):
+        if (!VMConvertToBool(callstack->Get(pc->m_operand1))) {
+            const auto offset = pc->m_operand2;
+            pc += offset;
+            if (offset < 0) {
+                VM_SAFEPOINT(pc + 1);
+            }
+        }
+        VM_NEXT();
+    VM_CASE(JMP):
+    {
+        const auto offset = pc->m_operand2;
+        pc += offset;
+        if (offset < 0) {
+            VM_SAFEPOINT(pc + 1);
+        }
+        VM_NEXT();
+    }
 
-        if (instructionCount % 10000000 == 0 && m_status == VMStatus::Running) {
-            m_status = VMStatus::GC;
-            RunGarbageColletion();
-            m_status = VMStatus::Running;
+    VM_CASE(ADD_CONST):
+    VM_CASE(SUB_CONST):
+    {
+        const auto val = CreateInteger(integers[pc->m_operand2]);
+        const auto op1 = callstack->Get(pc->m_operand1);
+        const bool isAdd = pc->m_opcode == VMOpcode::ADD_CONST;
+        const auto result = ExecuteBinaryOperator(isAdd ? VMOpcode::ADD : VMOpcode::SUB, op1, val);
+        if (m_status != VMStatus::Running) {
+            return;
+        }
+        if (op1.type() == VMObjectType::Integer) {
+            pc->m_opcode = isAdd ? VMOpcode::ADD_CONST_I : VMOpcode::SUB_CONST_I;
         }
+        VM_PUSH(val);
+        VM_PUSH(result);
+        VM_NEXT();
     }
+    VM_CASE(EQUAL_JMP_TRUE):
+    VM_CASE(EQUAL_JMP_FALSE):
+    VM_CASE(INEQUAL_JMP_TRUE):
+    VM_CASE(INEQUAL_JMP_FALSE):
+    VM_CASE(GREATER_JMP_TRUE):
+    VM_CASE(GREATER_JMP_FALSE):
+    VM_CASE(LESS_JMP_TRUE):
+    VM_CASE(LESS_JMP_FALSE):
+    VM_CASE(GREATER_EQ_JMP_TRUE):
+    VM_CASE(GREATER_EQ_JMP_FALSE):
+    VM_CASE(LESS_EQ_JMP_TRUE):
+    VM_CASE(LESS_EQ_JMP_FALSE):
+    {
+        // the variants come in pairs, in the order of the compare opcodes
+        const auto variant = static_cast<size_t>(pc->m_opcode) - static_cast<size_t>(VMOpcode::EQUAL_JMP_TRUE);
+        const auto compare = static_cast<VMOpcode>(static_cast<size_t>(VMOpcode::EQUAL) + variant / 2);
+        const auto op1 = callstack->Get(pc->m_operand1);
+        const auto op2 = callstack->Get(pc->m_operand2);
+        const auto result = ExecuteBinaryOperator(compare, op1, op2);
+        if (m_status != VMStatus::Running) {
+            return;
+        }
+        if (op1.type() == VMObjectType::Integer && op2.type() == VMObjectType::Integer) {
+            pc->m_opcode = static_cast<VMOpcode>(static_cast<size_t>(VMOpcode::EQUAL_JMP_TRUE_II) + variant);
+        }
+        VM_PUSH(result);
+        if (VMGetBool(result) == (variant % 2 == 0)) {
+            const auto offset = pc->m_operand3;
+            pc += offset;
+            if (offset < 0) {
+                VM_SAFEPOINT(pc + 1);
+            }
+        }
+        VM_NEXT();
+    }
+
+    VM_QUICK_BINARY(ADD_II, ADD, Integer, GetInteger, Integer, +);
+    VM_QUICK_BINARY(ADD_FF, ADD, Float, GetFloat, Float, +);
+    VM_QUICK_BINARY(SUB_II, SUB, Integer, GetInteger, Integer, -);
+    VM_QUICK_BINARY(SUB_FF, SUB, Float, GetFloat, Float, -);
+    VM_QUICK_BINARY(MUL_II, MUL, Integer, GetInteger, Integer, *);
+    VM_QUICK_BINARY(MUL_FF, MUL, Float, GetFloat, Float, *);
+    VM_QUICK_BINARY(DIV_FF, DIV, Float, GetFloat, Float, /);
+    VM_QUICK_BINARY(EQUAL_II, EQUAL, Integer, GetInteger, Boolean, ==);
+    VM_QUICK_BINARY(INEQUAL_II, INEQUAL, Integer, GetInteger, Boolean, !=);
+    VM_QUICK_BINARY(GREATER_II, GREATER, Integer, GetInteger, Boolean, >);
+    VM_QUICK_BINARY(GREATER_FF, GREATER, Float, GetFloat, Boolean, >);
+    VM_QUICK_BINARY(LESS_II, LESS, Integer, GetInteger, Boolean, <);
+    VM_QUICK_BINARY(LESS_FF, LESS, Float, GetFloat, Boolean, <);
+    VM_QUICK_BINARY(GREATER_EQ_II, GREATER_EQ, Integer, GetInteger, Boolean, >=);
+    VM_QUICK_BINARY(GREATER_EQ_FF, GREATER_EQ, Float, GetFloat, Boolean, >=);
+    VM_QUICK_BINARY(LESS_EQ_II, LESS_EQ, Integer, GetInteger, Boolean, <=);
+    VM_QUICK_BINARY(LESS_EQ_FF, LESS_EQ, Float, GetFloat, Boolean, <=);
+    VM_QUICK_CONST(ADD_CONST_I, ADD_CONST, +);
+    VM_QUICK_CONST(SUB_CONST_I, SUB_CONST, -);
+    VM_QUICK_COMPARE_JMP(EQUAL_JMP_TRUE_II, EQUAL_JMP_TRUE, ==, true);
+    VM_QUICK_COMPARE_JMP(EQUAL_JMP_FALSE_II, EQUAL_JMP_FALSE, ==, false);
+    VM_QUICK_COMPARE_JMP(INEQUAL_JMP_TRUE_II, INEQUAL_JMP_TRUE, !=, true);
+    VM_QUICK_COMPARE_JMP(INEQUAL_JMP_FALSE_II, INEQUAL_JMP_FALSE, !=, false);
+    VM_QUICK_COMPARE_JMP(GREATER_JMP_TRUE_II, GREATER_JMP_TRUE, >, true);
+    VM_QUICK_COMPARE_JMP(GREATER_JMP_FALSE_II, GREATER_JMP_FALSE, >, false);
+    VM_QUICK_COMPARE_JMP(LESS_JMP_TRUE_II, LESS_JMP_TRUE, <, true);
+    VM_QUICK_COMPARE_JMP(LESS_JMP_FALSE_II, LESS_JMP_FALSE, <, false);
+    VM_QUICK_COMPARE_JMP(GREATER_EQ_JMP_TRUE_II, GREATER_EQ_JMP_TRUE, >=, true);
+    VM_QUICK_COMPARE_JMP(GREATER_EQ_JMP_FALSE_II, GREATER_EQ_JMP_FALSE, >=, false);
+    VM_QUICK_COMPARE_JMP(LESS_EQ_JMP_TRUE_II, LESS_EQ_JMP_TRUE, <=, true);
+    VM_QUICK_COMPARE_JMP(LESS_EQ_JMP_FALSE_II, LESS_EQ_JMP_FALSE, <=, false);
+
+#ifndef M2V_THREADED_DISPATCH
+    }
+    MUnreachable();
+#endif
 }
 
-VMFunctionObject* VirtualMachine::LoadModule(const ExecutionModule& module)
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_PROFILE
+#undef VM_NEXT
+#undef VM_LOAD_FRAME
+#undef VM_PUSH
+#undef VM_QUICK_BINARY
+#undef VM_QUICK_CONST
+#undef VM_QUICK_COMPARE_JMP
+#undef VM_SAVE_IP
+#undef VM_RETURN
+#undef VM_SAFEPOINT
+
+VMModuleObject* VirtualMachine::CreateModule(const std::string& moduleName, std::shared_ptr<const ModuleImage> image)
 {
-    auto mod = CreateModule(module.GetModuleName(), module);
-    auto m = static_cast<VMModuleObject*>(&*mod);
-    return m->GetInitializer();
+    auto ans = m_heap.Allocate<VMModuleObject>(std::move(image), *this);
+    m_modules.insert({moduleName, ans});
+    return ans;
 }
 
 VMFunctionObject* VirtualMachine::LoadModuleFromFile(const std::string& moduleName)
 {
+    for (auto& dir: m_modulePaths) {
+        auto image = ModuleImage::Map(dir + "/" + moduleName + ModuleImage::FileExtension);
+        if (image) {
+            return CreateModule(moduleName, std::move(image))->GetInitializer();
+        }
+    }
     return nullptr;
 }
 
-void VirtualMachine::RunGarbageColletion()
+void VirtualMachine::VMPanic(const std::string& message)
 {
-    MDEBUG_LOG("run garbage collection");
-    m_gcGeneration++;
+    MDEBUG_LOG("vm panic: " << message);
+    m_status = VMStatus::Panic;
+    m_panicMessage = message;
+}
 
-    for (auto& [_, v]: m_globalObjects) {
-        v->MarkGeneration(m_gcGeneration);
+void VirtualMachine::VMExit(int status)
+{
+    m_status = VMStatus::Exited;
+    m_exitStatus = status;
+}
+
+VMValue VirtualMachine::Call(VMValue callee, const VMValue* args, size_t nargs)
+{
+    MASSERT(m_status == VMStatus::Running);
+    if (callee.type() != VMObjectType::Function) {
+        VMPanic("call to non-funciton object");
+        return GetNull();
     }
-    for (auto& [_, m]: m_modules) {
-        m->MarkGeneration(m_gcGeneration);
+    const auto func = callee.As<VMFunctionObject>();
+    if (func->isNative()) {
+        return func->GetNative()(*this, args, nargs);
     }
-    for (auto& stack: m_callstacks) {
-        stack->MarkObjects(m_gcGeneration);
+    auto callstack = GetActiveCallstack();
+    for (size_t i=0;i<nargs;i++) {
+        if (!callstack->Push(args[i])) {
+            VMPanic("stack overflow");
+            return GetNull();
+        }
     }
+    if (!CallFunction(func, nargs)) {
+        return GetNull();
+    }
+    // a nested interpreter runs until the callee returns here, it can't
+    // yield as the native is on the C++ stack
+    const auto returnDepth = m_returnDepth;
+    const auto sliceInstructions = m_sliceInstructions;
+    const auto sliceDeadline = m_sliceDeadline;
+    m_returnDepth = callstack->Depth() - 1;
+    m_sliceInstructions = PTRDIFF_MAX;
+    m_sliceDeadline.reset();
+    MainLoop();
+    m_returnDepth = returnDepth;
+    m_sliceInstructions = sliceInstructions;
+    m_sliceDeadline = sliceDeadline;
+    if (m_status != VMStatus::Running) {
+        return GetNull();
+    }
+    callstack->Pop(nargs);
+    return m_callResult;
+}
 
-    std::vector<VMObjectId> removedObjects;
-    for (auto& [id, obj]: m_objects) {
-        if (obj->GetGeneration() != m_gcGeneration) {
-            MASSERT(obj->GetGeneration() < m_gcGeneration);
-            removedObjects.push_back(id);
+std::optional<VMValue> VirtualMachine::GetElement(VMValue array, VMValue idx)
+{
+    if (array.type() != VMObjectType::Array && array.type() != VMObjectType::TypedArray) {
+        VMPanic("element of a non-array");
+        return std::nullopt;
+    }
+    if (idx.type() != VMObjectType::Integer) {
+        VMPanic("index of an array must be an integer");
+        return std::nullopt;
+    }
+    const auto i = idx.GetInteger();
+    if (array.type() == VMObjectType::Array) {
+        const auto elements = array.As<VMArrayObject>();
+        if (i < 0 || static_cast<size_t>(i) >= elements->size()) {
+            VMPanic("index " + std::to_string(i) + " out of range");
+            return std::nullopt;
+        }
+        return elements->get(i);
+    }
+    const auto typed = array.As<VMTypedArrayObject>();
+    if (i < 0 || static_cast<size_t>(i) >= typed->size()) {
+        VMPanic("index " + std::to_string(i) + " out of range");
+        return std::nullopt;
+    }
+    switch (typed->kind()) {
+    case VMTypedArrayKind::Int32:
+        return CreateInteger(typed->Int32Data()[i]);
+    case VMTypedArrayKind::Float64:
+        return CreateFloat(typed->FloatData()[i]);
+    case VMTypedArrayKind::Point2:
+        break;
+    }
+    VMPanic("element of a point array, use point_x and point_y");
+    return std::nullopt;
+}
+
+// an index one past the end appends to an array
+bool VirtualMachine::SetElement(VMValue array, VMValue idx, VMValue val)
+{
+    if (array.type() != VMObjectType::Array && array.type() != VMObjectType::TypedArray) {
+        VMPanic("element of a non-array");
+        return false;
+    }
+    if (idx.type() != VMObjectType::Integer) {
+        VMPanic("index of an array must be an integer");
+        return false;
+    }
+    const auto i = idx.GetInteger();
+    if (array.type() == VMObjectType::Array) {
+        const auto elements = array.As<VMArrayObject>();
+        if (i < 0 || static_cast<size_t>(i) > elements->size()) {
+            VMPanic("index " + std::to_string(i) + " out of range");
+            return false;
+        }
+        if (static_cast<size_t>(i) == elements->size()) {
+            elements->push(val);
+        } else {
+            elements->set(i, val);
+        }
+        return true;
+    }
+    const auto typed = array.As<VMTypedArrayObject>();
+    if (i < 0 || static_cast<size_t>(i) >= typed->size()) {
+        VMPanic("index " + std::to_string(i) + " out of range");
+        return false;
+    }
+    switch (typed->kind()) {
+    case VMTypedArrayKind::Int32:
+        if (val.type() != VMObjectType::Integer || val.GetInteger() < INT32_MIN || val.GetInteger() > INT32_MAX) {
+            VMPanic("int32 expected");
+            return false;
+        }
+        typed->Int32Data()[i] = static_cast<int32_t>(val.GetInteger());
+        return true;
+    case VMTypedArrayKind::Float64:
+        if (val.type() == VMObjectType::Integer) {
+            typed->FloatData()[i] = static_cast<FloatValueType>(val.GetInteger());
+        } else if (val.type() == VMObjectType::Float) {
+            typed->FloatData()[i] = val.GetFloat();
+        } else {
+            VMPanic("number expected");
+            return false;
         }
+        return true;
+    case VMTypedArrayKind::Point2:
+        break;
+    }
+    VMPanic("element of a point array, use point_set");
+    return false;
+}
+
+VMValue VirtualMachine::ConcatStrings(VMStringObject* left, VMStringObject* right)
+{
+    if (right->size() == 0) {
+        return VMValue(left);
+    } else if (left->size() == 0) {
+        return VMValue(right);
+    } else if (left->size() + right->size() < VMStringObject::MinRopeSize) {
+        return CreateString(left->GetValue() + right->GetValue());
+    }
+    return VMValue(m_heap.Allocate<VMStringObject>(left, right));
+}
+
+VMValue VirtualMachine::InternString(const std::string& val)
+{
+    auto it = m_strings.find(val);
+    if (it == m_strings.end()) {
+        it = m_strings.insert({val, m_heap.Allocate<VMStringObject>(val)}).first;
+    }
+    return VMValue(it->second);
+}
+
+void VirtualMachine::RegisterNative(const std::string& name, NativeFunction func)
+{
+    MASSERT(func);
+    SetGlobal(name, VMValue(m_heap.Allocate<VMFunctionObject>(func)));
+}
+
+void VirtualMachine::SetGlobal(const std::string& name, VMValue val)
+{
+    auto& var = m_globals.at(m_globals.Declare(name, nullptr));
+    var.m_value = val;
+    var.m_defined = true;
+}
+
+void VirtualMachine::MarkRoots()
+{
+    m_globals.MarkValues(m_heap);
+    for (auto& [_, s]: m_strings) {
+        m_heap.MarkObject(s);
     }
+    for (auto& [_, m]: m_modules) {
+        m_heap.MarkObject(m);
+    }
+    m_callstack.MarkObjects(m_heap);
+    m_memo.MarkValues(m_heap);
+    for (auto& val: m_nativeRoots) {
+        m_heap.MarkValue(val);
+    }
+}
 
-    for (auto& id: removedObjects) {
-        m_objects.erase(id);
+void VirtualMachine::RunMinorCollection()
+{
+    m_heap.BeginMinorCollection();
+    MarkRoots();
+    m_heap.FinishMinorCollection();
+}
+
+void VirtualMachine::RunGarbageColletion()
+{
+    MDEBUG_LOG("run garbage collection");
+    if (!m_heap.IsMarking()) {
+        m_heap.BeginMajorCollection();
     }
+    MarkRoots();
+    m_heap.FinishMajorCollection();
 }
 
+void VirtualMachine::StartIncrementalCollection()
+{
+    MDEBUG_LOG("start incremental marking");
+    m_heap.BeginMajorCollection();
+    MarkRoots();
+}
+
+void VirtualMachine::IncrementalMarkStep(size_t maxObjects)
+{
+    if (m_heap.MarkStep(maxObjects)) {
+        FinishIncrementalCollection();
+    }
+}
+
+void VirtualMachine::FinishIncrementalCollection()
+{
+    // the stacks and globals are not covered by the write barrier,
+    // they are scanned again before the heap is swept
+    MarkRoots();
+    m_heap.FinishMajorCollection();
+}
+
+void VirtualMachine::CollectGarbage(std::chrono::microseconds budget)
+{
+    const auto deadline = std::chrono::steady_clock::now() + budget;
+    if (!m_heap.IsMarking() && !m_heap.IsSweeping() && m_heap.WorthCollecting()) {
+        StartIncrementalCollection();
+    }
+    while (m_heap.IsMarking() && std::chrono::steady_clock::now() < deadline) {
+        IncrementalMarkStep(IncrementalMarkWork);
+    }
+    while (std::chrono::steady_clock::now() < deadline && m_heap.SweepStep()) {}
+}
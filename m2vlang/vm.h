@@ -1,6 +1,13 @@
 #pragma once
 #include "vm_object.h"
+#include "vm_heap.h"
+#include "memo.h"
+#include "profiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <memory>
+#include <optional>
 
 
 namespace M2V {
@@ -24,6 +31,7 @@ enum class VMOpcode: uint16_t {
     CALL,            // call funcidx, nargs
     CALL_MODULEFUNC, // call modfuncIdx, nargs
     DUP,             // dup idx
+    STORE,           // STORE slot, idx2
     RET,             // RET idx
     RETNULL,         // RETNULL
     PUSHSTR,         // PUSHSTR strLiteralIdx
@@ -34,7 +42,7 @@ enum class VMOpcode: uint16_t {
     PUSHFALSE,
     PUSHARRAY,
     PUSHOBJECT,
-    CREATE_CLOSURE,  // CREATE_CLOSURE, ncaptured
+    CREATE_CLOSURE,  // CREATE_CLOSURE modfuncIdx, ncaptured, the cells are the top ncaptured values
     GLOBAL_GETVAR,   // GGet nameidx1
     GLOBAL_SETVAR,   // GSet nameidx1, idx2
     MODULE_GETVAR,   // MGet nameidx1
@@ -45,19 +53,106 @@ enum class VMOpcode: uint16_t {
 
     JMP_TRUE,        // JMP_TRUE idx, offset
     JMP_FLASE,       // JMP_FALSE idx, offset
+    JMP,             // JMP 0, offset
+
+    // superinstructions emitted by PeepholeOptimizer, they push the same
+    // values as the sequence they replace
+    ADD_CONST,         // ADD_CONST idx, intLiteralIdx
+    SUB_CONST,         // SUB_CONST idx, intLiteralIdx
+    EQUAL_JMP_TRUE,    // EQUAL_JMP_TRUE idx1, idx2, offset
+    EQUAL_JMP_FALSE,
+    INEQUAL_JMP_TRUE,
+    INEQUAL_JMP_FALSE,
+    GREATER_JMP_TRUE,
+    GREATER_JMP_FALSE,
+    LESS_JMP_TRUE,
+    LESS_JMP_FALSE,
+    GREATER_EQ_JMP_TRUE,
+    GREATER_EQ_JMP_FALSE,
+    LESS_EQ_JMP_TRUE,
+    LESS_EQ_JMP_FALSE,
+
+    // quickened forms: the interpreter rewrites a generic instruction after
+    // seeing its operand types, the quickened form only checks those types
+    // and turns back into the generic one if they differ
+    ADD_II, ADD_FF, SUB_II, SUB_FF, MUL_II, MUL_FF, DIV_FF,
+    EQUAL_II, INEQUAL_II,
+    GREATER_II, GREATER_FF, LESS_II, LESS_FF,
+    GREATER_EQ_II, GREATER_EQ_FF, LESS_EQ_II, LESS_EQ_FF,
+    ADD_CONST_I, SUB_CONST_I,
+    EQUAL_JMP_TRUE_II,  // same order as EQUAL_JMP_TRUE ... LESS_EQ_JMP_FALSE
+    EQUAL_JMP_FALSE_II,
+    INEQUAL_JMP_TRUE_II,
+    INEQUAL_JMP_FALSE_II,
+    GREATER_JMP_TRUE_II,
+    GREATER_JMP_FALSE_II,
+    LESS_JMP_TRUE_II,
+    LESS_JMP_FALSE_II,
+    GREATER_EQ_JMP_TRUE_II,
+    GREATER_EQ_JMP_FALSE_II,
+    LESS_EQ_JMP_TRUE_II,
+    LESS_EQ_JMP_FALSE_II,
+
+    // variables with a literal name, resolved to slots when the module is loaded
+    MODULE_GETSLOT,  // MODULE_GETSLOT slot
+    MODULE_SETSLOT,  // MODULE_SETSLOT slot, idx2
+    GLOBAL_GETSLOT,  // GLOBAL_GETSLOT slot
+    GLOBAL_SETSLOT,  // GLOBAL_SETSLOT slot, idx2
+    // globals with a literal name, turned into slot instructions when they first run
+    GLOBAL_GETNAME,  // GLOBAL_GETNAME strLiteralIdx
+    GLOBAL_SETNAME,  // GLOBAL_SETNAME strLiteralIdx, idx2
+
+    // CALL/CALL_MODULEFUNC followed by a return of the result,
+    // the callee takes over the frame of the active call
+    TAILCALL,            // TAILCALL funcidx, nargs
+    TAILCALL_MODULEFUNC, // TAILCALL_MODULEFUNC modfuncIdx, nargs
+
+    // properties of objects with a literal key, op3 is an inline cache
+    // assigned when the module is loaded
+    GETPROP,         // GETPROP idx, strLiteralIdx
+    SETPROP,         // SETPROP idx, strLiteralIdx, the value is the top of the stack
+
+    CONCAT,          // CONCAT idx1, idx2
+
+    // variables captured by closures live in cells: the declaring function
+    // keeps the cell in a slot, a closure in its array of upvalues
+    NEWCELL,         // NEWCELL idx, push a cell holding the value
+    GETCELL,         // GETCELL slot
+    SETCELL,         // SETCELL slot, idx2
+    GETUPVAL,        // GETUPVAL upvalueIdx
+    SETUPVAL,        // SETUPVAL upvalueIdx, idx2
+    PUSHUPVAL,       // PUSHUPVAL upvalueIdx, push the cell to capture it again
+
+    // elements of arrays and typed arrays, properties with a computed key.
+    // MAP_SET of a new key gives the object a dictionary shape.
+    // op3 of ARRAY_GET/ARRAY_SET is 1 if the compiler proved the index in range
+    ARRAY_GET,       // ARRAY_GET idx, indexIdx
+    ARRAY_SET,       // ARRAY_SET idx, indexIdx, the value is the top of the stack
+    ARRAY_LEN,       // ARRAY_LEN idx
+    MAP_GET,         // MAP_GET idx, keyIdx
+    MAP_SET,         // MAP_SET idx, keyIdx, the value is the top of the stack
+
+    // functions marked pure: MEMO_GET begins the function and returns the
+    // cached result of its arguments, if there is one. MEMO_RET caches the
+    // result and returns it
+    MEMO_GET,        // MEMO_GET
+    MEMO_RET,        // MEMO_RET idx
 };
+constexpr size_t VMOpcodeCount = static_cast<size_t>(VMOpcode::MEMO_RET) + 1;
 
 struct VMInstruction {
     VMOpcode m_opcode;
     int16_t m_operand1;
     int16_t m_operand2;
+    int16_t m_operand3;
 
     VMInstruction():
-        m_opcode(VMOpcode::NOP), m_operand1(0), m_operand2(0) {}
+        m_opcode(VMOpcode::NOP), m_operand1(0), m_operand2(0), m_operand3(0) {}
 
-    VMInstruction(VMOpcode opcode, int16_t op1, int16_t op2):
-        m_opcode(opcode), m_operand1(op1), m_operand2(op2) {}
+    VMInstruction(VMOpcode opcode, int16_t op1, int16_t op2, int16_t op3 = 0):
+        m_opcode(opcode), m_operand1(op1), m_operand2(op2), m_operand3(op3) {}
 };
+static_assert(sizeof(VMInstruction) == 8, "VMInstruction should fit in one word");
 
 struct StringLiteralPool {
     std::vector<std::string> m_strings;
@@ -75,8 +170,12 @@ struct FunctionInfo {
     bool   m_varadic;
 };
 
+class ModuleImage;
+
 class ExecutionModule {
 public:
+    explicit ExecutionModule(const std::string& moduleName): m_moduleName(moduleName) {}
+
     const std::string& GetModuleName() const { return m_moduleName; }
     const std::string& GetNthString(size_t idx) const
     {
@@ -98,219 +197,422 @@ public:
         MASSERT(idx < m_instructions.size());
         return m_instructions.at(idx);
     }
+    const VMInstruction& GetInstruction(size_t idx) const
+    {
+        MASSERT(idx < m_instructions.size());
+        return m_instructions.at(idx);
+    }
+
+    const VMInstruction* GetInstructionData() const { return m_instructions.data(); }
+    size_t GetInstructionCount() const { return m_instructions.size(); }
+    const std::string* GetStringData() const { return m_stringPool.m_strings.data(); }
+    size_t GetStringCount() const { return m_stringPool.m_strings.size(); }
+    const IntegerValueType* GetIntegerData() const { return m_integerPool.m_integers.data(); }
+    size_t GetIntegerCount() const { return m_integerPool.m_integers.size(); }
+    const FloatValueType* GetFloatData() const { return m_floatPool.m_floatValues.data(); }
+    size_t GetFloatCount() const { return m_floatPool.m_floatValues.size(); }
 
     const auto& GetFunctionTable() const { return m_functionTable; }
     const std::optional<size_t> ModuleIntializer() const { return m_initializer; }
 
+    size_t AddString(const std::string& val)
+    {
+        m_stringPool.m_strings.push_back(val);
+        return m_stringPool.m_strings.size() - 1;
+    }
+    size_t AddInteger(IntegerValueType val)
+    {
+        m_integerPool.m_integers.push_back(val);
+        return m_integerPool.m_integers.size() - 1;
+    }
+    size_t AddFloat(FloatValueType val)
+    {
+        m_floatPool.m_floatValues.push_back(val);
+        return m_floatPool.m_floatValues.size() - 1;
+    }
+    size_t AddFunction(const std::string& name, const std::vector<VMInstruction>& instructions, bool varadic)
+    {
+        m_functionTable.push_back(FunctionInfo{ name, m_instructions.size(), instructions.size(), varadic });
+        m_instructions.insert(m_instructions.end(), instructions.begin(), instructions.end());
+        return m_functionTable.size() - 1;
+    }
+    void SetInitializer(size_t funcIdx)
+    {
+        MASSERT(funcIdx < m_functionTable.size());
+        m_initializer = funcIdx;
+    }
+
 private:
     std::string m_moduleName;
     StringLiteralPool m_stringPool;
     IntegerLiteralPool m_integerPool;
     FloatLiteralPool m_floatPool;
+    friend class PeepholeOptimizer;
+
     std::vector<FunctionInfo> m_functionTable;
     std::optional<size_t> m_initializer;
     std::vector<VMInstruction> m_instructions;
 };
 
+// Values of every active call live in one contiguous stack. A call is a
+// frame record holding the offsets of its slots and arguments: the arguments
+// are the top values of the caller and are addressed in place.
 class CallStack {
 public:
-    VMObjectPtr Get(int index)
+    static constexpr size_t DefaultStackSize = 64 * 1024;
+    static constexpr size_t DefaultMaxFrames = 8 * 1024;
+
+    explicit CallStack(size_t stackSize = DefaultStackSize, size_t maxFrames = DefaultMaxFrames):
+        m_values(stackSize), m_frames(maxFrames), m_depth(0), m_sp(0),
+        m_base(m_values.data()), m_args(nullptr), m_argc(0) {}
+    CallStack(const CallStack&) = delete;
+    CallStack& operator=(const CallStack&) = delete;
+
+    // non-negative index refers to the slots of the active call,
+    // index -1 is the first argument
+    VMValue Get(int index) const
     {
-        if (index > 0) {
-            MASSERT(index < m_stackValues.size());
-            return m_stackValues.at(index);
-        } else {
-            size_t n = -index;
-            MASSERT(n < m_argsAndCaptured.size());
-            return m_argsAndCaptured.at(n);
+        if (index >= 0) {
+            MASSERT(m_base + index < m_values.data() + m_sp);
+            return m_base[index];
         }
+        MASSERT(static_cast<size_t>(-index - 1) < m_argc);
+        return m_args[-index - 1];
     }
 
-    std::vector<VMObjectPtr> GetTopN(size_t n) const {
-        MASSERT(m_stackValues.size() > n);
-        std::vector<VMObjectPtr> ans(m_stackValues.end() - n, m_stackValues.end());
-        return ans;
+    // the top n values of the active call
+    const VMValue* GetTopN(size_t n) const
+    {
+        MASSERT(StackSize() >= n);
+        return m_values.data() + m_sp - n;
     }
 
-    void Pop(size_t n) {
-        MASSERT(n < m_stackValues.size());
-        m_stackValues.erase(m_stackValues.end() - n, m_stackValues.end());
+    void Pop(size_t n)
+    {
+        MASSERT(n <= StackSize());
+        m_sp -= n;
     }
 
-    void Push(VMObjectPtr obj) {
-        m_stackValues.push_back(obj);
+    // return false if the stack is full
+    bool Push(VMValue obj)
+    {
+        if (m_sp == m_values.size()) {
+            return false;
+        }
+        m_values[m_sp++] = obj;
+        return true;
     }
 
-    void Dup(int idx) {
-        m_stackValues.push_back(Get(idx));
+    bool Dup(int idx) { return Push(Get(idx)); }
+
+    // overwrite a slot of the active call, arguments can't be stored to
+    void Set(int index, VMValue obj)
+    {
+        MASSERT(index >= 0 && m_base + index < m_values.data() + m_sp);
+        m_base[index] = obj;
     }
 
-    size_t StackSize() const { return m_stackValues.size(); }
+    size_t StackSize() const { return m_values.data() + m_sp - m_base; }
 
-    VMInstruction FetchInstruction()
+    // make a call of function active, its arguments are the top argc values
+    // of the caller. dropOnReturn values above them are popped by PopFrame().
+    // return false if the frame limit is reached
+    bool PushFrame(VMFunctionObject* function, size_t argc, size_t dropOnReturn = 0)
     {
-        return *m_function->GetInstruction(m_instructionPtr);
+        if (m_depth == m_frames.size()) {
+            return false;
+        }
+        MASSERT(m_sp >= argc + dropOnReturn);
+        auto& frame = m_frames[m_depth++];
+        frame.m_function = function;
+        frame.m_instructionPtr = 0;
+        frame.m_base = m_sp;
+        frame.m_argBase = m_sp - argc;
+        frame.m_argc = argc;
+        frame.m_returnSp = m_sp - dropOnReturn;
+        LoadFrame();
+        return true;
     }
 
-    void MoveNext() {
-        m_instructionPtr++;
-        MASSERT(m_instructionPtr < m_function->InstructionSize());
+    // replace the active call with a call of function, its arguments are the
+    // top argc values. they are moved where the active call returns to, so
+    // a chain of tail calls runs in constant space
+    void ReplaceFrame(VMFunctionObject* function, size_t argc)
+    {
+        MASSERT(m_depth > 0 && StackSize() >= argc);
+        auto& frame = m_frames[m_depth - 1];
+        std::copy(m_values.begin() + (m_sp - argc), m_values.begin() + m_sp, m_values.begin() + frame.m_returnSp);
+        m_sp = frame.m_returnSp + argc;
+        frame.m_function = function;
+        frame.m_instructionPtr = 0;
+        frame.m_base = m_sp;
+        frame.m_argBase = frame.m_returnSp;
+        frame.m_argc = argc;
+        LoadFrame();
     }
 
-    void Jmp(int offset) {
-        if (offset > 0) {
-            m_instructionPtr += offset;
-            MASSERT(m_instructionPtr < m_function->InstructionSize());
-        } else {
-            MASSERT(m_instructionPtr >= -offset);
-            m_instructionPtr -= (-offset);
+    // drop every value of the active call, the caller becomes active
+    void PopFrame()
+    {
+        MASSERT(m_depth > 0);
+        m_sp = m_frames[--m_depth].m_returnSp;
+        if (m_depth > 0) {
+            LoadFrame();
         }
     }
 
-    void MarkObjects(size_t gen) {
-        for (auto& v: m_stackValues) {
-            v->MarkGeneration(gen);
+    bool Empty() const { return m_depth == 0; }
+    size_t Depth() const { return m_depth; }
+
+    // the interpreter keeps the instruction pointer of the active call in a
+    // local, it is stored here only when another call becomes active
+    size_t GetInstructionPointer() const { return ActiveFrame().m_instructionPtr; }
+    void SetInstructionPointer(size_t ip)
+    {
+        MASSERT(ip < ActiveFrame().m_function->InstructionSize());
+        m_frames[m_depth - 1].m_instructionPtr = ip;
+    }
+
+    void MarkObjects(VMHeap& heap)
+    {
+        for (size_t i=0;i<m_sp;i++) {
+            heap.MarkValue(m_values[i]);
         }
-        for (auto& v: m_argsAndCaptured) {
-            v->MarkGeneration(gen);
+        for (size_t i=0;i<m_depth;i++) {
+            heap.MarkObject(m_frames[i].m_function);
         }
-        m_function->MarkGeneration(gen);
     }
 
-    VMModuleObject* GetModule()
+    // the arguments of the active call
+    const VMValue* GetArgs() const { return m_args; }
+    size_t ArgCount() const { return m_argc; }
+
+    VMModuleObject* GetModule() const { return ActiveFrame().m_function->GetModule(); }
+    VMFunctionObject* GetFunction() const { return ActiveFrame().m_function; }
+
+private:
+    struct Frame {
+        VMFunctionObject* m_function;
+        size_t m_instructionPtr;
+        size_t m_base;
+        size_t m_argBase;
+        size_t m_argc;
+        size_t m_returnSp;
+    };
+
+    const Frame& ActiveFrame() const
     {
-        return m_function->GetModule();
+        MASSERT(m_depth > 0);
+        return m_frames[m_depth - 1];
     }
 
-    CallStack(VMFunctionObject* function, const std::vector<VMObjectPtr>& args):
-        m_function(function), m_argsAndCaptured(function->GetCaptured())
+    void LoadFrame()
     {
-        m_argsAndCaptured.insert(m_argsAndCaptured.end(), args.begin(), args.end());
+        auto& frame = ActiveFrame();
+        m_base = m_values.data() + frame.m_base;
+        m_args = m_values.data() + frame.m_argBase;
+        m_argc = frame.m_argc;
     }
 
-private:
-    std::vector<VMObjectPtr> m_stackValues;
-    std::vector<VMObjectPtr> m_argsAndCaptured;
-    VMFunctionObject* m_function;
-    size_t m_instructionPtr;
+    std::vector<VMValue> m_values;
+    std::vector<Frame> m_frames;
+    size_t m_depth;
+    size_t m_sp;
+
+    // cached from the active frame
+    VMValue* m_base;
+    const VMValue* m_args;
+    size_t m_argc;
+};
+
+enum class VMRunStatus {
+    Yielded, Exited, Panicked
 };
 
 class VirtualMachine {
 public:
     VirtualMachine();
 
+    // run the initializer of module, then funcname, to completion
     void ExecuteModule(const ExecutionModule& module, const std::string& funcname);
+    // the same with a linked module, which may be shared with other VMs
+    void ExecuteModule(std::shared_ptr<const ModuleImage> image, const std::string& funcname);
+    // the same, in slices of Run(). a slice ends at the first call, return,
+    // backward jump or allocation after its budget is used up, the VM then
+    // yields and the next slice resumes where it stopped
+    void StartModule(const ExecutionModule& module, const std::string& funcname);
+    void StartModule(std::shared_ptr<const ModuleImage> image, const std::string& funcname);
+    VMRunStatus Run(size_t maxInstructions);
+    VMRunStatus Run(std::chrono::microseconds budget);
+    // LOAD_MODULE of a module that isn't loaded maps <dir>/<name>.m2vb
+    // from the first directory that has it
+    void AddModulePath(const std::string& dir) { m_modulePaths.push_back(dir); }
+    // define the global variable name as a native function, see native.h
+    // for bindings of typed C++ functions
+    void RegisterNative(const std::string& name, NativeFunction func);
+    // define the global variable name, e.g. a parameter of the script
+    void SetGlobal(const std::string& name, VMValue val);
+    // an object of the embedder for its natives, e.g. the scene a script
+    // draws into. the VM doesn't own it
+    void SetHost(void* host) { m_host = host; }
+    void* GetHost() const { return m_host; }
+
+    bool IsPanicked() const { return m_status == VMStatus::Panic; }
+    const std::string& GetPanicMessage() const { return m_panicMessage; }
+    const std::optional<int>& GetExitStatus() const { return m_exitStatus; }
+
+    const VMHeap& GetHeap() const { return m_heap; }
+#ifdef M2V_PROFILE
+    VMProfiler& GetProfiler() { return m_profiler; }
+    const VMProfiler& GetProfiler() const { return m_profiler; }
+#endif
+    void SetNurserySize(size_t bytes) { m_heap.SetNurserySize(bytes); }
+    // results of the functions marked pure, see memo.h. a budget of 0 turns
+    // the cache off, a frame replayed by a script may call Clear() when its
+    // inputs change
+    VMMemoCache& GetMemoCache() { return m_memo; }
+    const VMMemoCache& GetMemoCache() const { return m_memo; }
+    // do garbage collection work for at most budget, e.g. in the idle time of a frame
+    void CollectGarbage(std::chrono::microseconds budget);
+
+    // for native functions: stop the script with an error, and create
+    // results. objects are only collected at safepoints of the interpreter,
+    // so a native may allocate several objects without rooting them
+    void Panic(const std::string& message) { VMPanic(message); }
+    // call a function value, e.g. a callback passed to the native, and
+    // return its result, null if it panicked. the interpreter runs during
+    // the call and may collect objects, a native keeps the objects it
+    // holds across the call alive with PushRoot()
+    VMValue Call(VMValue func, const VMValue* args, size_t nargs);
+    void PushRoot(VMValue val) { m_nativeRoots.push_back(val); }
+    void PopRoot() { m_nativeRoots.pop_back(); }
+    VMValue CreateString(const std::string& val)
+    {
+        return VMValue(m_heap.Allocate<VMStringObject>(val));
+    }
+    VMValue CreateArray()
+    {
+        return VMValue(m_heap.Allocate<VMArrayObject>());
+    }
+    // a rope unless the result is short
+    VMValue ConcatStrings(VMStringObject* left, VMStringObject* right);
+    VMValue CreateObject()
+    {
+        return VMValue(m_heap.Allocate<VMMapObject>(&m_emptyShape));
+    }
+    VMValue CreateTypedArray(VMTypedArrayKind kind, size_t size)
+    {
+        return VMValue(m_heap.Allocate<VMTypedArrayObject>(kind, size));
+    }
+    VMValue CreateBox(const BoxValueType& box)
+    {
+        return VMValue(m_heap.Allocate<VMBoxObject>(box));
+    }
 
 protected:
     friend class VMModuleObject;
 
     template<typename ... Args>
-    VMObjectPtr CreateFunction(Args&& ... args)
+    VMFunctionObject* CreateFunction(Args&& ... args)
     {
-        const auto id = m_nextFreeId++;
-        auto pt = std::make_unique<VMFunctionObject>(id, std::forward<Args>(args)...);
-        VMObjectPtr ans(pt.get());
-        m_objects.insert({id, std::move(pt)});
-        return ans;
+        return m_heap.Allocate<VMFunctionObject>(std::forward<Args>(args)...);
     }
 
+    // strings of the interning table are shared by every module and never collected
+    VMValue InternString(const std::string& val);
+
 private:
     enum class VMStatus
     {
-        Uninit, Initialized, Running, GC, Exited, Panic
+        Uninit, Initialized, Suspended, Running, GC, Exited, Panic
     };
 
-    VMObjectPtr GetNull() const { return VMObjectPtr(m_nullVal.get()); }
-    VMObjectPtr GetTrue() const { return VMObjectPtr(m_trueVal.get()); }
-    VMObjectPtr GetFalse() const { return VMObjectPtr(m_falseVal.get()); }
+    VMValue GetNull() const { return VMValue(); }
+    VMValue GetTrue() const { return VMValue::Boolean(true); }
+    VMValue GetFalse() const { return VMValue::Boolean(false); }
 
-    void ExecuteInstruction(const VMInstruction& instruction);
-    VMObjectPtr ExecuteBinaryOperator(VMOpcode opcode, VMObjectPtr op1, VMObjectPtr op2);
+    VMValue ExecuteBinaryOperator(VMOpcode opcode, VMValue op1, VMValue op2);
+    VMValue PointOperation(VMOpcode opcode, const PointValueType& p1, const PointValueType& p2);
 
     void MainLoop();
+    VMRunStatus RunSlice(ptrdiff_t instructions, std::optional<std::chrono::steady_clock::time_point> deadline);
+    void CallEntryFunction();
+    // the instructions of the slice are used up, return false and give it
+    // more if its deadline hasn't passed
+    bool SliceEnds(ptrdiff_t& fuel);
+    // push a call of func with the top nargs values of the active call,
+    // return false on stack overflow. natives are called by the interpreter
+    // without a frame
+    bool CallFunction(VMFunctionObject* func, size_t nargs);
+    // replace the active call with a call of func, see CallFunction()
+    bool TailCallFunction(VMFunctionObject* func, size_t nargs);
+    void CollectAtSafePoint();
+    // ARRAY_GET/ARRAY_SET of the cases the interpreter doesn't handle
+    // inline, nothing or false after a panic
+    std::optional<VMValue> GetElement(VMValue array, VMValue idx);
+    bool SetElement(VMValue array, VMValue idx, VMValue val);
 
     void VMPanic(const std::string&);
     void VMExit(int status);
 
     CallStack* GetActiveCallstack()
     {
-        MASSERT(!m_callstacks.empty());
-        return m_callstacks.back().get();
+        MASSERT(!m_callstack.Empty());
+        return &m_callstack;
     }
 
-    VMModuleObject& GetActiveModule();
+    VMValue CreateInteger(IntegerValueType val) { return VMValue::Integer(val); }
+    VMValue CreateFloat(FloatValueType val) { return VMValue::Float(val); }
 
-    VMObjectPtr CreateInteger(IntegerValueType val)
-    {
-        const auto id = m_nextFreeId++;
-        auto pt = std::make_unique<VMIntegerObject>(id, val);
-        VMObjectPtr ans(pt.get());
-        m_objects.insert({id, std::move(pt)});
-        return ans;
-    }
+    VMModuleObject* CreateModule(const std::string& moduleName, std::shared_ptr<const ModuleImage> image);
 
-    VMObjectPtr CreateFloat(FloatValueType val)
-    {
-        const auto id = m_nextFreeId++;
-        auto pt = std::make_unique<VMFloatObject>(id, val);
-        VMObjectPtr ans(pt.get());
-        m_objects.insert({id, std::move(pt)});
-        return ans;
-    }
-
-    VMObjectPtr CreateString(const std::string& val)
-    {
-        const auto id = m_nextFreeId++;
-        auto pt = std::make_unique<VMStringObject>(id, val);
-        VMObjectPtr ans(pt.get());
-        m_objects.insert({id, std::move(pt)});
-        return ans;
-    }
-
-    VMObjectPtr CreateArray()
-    {
-        const auto id = m_nextFreeId++;
-        auto pt = std::make_unique<VMArrayObject>(id);
-        VMObjectPtr ans(pt.get());
-        m_objects.insert({id, std::move(pt)});
-        return ans;
-    }
-
-    VMObjectPtr CreateObject()
-    {
-        const auto id = m_nextFreeId++;
-        auto pt = std::make_unique<VMMapObject>(id);
-        VMObjectPtr ans(pt.get());
-        m_objects.insert({id, std::move(pt)});
-        return ans;
-    }
-
-    VMObjectPtr CreateModule(const std::string& moduleName, const ExecutionModule& module)
-    {
-        const auto id = m_nextFreeId++;
-        auto pt = std::make_unique<VMModuleObject>(id, module, *this);
-        VMObjectPtr ans(pt.get());
-        m_modules.insert({moduleName, pt.get()});
-        m_objects.insert({id, std::move(pt)});
-        return ans;
-    }
-
-    VMFunctionObject* LoadModule(const ExecutionModule& module);
     VMFunctionObject* LoadModuleFromFile(const std::string& moduleName);
 
+    void MarkRoots();
+    void RunMinorCollection();
     void RunGarbageColletion();
-
-    VMObjectId m_nextFreeId;
+    void StartIncrementalCollection();
+    void IncrementalMarkStep(size_t maxObjects);
+    void FinishIncrementalCollection();
+
+    // gray objects visited by a marking slice of MainLoop
+    static constexpr size_t IncrementalMarkWork = 1024;
+    // safe points (calls, returns and backward jumps) between two
+    // marking slices without allocation
+    static constexpr size_t IncrementalMarkInterval = 4096;
+    // instructions between two checks of the deadline of a slice
+    static constexpr ptrdiff_t SliceCheckInterval = 4096;
+
+#ifdef M2V_PROFILE
+    // before the heap, which reports to it
+    VMProfiler m_profiler;
+#endif
+    // root of the shapes of map objects, outlives the heap
+    VMShape m_emptyShape;
+    VMHeap m_heap;
+    VMMemoCache m_memo;
     VMStatus m_status;
-    size_t m_gcGeneration;
-    std::unordered_map<VMObjectId, std::unique_ptr<VMObject>> m_objects;
-    std::unordered_map<std::string, VMObjectPtr> m_globalObjects;
-    std::unique_ptr<VMNullObject> m_nullVal;
-    std::unique_ptr<VMBooleanObject> m_trueVal, m_falseVal;
-    std::vector<std::unique_ptr<CallStack>> m_callstacks;
+    VMVariableTable m_globals;
+    CallStack m_callstack;
     std::unordered_map<std::string,VMModuleObject*> m_modules;
+    std::unordered_map<std::string,VMStringObject*> m_strings;
+    std::vector<std::string> m_modulePaths;
+    void* m_host;
+
+    size_t m_safePointsSinceMarkStep;
+    VMModuleObject* m_entryModule;
+    std::string m_entryFunction;
+    bool m_initializing;
+    ptrdiff_t m_sliceInstructions;
+    std::optional<std::chrono::steady_clock::time_point> m_sliceDeadline;
+    // a return to this depth of the call stack ends the interpreter loop,
+    // it is above 0 while a native calls a function
+    size_t m_returnDepth;
+    VMValue m_callResult;
+    std::vector<VMValue> m_nativeRoots;
 
     std::optional<int> m_exitStatus;
+    std::string m_panicMessage;
 };
 
 }
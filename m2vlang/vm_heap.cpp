@@ -0,0 +1,339 @@
+#include "vm_heap.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+using namespace M2V;
+
+
+VMHeap::VMHeap():
+    m_largePages(nullptr), m_unsweptLargePages(nullptr),
+    m_allocatedBytes(0), m_pageCount(0),
+    m_youngBytes(0), m_nurserySize(DefaultNurserySize), m_markedBytes(0), m_liveBytes(0),
+    m_majorThreshold(MinMajorThreshold), m_minorMarking(false),
+    m_majorMarking(false), m_markingDebt(0),
+    m_minorCount(0), m_majorCount(0)
+{
+    for (size_t i=0;i<NumSizeClass;i++) {
+        m_freeList[i] = nullptr;
+        m_bumpPage[i] = nullptr;
+        m_pages[i] = nullptr;
+        m_unsweptPages[i] = nullptr;
+    }
+}
+
+VMHeap::~VMHeap()
+{
+    for (size_t i=0;i<NumSizeClass;i++) {
+        for (auto list: { m_pages[i], m_unsweptPages[i] }) {
+            while (list) {
+                auto next = list->m_next;
+                DestroyPage(list);
+                list = next;
+            }
+        }
+    }
+    for (auto list: { m_largePages, m_unsweptLargePages }) {
+        while (list) {
+            auto next = list->m_next;
+            DestroyPage(list);
+            list = next;
+        }
+    }
+}
+
+VMHeap::Page* VMHeap::NewPage(size_t cellShift, size_t size)
+{
+    const auto bytes = (HeaderSize() + size + PageSize - 1) & ~(PageSize - 1);
+    void* mem = std::aligned_alloc(PageSize, bytes);
+    if (mem == nullptr) {
+        std::abort();
+    }
+    auto page = static_cast<Page*>(mem);
+    std::memset(page, 0, HeaderSize());
+    page->m_heap = this;
+    page->m_cellShift = cellShift;
+    page->m_cellCount = size ? 1 : (PageSize - HeaderSize()) >> cellShift;
+    page->m_largeSize = size;
+    m_pageCount++;
+    return page;
+}
+
+void VMHeap::ReleasePage(Page* page)
+{
+    MASSERT(m_pageCount > 0);
+    if (page->m_inYoungList) {
+        auto it = std::find(m_youngPages.begin(), m_youngPages.end(), page);
+        MASSERT(it != m_youngPages.end());
+        *it = m_youngPages.back();
+        m_youngPages.pop_back();
+    }
+    m_pageCount--;
+    std::free(page);
+}
+
+void VMHeap::DestroyPage(Page* page)
+{
+    for (size_t i=0;i<page->m_bumpIndex;i++) {
+        if (Page::TestBit(page->m_allocBits, i)) {
+            static_cast<VMObject*>(page->Cell(i))->~VMObject();
+        }
+    }
+    m_pageCount--;
+    std::free(page);
+}
+
+void VMHeap::FreeCellAt(Page* page, size_t idx)
+{
+    MASSERT(Page::TestBit(page->m_allocBits, idx));
+    static_cast<VMObject*>(page->Cell(idx))->~VMObject();
+    Page::ClearBit(page->m_allocBits, idx);
+    Page::ClearBit(page->m_markBits, idx);
+    Page::ClearBit(page->m_oldBits, idx);
+    Page::ClearBit(page->m_rememberedBits, idx);
+    const auto size = page->CellSize();
+    MASSERT(m_allocatedBytes >= size);
+    m_allocatedBytes -= size;
+}
+
+void* VMHeap::AllocateCellSlow(size_t sizeClass)
+{
+    while (m_unsweptPages[sizeClass]) {
+        auto page = m_unsweptPages[sizeClass];
+        m_unsweptPages[sizeClass] = page->m_next;
+        SweepPage(page, &m_pages[sizeClass], page == m_bumpPage[sizeClass]);
+        if (m_freeList[sizeClass]) {
+            return AllocateCell(sizeClass);
+        }
+    }
+
+    auto page = NewPage(sizeClass + MinCellShift, 0);
+    page->m_next = m_pages[sizeClass];
+    m_pages[sizeClass] = page;
+    m_bumpPage[sizeClass] = page;
+    return AllocateCell(sizeClass);
+}
+
+void* VMHeap::AllocateLarge(size_t size)
+{
+    auto page = NewPage(0, size);
+    page->m_next = m_largePages;
+    m_largePages = page;
+    page->m_bumpIndex = 1;
+    NewYoungCell(page, 0);
+    return page->Cell(0);
+}
+
+void VMHeap::SweepPage(Page* page, Page** sweptList, bool keepIfEmpty)
+{
+    bool hasLive = page->m_sweepLimit < page->m_bumpIndex;
+    for (size_t i=0;i<page->m_sweepLimit;i++) {
+        if (Page::TestBit(page->m_allocBits, i) && Page::TestBit(page->m_markBits, i)) {
+            hasLive = true;
+            break;
+        }
+    }
+
+    for (size_t i=0;i<page->m_sweepLimit;i++) {
+        if (Page::TestBit(page->m_markBits, i)) {
+            Page::ClearBit(page->m_markBits, i);
+            continue;
+        }
+        if (Page::TestBit(page->m_allocBits, i)) {
+            FreeCellAt(page, i);
+        }
+        if ((hasLive || keepIfEmpty) && !page->m_largeSize) {
+            auto cell = static_cast<FreeCell*>(page->Cell(i));
+            const auto sizeClass = page->m_cellShift - MinCellShift;
+            cell->m_next = m_freeList[sizeClass];
+            m_freeList[sizeClass] = cell;
+        }
+    }
+    page->m_sweepLimit = 0;
+
+    if (hasLive || keepIfEmpty) {
+        page->m_next = *sweptList;
+        *sweptList = page;
+    } else {
+        ReleasePage(page);
+    }
+}
+
+void VMHeap::StartSweep()
+{
+    MASSERT(!IsSweeping());
+    for (size_t i=0;i<NumSizeClass;i++) {
+        m_freeList[i] = nullptr;
+        for (auto page = m_pages[i]; page; page = page->m_next) {
+            page->m_sweepLimit = page->m_bumpIndex;
+        }
+        m_unsweptPages[i] = m_pages[i];
+        m_pages[i] = nullptr;
+    }
+    for (auto page = m_largePages; page; page = page->m_next) {
+        page->m_sweepLimit = page->m_bumpIndex;
+    }
+    m_unsweptLargePages = m_largePages;
+    m_largePages = nullptr;
+}
+
+void VMHeap::FinishSweep()
+{
+    for (size_t i=0;i<NumSizeClass;i++) {
+        while (m_unsweptPages[i]) {
+            auto page = m_unsweptPages[i];
+            m_unsweptPages[i] = page->m_next;
+            SweepPage(page, &m_pages[i], page == m_bumpPage[i]);
+        }
+    }
+    while (m_unsweptLargePages) {
+        auto page = m_unsweptLargePages;
+        m_unsweptLargePages = page->m_next;
+        SweepPage(page, &m_largePages, false);
+    }
+}
+
+bool VMHeap::SweepStep()
+{
+    for (size_t i=0;i<NumSizeClass;i++) {
+        if (auto page = m_unsweptPages[i]) {
+            m_unsweptPages[i] = page->m_next;
+            SweepPage(page, &m_pages[i], page == m_bumpPage[i]);
+            return true;
+        }
+    }
+    if (auto page = m_unsweptLargePages) {
+        m_unsweptLargePages = page->m_next;
+        SweepPage(page, &m_largePages, false);
+        return true;
+    }
+    return false;
+}
+
+bool VMHeap::IsSweeping() const
+{
+    for (size_t i=0;i<NumSizeClass;i++) {
+        if (m_unsweptPages[i]) {
+            return true;
+        }
+    }
+    return m_unsweptLargePages != nullptr;
+}
+
+void VMHeap::DrainGrayStack()
+{
+    while (!m_grayStack.empty()) {
+        auto obj = m_grayStack.back();
+        m_grayStack.pop_back();
+        obj->MarkChildren(*this);
+    }
+}
+
+bool VMHeap::MarkStep(size_t maxObjects)
+{
+    MASSERT(m_majorMarking);
+    for (size_t i=0;i<maxObjects && !m_grayStack.empty();i++) {
+        auto obj = m_grayStack.back();
+        m_grayStack.pop_back();
+        obj->MarkChildren(*this);
+    }
+    m_markingDebt = 0;
+    return m_grayStack.empty();
+}
+
+void VMHeap::BeginMinorCollection()
+{
+    MASSERT(!m_majorMarking);
+    FinishSweep();
+    m_minorMarking = true;
+    m_markedBytes = 0;
+    for (auto obj: m_rememberedSet) {
+        obj->MarkChildren(*this);
+    }
+}
+
+void VMHeap::FinishMinorCollection()
+{
+    MASSERT(m_minorMarking);
+    DrainGrayStack();
+    for (auto page: m_youngPages) {
+        page->m_inYoungList = false;
+        if (page->m_largeSize) {
+            continue;
+        }
+        const auto sizeClass = page->m_cellShift - MinCellShift;
+        for (size_t i=0;i<page->m_bumpIndex;i++) {
+            if (!Page::TestBit(page->m_allocBits, i) || Page::TestBit(page->m_oldBits, i)) {
+                continue;
+            }
+            if (Page::TestBit(page->m_markBits, i)) {
+                Page::ClearBit(page->m_markBits, i);
+                Page::SetBit(page->m_oldBits, i);
+            } else {
+                FreeCellAt(page, i);
+                auto cell = static_cast<FreeCell*>(page->Cell(i));
+                cell->m_next = m_freeList[sizeClass];
+                m_freeList[sizeClass] = cell;
+            }
+        }
+    }
+    m_youngPages.clear();
+
+    // large pages are unlinked right away, they are never reused
+    for (Page** link = &m_largePages; *link;) {
+        auto page = *link;
+        if (Page::TestBit(page->m_oldBits, 0)) {
+            link = &page->m_next;
+        } else if (Page::TestBit(page->m_markBits, 0)) {
+            Page::ClearBit(page->m_markBits, 0);
+            Page::SetBit(page->m_oldBits, 0);
+            link = &page->m_next;
+        } else {
+            *link = page->m_next;
+            FreeCellAt(page, 0);
+            ReleasePage(page);
+        }
+    }
+
+    for (auto obj: m_rememberedSet) {
+        auto page = PageOf(obj);
+        Page::ClearBit(page->m_rememberedBits, page->IndexOf(obj));
+    }
+    m_rememberedSet.clear();
+    m_youngBytes = 0;
+    m_minorMarking = false;
+    m_minorCount++;
+}
+
+void VMHeap::BeginMajorCollection()
+{
+    MASSERT(!m_majorMarking);
+    FinishSweep();
+    m_minorMarking = false;
+    m_majorMarking = true;
+    m_markedBytes = 0;
+    m_markingDebt = 0;
+}
+
+void VMHeap::FinishMajorCollection()
+{
+    MASSERT(m_majorMarking);
+    DrainGrayStack();
+    m_majorMarking = false;
+
+    // every reachable object is old now, so no old to young reference is left
+    for (auto obj: m_rememberedSet) {
+        auto page = PageOf(obj);
+        Page::ClearBit(page->m_rememberedBits, page->IndexOf(obj));
+    }
+    m_rememberedSet.clear();
+    for (auto page: m_youngPages) {
+        page->m_inYoungList = false;
+    }
+    m_youngPages.clear();
+    m_youngBytes = 0;
+
+    m_liveBytes = m_markedBytes;
+    m_majorThreshold = std::max(MinMajorThreshold, m_markedBytes * 2);
+    StartSweep();
+    m_majorCount++;
+}
@@ -0,0 +1,292 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "vm_object.h"
+#include "profiler.h"
+
+
+namespace M2V {
+
+// Object heap of the VM. Cells are bump allocated from pages segregated by
+// power-of-two size classes, every page keeps the allocation and mark bits
+// of its cells. Sweeping is lazy: after marking, pages are swept one by one
+// when their size class runs out of free cells.
+//
+// The heap is generational without moving objects: every cell carries an
+// old bit. Freshly allocated cells form the nursery, a minor collection
+// marks only young objects reachable from the roots and from the remembered
+// set, then promotes the survivors in place by setting their old bit.
+// Storing a young object into an old one must go through WriteBarrier().
+//
+// Marking is tri-color with an explicit gray stack: a marked object is gray
+// while it stays on the stack and black once its children have been shaded.
+// A major collection may be marked incrementally with MarkStep(), during which
+// WriteBarrier() shades the stored value (Dijkstra) and new objects are
+// allocated gray.
+class VMHeap {
+public:
+    static constexpr size_t PageSize = 64 * 1024;
+    static constexpr size_t MinCellShift = 4;
+    static constexpr size_t MaxCellShift = 10;
+    static constexpr size_t NumSizeClass = MaxCellShift - MinCellShift + 1;
+
+    static constexpr size_t DefaultNurserySize = 1024 * 1024;
+    static constexpr size_t MinMajorThreshold = 8 * 1024 * 1024;
+    static constexpr size_t MarkStepBytes = 64 * 1024;
+
+    VMHeap();
+    VMHeap(const VMHeap&) = delete;
+    VMHeap& operator=(const VMHeap&) = delete;
+    ~VMHeap();
+
+    template<typename T, typename ... Args>
+    T* Allocate(Args&& ... args)
+    {
+        static_assert(std::is_base_of<VMObject, T>::value, "only VMObject lives in VMHeap");
+        constexpr size_t sizeClass = SizeClassOf(sizeof(T));
+        void* cell = sizeClass < NumSizeClass ? AllocateCell(sizeClass) : AllocateLarge(sizeof(T));
+        auto ans = new (cell) T(std::forward<Args>(args)...);
+#ifdef M2V_PROFILE
+        if (m_profiler) {
+            m_profiler->CountAllocation(ans->type(), sizeof(T));
+        }
+#endif
+        return ans;
+    }
+
+#ifdef M2V_PROFILE
+    void SetProfiler(VMProfiler* profiler) { m_profiler = profiler; }
+#endif
+
+    // return true if the object wasn't marked before, old objects
+    // are neither marked nor traced by a minor collection
+    bool Mark(VMObject* obj)
+    {
+        auto page = PageOf(obj);
+        const auto idx = page->IndexOf(obj);
+        MASSERT(page->TestBit(page->m_allocBits, idx));
+        if (page->TestBit(page->m_markBits, idx)) {
+            return false;
+        }
+        if (m_minorMarking) {
+            if (page->TestBit(page->m_oldBits, idx)) {
+                return false;
+            }
+        } else {
+            page->SetBit(page->m_oldBits, idx);
+        }
+        page->SetBit(page->m_markBits, idx);
+        m_markedBytes += page->CellSize();
+        return true;
+    }
+    // shade the object gray, its children are visited by Drain/MarkStep
+    void MarkObject(VMObject* obj)
+    {
+        if (Mark(obj)) {
+            m_grayStack.push_back(obj);
+        }
+    }
+    void MarkValue(VMValue val)
+    {
+        if (val.IsObject()) {
+            MarkObject(val.GetObject());
+        }
+    }
+    bool IsMarked(const VMObject* obj) const
+    {
+        auto page = PageOf(obj);
+        return page->TestBit(page->m_markBits, page->IndexOf(obj));
+    }
+    bool IsOld(const VMObject* obj) const
+    {
+        auto page = PageOf(obj);
+        return page->TestBit(page->m_oldBits, page->IndexOf(obj));
+    }
+
+    // must be called after val has been stored into holder
+    static void WriteBarrier(VMObject* holder, VMValue val)
+    {
+        if (!val.IsObject()) {
+            return;
+        }
+        auto page = PageOf(holder);
+        if (page->m_heap->m_majorMarking) {
+            page->m_heap->MarkObject(val.GetObject());
+            return;
+        }
+        const auto idx = page->IndexOf(holder);
+        if (page->TestBit(page->m_oldBits, idx) &&
+            !page->TestBit(page->m_rememberedBits, idx) &&
+            !page->m_heap->IsOld(val.GetObject()))
+        {
+            page->SetBit(page->m_rememberedBits, idx);
+            page->m_heap->m_rememberedSet.push_back(holder);
+        }
+    }
+
+    // a collection is: Begin*Collection(), mark the roots, Finish*Collection().
+    // a major collection may call MarkStep() in between, the roots have to be
+    // marked again right before FinishMajorCollection()
+    void BeginMinorCollection();
+    void FinishMinorCollection();
+    void BeginMajorCollection();
+    // visit at most maxObjects gray objects, return true if none is left
+    bool MarkStep(size_t maxObjects);
+    void FinishMajorCollection();
+    bool IsMarking() const { return m_majorMarking; }
+    // sweep a single page, return false if nothing is left to sweep
+    bool SweepStep();
+
+    bool NeedsMinorCollection() const { return m_youngBytes >= m_nurserySize; }
+    bool NeedsMajorCollection() const { return m_allocatedBytes >= m_majorThreshold; }
+    bool NeedsMarkStep() const { return m_markingDebt >= MarkStepBytes; }
+    // the heap has grown by a nursery since the last major collection
+    bool WorthCollecting() const { return m_allocatedBytes >= m_liveBytes + m_nurserySize; }
+    void SetNurserySize(size_t bytes) { m_nurserySize = bytes; }
+
+    // every page allocated before this call will be swept lazily,
+    // marking must not start again before FinishSweep()
+    void StartSweep();
+    void FinishSweep();
+    bool IsSweeping() const;
+
+    size_t GetAllocatedBytes() const { return m_allocatedBytes; }
+    size_t GetYoungBytes() const { return m_youngBytes; }
+    size_t GetPageCount() const { return m_pageCount; }
+    size_t GetMinorCollectionCount() const { return m_minorCount; }
+    size_t GetMajorCollectionCount() const { return m_majorCount; }
+
+private:
+    struct FreeCell {
+        FreeCell* m_next;
+    };
+
+    struct Page {
+        static constexpr size_t MaxCells = PageSize >> MinCellShift;
+        static constexpr size_t BitmapWords = MaxCells / 64;
+
+        Page*    m_next;
+        VMHeap*  m_heap;
+        uint32_t m_cellShift;
+        uint32_t m_cellCount;
+        uint32_t m_bumpIndex;
+        // cells at or above this index were allocated after the sweep started
+        uint32_t m_sweepLimit;
+        size_t   m_largeSize;
+        bool     m_inYoungList;
+        uint64_t m_allocBits[BitmapWords];
+        uint64_t m_markBits[BitmapWords];
+        uint64_t m_oldBits[BitmapWords];
+        uint64_t m_rememberedBits[BitmapWords];
+
+        char* Cells() { return reinterpret_cast<char*>(this) + HeaderSize(); }
+        const char* Cells() const { return reinterpret_cast<const char*>(this) + HeaderSize(); }
+        void* Cell(size_t idx) { return Cells() + (idx << m_cellShift); }
+        size_t IndexOf(const void* ptr) const
+        {
+            return static_cast<size_t>(static_cast<const char*>(ptr) - Cells()) >> m_cellShift;
+        }
+        size_t CellSize() const { return m_largeSize ? m_largeSize : size_t(1) << m_cellShift; }
+
+        static bool TestBit(const uint64_t* bits, size_t idx) { return (bits[idx / 64] >> (idx % 64)) & 1; }
+        static void SetBit(uint64_t* bits, size_t idx) { bits[idx / 64] |= uint64_t(1) << (idx % 64); }
+        static void ClearBit(uint64_t* bits, size_t idx) { bits[idx / 64] &= ~(uint64_t(1) << (idx % 64)); }
+    };
+
+    static constexpr size_t HeaderSize() { return (sizeof(Page) + 63) & ~size_t(63); }
+
+    static constexpr size_t SizeClassOf(size_t size)
+    {
+        size_t sizeClass = 0;
+        while (sizeClass < NumSizeClass && (size_t(1) << (sizeClass + MinCellShift)) < size) {
+            sizeClass++;
+        }
+        return sizeClass;
+    }
+
+    static Page* PageOf(const void* ptr)
+    {
+        return reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(ptr) & ~uintptr_t(PageSize - 1));
+    }
+
+    void* AllocateCell(size_t sizeClass)
+    {
+        if (auto cell = m_freeList[sizeClass]) {
+            m_freeList[sizeClass] = cell->m_next;
+            auto page = PageOf(cell);
+            NewYoungCell(page, page->IndexOf(cell));
+            return cell;
+        }
+        auto page = m_bumpPage[sizeClass];
+        if (page && page->m_bumpIndex < page->m_cellCount) {
+            const auto idx = page->m_bumpIndex++;
+            NewYoungCell(page, idx);
+            return page->Cell(idx);
+        }
+        return AllocateCellSlow(sizeClass);
+    }
+
+    void NewYoungCell(Page* page, size_t idx)
+    {
+        Page::SetBit(page->m_allocBits, idx);
+        const auto size = page->CellSize();
+        m_allocatedBytes += size;
+        if (m_majorMarking) {
+            Page::SetBit(page->m_markBits, idx);
+            Page::SetBit(page->m_oldBits, idx);
+            m_markedBytes += size;
+            m_markingDebt += size;
+            m_grayStack.push_back(static_cast<VMObject*>(page->Cell(idx)));
+            return;
+        }
+        m_youngBytes += size;
+        if (!page->m_inYoungList) {
+            page->m_inYoungList = true;
+            m_youngPages.push_back(page);
+        }
+    }
+
+    void* AllocateCellSlow(size_t sizeClass);
+    void* AllocateLarge(size_t size);
+
+    Page* NewPage(size_t cellShift, size_t size);
+    void  ReleasePage(Page* page);
+    void  FreeCellAt(Page* page, size_t idx);
+    // link the page back to sweptList, or release it if nothing survived
+    void  SweepPage(Page* page, Page** sweptList, bool keepIfEmpty);
+    void  DestroyPage(Page* page);
+    void  DrainGrayStack();
+
+    FreeCell* m_freeList[NumSizeClass];
+    Page*     m_bumpPage[NumSizeClass];
+    Page*     m_pages[NumSizeClass];
+    Page*     m_unsweptPages[NumSizeClass];
+    Page*     m_largePages;
+    Page*     m_unsweptLargePages;
+    size_t    m_allocatedBytes;
+    size_t    m_pageCount;
+
+    std::vector<Page*>     m_youngPages;
+#ifdef M2V_PROFILE
+    VMProfiler* m_profiler = nullptr;
+#endif
+    std::vector<VMObject*> m_rememberedSet;
+    std::vector<VMObject*> m_grayStack;
+    size_t m_youngBytes;
+    size_t m_nurserySize;
+    size_t m_markedBytes;
+    // marked bytes of the last major collection
+    size_t m_liveBytes;
+    size_t m_majorThreshold;
+    bool   m_minorMarking;
+    bool   m_majorMarking;
+    size_t m_markingDebt;
+    size_t m_minorCount;
+    size_t m_majorCount;
+};
+
+}
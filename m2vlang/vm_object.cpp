@@ -1,51 +1,357 @@
 #include "vm_object.h"
 #include "vm.h"
+#include "vm_heap.h"
+#include "module_image.h"
 
 using namespace M2V;
 
 
-void VMFunctionObject::MarkGeneration(size_t gen)
+const VMInstruction* VMFunctionObject::GetInstruction(size_t instructionPointer) const
 {
-    for (auto& v: m_capturedVariable) {
-        v->MarkGeneration(gen);
+    MASSERT(instructionPointer < m_instructionSize);
+    return m_code + instructionPointer;
+}
+
+VMInstruction* VMFunctionObject::GetInstruction(size_t instructionPointer)
+{
+    MASSERT(instructionPointer < m_instructionSize);
+    return m_code + instructionPointer;
+}
+
+void VMStringObject::Flatten() const
+{
+    // leaves from left to right, without recursion as appending to a
+    // string builds a rope as deep as the number of appends
+    m_val.reserve(m_size);
+    std::vector<const VMStringObject*> pending = { m_right, m_left };
+    while (!pending.empty()) {
+        const auto str = pending.back();
+        pending.pop_back();
+        if (str->m_left != nullptr) {
+            pending.push_back(str->m_right);
+            pending.push_back(str->m_left);
+        } else {
+            m_val += str->m_val;
+        }
+    }
+    m_left = nullptr;
+    m_right = nullptr;
+}
+
+void VMStringObject::MarkChildren(VMHeap& heap)
+{
+    if (m_left != nullptr) {
+        heap.MarkObject(m_left);
+        heap.MarkObject(m_right);
+    }
+}
+
+void VMArrayObject::push(VMValue obj)
+{
+    m_objects.push_back(obj);
+    VMHeap::WriteBarrier(this, obj);
+}
+
+void VMArrayObject::insert(size_t idx, VMValue obj)
+{
+    m_objects.insert(m_objects.begin() + idx, obj);
+    VMHeap::WriteBarrier(this, obj);
+}
+
+void VMArrayObject::set(size_t idx, VMValue obj)
+{
+    MASSERT(idx < m_objects.size());
+    m_objects[idx] = obj;
+    VMHeap::WriteBarrier(this, obj);
+}
+
+void VMArrayObject::MarkChildren(VMHeap& heap)
+{
+    for (auto& o: m_objects) {
+        heap.MarkValue(o);
+    }
+}
+
+VMShape::VMShape(VMShape* root, std::vector<std::string> keys):
+    m_root(root), m_shared(false), m_keys(std::move(keys))
+{
+    for (size_t i=0;i<m_keys.size();i++) {
+        m_index.insert({m_keys[i], i});
+    }
+}
+
+VMShape::VMShape(VMShape* parent, const std::string& key):
+    m_root(parent->m_root), m_shared(true), m_keys(parent->m_keys), m_index(parent->m_index)
+{
+    m_index.insert({key, m_keys.size()});
+    m_keys.push_back(key);
+}
+
+VMShape* VMShape::Transition(const std::string& key)
+{
+    MASSERT(m_shared && !m_index.count(key));
+    auto& next = m_transitions[key];
+    if (!next) {
+        next.reset(new VMShape(this, key));
+    }
+    return next.get();
+}
+
+void VMShape::Append(const std::string& key)
+{
+    MASSERT(!m_shared && !m_index.count(key));
+    m_index.insert({key, m_keys.size()});
+    m_keys.push_back(key);
+}
+
+void VMShape::Remove(const std::string& key)
+{
+    MASSERT(!m_shared);
+    auto it = m_index.find(key);
+    MASSERT(it != m_index.end());
+    const auto slot = it->second;
+    m_index.erase(it);
+    m_keys.erase(m_keys.begin() + slot);
+    for (size_t i=slot;i<m_keys.size();i++) {
+        m_index[m_keys[i]] = i;
     }
-    m_module->MarkGeneration(gen);
 }
 
-VMModuleObject::VMModuleObject(VMObjectId id, const ExecutionModule& module, VirtualMachine& vm):
-    VMObject(VMObjectType::Module, id), m_module(std::make_unique<ExecutionModule>(module))
+void VMMapObject::clear()
+{
+    m_shape = m_shape->GetRoot();
+    m_ownShape.reset();
+    m_slots.clear();
+}
+
+void VMMapObject::insert(const std::string& key, VMValue obj)
 {
-    for (auto& func: m_module->GetFunctionTable()) {
-        auto kfunc = vm.CreateFunction(this, func.m_begin, func.m_size, 
-                                       std::vector<VMObjectPtr>(), func.m_varadic);
-        m_functions.push_back(static_cast<VMFunctionObject*>(&*kfunc));
+    if (const auto slot = m_shape->Find(key)) {
+        SetSlot(slot.value(), obj);
+        return;
+    }
+    if (m_shape->IsShared() && m_shape->size() < VMShape::MaxSharedKeys) {
+        AddSlot(m_shape->Transition(key), obj);
+        return;
     }
+    ToDictionary();
+    m_ownShape->Append(key);
+    m_slots.push_back(obj);
+    VMHeap::WriteBarrier(this, obj);
 }
 
-const VMInstruction& VMModuleObject::GetInstruction(size_t instructioinPointer) const
+void VMMapObject::insertComputed(const std::string& key, VMValue obj)
 {
-    return m_module->GetInstruction(instructioinPointer);
+    if (const auto slot = m_shape->Find(key)) {
+        SetSlot(slot.value(), obj);
+        return;
+    }
+    ToDictionary();
+    m_ownShape->Append(key);
+    m_slots.push_back(obj);
+    VMHeap::WriteBarrier(this, obj);
 }
 
-const std::string& VMModuleObject::GetNthString(size_t idx) const
+void VMMapObject::erase(const std::string& key)
 {
-    return m_module->GetNthString(idx);
+    const auto slot = m_shape->Find(key);
+    if (!slot.has_value()) {
+        return;
+    }
+    ToDictionary();
+    m_ownShape->Remove(key);
+    m_slots.erase(m_slots.begin() + slot.value());
+}
+
+void VMMapObject::SetSlot(size_t slot, VMValue obj)
+{
+    MASSERT(slot < m_slots.size());
+    m_slots[slot] = obj;
+    VMHeap::WriteBarrier(this, obj);
+}
+
+void VMMapObject::AddSlot(VMShape* next, VMValue obj)
+{
+    MASSERT(next->size() == m_slots.size() + 1);
+    m_shape = next;
+    m_slots.push_back(obj);
+    VMHeap::WriteBarrier(this, obj);
+}
+
+void VMMapObject::ToDictionary()
+{
+    if (m_shape->IsShared()) {
+        m_ownShape = std::make_unique<VMShape>(m_shape->GetRoot(), m_shape->GetKeys());
+        m_shape = m_ownShape.get();
+    }
+}
+
+void VMMapObject::MarkChildren(VMHeap& heap)
+{
+    for (auto& o: m_slots) {
+        heap.MarkValue(o);
+    }
+}
+
+void VMCellObject::Set(VMValue val)
+{
+    m_value = val;
+    VMHeap::WriteBarrier(this, val);
+}
+
+void VMCellObject::MarkChildren(VMHeap& heap)
+{
+    heap.MarkValue(m_value);
+}
+
+void VMFunctionObject::MarkChildren(VMHeap& heap)
+{
+    for (auto cell: m_upvalues) {
+        heap.MarkObject(cell);
+    }
+    if (m_module) {
+        heap.MarkObject(m_module);
+    }
+}
+
+VMModuleObject::VMModuleObject(std::shared_ptr<const ModuleImage> image, VirtualMachine& vm):
+    VMObject(VMObjectType::Module), m_image(std::move(image)),
+    m_code(m_image->FunctionCount()),
+    m_vm(vm), m_name(m_image->GetModuleName()),
+    m_variableCaches(m_image->CacheCount()), m_propertyCaches(m_image->PropertyCacheCount()), m_stringLiterals(m_image->StringCount()),
+    m_functions(m_image->FunctionCount(), nullptr)
+{
+    // slot i of the table is variable i of the image
+    for (size_t i=0;i<m_image->VariableCount();i++) {
+        m_variables.Declare(std::string(m_image->GetVariableName(i)), nullptr);
+    }
+}
+
+VMModuleObject::~VMModuleObject() = default;
+
+std::string_view VMModuleObject::GetNthString(size_t idx) const
+{
+    return m_image->GetString(idx);
 }
 IntegerValueType VMModuleObject::GetNthInteger(size_t idx) const
 {
-    return m_module->GetNthInt(idx);
+    return m_image->GetIntegerData()[idx];
 }
 FloatValueType VMModuleObject::GetNthFloat(size_t idx) const
 {
-    return m_module->GetNthFloat(idx);
+    return m_image->GetFloatData()[idx];
+}
+const IntegerValueType* VMModuleObject::GetIntegerData() const
+{
+    return m_image->GetIntegerData();
+}
+const FloatValueType* VMModuleObject::GetFloatData() const
+{
+    return m_image->GetFloatData();
+}
+
+VMFunctionObject* VMModuleObject::CreateNthFunction(size_t idx)
+{
+    const auto& info = m_image->GetFunction(idx);
+    auto func = m_vm.CreateFunction(this, info.m_begin, GetNthCode(idx), info.m_size, std::vector<VMCellObject*>(), info.m_varargs != 0);
+    m_functions[idx] = func;
+    VMHeap::WriteBarrier(this, VMValue(func));
+    return func;
+}
+
+VMFunctionObject* VMModuleObject::CreateClosure(size_t idx, std::vector<VMCellObject*> upvalues)
+{
+    const auto& info = m_image->GetFunction(idx);
+    return m_vm.CreateFunction(this, info.m_begin, GetNthCode(idx), info.m_size, std::move(upvalues), info.m_varargs != 0);
+}
+
+VMInstruction* VMModuleObject::GetNthCode(size_t idx)
+{
+    auto& code = m_code.at(idx);
+    if (!code) {
+        const auto& info = m_image->GetFunction(idx);
+        MASSERT(info.m_begin + info.m_size <= m_image->InstructionCount());
+        const auto begin = m_image->GetInstructions() + info.m_begin;
+        code.reset(new VMInstruction[info.m_size]);
+        std::copy(begin, begin + info.m_size, code.get());
+    }
+    return code.get();
+}
+
+VMFunctionObject* VMModuleObject::GetFunction(const std::string& name)
+{
+    for (size_t i=0;i<m_image->FunctionCount();i++) {
+        if (m_image->GetFunctionName(i) == name) {
+            return GetNthFunction(i);
+        }
+    }
+    return nullptr;
+}
+
+std::string_view VMModuleObject::GetFunctionNameAt(size_t instructioinPointer) const
+{
+    for (size_t i=0;i<m_image->FunctionCount();i++) {
+        const auto& func = m_image->GetFunction(i);
+        if (instructioinPointer >= func.m_begin && instructioinPointer < func.m_begin + func.m_size) {
+            return m_image->GetFunctionName(i);
+        }
+    }
+    return "<unknown>";
+}
+
+VMValue VMModuleObject::InternStringLiteral(size_t idx)
+{
+    // the interning table keeps the string alive, it isn't a child of the module
+    auto& literal = m_stringLiterals.at(idx);
+    literal = m_vm.InternString(std::string(m_image->GetString(idx)));
+    return literal;
+}
+
+std::optional<VMValue> VMModuleObject::GetModuleVariable(const std::string& name)
+{
+    auto slot = m_variables.Find(name, nullptr);
+    if (!slot.has_value() || !m_variables.at(slot.value()).m_defined) {
+        return std::nullopt;
+    }
+    return m_variables.at(slot.value()).m_value;
+}
+
+void VMModuleObject::SetModuleVariable(const std::string& name, VMValue obj)
+{
+    SetVariable(m_variables.Declare(name, nullptr), obj);
+}
+
+void VMModuleObject::SetVariable(size_t slot, VMValue obj)
+{
+    auto& var = m_variables.at(slot);
+    var.m_value = obj;
+    var.m_defined = true;
+    VMHeap::WriteBarrier(this, obj);
 }
 
 VMFunctionObject* VMModuleObject::GetInitializer()
 {
-    auto idxOpt = m_module->ModuleIntializer();
+    auto idxOpt = m_image->Initializer();
     if (idxOpt.has_value()) {
         return GetNthFunction(idxOpt.value());
     } else {
         return nullptr;
     }
 }
+
+void VMVariableTable::MarkValues(VMHeap& heap)
+{
+    for (auto& slot: m_slots) {
+        heap.MarkValue(slot.m_value);
+    }
+}
+
+void VMModuleObject::MarkChildren(VMHeap& heap)
+{
+    for (auto& func: m_functions) {
+        if (func) {
+            heap.MarkObject(func);
+        }
+    }
+    m_variables.MarkValues(heap);
+}
@@ -1,240 +1,561 @@
 #pragma once
 
 #include <cstdint>
-#include <functional>
 #include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 #include "common.h"
+#include "h2geometry.h"
 
 
 namespace M2V {
 
-class VMInstruction;
+struct VMInstruction;
 class VMModuleObject;
 class ExecutionModule;
+class ModuleImage;
 class VirtualMachine;
 class CallStack;
+class VMHeap;
 
 
-enum class VMObjectType {
-    Integer = 1, Boolean, Float, String,
-    Array, Object, Null,
-    Function, Module,
+// value types before String are stored inline in VMValue,
+// the others live on the VM heap
+enum class VMObjectType: uint8_t {
+    Null = 0, Integer, Boolean, Float, Point,
+    String, Array, TypedArray, Object,
+    Function, Module, Cell, Box,
 };
-using VMObjectId = std::size_t;
+constexpr size_t VMObjectTypeCount = static_cast<size_t>(VMObjectType::Box) + 1;
 
+// objects are owned by VMHeap, identity is the address of the object,
+// mark bits are kept by the heap page
 class VMObject {
 public:
-    VMObject(VMObjectType type, VMObjectId id): m_type(type), m_id(id), m_gen(0) {}
+    explicit VMObject(VMObjectType type): m_type(type) {}
 
-    auto GetId() const { return m_id; }
     auto type() const { return m_type; }
     virtual ~VMObject() = default;
 
-    virtual void MarkGeneration(size_t gen)
+    // mark every object referenced by this one
+    virtual void MarkChildren(VMHeap&) {}
+
+private:
+    VMObjectType m_type;
+};
+
+using IntegerValueType = int64_t;
+using FloatValueType = double;
+// the geometry of H2G, a point fits in the payload of VMValue
+using PointValueType = H2G::Point<int>;
+using BoxValueType = H2G::Box2D<int>;
+
+// tagged value: integers, floats, booleans and null are stored inline,
+// everything else points to a heap object. the tag of a heap value caches
+// the object type, so type checks never touch the heap.
+class VMValue {
+public:
+    VMValue(): m_type(VMObjectType::Null), m_integer(0) {}
+    explicit VMValue(VMObject* obj): m_type(obj->type()), m_object(obj) {}
+
+    static VMValue Integer(IntegerValueType val)
+    {
+        VMValue ans(VMObjectType::Integer);
+        ans.m_integer = val;
+        return ans;
+    }
+    static VMValue Float(FloatValueType val)
+    {
+        VMValue ans(VMObjectType::Float);
+        ans.m_float = val;
+        return ans;
+    }
+    static VMValue Boolean(bool val)
+    {
+        VMValue ans(VMObjectType::Boolean);
+        ans.m_boolean = val;
+        return ans;
+    }
+    static VMValue Point(PointValueType val)
+    {
+        VMValue ans(VMObjectType::Point);
+        ans.m_point = val;
+        return ans;
+    }
+
+    VMObjectType type() const { return m_type; }
+    bool IsObject() const { return m_type >= VMObjectType::String; }
+
+    IntegerValueType GetInteger() const
+    {
+        MASSERT(m_type == VMObjectType::Integer);
+        return m_integer;
+    }
+    FloatValueType GetFloat() const
+    {
+        MASSERT(m_type == VMObjectType::Float);
+        return m_float;
+    }
+    bool GetBoolean() const
+    {
+        MASSERT(m_type == VMObjectType::Boolean);
+        return m_boolean;
+    }
+    const PointValueType& GetPoint() const
     {
-        MASSERT(gen > m_gen);
-        m_gen = gen;
+        MASSERT(m_type == VMObjectType::Point);
+        return m_point;
+    }
+    VMObject* GetObject() const
+    {
+        MASSERT(IsObject());
+        return m_object;
     }
 
-    size_t GetGeneration() const { return m_gen; }
+    template<typename T>
+    T* As() const
+    {
+        MASSERT(T::ClassOf(*this));
+        return static_cast<T*>(m_object);
+    }
+
+    // same type and same payload, i.e. identity for heap objects
+    bool IsSame(const VMValue& oth) const
+    {
+        return m_type == oth.m_type && m_integer == oth.m_integer;
+    }
 
 private:
+    explicit VMValue(VMObjectType type): m_type(type), m_integer(0) {}
+
     VMObjectType m_type;
-    VMObjectId m_id;
-    size_t m_gen;
+    union {
+        IntegerValueType m_integer;
+        FloatValueType m_float;
+        bool m_boolean;
+        PointValueType m_point;
+        VMObject* m_object;
+    };
 };
-using VMObjectPtr = QPtr<VMObject>;;
+static_assert(sizeof(VMValue) <= 16, "VMValue should be two words at most");
+static_assert(sizeof(PointValueType) == sizeof(IntegerValueType), "IsSame() compares points as integers");
 
-using IntegerValueType = int64_t;
-class VMIntegerObject: public VMObject {
+using StringValueType = std::string;
+// A string is flat or a rope, the concatenation of two strings. A rope
+// is flattened the first time its value is read, e.g. to hash or compare
+// it, and drops its children then, so a string built by appending to it
+// is copied once. Short concatenations are flat right away, the value of
+// a short string is stored inline by StringValueType.
+class VMStringObject: public VMObject {
 public:
-    VMIntegerObject(VMObjectId id, IntegerValueType val):
-        VMObject(VMObjectType::Integer, id), m_val(val) {}
+    // concatenations shorter than this are flat
+    static constexpr size_t MinRopeSize = 32;
 
-    auto GetValue() const { return m_val; }
+    explicit VMStringObject(StringValueType val):
+        VMObject(VMObjectType::String), m_val(std::move(val)), m_size(m_val.size()) {}
+    VMStringObject(VMStringObject* left, VMStringObject* right):
+        VMObject(VMObjectType::String), m_left(left), m_right(right), m_size(left->size() + right->size()) {}
 
-    static bool ClassOf(VMObjectPtr obj) { return obj->type() == VMObjectType::Integer; }
+    const StringValueType& GetValue() const
+    {
+        if (m_left != nullptr) {
+            Flatten();
+        }
+        return m_val;
+    }
+    size_t size() const { return m_size; }
+    bool IsRope() const { return m_left != nullptr; }
+
+    static bool ClassOf(VMValue obj) { return obj.type() == VMObjectType::String; }
+
+    void MarkChildren(VMHeap& heap) override;
 
 private:
-    IntegerValueType m_val;
+    void Flatten() const;
+
+    mutable StringValueType m_val;
+    mutable VMStringObject* m_left = nullptr;
+    mutable VMStringObject* m_right = nullptr;
+    size_t m_size;
 };
 
-class VMBooleanObject: public VMObject {
+class VMArrayObject: public VMObject {
 public:
-    VMBooleanObject(VMObjectId id, bool val):
-        VMObject(VMObjectType::Boolean, id), m_val(val) {}
+    VMArrayObject():
+        VMObject(VMObjectType::Array) {}
+
+    static bool ClassOf(VMValue obj) { return obj.type() == VMObjectType::Array; }
 
-    bool GetValue() const { return m_val; }
+    void MarkChildren(VMHeap& heap) override;
 
-    static bool ClassOf(VMObjectPtr obj) { return obj->type() == VMObjectType::Boolean; }
+    auto size() const { return m_objects.size(); }
+    void clear() { m_objects.clear(); }
+    void push(VMValue obj);
+    void insert(size_t idx, VMValue obj);
+    auto get(size_t idx) const { return m_objects.at(idx); }
+    // idx < size()
+    void set(size_t idx, VMValue obj);
+    const VMValue* data() const { return m_objects.data(); }
 
 private:
-    bool m_val;
+    std::vector<VMValue> m_objects;
 };
 
-using FloatValueType = double;
-class VMFloatObject: public VMObject {
+// numbers stored unboxed and contiguously, an array of n points holds
+// x0 y0 x1 y1 ... in 2n floats. they hold no references, so the GC never
+// looks into them
+enum class VMTypedArrayKind: uint8_t {
+    Int32, Float64, Point2,
+};
+class VMTypedArrayObject: public VMObject {
 public:
-    VMFloatObject(VMObjectId id, FloatValueType val):
-        VMObject(VMObjectType::Float, id), m_val(val) {}
+    VMTypedArrayObject(VMTypedArrayKind kind, size_t size):
+        VMObject(VMObjectType::TypedArray), m_kind(kind), m_size(size)
+    {
+        if (kind == VMTypedArrayKind::Int32) {
+            m_ints.resize(size);
+        } else {
+            m_floats.resize(kind == VMTypedArrayKind::Point2 ? size * 2 : size);
+        }
+    }
 
-    auto GetValue() const { return m_val; }
+    static bool ClassOf(VMValue obj) { return obj.type() == VMObjectType::TypedArray; }
 
-    static bool ClassOf(VMObjectPtr obj) { return obj->type() == VMObjectType::Float; }
+    auto kind() const { return m_kind; }
+    // number of elements, i.e. of points for Point2
+    auto size() const { return m_size; }
+
+    int32_t* Int32Data()
+    {
+        MASSERT(m_kind == VMTypedArrayKind::Int32);
+        return m_ints.data();
+    }
+    const int32_t* Int32Data() const
+    {
+        MASSERT(m_kind == VMTypedArrayKind::Int32);
+        return m_ints.data();
+    }
+    // the elements of Float64, the coordinates of Point2
+    FloatValueType* FloatData()
+    {
+        MASSERT(m_kind != VMTypedArrayKind::Int32);
+        return m_floats.data();
+    }
+    const FloatValueType* FloatData() const
+    {
+        MASSERT(m_kind != VMTypedArrayKind::Int32);
+        return m_floats.data();
+    }
 
 private:
-    FloatValueType m_val;
+    VMTypedArrayKind m_kind;
+    size_t m_size;
+    std::vector<int32_t> m_ints;
+    std::vector<FloatValueType> m_floats;
 };
 
-using StringValueType = std::string;
-class VMStringObject: public VMObject {
+// an immutable H2G box, bigger than the payload of VMValue
+class VMBoxObject: public VMObject {
 public:
-    VMStringObject(VMObjectId id, StringValueType val):
-        VMObject(VMObjectType::String, id), m_val(val) {}
+    explicit VMBoxObject(const BoxValueType& box):
+        VMObject(VMObjectType::Box), m_box(box) {}
 
-    auto& GetValue() const { return m_val; }
+    static bool ClassOf(VMValue obj) { return obj.type() == VMObjectType::Box; }
 
-    static bool ClassOf(VMObjectPtr obj) { return obj->type() == VMObjectType::String; }
+    const BoxValueType& GetBox() const { return m_box; }
 
 private:
-    StringValueType m_val;
+    BoxValueType m_box;
 };
 
-class VMArrayObject: public VMObject {
+// Hidden class of map objects: the keys of an object and the slot of each
+// key. Objects that got the same keys in the same order share a shape, a
+// shape knows the shape after each key added to it, so building a record
+// walks a tree of shapes owned by the VM. Shapes of the tree live as long
+// as the VM, which lets inline caches keep pointers to them.
+// An object with many keys or one that had a key erased gets a dictionary
+// shape of its own, which is never cached.
+class VMShape {
 public:
-    VMArrayObject(VMObjectId id):
-        VMObject(VMObjectType::Array, id) {}
+    static constexpr size_t MaxSharedKeys = 64;
 
-    static bool ClassOf(VMObjectPtr obj) { return obj->type() == VMObjectType::Array; }
+    // the empty shape, root of a tree
+    VMShape(): m_root(this), m_shared(true) {}
+    // a dictionary shape with keys
+    VMShape(VMShape* root, std::vector<std::string> keys);
+    VMShape(const VMShape&) = delete;
+    VMShape& operator=(const VMShape&) = delete;
 
-    void MarkGeneration(size_t gen) override {
-        if (gen != GetGeneration()) {
-            VMObject::MarkGeneration(gen);
-            for(auto& o: m_objects) {
-                o->MarkGeneration(gen);
-            }
-        }
+    std::optional<size_t> Find(const std::string& key) const
+    {
+        auto it = m_index.find(key);
+        return it == m_index.end() ? std::nullopt : std::optional<size_t>(it->second);
     }
-
-    auto size() const { return m_objects.size(); }
-    void clear() { m_objects.clear(); }
-    void push(VMObjectPtr obj) { m_objects.push_back(obj); }
-    void insert(size_t idx, VMObjectPtr obj) { m_objects.insert(m_objects.begin() + idx, obj); }
-    auto get(size_t idx) const { return m_objects.at(idx); }
+    size_t size() const { return m_keys.size(); }
+    const std::string& KeyAt(size_t slot) const { return m_keys.at(slot); }
+    const std::vector<std::string>& GetKeys() const { return m_keys; }
+    bool IsShared() const { return m_shared; }
+    VMShape* GetRoot() const { return m_root; }
+
+    // shared shapes: the shape with key appended, key isn't in this one
+    VMShape* Transition(const std::string& key);
+    // dictionary shapes: add or remove a key in place, the slots of the
+    // keys after a removed one move down by one
+    void Append(const std::string& key);
+    void Remove(const std::string& key);
+
+    // inline cache of a property access. a hit needs the shape of the object
+    // to be m_shape, a store that adds the key moves the object to m_transition
+    struct Cache {
+        const VMShape* m_shape = nullptr;
+        VMShape* m_transition = nullptr;
+        size_t m_slot = 0;
+    };
 
 private:
-    std::vector<VMObjectPtr> m_objects;
+    VMShape(VMShape* parent, const std::string& key);
+
+    VMShape* m_root;
+    bool m_shared;
+    std::vector<std::string> m_keys;
+    std::unordered_map<std::string, size_t> m_index;
+    std::unordered_map<std::string, std::unique_ptr<VMShape>> m_transitions;
 };
 
 class VMMapObject: public VMObject {
 public:
-    VMMapObject(VMObjectId id):
-        VMObject(VMObjectType::Object, id) {}
-
-    static bool ClassOf(VMObjectPtr obj) { return obj->type() == VMObjectType::Object; }
-
-    void MarkGeneration(size_t gen) override {
-        if (gen != GetGeneration()) {
-            VMObject::MarkGeneration(gen);
-            for(auto& [_, o]: m_map) {
-                o->MarkGeneration(gen);
-            }
-        }
+    explicit VMMapObject(VMShape* emptyShape):
+        VMObject(VMObjectType::Object), m_shape(emptyShape) {}
+
+    static bool ClassOf(VMValue obj) { return obj.type() == VMObjectType::Object; }
+
+    void MarkChildren(VMHeap& heap) override;
+
+    auto size() const { return m_slots.size(); }
+    void clear();
+    void insert(const std::string& key, VMValue obj);
+    // insert a key computed at run time. a new key moves the object to a
+    // dictionary shape, distinct keys would otherwise grow the shape tree
+    // for as long as the VM lives
+    void insertComputed(const std::string& key, VMValue obj);
+    bool has(const std::string& key) const { return m_shape->Find(key).has_value(); }
+    void erase(const std::string& key);
+    VMValue get(const std::string& key) const
+    {
+        const auto slot = m_shape->Find(key);
+        MASSERT(slot.has_value());
+        return m_slots[slot.value()];
     }
 
-    auto size() const { return m_map.size(); }
-    void clear() { m_map.clear(); }
-    void insert(const std::string& key, VMObjectPtr obj) { m_map.insert({key, obj}); }
-    bool has(const std::string& key) const { return m_map.count(key); }
-    void erase(const std::string& key) { m_map.erase(key); }
-    auto get(const std::string& key) const { return m_map.at(key); }
+    VMShape* GetShape() const { return m_shape; }
+    VMValue GetSlot(size_t slot) const { return m_slots[slot]; }
+    void SetSlot(size_t slot, VMValue obj);
+    // add the key that leads from the current shape to next
+    void AddSlot(VMShape* next, VMValue obj);
 
 private:
-    std::unordered_map<std::string,VMObjectPtr> m_map;
+    void ToDictionary();
+
+    VMShape* m_shape;
+    std::vector<VMValue> m_slots;
+    // the dictionary shape of this object
+    std::unique_ptr<VMShape> m_ownShape;
 };
 
-class VMNullObject: public VMObject {
+// a native function reads the nargs arguments of its call in place and
+// returns the result, errors are reported with VirtualMachine::Panic()
+using NativeFunction = VMValue (*)(VirtualMachine& vm, const VMValue* args, size_t nargs);
+// A variable captured by a closure. The function that declares it and
+// every closure capturing it share the cell, so an assignment is seen by
+// all of them. Cells never escape as values of the language.
+class VMCellObject: public VMObject {
 public:
-    VMNullObject(VMObjectId id):
-        VMObject(VMObjectType::Null, id) {}
+    explicit VMCellObject(VMValue val):
+        VMObject(VMObjectType::Cell), m_value(val) {}
+
+    static bool ClassOf(VMValue obj) { return obj.type() == VMObjectType::Cell; }
+
+    VMValue Get() const { return m_value; }
+    void Set(VMValue val);
 
-    static bool ClassOf(VMObjectPtr obj) { return obj->type() == VMObjectType::Null; }
+    void MarkChildren(VMHeap& heap) override;
 
 private:
-    std::unordered_map<std::string,VMObjectPtr> m_map;
+    VMValue m_value;
 };
 
-using InternalFunctionType = std::function<int(const VirtualMachine&, const CallStack&)>;
+// A function of a module or a native function. A closure is a function of
+// a module with a flat array of the cells it captured, read in place by
+// GETUPVAL/SETUPVAL, calling it copies nothing.
 class VMFunctionObject: public VMObject {
 public:
-    VMFunctionObject(VMObjectId id, VMModuleObject* module, size_t baseOffset, 
-                     size_t instructionSize, std::vector<VMObjectPtr> capturedVariables, bool varArgs):
-        VMObject(VMObjectType::Function, id), m_baseOffset(baseOffset), m_instructionSize(instructionSize),
-        m_module(module), m_capturedVariable(capturedVariables), m_varArgs(varArgs), m_internalFunction() {}
+    VMFunctionObject(VMModuleObject* module, size_t baseOffset, VMInstruction* code,
+                     size_t instructionSize, std::vector<VMCellObject*> upvalues, bool varArgs):
+        VMObject(VMObjectType::Function), m_baseOffset(baseOffset), m_code(code), m_instructionSize(instructionSize),
+        m_upvalues(std::move(upvalues)), m_module(module), m_varArgs(varArgs), m_native(nullptr) {}
 
-    VMFunctionObject(VMObjectId id, InternalFunctionType func):
-        VMObject(VMObjectType::Function, id), m_baseOffset(0), m_instructionSize(0),
-        m_module(nullptr), m_capturedVariable(), m_varArgs(false), m_internalFunction(func) {}
+    explicit VMFunctionObject(NativeFunction func):
+        VMObject(VMObjectType::Function), m_baseOffset(0), m_code(nullptr), m_instructionSize(0),
+        m_upvalues(), m_module(nullptr), m_varArgs(false), m_native(func) {}
 
-    static bool ClassOf(VMObjectPtr obj) { return obj->type() == VMObjectType::Function; }
+    static bool ClassOf(VMValue obj) { return obj.type() == VMObjectType::Function; }
 
+    const VMInstruction* GetInstruction(size_t instructionPointer) const;
+    // the interpreter rewrites instructions of the copy owned by the VM
     VMInstruction* GetInstruction(size_t instructionPointer);
     auto InstructionSize() const { return m_instructionSize; }
+    // offset of the code in the image of the module
+    auto GetBaseOffset() const { return m_baseOffset; }
 
-    bool isClosure() const { return m_capturedVariable.size() > 0; }
-    bool isInternal() const { return m_internalFunction != nullptr; }
+    bool isClosure() const { return !m_upvalues.empty(); }
+    bool isNative() const { return m_native != nullptr; }
     bool isVarArgs() const { return m_varArgs; }
 
     auto GetModule() { return m_module; }
+    NativeFunction GetNative() const { return m_native; }
 
-    int invokeInternal(const VirtualMachine& vm, const CallStack& stack)
-    {
-        MASSERT(m_internalFunction);
-        return m_internalFunction(vm, stack);
-    }
-
-    auto& GetCaptured() const { return m_capturedVariable; }
+    VMCellObject* const* GetUpvalues() const { return m_upvalues.data(); }
+    size_t UpvalueCount() const { return m_upvalues.size(); }
 
-    void MarkGeneration(size_t gen) override;
+    void MarkChildren(VMHeap& heap) override;
 
 private:
     size_t m_baseOffset;
+    VMInstruction* m_code;
     size_t m_instructionSize;
-    std::vector<VMObjectPtr> m_capturedVariable;
+    std::vector<VMCellObject*> m_upvalues;
     VMModuleObject* m_module;
     bool m_varArgs;
-    InternalFunctionType m_internalFunction;
+    NativeFunction m_native;
+};
+
+// variables addressed by slot index, a name is resolved to its slot once,
+// either when a module is loaded or by the inline cache of the access
+class VMVariableTable {
+public:
+    static constexpr size_t InvalidSlot = SIZE_MAX;
+
+    struct Slot {
+        VMValue m_value;
+        bool m_defined = false;
+    };
+    struct Cache {
+        std::string m_name;
+        size_t m_slot = InvalidSlot;
+    };
+
+    // cache may be null
+    std::optional<size_t> Find(const std::string& name, Cache* cache)
+    {
+        if (cache && cache->m_slot != InvalidSlot && cache->m_name == name) {
+            return cache->m_slot;
+        }
+        auto it = m_index.find(name);
+        if (it == m_index.end()) {
+            return std::nullopt;
+        }
+        if (cache) {
+            cache->m_name = name;
+            cache->m_slot = it->second;
+        }
+        return it->second;
+    }
+    // find the slot of name, add an undefined one if there is none
+    size_t Declare(const std::string& name, Cache* cache)
+    {
+        if (auto slot = Find(name, cache)) {
+            return slot.value();
+        }
+        m_index.insert({name, m_slots.size()});
+        m_names.push_back(name);
+        m_slots.emplace_back();
+        return Find(name, cache).value();
+    }
+
+    // pointers are invalidated by Declare()
+    Slot* data() { return m_slots.data(); }
+    Slot& at(size_t slot) { return m_slots.at(slot); }
+    const std::string& NameOf(size_t slot) const { return m_names.at(slot); }
+    size_t size() const { return m_slots.size(); }
+
+    void MarkValues(VMHeap& heap);
+
+private:
+    std::vector<Slot> m_slots;
+    std::vector<std::string> m_names;
+    std::unordered_map<std::string, size_t> m_index;
 };
 
 class VMModuleObject: public VMObject {
 public:
-    VMModuleObject(VMObjectId id, const ExecutionModule& module, VirtualMachine& vm);
+    VMModuleObject(std::shared_ptr<const ModuleImage> image, VirtualMachine& vm);
+    ~VMModuleObject() override;
 
-    static bool ClassOf(VMObjectPtr obj) { return obj->type() == VMObjectType::Module; }
+    static bool ClassOf(VMValue obj) { return obj.type() == VMObjectType::Module; }
 
-    const VMInstruction& GetInstruction(size_t instructioinPointer) const;
-    const std::string& GetNthString(size_t idx) const;
+    std::string_view GetNthString(size_t idx) const;
     IntegerValueType GetNthInteger(size_t idx) const;
     FloatValueType GetNthFloat(size_t idx) const;
+    const IntegerValueType* GetIntegerData() const;
+    const FloatValueType* GetFloatData() const;
+    // functions are created when they're first used
     VMFunctionObject* GetNthFunction(size_t idx)
     {
         MASSERT(m_functions.size() > idx);
-        return m_functions.at(idx);
+        auto func = m_functions[idx];
+        return func ? func : CreateNthFunction(idx);
     }
-
-     const std::string& GetModuleName() const;
-
-     std::optional<VMObjectPtr> GetModuleVariable(const std::string& name);
-     void SetModuleVariable(const std::string& name, VMObjectPtr obj);
+    VMFunctionObject* GetFunction(const std::string& name);
+    // a new closure of function idx over the cells
+    VMFunctionObject* CreateClosure(size_t idx, std::vector<VMCellObject*> upvalues);
+    // name of the function whose code holds the instruction
+    std::string_view GetFunctionNameAt(size_t instructioinPointer) const;
+
+     const std::string& GetModuleName() const { return m_name; }
+
+     std::optional<VMValue> GetModuleVariable(const std::string& name);
+     void SetModuleVariable(const std::string& name, VMValue obj);
+
+     VMVariableTable& GetVariables() { return m_variables; }
+     void SetVariable(size_t slot, VMValue obj);
+     // inline cache of a variable access by a dynamic name, idx is the
+     // operand3 of the instruction and may be -1
+     VMVariableTable::Cache* GetVariableCache(int idx)
+     {
+         return idx >= 0 ? &m_variableCaches.at(idx) : nullptr;
+     }
+     // inline cache of GETPROP/SETPROP, idx may be -1
+     VMShape::Cache* GetPropertyCache(int idx)
+     {
+         return idx >= 0 ? &m_propertyCaches.at(idx) : nullptr;
+     }
+
+     // string literals of the module, null until InternStringLiteral()
+     const VMValue* GetStringLiterals() const { return m_stringLiterals.data(); }
+     VMValue InternStringLiteral(size_t idx);
 
      VMFunctionObject* GetInitializer();
 
+     void MarkChildren(VMHeap& heap) override;
+
 private:
-    std::unique_ptr<ExecutionModule> m_module;
-    std::unordered_map<std::string, VMObjectPtr> m_moduleVariable;
+    VMFunctionObject* CreateNthFunction(size_t idx);
+    // the code of function idx, copied from the image when it is first used
+    VMInstruction* GetNthCode(size_t idx);
+
+    std::shared_ptr<const ModuleImage> m_image;
+    // the instructions of each function, rewritten by the interpreter of
+    // this VM. functions never used aren't copied, the image is shared
+    std::vector<std::unique_ptr<VMInstruction[]>> m_code;
+    VirtualMachine& m_vm;
+    std::string m_name;
+    VMVariableTable m_variables;
+    std::vector<VMVariableTable::Cache> m_variableCaches;
+    std::vector<VMShape::Cache> m_propertyCaches;
+    std::vector<VMValue> m_stringLiterals;
     std::vector<VMFunctionObject*> m_functions;
 };
 
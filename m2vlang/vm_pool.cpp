@@ -0,0 +1,93 @@
+#include "vm_pool.h"
+#include "module_image.h"
+#include <algorithm>
+using namespace M2V;
+
+
+VMPool::VMPool(size_t threads)
+{
+    if (threads == 0) {
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    for (size_t i=0;i<threads;i++) {
+        m_threads.emplace_back(&VMPool::WorkerLoop, this);
+    }
+}
+
+VMPool::~VMPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wakeup.notify_all();
+    for (auto& thread: m_threads) {
+        thread.join();
+    }
+}
+
+std::future<VMResult> VMPool::Submit(Job job)
+{
+    MASSERT(job.m_image);
+    Task task{ std::move(job), std::promise<VMResult>() };
+    auto ans = task.m_result.get_future();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(std::move(task));
+    }
+    m_wakeup.notify_one();
+    return ans;
+}
+
+std::vector<VMResult> VMPool::RunAll(std::vector<Job> jobs)
+{
+    std::vector<std::future<VMResult>> futures;
+    futures.reserve(jobs.size());
+    for (auto& job: jobs) {
+        futures.push_back(Submit(std::move(job)));
+    }
+    std::vector<VMResult> ans;
+    ans.reserve(futures.size());
+    for (auto& future: futures) {
+        ans.push_back(future.get());
+    }
+    return ans;
+}
+
+void VMPool::WorkerLoop()
+{
+    for (;;) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeup.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+            if (m_queue.empty()) {
+                return;
+            }
+            task = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        // a setup or a native that throws fails its own job, not the pool
+        try {
+            task.m_result.set_value(RunJob(task.m_job));
+        } catch (...) {
+            task.m_result.set_exception(std::current_exception());
+        }
+    }
+}
+
+VMResult VMPool::RunJob(const Job& job)
+{
+    VirtualMachine vm;
+    if (job.m_setup) {
+        job.m_setup(vm);
+    }
+    vm.ExecuteModule(job.m_image, job.m_function);
+    VMResult ans;
+    if (vm.IsPanicked()) {
+        ans.m_panicMessage = vm.GetPanicMessage();
+    } else {
+        ans.m_exitStatus = vm.GetExitStatus();
+    }
+    return ans;
+}
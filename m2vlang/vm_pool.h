@@ -0,0 +1,70 @@
+#pragma once
+#include "vm.h"
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace M2V {
+
+// how a script run by VMPool ended
+struct VMResult {
+    std::optional<int> m_exitStatus;
+    // empty unless the script panicked
+    std::string m_panicMessage;
+};
+
+// Runs scripts on a fixed set of worker threads, every script in a
+// VirtualMachine of its own that lives for the run. The VMs share nothing
+// but the module images, so the scripts never wait for each other.
+class VMPool {
+public:
+    // prepares the VM of a script on its worker thread before the module
+    // starts, e.g. installs natives and sets globals
+    using Setup = std::function<void(VirtualMachine&)>;
+
+    struct Job {
+        std::shared_ptr<const ModuleImage> m_image;
+        std::string m_function;
+        Setup m_setup;
+    };
+
+    // one thread per core if threads is 0
+    explicit VMPool(size_t threads = 0);
+    VMPool(const VMPool&) = delete;
+    VMPool& operator=(const VMPool&) = delete;
+    // finishes the queued jobs
+    ~VMPool();
+
+    // the future rethrows an exception thrown by the job
+    std::future<VMResult> Submit(Job job);
+    // run the jobs and wait for them, the results are in the order of jobs
+    std::vector<VMResult> RunAll(std::vector<Job> jobs);
+
+    size_t GetThreadCount() const { return m_threads.size(); }
+
+private:
+    struct Task {
+        Job m_job;
+        std::promise<VMResult> m_result;
+    };
+
+    void WorkerLoop();
+    static VMResult RunJob(const Job& job);
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::deque<Task> m_queue;
+    bool m_stopping = false;
+    std::vector<std::thread> m_threads;
+};
+
+}
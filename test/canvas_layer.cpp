@@ -0,0 +1,87 @@
+#include "canvas_layer.h"
+#include <gtest/gtest.h>
+#include <vector>
+using namespace M2V;
+
+
+// a block of n circles with ids from firstId
+static std::unique_ptr<GObjectBlock> CreateBlock(GObjectID firstId, size_t n)
+{
+    std::vector<CommonShape> shapes;
+    for (size_t i=0;i<n;i++) {
+        shapes.push_back(CommonShape::createCircle(Point(static_cast<int>(i), 0), 1));
+    }
+    return std::make_unique<GObjectBlock>(firstId, GObject::CreateObjects(firstId, shapes));
+}
+
+TEST(canvas_layer, object_blocks) {
+    auto block = CreateBlock(10, 3);
+    EXPECT_EQ(block->GetFirstId(), 10u);
+    EXPECT_EQ(block->GetEndId(), 13u);
+    EXPECT_FALSE(block->Contains(9));
+    EXPECT_TRUE(block->Contains(12));
+    EXPECT_FALSE(block->Contains(13));
+    EXPECT_EQ(block->Get(11)->GetId(), 11u);
+    EXPECT_EQ(block->Get(11)->shape().type(), H2G::SHAPE_TYPE::CIRCLE);
+
+    block->Remove(11);
+    block->Remove(11);
+    EXPECT_TRUE(block->IsRemoved(11));
+    EXPECT_FALSE(block->IsRemoved(12));
+    EXPECT_EQ(block->size(), 2u);
+    block->Remove(10);
+    block->Remove(12);
+    EXPECT_TRUE(block->empty());
+}
+
+TEST(canvas_layer, objects_are_found_in_their_block) {
+    CanvasLayer layer(1, "layer", 0);
+    EXPECT_FALSE(layer.dirty());
+    // added out of order, the layer keeps them sorted by the first id
+    auto b1 = CreateBlock(1, 4);
+    auto b3 = CreateBlock(20, 1);
+    auto b2 = CreateBlock(5, 10);
+    layer.AddBlock(b1.get());
+    layer.AddBlock(b3.get());
+    layer.AddBlock(b2.get());
+    EXPECT_TRUE(layer.dirty());
+
+    // a removed object of a block is marked in its block
+    for (GObjectID id: { 1, 4, 5, 14, 20 }) {
+        layer.Remove(id);
+    }
+    EXPECT_TRUE(b1->IsRemoved(1));
+    EXPECT_TRUE(b1->IsRemoved(4));
+    EXPECT_FALSE(b1->IsRemoved(2));
+    EXPECT_TRUE(b2->IsRemoved(5));
+    EXPECT_TRUE(b2->IsRemoved(14));
+    EXPECT_EQ(b2->size(), 8u);
+    EXPECT_TRUE(b3->empty());
+
+    // an object added on its own is removed from the layer itself
+    auto single = GObject::CreateObject(30, CommonShape::createCircle(Point(0, 0), 1));
+    layer.Add(GObjectPtr(single.get()));
+    layer.Remove(30);
+
+    // the blocks after a removed one are still found
+    layer.RemoveBlock(b1.get());
+    layer.Remove(6);
+    EXPECT_TRUE(b2->IsRemoved(6));
+    layer.RemoveBlock(b2.get());
+    layer.RemoveBlock(b3.get());
+}
+
+TEST(canvas_layer, unknown_objects_are_ignored) {
+    CanvasLayer layer(1, "layer", 0);
+    layer.Remove(3);
+    EXPECT_FALSE(layer.dirty());
+
+    auto block = CreateBlock(5, 2);
+    layer.AddBlock(block.get());
+    // before, between and after the objects of the block
+    for (GObjectID id: { 3, 7, 100 }) {
+        layer.Remove(id);
+    }
+    EXPECT_EQ(block->size(), 2u);
+    layer.RemoveBlock(block.get());
+}
@@ -0,0 +1,84 @@
+#include "scene_batch.h"
+#include "viewport.h"
+#include <gtest/gtest.h>
+using namespace M2V;
+
+
+namespace {
+
+// a viewport whose layers are made by the test
+class TestViewport: public Viewport {
+public:
+    using Viewport::CreateLayer;
+};
+
+CommonShape Circle(int x)
+{
+    return CommonShape::createCircle(Point(x, 0), 1);
+}
+
+}
+
+TEST(scene_batch, layers_in_order_of_first_shape) {
+    SceneBatch batch;
+    EXPECT_TRUE(batch.empty());
+    batch.Append(2, Circle(0));
+    batch.Append(1, Circle(1));
+    batch.Append(2, Circle(2));
+    batch.Append(2, Circle(3));
+    EXPECT_EQ(batch.size(), 4u);
+    const auto& layers = batch.GetLayers();
+    ASSERT_EQ(layers.size(), 2u);
+    EXPECT_EQ(layers[0].m_layer, 2u);
+    EXPECT_EQ(layers[0].m_shapes.size(), 3u);
+    EXPECT_EQ(layers[1].m_layer, 1u);
+    EXPECT_EQ(layers[1].m_shapes.size(), 1u);
+
+    // a cleared batch keeps its layers and their buffers
+    batch.Reserve(1, 100);
+    const auto capacity = layers[1].m_shapes.capacity();
+    batch.Clear();
+    EXPECT_TRUE(batch.empty());
+    ASSERT_EQ(batch.GetLayers().size(), 2u);
+    EXPECT_TRUE(batch.GetLayers()[1].m_shapes.empty());
+    EXPECT_EQ(batch.GetLayers()[1].m_shapes.capacity(), capacity);
+    batch.Append(1, Circle(4));
+    EXPECT_EQ(batch.GetLayers().size(), 2u);
+    EXPECT_EQ(batch.GetLayers()[1].m_shapes.size(), 1u);
+}
+
+TEST(scene_batch, valid_layers) {
+    SceneBatch batch;
+    EXPECT_FALSE(batch.HasLayer(1));
+    batch.SetLayers({ 1, 3 });
+    EXPECT_TRUE(batch.HasLayer(1));
+    EXPECT_FALSE(batch.HasLayer(2));
+    EXPECT_TRUE(batch.HasLayer(3));
+}
+
+TEST(scene_batch, emit_to_a_viewport) {
+    TestViewport viewport;
+    const auto bottom = viewport.CreateLayer("bottom");
+    const auto top = viewport.CreateLayer("top");
+    EXPECT_EQ(viewport.GetLayers(), std::vector<LayerID>({ bottom, top }));
+
+    SceneBatch batch;
+    batch.SetLayers(viewport.GetLayers());
+    batch.Append(top, Circle(0));
+    batch.Append(bottom, Circle(1));
+    batch.Append(top, Circle(2));
+    EXPECT_EQ(viewport.Emit(batch), 0u);
+    EXPECT_TRUE(batch.empty());
+    // nothing to emit
+    EXPECT_EQ(viewport.Emit(batch), 0u);
+
+    // shapes of a layer the viewport doesn't have are dropped, the others
+    // are still added
+    batch.Append(top + 1, Circle(3));
+    batch.Append(top + 1, Circle(4));
+    batch.Append(bottom, Circle(5));
+    EXPECT_EQ(viewport.Emit(batch), 2u);
+    EXPECT_TRUE(batch.empty());
+    batch.Append(top + 1, Circle(6));
+    EXPECT_EQ(viewport.Emit(batch), 1u);
+}
@@ -0,0 +1,57 @@
+#include "run_script.h"
+#include "geometry.h"
+#include "scene_batch.h"
+#include "scene_natives.h"
+#include <gtest/gtest.h>
+#include <string>
+using namespace M2V;
+
+
+static NativeRegistry SceneNatives()
+{
+    NativeRegistry natives;
+    AddGeometryNatives(natives);
+    AddSceneNatives(natives);
+    return natives;
+}
+
+// run main of source drawing into scene
+static std::string RunScene(const std::string& source, SceneBatch* scene)
+{
+    VirtualMachine vm;
+    vm.SetHost(scene);
+    return RunScript(source, SceneNatives(), vm);
+}
+
+TEST(scene_natives, shapes_are_staged) {
+    SceneBatch scene;
+    scene.SetLayers({ 1, 2 });
+    EXPECT_EQ(RunScene(
+        "(def main () (let i 0)"
+        "  (while (< i 10) (emit_circle 1 (point i 0) 5) (let i (+ i 1)))"
+        "  (emit_segment 2 (point 0 0) (point 10 10))"
+        "  (emit_polygon 2 (array (point 0 0) (point 4 0) (point 4 3)))"
+        "  0)", &scene), "0");
+    EXPECT_EQ(scene.size(), 12u);
+    const auto& layers = scene.GetLayers();
+    ASSERT_EQ(layers.size(), 2u);
+    EXPECT_EQ(layers[0].m_layer, 1u);
+    ASSERT_EQ(layers[0].m_shapes.size(), 10u);
+    EXPECT_EQ(layers[0].m_shapes[3].type(), H2G::SHAPE_TYPE::CIRCLE);
+    EXPECT_EQ(layers[1].m_layer, 2u);
+    ASSERT_EQ(layers[1].m_shapes.size(), 2u);
+    EXPECT_EQ(layers[1].m_shapes[0].type(), H2G::SHAPE_TYPE::SEGMENT);
+    EXPECT_EQ(layers[1].m_shapes[1].type(), H2G::SHAPE_TYPE::POLYGON);
+}
+
+TEST(scene_natives, errors) {
+    SceneBatch scene;
+    scene.SetLayers({ 1 });
+    // a layer the viewport doesn't have panics the script, not the host
+    EXPECT_EQ(RunScene("(def main () (emit_circle 2 (point 0 0) 1))", &scene), "invalid layer 2");
+    EXPECT_EQ(RunScene("(def main () (emit_circle -1 (point 0 0) 1))", &scene), "invalid layer -1");
+    EXPECT_EQ(RunScene("(def main () (emit_circle 1 (point 0 0) -1))", &scene), "invalid radius -1");
+    EXPECT_EQ(RunScene("(def main () (emit_polygon 1 (array (point 0 0) 1)))", &scene), "point expected");
+    EXPECT_EQ(RunScene("(def main () (emit_segment 1 (point 0 0) (point 1 1)))", nullptr), "no scene to emit into");
+    EXPECT_TRUE(scene.empty());
+}